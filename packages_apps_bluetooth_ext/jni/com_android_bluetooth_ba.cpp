@@ -41,6 +41,10 @@ static jmethodID method_onBAStateChanged;
 static jmethodID method_onEncKeyUpdateCallback;
 static jmethodID method_onDivUpdateCallback;
 static jmethodID method_onStreamIdUpdateCallback;
+static jmethodID method_onStreamStateChanged;
+static jmethodID method_onStreamEncKeyUpdateCallback;
+static jmethodID method_onStreamDivUpdateCallback;
+static jmethodID method_onStreamCodecUpdateCallback;
 
 static const ba_transmitter_interface_t* sBATInterface = NULL;
 static jobject mCallbacksObj = NULL;
@@ -96,12 +100,86 @@ static void ba_stream_id_update_callback(uint8_t stream_id) {
   sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onStreamIdUpdateCallback, (jbyte)stream_id);
 }
 
+static void ba_stream_state_change_callback(uint8_t stream, ba_state_t state) {
+  ALOGI("%s stream = %d", __func__, stream);
+  CallbackEnv sCallbackEnv(__func__);
+  if (!sCallbackEnv.valid()) return;
+
+  sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onStreamStateChanged,
+                               (jbyte)stream, (jint)state);
+}
+
+static void ba_stream_enc_key_update_callback(uint8_t stream, uint8_t size,
+                                              uint8_t* p_enc_key) {
+  ALOGI("%s stream = %d", __func__, stream);
+  CallbackEnv sCallbackEnv(__func__);
+  if (!sCallbackEnv.valid()) return;
+
+  ScopedLocalRef<jbyteArray> enc_key(
+     sCallbackEnv.get(), sCallbackEnv->NewByteArray(size));
+  if (!enc_key.get()) {
+      ALOGE("Fail to get new jbyteArray for enc key, ba_stream_enc_key_update_callback");
+      return;
+  }
+
+  sCallbackEnv->SetByteArrayRegion(enc_key.get(), 0, size, (jbyte*)p_enc_key);
+
+  sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onStreamEncKeyUpdateCallback,
+                               (jbyte)stream, (jbyte)size, enc_key.get());
+}
+
+static void ba_stream_div_update_callback(uint8_t stream, uint8_t size,
+                                          uint8_t* p_div) {
+  ALOGI("%s stream = %d", __func__, stream);
+  CallbackEnv sCallbackEnv(__func__);
+  if (!sCallbackEnv.valid()) return;
+
+  ScopedLocalRef<jbyteArray> div(
+     sCallbackEnv.get(), sCallbackEnv->NewByteArray(size));
+  if (!div.get()) {
+      ALOGE("Fail to get new jbyteArray for div, ba_stream_div_update_callback");
+      return;
+  }
+
+  sCallbackEnv->SetByteArrayRegion(div.get(), 0, size, (jbyte*)p_div);
+
+  sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onStreamDivUpdateCallback,
+                               (jbyte)stream, (jbyte)size, div.get());
+}
+
+static void ba_stream_codec_update_callback(uint8_t stream, uint8_t size,
+                                            uint8_t* p_codec_config) {
+  ALOGI("%s stream = %d", __func__, stream);
+  CallbackEnv sCallbackEnv(__func__);
+  if (!sCallbackEnv.valid()) return;
+
+  ScopedLocalRef<jbyteArray> codec_config(
+     sCallbackEnv.get(), sCallbackEnv->NewByteArray(size));
+  if (!codec_config.get()) {
+      ALOGE("Fail to get new jbyteArray for codec config, "
+            "ba_stream_codec_update_callback");
+      return;
+  }
+
+  sCallbackEnv->SetByteArrayRegion(codec_config.get(), 0, size,
+                                   (jbyte*)p_codec_config);
+
+  sCallbackEnv->CallVoidMethod(mCallbacksObj,
+                               method_onStreamCodecUpdateCallback,
+                               (jbyte)stream, (jbyte)size,
+                               codec_config.get());
+}
+
 static ba_transmitter_callbacks_t sBATCallbacks = {
     sizeof(sBATCallbacks),
     ba_state_change_callback,
     ba_enc_key_update_callback,
     ba_div_update_callback,
     ba_stream_id_update_callback,
+    ba_stream_state_change_callback,
+    ba_stream_enc_key_update_callback,
+    ba_stream_div_update_callback,
+    ba_stream_codec_update_callback,
 };
 
 static void classInitNative(JNIEnv* env, jclass clazz) {
@@ -119,6 +197,18 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
   method_onStreamIdUpdateCallback =
       env->GetMethodID(clazz, "onStreamIdUpdate", "(B)V");
 
+  method_onStreamStateChanged =
+      env->GetMethodID(clazz, "onStreamStateChanged", "(BI)V");
+
+  method_onStreamEncKeyUpdateCallback =
+      env->GetMethodID(clazz, "onStreamEncKeyUpdate", "(BB[B)V");
+
+  method_onStreamDivUpdateCallback =
+      env->GetMethodID(clazz, "onStreamDivUpdate", "(BB[B)V");
+
+  method_onStreamCodecUpdateCallback =
+      env->GetMethodID(clazz, "onStreamCodecUpdate", "(BB[B)V");
+
   ALOGI("%s: succeeds", __func__);
 }
 
@@ -205,6 +295,53 @@ static void setVolNative(JNIEnv* env, jobject object, jint volLevel, jint maxVol
     sBATInterface->set_vol(volLevel, maxVolLevel);
 }
 
+static jboolean setStreamConfigNative(JNIEnv* env, jobject object, jint stream,
+                                      jint sampleRate, jint channelMode,
+                                      jint frameSize, jint bitRate) {
+    if (sBATInterface == NULL) {
+      ALOGE("Failed to get BA Transmitter Interface in setStreamConfigNative ");
+      return JNI_FALSE;
+    }
+    ba_stream_config_t config;
+    config.sample_rate = sampleRate;
+    config.channel_mode = channelMode;
+    config.frame_size = frameSize;
+    config.bit_rate = bitRate;
+    bt_status_t status = sBATInterface->set_stream_config(stream, &config);
+    return (status == BT_STATUS_SUCCESS) ? JNI_TRUE : JNI_FALSE;
+}
+
+static jboolean setStreamStateNative(JNIEnv* env, jobject object, jint stream,
+                                     jint state) {
+    if (sBATInterface == NULL) {
+      ALOGE("Failed to get BA Transmitter Interface in setStreamStateNative ");
+      return JNI_FALSE;
+    }
+    bt_status_t status = sBATInterface->set_stream_state(stream, state);
+    return (status == BT_STATUS_SUCCESS) ? JNI_TRUE : JNI_FALSE;
+}
+
+static jboolean refreshStreamEncKeyNative(JNIEnv* env, jobject object,
+                                          jint stream) {
+    if (sBATInterface == NULL) {
+      ALOGE("Failed to get BA Transmitter Interface in refreshStreamEncKeyNative");
+      return JNI_FALSE;
+    }
+    bt_status_t status = sBATInterface->refresh_stream_enc_key(stream);
+    return (status == BT_STATUS_SUCCESS) ? JNI_TRUE : JNI_FALSE;
+}
+
+static jboolean setStreamVolNative(JNIEnv* env, jobject object, jint stream,
+                                   jint volLevel, jint maxVolLevel) {
+    if (sBATInterface == NULL) {
+      ALOGE("Failed to get BA Transmitter Interface in setStreamVolNative ");
+      return JNI_FALSE;
+    }
+    bt_status_t status =
+        sBATInterface->set_stream_vol(stream, volLevel, maxVolLevel);
+    return (status == BT_STATUS_SUCCESS) ? JNI_TRUE : JNI_FALSE;
+}
+
 static JNINativeMethod sMethods[] = {
     {"classInitNative", "()V", (void*)classInitNative},
     {"initNative", "()V", (void*)initNative},
@@ -212,6 +349,10 @@ static JNINativeMethod sMethods[] = {
     {"cleanupNative", "()V", (void*)cleanupNative},
     {"setBAStateNative", "(I)V", (void*)setBAStateNative},
     {"setVolNative", "(II)V", (void*)setVolNative},
+    {"setStreamConfigNative", "(IIIII)Z", (void*)setStreamConfigNative},
+    {"setStreamStateNative", "(II)Z", (void*)setStreamStateNative},
+    {"refreshStreamEncKeyNative", "(I)Z", (void*)refreshStreamEncKeyNative},
+    {"setStreamVolNative", "(III)Z", (void*)setStreamVolNative},
 };
 
 int register_com_android_bluetooth_ba(JNIEnv* env) {
@@ -589,6 +589,19 @@ static bool setWifiStateNative(JNIEnv *env, jobject obj, jboolean status) {
     return JNI_TRUE;
 }
 
+static void setWifiChannelNative(JNIEnv *env, jobject obj, jint centerFreqMhz,
+                                 jint widthMhz) {
+
+    ALOGI("%s", __FUNCTION__);
+
+    std::shared_lock<std::shared_timed_mutex> lock(interface_mutex);
+
+    if (!sBluetoothVendorInterface || !sBluetoothVendorInterface->set_wifi_channel)
+        return;
+
+    sBluetoothVendorInterface->set_wifi_channel(centerFreqMhz, widthMhz);
+}
+
 static bool setPowerBackoffNative(JNIEnv *env, jobject obj, jboolean status) {
 
     ALOGI("%s", __FUNCTION__);
@@ -1008,6 +1021,61 @@ static jboolean getAfhChannelMapNative(JNIEnv* env, jclass clazz, jstring addres
   return (ret == true) ? JNI_TRUE : JNI_FALSE;
 }
 
+static jintArray getLinkQualityStatsNative(JNIEnv* env, jclass clazz,
+                                           jstring address, jint metric) {
+  ALOGV("%s", __func__);
+
+  std::shared_lock<std::shared_timed_mutex> lock(interface_mutex);
+
+  if (!sBluetoothVendorInterface ||
+      !sBluetoothVendorInterface->get_link_quality_stats) {
+    ALOGW("%s: sBluetoothVendorInterface is null.", __func__);
+    return NULL;
+  }
+
+  const char* tmp_addr = env->GetStringUTFChars(address, NULL);
+  if (!tmp_addr) {
+    ALOGW("%s: address is null.", __func__);
+    return NULL;
+  }
+  RawAddress bdaddr;
+  bool success = RawAddress::FromString(tmp_addr, bdaddr);
+
+  env->ReleaseStringUTFChars(address, tmp_addr);
+
+  if (!success) {
+    ALOGW("%s: address is invalid.", __func__);
+    return NULL;
+  }
+
+  bt_link_quality_stats_t stats;
+  if (!sBluetoothVendorInterface->get_link_quality_stats(&bdaddr,
+          (bt_link_quality_metric_t)metric, &stats))
+    return NULL;
+
+  // Same order as the LINK_QUALITY_STATS_* indexes of Vendor.java
+  jint vals[] = {stats.num_samples, stats.min, stats.max, stats.avg,
+                 stats.p50, stats.p90, stats.breached ? 1 : 0,
+                 (jint)stats.breach_count};
+  jintArray result = env->NewIntArray(NELEM(vals));
+  if (result == NULL) return NULL;
+  env->SetIntArrayRegion(result, 0, NELEM(vals), vals);
+  return result;
+}
+
+static void dumpNative(JNIEnv* env, jobject obj, jobject fdObj) {
+  ALOGV("%s", __func__);
+
+  std::shared_lock<std::shared_timed_mutex> lock(interface_mutex);
+
+  if (!sBluetoothVendorInterface || !sBluetoothVendorInterface->dump) return;
+
+  int fd = jniGetFDFromFileDescriptor(env, fdObj);
+  if (fd < 0) return;
+
+  sBluetoothVendorInterface->dump(fd);
+}
+
 static JNINativeMethod sMethods[] = {
     {"classInitNative", "()V", (void *) classInitNative},
     {"initNative", "()V", (void *) initNative},
@@ -1015,6 +1083,7 @@ static JNINativeMethod sMethods[] = {
     {"bredrcleanupNative", "()V", (void*) bredrcleanupNative},
     {"bredrstartupNative", "()V", (void*) bredrstartupNative},
     {"setWifiStateNative", "(Z)V", (void*) setWifiStateNative},
+    {"setWifiChannelNative", "(II)V", (void*) setWifiChannelNative},
     {"setPowerBackoffNative", "(Z)V", (void*) setPowerBackoffNative},
     {"getProfileInfoNative", "(II)Z", (void*) getProfileInfoNative},
     {"getQtiStackStatusNative", "()Z", (void*) getQtiStackStatusNative},
@@ -1049,6 +1118,9 @@ static JNINativeMethod sMethods[] = {
         (void*) setAfhChannelMapNative},
     {"getAfhChannelMapNative", "(Ljava/lang/String;I)Z",
         (void*) getAfhChannelMapNative},
+    {"getLinkQualityStatsNative", "(Ljava/lang/String;I)[I",
+        (void*) getLinkQualityStatsNative},
+    {"dumpNative", "(Ljava/io/FileDescriptor;)V", (void*) dumpNative},
 };
 
 int load_bt_configstore_lib() {
@@ -77,7 +77,8 @@ public class BATService extends ProfileService {
 
     private static final int NUM_SERIVCE_RECORD = 1;
     private static final long STREAM_ID_48 = 1;
-    // currently we are using 512(fr_samples),186(frame_size),frequency.
+    // defaults are 512(fr_samples),186(frame_size),frequency, rate control
+    // in the stack may lower them while streaming, see updateCodecConfig.
     // check GattService specification for more details
     //private static final long  CODEC_CONFIG_CELT = (long)0x020000BA0100;
     // Messages
@@ -89,6 +90,30 @@ public class BATService extends ProfileService {
     private final int MESSAGE_BAT_ENC_CHANGE_EVT = 102;
     private final int MESSAGE_BAT_DIV_CHANGE_EVT = 103;
     private final int MESSAGE_BAT_STREAMING_ID_EVT = 104;
+    private final int MESSAGE_BAT_STREAM_STATE_CHANGE_EVT = 105;
+    private final int MESSAGE_BAT_STREAM_ENC_CHANGE_EVT = 106;
+    private final int MESSAGE_BAT_STREAM_DIV_CHANGE_EVT = 107;
+    private final int MESSAGE_BAT_CODEC_CHANGE_EVT = 108;
+
+    // layout of the codec config from the stack, see getBACodecConfig
+    private static final int CODEC_CONFIG_LEN = 10;
+    private static final int CODEC_CONFIG_FREQ_IDX = 3;
+    private static final int CODEC_CONFIG_FRAME_SIZE_IDX = 4;
+    private static final int CODEC_CONFIG_BIT_RATE_IDX = 6;
+
+    // additional broadcast streams, stream 0 is the primary stream which is
+    // tracked by mCurrStackBATState. Keep in sync with BA_MAX_STREAMS in hal.
+    private static final int BA_MAX_STREAMS = 6;
+    private final int[] mStreamStackStates = new int[BA_MAX_STREAMS];
+    private final BluetoothBAEncryptionKey[] mStreamEncryptionKeys =
+            new BluetoothBAEncryptionKey[BA_MAX_STREAMS];
+    private final int[] mStreamDIVs = new int[BA_MAX_STREAMS];
+    // packed codec config the encoder of a stream is set up with
+    private final byte[][] mStreamCodecConfigs = new byte[BA_MAX_STREAMS][];
+    // requested stream states, keep in sync with BA_STREAM_REQ_* in hal
+    protected static final int BA_STREAM_REQ_STOP = 0;
+    protected static final int BA_STREAM_REQ_PAUSE = 1;
+    protected static final int BA_STREAM_REQ_STREAM = 2;
 
     private final String BLUETOOTH_PERM = android.Manifest.permission.BLUETOOTH;
     static final String BLUETOOTH_PERM_ADMIN = android.Manifest.permission.BLUETOOTH_ADMIN;
@@ -492,6 +517,10 @@ public class BATService extends ProfileService {
             case MESSAGE_BAT_ENC_CHANGE_EVT: str = "CB_ENC_KEY_UPDATED"; break;
             case MESSAGE_BAT_STATE_CHANGE_EVT: str = "CB_STATE_CHANDED"; break;
             case MESSAGE_BAT_STREAMING_ID_EVT: str = "CB_STREAM_ID_UPDATED"; break;
+            case MESSAGE_BAT_STREAM_STATE_CHANGE_EVT: str = "CB_STREAM_STATE_CHANGED"; break;
+            case MESSAGE_BAT_STREAM_ENC_CHANGE_EVT: str = "CB_STREAM_ENC_KEY_UPDATED"; break;
+            case MESSAGE_BAT_STREAM_DIV_CHANGE_EVT: str = "CB_STREAM_DIV_UPDATED"; break;
+            case MESSAGE_BAT_CODEC_CHANGE_EVT: str = "CB_CODEC_UPDATED"; break;
             default:
                 str = Integer.toString(message);
         }
@@ -884,6 +913,29 @@ public class BATService extends ProfileService {
                     broadcastStramIdpdate(msg.arg1);
                     break;
 
+                case MESSAGE_BAT_STREAM_STATE_CHANGE_EVT:
+                    mStreamStackStates[msg.arg1] = msg.arg2;
+                    break;
+
+                case MESSAGE_BAT_STREAM_ENC_CHANGE_EVT:
+                    mStreamEncryptionKeys[msg.arg1] = new BluetoothBAEncryptionKey(
+                            msg.getData().getByteArray("encKey"),
+                            BluetoothBAEncryptionKey.SECURITY_KEY_TYPE_PRIVATE);
+                    break;
+
+                case MESSAGE_BAT_STREAM_DIV_CHANGE_EVT:
+                    mStreamDIVs[msg.arg1] = msg.arg2;
+                    break;
+
+                case MESSAGE_BAT_CODEC_CHANGE_EVT:
+                    if (msg.arg1 == 0) {
+                        updateCodecConfig(msg.getData().getByteArray("codecConfig"));
+                    } else {
+                        mStreamCodecConfigs[msg.arg1] =
+                                msg.getData().getByteArray("codecConfig");
+                    }
+                    break;
+
                 case MESSAGE_BAT_VOL_CHANGE_REQ:
                     mCurrVolLevel = msg.arg1;
                     int maxVolLevel = mAudioManager.getStreamMaxVolume(AudioManager.STREAM_MUSIC);
@@ -973,6 +1025,154 @@ public class BATService extends ProfileService {
         return mServiceRecord;
     }
 
+    private boolean isValidExtStream(int stream) {
+        return (stream > 0) && (stream < BA_MAX_STREAMS);
+    }
+
+    // apis for additional broadcast streams
+    protected boolean setBAStreamConfig(int stream, int sampleRate, int channelMode,
+            int frameSize, int bitRate) {
+        Log.d(TAG," setBAStreamConfig stream = " + stream + " sampleRate = " + sampleRate
+              + " channelMode = " + channelMode + " frameSize = " + frameSize
+              + " bitRate = " + bitRate);
+        if (!isValidExtStream(stream))
+            return false;
+        return setStreamConfigNative(stream, sampleRate, channelMode, frameSize, bitRate);
+    }
+
+    protected boolean setBAStreamState(int stream, int newState) {
+        Log.d(TAG," setBAStreamState stream = " + stream + " newState = " + newState);
+        if (!isValidExtStream(stream))
+            return false;
+        if ((newState != BA_STREAM_REQ_STOP) && isCallActive()) {
+            Log.d(TAG," setBAStreamState Call active, can't enable stream ");
+            return false;
+        }
+        return setStreamStateNative(stream, newState);
+    }
+
+    protected boolean refreshBAStreamEncryptionKey(int stream) {
+        Log.d(TAG," refreshBAStreamEncryptionKey stream = " + stream);
+        if (!isValidExtStream(stream))
+            return false;
+        return refreshStreamEncKeyNative(stream);
+    }
+
+    protected boolean setBAStreamVolume(int stream, int volLevel) {
+        Log.d(TAG," setBAStreamVolume stream = " + stream + " volLevel = " + volLevel);
+        if (!isValidExtStream(stream))
+            return false;
+        int maxVolLevel = mAudioManager.getStreamMaxVolume(AudioManager.STREAM_MUSIC);
+        return setStreamVolNative(stream, volLevel, maxVolLevel);
+    }
+
+    protected int getBAStreamState(int stream) {
+        if (!isValidExtStream(stream))
+            return BA_STACK_STATE_IDLE;
+        return mStreamStackStates[stream];
+    }
+
+    protected BluetoothBAEncryptionKey getBAStreamEncryptionKey(int stream) {
+        if (!isValidExtStream(stream) ||
+                (mStreamStackStates[stream] == BA_STACK_STATE_IDLE) ||
+                (mStreamStackStates[stream] == BA_STACK_STATE_PENDING))
+            return null;
+        return mStreamEncryptionKeys[stream];
+    }
+
+    protected int getBAStreamDIV(int stream) {
+        if (!isValidExtStream(stream) ||
+                (mStreamStackStates[stream] == BA_STACK_STATE_IDLE) ||
+                (mStreamStackStates[stream] == BA_STACK_STATE_PENDING))
+            return 0;
+        return mStreamDIVs[stream];
+    }
+
+    // the stack sends it when the stream gets enabled, an encoder for the
+    // stream has to be set up with it before audio goes out.
+    protected byte[] getBAStreamCodecConfig(int stream) {
+        if (!isValidExtStream(stream) ||
+                (mStreamStackStates[stream] == BA_STACK_STATE_IDLE))
+            return null;
+        return mStreamCodecConfigs[stream];
+    }
+
+    private void onStreamStateChanged(byte stream, int newState) {
+        Log.d(TAG," onStreamStateChanged stream = " + stream + " state = "
+              + dumpStateString(newState));
+        if (sBATService != null) {
+            sBATService.mMsgHandler.obtainMessage(MESSAGE_BAT_STREAM_STATE_CHANGE_EVT,
+                    stream, newState).sendToTarget();
+        }
+    }
+
+    private void onStreamEncKeyUpdate(byte stream, byte size, byte[] enc_key) {
+        Log.d(TAG," onStreamEncKeyUpdate stream = " + stream + " size = " + size);
+        if (sBATService != null) {
+            Bundle data =  new Bundle();
+            data.putByteArray("encKey", enc_key);
+            Message msg = sBATService.mMsgHandler.obtainMessage(
+                    MESSAGE_BAT_STREAM_ENC_CHANGE_EVT, stream, 0);
+            msg.setData(data);
+            sBATService.mMsgHandler.sendMessage(msg);
+        }
+    }
+
+    private void onStreamDivUpdate(byte stream, byte size, byte[] div_key) {
+        Log.d(TAG," onStreamDivUpdate stream = " + stream + " size = " + size);
+        if (sBATService != null) {
+            ByteBuffer bb = ByteBuffer.wrap(div_key);
+            sBATService.mMsgHandler.obtainMessage(MESSAGE_BAT_STREAM_DIV_CHANGE_EVT,
+                    stream, (int)bb.getShort()).sendToTarget();
+        }
+    }
+
+    private void onStreamCodecUpdate(byte stream, byte size, byte[] codec_config) {
+        Log.d(TAG," onStreamCodecUpdate stream = " + stream + " size = " + size);
+        if (sBATService != null) {
+            Bundle data =  new Bundle();
+            data.putByteArray("codecConfig", codec_config);
+            Message msg = sBATService.mMsgHandler.obtainMessage(
+                    MESSAGE_BAT_CODEC_CHANGE_EVT, stream, 0);
+            msg.setData(data);
+            sBATService.mMsgHandler.sendMessage(msg);
+        }
+    }
+
+    // primary stream codec changed: receivers read frame size and samples from
+    // the service record, the encoder has to be set up again if it is running.
+    private void updateCodecConfig(byte[] codecConfig) {
+        if (codecConfig == null || codecConfig.length < CODEC_CONFIG_LEN) {
+            Log.e(TAG," updateCodecConfig invalid config ");
+            return;
+        }
+        long frameSamples = 512;
+        switch (codecConfig[CODEC_CONFIG_FRAME_SIZE_IDX] & 0xF0) {
+            case 0x10: frameSamples = 64; break;
+            case 0x20: frameSamples = 128; break;
+            case 0x40: frameSamples = 256; break;
+        }
+        long sampleRate = 48000;
+        switch (codecConfig[CODEC_CONFIG_FREQ_IDX] & 0xF0) {
+            case 0x20: sampleRate = 44100; break;
+            case 0x40: sampleRate = 32000; break;
+        }
+        long bitRate = ByteBuffer.wrap(codecConfig, CODEC_CONFIG_BIT_RATE_IDX, 4)
+                .getInt() & 0xFFFFFFFFL;
+        long frameSize = (bitRate * frameSamples + sampleRate * 8 - 1) / (sampleRate * 8);
+        Log.d(TAG," updateCodecConfig bitRate = " + bitRate + " frameSize = "
+              + frameSize + " frameSamples = " + frameSamples);
+        mServiceRecord.addServiceRecordValue(STREAM_ID_48,
+                BluetoothBAStreamServiceRecord.BSSR_TYPE_CODEC_CONFIG_CELT_FRAME_SIZE_ID,
+                frameSize);
+        mServiceRecord.addServiceRecordValue(STREAM_ID_48,
+                BluetoothBAStreamServiceRecord
+                .BSSR_TYPE_CODEC_CONFIG_CELT_FRAME_SAMPLES_ID, frameSamples);
+        if ((mCurrStackBATState == BA_STACK_STATE_STREAMING) && !isCallActive()) {
+            mAudioManager.setParameters("reconfigA2dp=true");
+        }
+    }
+
     private void onBATStateChanged(int newState) {
         Log.d(TAG," onBATStateChanged ( " + newState + " )");
         if (sBATService != null) {
@@ -1014,4 +1214,10 @@ public class BATService extends ProfileService {
     private native static void cleanupNative();
     private native static void setBAStateNative(int enable);
     private native static void setVolNative(int volLevel, int maxVolLevel);
+    private native static boolean setStreamConfigNative(int stream, int sampleRate,
+            int channelMode, int frameSize, int bitRate);
+    private native static boolean setStreamStateNative(int stream, int state);
+    private native static boolean refreshStreamEncKeyNative(int stream);
+    private native static boolean setStreamVolNative(int stream, int volLevel,
+            int maxVolLevel);
 }
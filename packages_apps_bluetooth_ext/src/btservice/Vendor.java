@@ -67,6 +67,9 @@ import com.android.bluetooth.apm.ApmConstIntf;
 
 import android.content.Intent;
 import android.content.Context;
+import android.net.wifi.WifiInfo;
+import android.net.wifi.WifiManager;
+import java.io.FileDescriptor;
 import java.util.UUID;
 
 final class Vendor {
@@ -127,6 +130,22 @@ final class Vendor {
     public void setWifiState(boolean status) {
         Log.d(TAG,"setWifiState to: " + status);
         setWifiStateNative(status);
+        updateWifiChannel(status);
+    }
+
+    /* 2.4 GHz networks run on 20 MHz channels unless told otherwise */
+    private static final int WIFI_24GHZ_CHANNEL_WIDTH_MHZ = 20;
+
+    private void updateWifiChannel(boolean wifiOn) {
+        int freqMhz = 0;
+        if (wifiOn) {
+            WifiManager wifiManager = mService.getSystemService(WifiManager.class);
+            WifiInfo info = (wifiManager != null) ? wifiManager.getConnectionInfo() : null;
+            if (info != null && info.getFrequency() > 0)
+                freqMhz = info.getFrequency();
+        }
+        Log.d(TAG,"updateWifiChannel to: " + freqMhz + " MHz");
+        setWifiChannelNative(freqMhz, (freqMhz > 0) ? WIFI_24GHZ_CHANNEL_WIDTH_MHZ : 0);
     }
 
     public int setLeHighPriorityMode(String address, boolean enable) {
@@ -177,6 +196,32 @@ final class Vendor {
 
        return status;
     }
+
+    /* Link quality metrics, same values as bt_link_quality_metric_t */
+    public static final int LINK_QUALITY_RSSI = 0;
+    public static final int LINK_QUALITY_SNR = 1;
+    public static final int LINK_QUALITY_RETRANSMISSION = 2;
+    public static final int LINK_QUALITY_PACKET_LOSS = 3;
+    public static final int LINK_QUALITY_UNUSED_CHANNELS = 4;
+
+    /* Indexes in the array returned by getLinkQualityStats */
+    public static final int LINK_QUALITY_STATS_NUM_SAMPLES = 0;
+    public static final int LINK_QUALITY_STATS_MIN = 1;
+    public static final int LINK_QUALITY_STATS_MAX = 2;
+    public static final int LINK_QUALITY_STATS_AVG = 3;
+    public static final int LINK_QUALITY_STATS_P50 = 4;
+    public static final int LINK_QUALITY_STATS_P90 = 5;
+    public static final int LINK_QUALITY_STATS_BREACHED = 6;
+    public static final int LINK_QUALITY_STATS_BREACH_COUNT = 7;
+
+    /* Returns null if no quality report of the device is known */
+    public int[] getLinkQualityStats(String address, int metric) {
+        return getLinkQualityStatsNative(address, metric);
+    }
+
+    public void dump(FileDescriptor fd) {
+        dumpNative(fd);
+    }
    public void setPowerBackoff(boolean status) {
 
         if (getPowerBackoff() == status)
@@ -545,6 +590,7 @@ final class Vendor {
     private native static void classInitNative();
     private native void cleanupNative();
     private native void setWifiStateNative(boolean status);
+    private native void setWifiChannelNative(int centerFreqMhz, int widthMhz);
     private native void setPowerBackoffNative(boolean status);
     private native boolean getProfileInfoNative(int profile_id , int profile_info);
     private native boolean getQtiStackStatusNative();
@@ -574,4 +620,6 @@ final class Vendor {
     private native static boolean isLeHighPriorityModeSetNative(String address);
     private native static boolean setAfhChannelMapNative(int transport, int len, byte [] afhMap);
     private native static boolean getAfhChannelMapNative(String address, int transport);
+    private native static int[] getLinkQualityStatsNative(String address, int metric);
+    private native void dumpNative(FileDescriptor fd);
 }
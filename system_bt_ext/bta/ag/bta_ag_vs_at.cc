@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2017-2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the
+ * disclaimer below) provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ *  * Neither the name of The Linux Foundation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+ * GRANTED BY THIS LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+ * HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "bta_ag_vs_at.h"
+
+#define BTA_AG_AT_TOK_DELIM ','
+
+static bool bta_ag_at_tok_is_space(char c) {
+  return (c == ' ' || c == '\t');
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_at_tok_field
+ *
+ * Description      Consumes the next field, the delimiter after it included,
+ *                  and returns its bounds with surrounding blanks stripped.
+ *
+ * Returns          false if no field is left
+ *
+ ******************************************************************************/
+static bool bta_ag_at_tok_field(tBTA_AG_AT_TOK* p_tok, const char** pp_start,
+                                const char** pp_stop) {
+  const char* p_start = p_tok->p_cur;
+  const char* p_stop;
+
+  if (p_tok->done) return false;
+
+  p_stop = (const char*)memchr(p_start, BTA_AG_AT_TOK_DELIM,
+                               p_tok->p_end - p_start);
+  if (p_stop == NULL) {
+    p_stop = p_tok->p_end;
+    p_tok->p_cur = p_stop;
+    p_tok->done = true;
+  } else {
+    p_tok->p_cur = p_stop + 1;
+  }
+
+  while (p_start < p_stop && bta_ag_at_tok_is_space(*p_start)) p_start++;
+  while (p_stop > p_start && bta_ag_at_tok_is_space(*(p_stop - 1))) p_stop--;
+
+  *pp_start = p_start;
+  *pp_stop = p_stop;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_at_tok_init
+ *
+ * Description      Starts tokenizing |p_s|, reading at most |max_len| bytes
+ *                  even if the string is not terminated within them.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void bta_ag_at_tok_init(tBTA_AG_AT_TOK* p_tok, const char* p_s,
+                        size_t max_len) {
+  if (p_s == NULL) {
+    p_tok->p_cur = p_tok->p_end = NULL;
+    p_tok->done = true;
+    return;
+  }
+  p_tok->p_cur = p_s;
+  p_tok->p_end = p_s + strnlen(p_s, max_len);
+  p_tok->done = false;
+}
+
+bool bta_ag_at_tok_has_more(const tBTA_AG_AT_TOK* p_tok) {
+  return !p_tok->done;
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_at_tok_next_int
+ *
+ * Description      Consumes the next field and reads it as a decimal integer
+ *                  in [min_val, max_val]. The field is consumed even when it
+ *                  is not valid, so the caller can skip it.
+ *
+ * Returns          true if the field holds a valid value
+ *
+ ******************************************************************************/
+bool bta_ag_at_tok_next_int(tBTA_AG_AT_TOK* p_tok, int32_t min_val,
+                            int32_t max_val, int32_t* p_val) {
+  const char* p_start;
+  const char* p_stop;
+  bool negative = false;
+  int64_t val = 0;
+
+  if (!bta_ag_at_tok_field(p_tok, &p_start, &p_stop)) return false;
+
+  if (p_start < p_stop && (*p_start == '-' || *p_start == '+')) {
+    negative = (*p_start == '-');
+    p_start++;
+  }
+  if (p_start == p_stop) return false;
+
+  for (; p_start < p_stop; p_start++) {
+    if (*p_start < '0' || *p_start > '9') return false;
+    val = val * 10 + (*p_start - '0');
+    /* Stop before overflowing, the value is out of range anyway */
+    if (val > (int64_t)INT32_MAX + 1) return false;
+  }
+  if (negative) val = -val;
+
+  if (val < min_val || val > max_val) return false;
+
+  *p_val = (int32_t)val;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_at_tok_next_str
+ *
+ * Description      Consumes the next field and returns it in place. The field
+ *                  is not terminated, |p_len| gives its length.
+ *
+ * Returns          false if no field is left
+ *
+ ******************************************************************************/
+bool bta_ag_at_tok_next_str(tBTA_AG_AT_TOK* p_tok, const char** pp_s,
+                            size_t* p_len) {
+  const char* p_start;
+  const char* p_stop;
+
+  if (!bta_ag_at_tok_field(p_tok, &p_start, &p_stop)) return false;
+
+  *pp_s = p_start;
+  *p_len = p_stop - p_start;
+  return true;
+}
@@ -36,32 +36,97 @@
 #include "btif_bat.h"
 #include "sdp_api.h"
 #include "hcimsgs.h"
+#include "hcivendorcmds.h"
 #include "bta_bat.h"
 #include "btm_api.h"
+#include "btm_vendor_cmd.h"
 #include "hcidefs.h"
 
 #include "osi/include/allocator.h"
 
 #define MAX_COMMANDS     10
-#define START_LT_ADDR    2
-#define MAX_LT_ADDR      7
-static uint8_t bat_lt_addr = START_LT_ADDR;
+// a vendor command the controller doesn't answer fails its sequence
+#define BTA_BA_VSC_TIMEOUT_MS 2000
+
+typedef struct {
+    uint8_t lt_addr;// 0 when no LT_ADDR is reserved for this stream
+    uint8_t enc_key[ENCRYPTION_KEY_LEN];
+    uint8_t div_key[DIV_KEY_LEN];
+    // bumped on every key change, receivers see it in the CSB metadata
+    uint8_t key_generation;
+    uint8_t curr_vol_level;
+    uint8_t curr_playing_state;
+    uint8_t sampl_freq;
+    // requests which arrived while a command sequence was in flight.
+    // Only the latest value of each class is kept and sent once the
+    // pending sequence is over.
+    uint16_t deferred_req;
+    bool vol_update_pending;
+    uint8_t pending_vol_level;
+    bool enc_key_update_pending;
+    uint8_t pending_enc_key[ENCRYPTION_KEY_LEN];
+    // number of streaming streams changed, CSB interval has to be updated
+    bool csb_update_pending;
+    // codec frame geometry sent in VS_TX_CONFIG, changes at runtime with
+    // the rate controller in btif.
+    uint16_t max_packet_size;
+    uint16_t sample_size;
+    bool codec_update_pending;
+}bta_ba_stream_t;
 
 typedef struct {
     uint32_t sdp_handle;
     uint16_t pending_cmds[MAX_COMMANDS];
     uint16_t num_cmd_pending;
     uint16_t ack_pending_req;// message to send to btif once all cmds are sent
+    uint8_t curr_stream;// stream to which pending_cmds belong
+    uint8_t next_stream;// round robin start for deferred requests
+    bta_ba_stream_t streams[BTA_BA_MAX_STREAMS];
+    tBTA_BA_UPDATE_STATS stats;
+    // deregister waits until every enabled stream is stopped
+    bool deregister_pending;
+    bool register_pending;// register arrived while deregister was pending
+}bta_ba_cb_t;
+
+typedef struct {
+    BT_HDR hdr;
+    uint8_t stream_idx;
+} tBTA_BA_API_REQ;
+
+typedef struct {
+    BT_HDR hdr;
+    uint8_t stream_idx;
     uint8_t enc_key[ENCRYPTION_KEY_LEN];
     uint8_t div_key[DIV_KEY_LEN];
-    uint8_t curr_vol_level;
-    uint8_t curr_playing_state;
-}bta_ba_cb_t;
+    uint8_t vol_level;
+    uint8_t sampl_freq;
+} tBTA_BA_API_PAUSE;
+
+typedef struct {
+    BT_HDR hdr;
+    uint8_t stream_idx;
+    uint8_t vol_level;
+} tBTA_BA_API_SET_VOL;
+
+typedef struct {
+    BT_HDR hdr;
+    uint8_t stream_idx;
+    uint8_t enc_key[ENCRYPTION_KEY_LEN];
+} tBTA_BA_API_SET_ENC_KEY;
+
+typedef struct {
+    BT_HDR hdr;
+    uint8_t stream_idx;
+    uint16_t max_packet_size;
+    uint16_t sample_size;
+} tBTA_BA_API_SET_CODEC;
 
 bta_ba_cb_t bta_ba_cb;
 static uint8_t bat_sdp_uuid[16] = {0x3d,0x6d,0x40,0x0e,0xaa,0xd7,0xf8,0xac,0x43,0x43,0x4d,0x5d,0xc9,0xbe,0x18,0xba};
 bool bta_ba_hdl_msg(BT_HDR* p_msg);
 
+#define BTA_BA_CURR_STREAM (&bta_ba_cb.streams[bta_ba_cb.curr_stream])
+
 #ifndef CASE_RETURN_STR
 #define CASE_RETURN_STR(const) \
   case const:                  \
@@ -91,6 +156,7 @@ const char* dump_ba_event(uint16_t event) {
     CASE_RETURN_STR(BTA_BA_CMD_SEND_SYNC_TRAIN_PARAM)
     CASE_RETURN_STR(BTA_BA_RSP_SEND_SYNC_TRAIN_PARAM)
     CASE_RETURN_STR(BTA_BA_HCI_EVT_CSB_TIMEOUT)
+    CASE_RETURN_STR(BTA_BA_SET_CODEC_REQ)
     default:
       return "UNKNOWN_EVENT";
   }
@@ -108,9 +174,123 @@ const char* dump_btif_event(uint16_t event) {
   }
 }
 
+static bool bta_ba_is_stream_enabled(uint8_t idx) {
+    return ((bta_ba_cb.streams[idx].curr_playing_state == BTA_BA_STATE_PAUSED) ||
+        (bta_ba_cb.streams[idx].curr_playing_state == BTA_BA_STATE_STREAMING));
+}
+
+// returns first LT_ADDR >= start_lt_addr which is not reserved by any
+// other stream, 0 if the whole range is in use.
+static uint8_t bta_ba_get_free_lt_addr(uint8_t idx, uint8_t start_lt_addr) {
+    for (uint8_t lt_addr = start_lt_addr; lt_addr <= MAX_LT_ADDR; lt_addr++) {
+        bool in_use = false;
+        for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+            if ((i != idx) && (bta_ba_cb.streams[i].lt_addr == lt_addr)) {
+                in_use = true;
+                break;
+            }
+        }
+        if (!in_use)
+            return lt_addr;
+    }
+    return 0;
+}
+
+static uint8_t bta_ba_get_stream_by_lt_addr(uint8_t lt_addr) {
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        if (bta_ba_cb.streams[i].lt_addr == lt_addr)
+            return i;
+    }
+    return BTA_BA_MAX_STREAMS;
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ba_get_csb_interval
+ *
+ * Description      CSB scheduler. Paused streams only keep sync alive and use
+ *                  the long interval. Streaming streams share the air: every
+ *                  stream keeps the short min interval and the max interval
+ *                  grows with the number of streaming streams, so that the
+ *                  controller can interleave their broadcast packets.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void bta_ba_get_csb_interval(uint8_t idx, bool streaming,
+                                    uint16_t* p_min, uint16_t* p_max) {
+    if (!streaming) {
+        *p_min = HCI_CSB_INTEVAL_LONG_MIN;
+        *p_max = HCI_CSB_INTEVAL_LONG_MAX;
+        return;
+    }
+    uint16_t num_streaming = 1;
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        if ((i != idx) &&
+            (bta_ba_cb.streams[i].curr_playing_state == BTA_BA_STATE_STREAMING))
+            num_streaming++;
+    }
+    *p_min = HCI_CSB_INTEVAL_SHORT;
+    *p_max = HCI_CSB_INTEVAL_SHORT * num_streaming;
+}
+
+// ask every other streaming stream to pick up the new CSB interval share.
+static void bta_ba_reschedule_csb(uint8_t changed_idx) {
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        if ((i != changed_idx) &&
+            (bta_ba_cb.streams[i].curr_playing_state == BTA_BA_STATE_STREAMING))
+            bta_ba_cb.streams[i].csb_update_pending = true;
+    }
+}
+
+static void bta_ba_clear_deferred_reqs() {
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        bta_ba_stream_t* p_stream = &bta_ba_cb.streams[i];
+        p_stream->deferred_req = 0;
+        p_stream->vol_update_pending = false;
+        p_stream->enc_key_update_pending = false;
+        p_stream->csb_update_pending = false;
+        p_stream->codec_update_pending = false;
+    }
+    bta_ba_cb.next_stream = 0;
+    memset(&bta_ba_cb.stats, 0, sizeof(bta_ba_cb.stats));
+}
+
+// state transitions are serialized by btif per stream, so there can be at
+// most one waiting here. Keep the latest one in case that ever breaks.
+static void bta_ba_defer_req(uint8_t idx, uint16_t event) {
+    APPL_TRACE_DEBUG(" %s stream = %d cmds pending, defer %s ", __func__,
+                                                  idx, dump_ba_event(event));
+    if (bta_ba_cb.streams[idx].deferred_req != 0) {
+        APPL_TRACE_ERROR(" %s %s overrides deferred %s ", __func__,
+          dump_ba_event(event),
+          dump_ba_event(bta_ba_cb.streams[idx].deferred_req));
+    }
+    bta_ba_cb.streams[idx].deferred_req = event;
+}
+
+// streams keep LT_ADDR and playing state only as long as the profile is
+// registered, nothing of a previous session is valid afterwards.
+static void bta_ba_reset_streams() {
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        bta_ba_stream_t* p_stream = &bta_ba_cb.streams[i];
+        p_stream->lt_addr = 0;
+        p_stream->curr_playing_state = BTA_BA_STATE_DISABLED;
+        p_stream->max_packet_size = VS_HCI_MAX_PACKET_SIZE_48;
+        p_stream->sample_size = VS_HCI_SAMPLE_SIZE;
+    }
+    bta_ba_cb.curr_stream = BTA_BA_PRIMARY_STREAM;
+}
+
 void bta_ba_handle_register_req()
 {
     APPL_TRACE_DEBUG(" %s ", __func__);
+    if (bta_ba_cb.deregister_pending) {
+        APPL_TRACE_DEBUG(" %s deregister in progress, register after ",
+                                                               __func__);
+        bta_ba_cb.register_pending = true;
+        return;
+    }
     bta_ba_cb.sdp_handle = SDP_CreateRecord();
     if(bta_ba_cb.sdp_handle == 0)
     {
@@ -119,17 +299,35 @@ void bta_ba_handle_register_req()
     }
     SDP_AddAttribute(bta_ba_cb.sdp_handle, ATTR_ID_SERVICE_CLASS_ID_LIST,
                                              UUID_DESC_TYPE, 16, bat_sdp_uuid);
+    bta_ba_reset_streams();
     bta_ba_cb.num_cmd_pending = 0;
     bta_ba_cb.ack_pending_req = 0;
     for (int i = 0; i < MAX_COMMANDS; i++) {
         bta_ba_cb.pending_cmds[i] = 0;
     }
+    bta_ba_clear_deferred_reqs();
+}
 
+void bta_ba_handle_stop_req(uint8_t idx);
+
+// stops the first enabled stream, returns false once all are stopped. A
+// stop always leaves the stream disabled, even if it fails.
+static bool bta_ba_stop_next_stream() {
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        if (bta_ba_is_stream_enabled(i)) {
+            APPL_TRACE_DEBUG(" %s stream = %d ", __func__, i);
+            bta_ba_handle_stop_req(i);
+            return true;
+        }
+    }
+    return false;
 }
 
-void bta_ba_handle_deregister_req()
-{
-    APPL_TRACE_DEBUG(" %s ", __func__);
+// called with no command sequence in flight.
+static void bta_ba_continue_deregister() {
+    if (bta_ba_stop_next_stream())
+        return;
+    APPL_TRACE_DEBUG(" %s all streams stopped ", __func__);
     SDP_DeleteRecord(bta_ba_cb.sdp_handle);
     bta_ba_cb.sdp_handle = 0;
     bta_ba_cb.num_cmd_pending = 0;
@@ -137,13 +335,36 @@ void bta_ba_handle_deregister_req()
     for (int i = 0; i < MAX_COMMANDS; i++) {
         bta_ba_cb.pending_cmds[i] = 0;
     }
+    bta_ba_clear_deferred_reqs();
+    bta_ba_reset_streams();
+    bta_ba_cb.deregister_pending = false;
+    // stays registered with bta_sys, btif may have enabled BA again for the
+    // next session already. bta_sys disables it along with the stack.
+    if (bta_ba_cb.register_pending) {
+        bta_ba_cb.register_pending = false;
+        bta_ba_handle_register_req();
+    }
+}
+
+void bta_ba_handle_deregister_req()
+{
+    APPL_TRACE_DEBUG(" %s pending commands = %d ", __func__,
+                                         bta_ba_cb.num_cmd_pending);
+    bta_ba_cb.deregister_pending = true;
+    bta_ba_cb.register_pending = false;
+    // nothing new gets started, the sequence in flight completes first.
+    bta_ba_clear_deferred_reqs();
+    if (bta_ba_cb.num_cmd_pending != 0)
+        return;
+    bta_ba_continue_deregister();
 }
 
 // this api just picks first command from top of the pending_cmd list
 // and send message to bta_ba.
 void process_hci_cmds(uint16_t event) {
-    APPL_TRACE_DEBUG(" %s pending commands = %d event = %d top_cmd = %d",
-        __func__,bta_ba_cb.num_cmd_pending, event, bta_ba_cb.pending_cmds[0]);
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d event = %d"
+        " top_cmd = %d", __func__, bta_ba_cb.curr_stream,
+        bta_ba_cb.num_cmd_pending, event, bta_ba_cb.pending_cmds[0]);
 
     if (event != bta_ba_cb.pending_cmds[0]) {
         return;
@@ -156,39 +377,125 @@ void process_hci_cmds(uint16_t event) {
      bta_sys_sendmsg(p_buf);
 }
 
-void  bta_ba_handle_set_enc_key_req() {
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                  bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
-    if(bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
+static void bta_ba_set_stream_enc_key(bta_ba_stream_t* p_stream,
+                                      const uint8_t* enc_key) {
+    if (memcmp(p_stream->enc_key, enc_key, ENCRYPTION_KEY_LEN) == 0)
         return;
-    }
+    memcpy(p_stream->enc_key, enc_key, ENCRYPTION_KEY_LEN);
+    p_stream->key_generation++;
+}
+
+static void bta_ba_send_enc_key(uint8_t idx) {
+    bta_ba_cb.stats.enc_key_updates_sent++;
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_ENC_KEY_UPDATE_DONE_EVT;
     bta_ba_cb.num_cmd_pending = 1;
     bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_VS_TX_CONFIG;
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
 
-void  bta_ba_handle_set_vol_req() {
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                  bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
-    if(bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
-        return;
-    }
+static void bta_ba_send_vol(uint8_t idx) {
+    bta_ba_cb.stats.vol_updates_sent++;
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_VOL_UPDATE_DONE_EVT;
     bta_ba_cb.num_cmd_pending = 1;
     bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_VS_VOL;
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
 
-void bta_ba_handle_stop_req() {
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                    bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+// re-send VS_TX_CONFIG with the new codec frame geometry. Sync train and CSB
+// stay as they are. Nothing to acknowledge to btif for this one.
+static void bta_ba_send_codec_update(uint8_t idx) {
+    bta_ba_cb.curr_stream = idx;
+    bta_ba_cb.ack_pending_req = 0;
+    bta_ba_cb.num_cmd_pending = 1;
+    bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_VS_TX_CONFIG;
+    process_hci_cmds(bta_ba_cb.pending_cmds[0]);
+}
+
+// re-program CSB of a streaming stream with its new interval share.
+// Nothing to acknowledge to btif for this one.
+static void bta_ba_send_csb_update(uint8_t idx) {
+    bta_ba_cb.curr_stream = idx;
+    bta_ba_cb.ack_pending_req = 0;
+    bta_ba_cb.num_cmd_pending = 1;
+    bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_ENABLE_CSB;
+    process_hci_cmds(bta_ba_cb.pending_cmds[0]);
+}
+
+void  bta_ba_handle_set_enc_key_req(uint8_t idx, uint8_t* enc_key) {
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d ",
+       __func__, idx, bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+    bta_ba_stream_t* p_stream = &bta_ba_cb.streams[idx];
+    if(bta_ba_cb.num_cmd_pending !=0) {
+        // keep only the newest key, it is sent once current cmds are done
+        if (p_stream->enc_key_update_pending)
+            bta_ba_cb.stats.enc_key_updates_coalesced++;
+        memcpy(p_stream->pending_enc_key, enc_key, ENCRYPTION_KEY_LEN);
+        p_stream->enc_key_update_pending = true;
+        return;
+    }
+    bta_ba_set_stream_enc_key(p_stream, enc_key);
+    if (!bta_ba_is_stream_enabled(idx)) {
+        // nothing on air, key goes out with the next enable
+        btif_ba_bta_callback(idx, BTIF_BA_RSP_ENC_KEY_UPDATE_DONE_EVT,
+                                                          HCI_SUCCESS);
+        return;
+    }
+    bta_ba_send_enc_key(idx);
+}
+
+void bta_ba_handle_set_codec_req(uint8_t idx, uint16_t max_packet_size,
+                                 uint16_t sample_size) {
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d packet_size = %d"
+       " sample_size = %d", __func__, idx, bta_ba_cb.num_cmd_pending,
+       max_packet_size, sample_size);
+    bta_ba_stream_t* p_stream = &bta_ba_cb.streams[idx];
+    if ((p_stream->max_packet_size == max_packet_size) &&
+        (p_stream->sample_size == sample_size))
+        return;
+    // any VS_TX_CONFIG still to be sent picks up the new values.
+    p_stream->max_packet_size = max_packet_size;
+    p_stream->sample_size = sample_size;
     if(bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
+        // VS_TX_CONFIG of the ongoing sequence might have gone out already
+        p_stream->codec_update_pending = true;
         return;
     }
+    if (bta_ba_is_stream_enabled(idx))
+        bta_ba_send_codec_update(idx);
+}
+
+void  bta_ba_handle_set_vol_req(uint8_t idx, uint8_t vol_level) {
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d"
+       " vol = %d", __func__, idx, bta_ba_cb.num_cmd_pending,
+       bta_ba_cb.ack_pending_req, vol_level);
+    bta_ba_stream_t* p_stream = &bta_ba_cb.streams[idx];
+    if(bta_ba_cb.num_cmd_pending !=0) {
+        // keep only the newest level, it is sent once current cmds are done
+        if (p_stream->vol_update_pending)
+            bta_ba_cb.stats.vol_updates_coalesced++;
+        p_stream->pending_vol_level = vol_level;
+        p_stream->vol_update_pending = true;
+        return;
+    }
+    p_stream->curr_vol_level = vol_level;
+    if (!bta_ba_is_stream_enabled(idx)) {
+        // nothing on air, level is sent as part of next VS_TX_CONFIG
+        bta_ba_cb.stats.vol_updates_coalesced++;
+        return;
+    }
+    bta_ba_send_vol(idx);
+}
+
+void bta_ba_handle_stop_req(uint8_t idx) {
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d ",
+       __func__, idx, bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+    if(bta_ba_cb.num_cmd_pending !=0) {
+        bta_ba_defer_req(idx, BTA_BA_STOP_REQ);
+        return;
+    }
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_STOP_DONE_EVT;
     bta_ba_cb.num_cmd_pending = 2;
     bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_DISABLE_CSB;
@@ -196,13 +503,14 @@ void bta_ba_handle_stop_req() {
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
 
-void bta_ba_handle_pause_req() {
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                    bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+void bta_ba_handle_pause_req(uint8_t idx) {
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d ",
+       __func__, idx, bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
     if(bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
+        bta_ba_defer_req(idx, BTA_BA_PAUSE_REQ);
         return;
     }
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_PAUSE_DONE_EVT;
     bta_ba_cb.num_cmd_pending = 2;
     bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_ENABLE_CSB;
@@ -211,13 +519,14 @@ void bta_ba_handle_pause_req() {
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
 
-void bta_ba_handle_stream_req(){
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                      bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+void bta_ba_handle_stream_req(uint8_t idx){
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d ",
+       __func__, idx, bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
     if (bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
+        bta_ba_defer_req(idx, BTA_BA_STREAM_REQ);
         return;
     }
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_STREAM_DONE_EVT;
     bta_ba_cb.num_cmd_pending = 2;
     bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_ENABLE_CSB;
@@ -225,55 +534,182 @@ void bta_ba_handle_stream_req(){
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
 
-void bta_ba_handle_enable_req()
+void bta_ba_handle_enable_req(uint8_t idx)
 {
-    APPL_TRACE_DEBUG(" %s pending commands = %d ack_cmd = %d ", __func__,
-                        bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
+    APPL_TRACE_DEBUG(" %s stream = %d pending commands = %d ack_cmd = %d ",
+       __func__, idx, bta_ba_cb.num_cmd_pending, bta_ba_cb.ack_pending_req);
     if (bta_ba_cb.num_cmd_pending !=0) {
-        APPL_TRACE_ERROR(" %s cmds already pending, bail out",__func__);
+        bta_ba_defer_req(idx, BTA_BA_ENABLE_REQ);
+        return;
+    }
+    // sync train is shared by all streams, only first stream starts it.
+    bool sync_train_running = false;
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        if ((i != idx) && bta_ba_is_stream_enabled(i))
+            sync_train_running = true;
+    }
+    bta_ba_stream_t* p_stream = &bta_ba_cb.streams[idx];
+    p_stream->curr_playing_state = BTA_BA_STATE_DISABLED;
+    p_stream->lt_addr = bta_ba_get_free_lt_addr(idx, START_LT_ADDR);
+    if (p_stream->lt_addr == 0) {
+        APPL_TRACE_ERROR(" %s no free LT_ADDR for stream %d ", __func__, idx);
+        btif_ba_bta_callback(idx, BTIF_BA_RSP_PAUSE_DONE_EVT,
+                                           HCI_ERR_HOST_REJECT_RESOURCES);
         return;
     }
+    bta_ba_cb.curr_stream = idx;
     bta_ba_cb.ack_pending_req = BTIF_BA_RSP_PAUSE_DONE_EVT;
-    bta_ba_cb.num_cmd_pending = 5;
-    bat_lt_addr = START_LT_ADDR;
-    bta_ba_cb.pending_cmds[0] = BTA_BA_CMD_SET_LT_ADDR;
-    bta_ba_cb.pending_cmds[1] = BTA_BA_CMD_ENABLE_CSB;
-    bta_ba_cb.pending_cmds[2] = BTA_BA_CMD_SEND_SYNC_TRAIN_PARAM;
-    bta_ba_cb.pending_cmds[3] = BTA_BA_CMD_VS_TX_CONFIG;
-    bta_ba_cb.pending_cmds[4] = BTA_BA_CMD_START_SYNC_TRAIN;
+    bta_ba_cb.num_cmd_pending = 0;
+    bta_ba_cb.pending_cmds[bta_ba_cb.num_cmd_pending++] = BTA_BA_CMD_SET_LT_ADDR;
+    bta_ba_cb.pending_cmds[bta_ba_cb.num_cmd_pending++] = BTA_BA_CMD_ENABLE_CSB;
+    if (!sync_train_running) {
+        bta_ba_cb.pending_cmds[bta_ba_cb.num_cmd_pending++] =
+                                         BTA_BA_CMD_SEND_SYNC_TRAIN_PARAM;
+    }
+    bta_ba_cb.pending_cmds[bta_ba_cb.num_cmd_pending++] = BTA_BA_CMD_VS_TX_CONFIG;
+    if (!sync_train_running) {
+        bta_ba_cb.pending_cmds[bta_ba_cb.num_cmd_pending++] =
+                                         BTA_BA_CMD_START_SYNC_TRAIN;
+    }
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
 }
-void ba_vs_cmd_cback(tBTM_VSC_CMPL *param){
-    uint8_t status = 0;
-    uint8_t sub_opcode = 0;
-    uint16_t opcode = param->opcode;
-    uint16_t param_len = param->param_len;
-
-    APPL_TRACE_DEBUG(" %s opcode  = %x param_len = %d",__func__,
-                                                   opcode, param_len);
-    status = param->p_param_buf[0];
-    sub_opcode = param->p_param_buf[1];
-    //status = HCI_SUCCESS;// HACK till we get proper response from soc.
-    APPL_TRACE_DEBUG(" %s pencking_ack  = %d status = %x, sub_opcode = %x",
-               __func__,bta_ba_cb.ack_pending_req, status, sub_opcode);
-
-    if (status != HCI_SUCCESS) {
-      // in case of error subopcode might not be correct, use ack_pending_req
-      if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_VOL_UPDATE_DONE_EVT)
-        sub_opcode = VS_HCI_BAT_TX_VOL;
-      else
-        sub_opcode = VS_HCI_BAT_TX_CONFIG;
-    }
-
-    switch(sub_opcode) {
-      case VS_HCI_BAT_TX_CONFIG:
-        bta_ba_handle_hci_event(BTA_BA_RSP_VS_TX_CONFIG,status, NULL, 0);
+
+// starts the most important deferred request of this stream, if any.
+static void bta_ba_process_stream_deferred_reqs(uint8_t idx) {
+    bta_ba_stream_t* p_stream = &bta_ba_cb.streams[idx];
+    uint16_t deferred_req = p_stream->deferred_req;
+    p_stream->deferred_req = 0;
+    switch(deferred_req) {
+      case BTA_BA_ENABLE_REQ:
+        bta_ba_handle_enable_req(idx);
+        break;
+      case BTA_BA_PAUSE_REQ:
+        bta_ba_handle_pause_req(idx);
         break;
-      case VS_HCI_BAT_TX_VOL:
-        bta_ba_handle_hci_event(BTA_BA_RSP_VS_VOL,status, NULL, 0);
+      case BTA_BA_STREAM_REQ:
+        bta_ba_handle_stream_req(idx);
+        break;
+      case BTA_BA_STOP_REQ:
+        bta_ba_handle_stop_req(idx);
         break;
     }
+    if (bta_ba_cb.num_cmd_pending != 0)
+        return;
+
+    if (p_stream->enc_key_update_pending &&
+        !bta_ba_is_stream_enabled(idx)) {
+        // stopped by the sequence that just ended, nothing to send
+        p_stream->enc_key_update_pending = false;
+        bta_ba_handle_set_enc_key_req(idx, p_stream->pending_enc_key);
+    }
+
+    if (p_stream->enc_key_update_pending) {
+        p_stream->enc_key_update_pending = false;
+        // VS_TX_CONFIG carries the latest codec values as well
+        p_stream->codec_update_pending = false;
+        bta_ba_set_stream_enc_key(p_stream, p_stream->pending_enc_key);
+        if (p_stream->vol_update_pending) {
+            p_stream->vol_update_pending = false;
+            p_stream->curr_vol_level = p_stream->pending_vol_level;
+            bta_ba_cb.stats.vol_updates_sent++;
+        }
+        bta_ba_send_enc_key(idx);
+        return;
+    }
+
+    if (p_stream->codec_update_pending) {
+        p_stream->codec_update_pending = false;
+        if (bta_ba_is_stream_enabled(idx)) {
+            // VS_TX_CONFIG carries the vol level as well
+            if (p_stream->vol_update_pending) {
+                p_stream->vol_update_pending = false;
+                p_stream->curr_vol_level = p_stream->pending_vol_level;
+                bta_ba_cb.stats.vol_updates_sent++;
+            }
+            bta_ba_send_codec_update(idx);
+            return;
+        }
+    }
+
+    if (p_stream->vol_update_pending) {
+        p_stream->vol_update_pending = false;
+        bta_ba_handle_set_vol_req(idx, p_stream->pending_vol_level);
+        if (bta_ba_cb.num_cmd_pending != 0)
+            return;
+    }
+
+    if (p_stream->csb_update_pending) {
+        p_stream->csb_update_pending = false;
+        if (p_stream->curr_playing_state == BTA_BA_STATE_STREAMING)
+            bta_ba_send_csb_update(idx);
+    }
 }
+
+// called once a command sequence is over. Streams are served round robin so
+// that one busy stream can't starve the others. Per stream, state transitions
+// go first, then the latest enc key or codec (VS_TX_CONFIG carries the vol
+// level too), then volume and last the CSB interval share.
+static void bta_ba_process_deferred_reqs() {
+    for (uint8_t n = 0; n < BTA_BA_MAX_STREAMS; n++) {
+        uint8_t idx = (bta_ba_cb.next_stream + n) % BTA_BA_MAX_STREAMS;
+        bta_ba_process_stream_deferred_reqs(idx);
+        if (bta_ba_cb.num_cmd_pending != 0) {
+            bta_ba_cb.next_stream = (idx + 1) % BTA_BA_MAX_STREAMS;
+            return;
+        }
+    }
+}
+
+// context carries the BTA_BA_RSP_VS_* event of the command, the dispatcher
+// hands back the completion of exactly this command, failed or timed out.
+static void ba_vs_cmd_cback(uint16_t cmd_id, uint8_t status,
+                            tBTM_VSC_CMPL *param, void *context) {
+    uint16_t event = (uint16_t)(uintptr_t)context;
+
+    APPL_TRACE_DEBUG(" %s cmd_id = %d event = %s status = %x param_len = %d",
+               __func__, cmd_id, dump_ba_event(event), status,
+               param ? param->param_len : 0);
+    if (status == BTM_VSC_STATUS_TIMEOUT) {
+        APPL_TRACE_ERROR(" %s %s timed out", __func__, dump_ba_event(event));
+    }
+    bta_ba_handle_hci_event(event, status, NULL, 0);
+}
+
+// a command the dispatcher has no room for fails like a rejected one, so
+// that the sequence is unwound.
+static bool bta_ba_send_vs_cmd(uint8_t* param, uint8_t param_len,
+                               uint16_t rsp_event) {
+    if (BTM_VscSubmit(VS_BA_CMD_OPCODE, param_len, param,
+            BTA_BA_VSC_TIMEOUT_MS, ba_vs_cmd_cback,
+            (void*)(uintptr_t)rsp_event) != BTM_VSC_INVALID_ID)
+        return true;
+    ba_vs_cmd_cback(BTM_VSC_INVALID_ID, HCI_ERR_HOST_REJECT_RESOURCES, NULL,
+                    (void*)(uintptr_t)rsp_event);
+    return false;
+}
+
+// writes the broadcast metadata of a stream as its CSB data. Goes out along
+// with every VS_TX_CONFIG, the writer skips it if nothing changed. CSB data
+// is not encrypted, so only the key generation goes out, never the key.
+static void bta_ba_write_csb_metadata(bta_ba_stream_t* p_stream,
+                                      uint8_t stream_id) {
+    uint8_t data[BTA_BA_CSB_METADATA_LEN];
+    uint8_t index = 0;
+    data[index++] = BTA_BA_CSB_METADATA_VERSION;
+    data[index++] = stream_id;
+    data[index++] = VS_HCI_CODEC_TYPE_CELT;
+    data[index++] = p_stream->sampl_freq;
+    data[index++] = p_stream->max_packet_size & 0x00FF;
+    data[index++] = (p_stream->max_packet_size >> 8) & 0x00FF;
+    data[index++] = p_stream->sample_size & 0x00FF;
+    data[index++] = (p_stream->sample_size >> 8) & 0x00FF;
+    data[index++] = p_stream->key_generation;
+    uint16_t num_cmds =
+        btsnd_hcic_write_csb_data(p_stream->lt_addr, data, index);
+    APPL_TRACE_DEBUG(" %s lt_addr = %d stream_id = %x cmds = %d", __func__,
+                                 p_stream->lt_addr, stream_id, num_cmds);
+}
+
 /*******************************************************************************
  *
  * Function         bta_ba_hdl_msg
@@ -288,6 +724,11 @@ bool bta_ba_hdl_msg(BT_HDR* p_msg) {
     APPL_TRACE_DEBUG(" %s event = %s", __func__, dump_ba_event(p_msg->event));
     uint8_t param[40];
     uint8_t index = 0;
+    uint16_t csb_min_interval = 0;
+    uint16_t csb_max_interval = 0;
+    uint8_t stream_id = VS_HCI_STREAM_ID_INVALID;
+    bta_ba_stream_t* p_stream = BTA_BA_CURR_STREAM;
+    tBTA_BA_API_PAUSE* p_pause = NULL;
     switch(p_msg->event)
     {
       // request from btif
@@ -298,57 +739,74 @@ bool bta_ba_hdl_msg(BT_HDR* p_msg) {
         bta_ba_handle_deregister_req();
         break;
     case BTA_BA_ENABLE_REQ:
-        bta_ba_handle_enable_req();
-        bta_ba_cb.curr_playing_state = BTA_BA_STATE_DISABLED;
+    case BTA_BA_PAUSE_REQ:
+        p_pause = (tBTA_BA_API_PAUSE*)p_msg;
+        p_stream = &bta_ba_cb.streams[p_pause->stream_idx];
+        bta_ba_set_stream_enc_key(p_stream, p_pause->enc_key);
+        memcpy(p_stream->div_key, p_pause->div_key, DIV_KEY_LEN);
+        p_stream->curr_vol_level = p_pause->vol_level;
+        p_stream->sampl_freq = p_pause->sampl_freq;
+        if (p_msg->event == BTA_BA_ENABLE_REQ)
+            bta_ba_handle_enable_req(p_pause->stream_idx);
+        else
+            bta_ba_handle_pause_req(p_pause->stream_idx);
         break;
     case BTA_BA_STREAM_REQ:
-        bta_ba_handle_stream_req();
-        break;
-    case BTA_BA_PAUSE_REQ:
-        bta_ba_handle_pause_req();
+        bta_ba_handle_stream_req(((tBTA_BA_API_REQ*)p_msg)->stream_idx);
         break;
     case BTA_BA_STOP_REQ:
-        bta_ba_handle_stop_req();
+        bta_ba_handle_stop_req(((tBTA_BA_API_REQ*)p_msg)->stream_idx);
         break;
     case BTA_BA_SET_VOL_REQ:
-        bta_ba_handle_set_vol_req();
+        bta_ba_handle_set_vol_req(((tBTA_BA_API_SET_VOL*)p_msg)->stream_idx,
+                                  ((tBTA_BA_API_SET_VOL*)p_msg)->vol_level);
         break;
     case BTA_BA_SET_ENC_KEY:
-        bta_ba_handle_set_enc_key_req();
+        bta_ba_handle_set_enc_key_req(
+                              ((tBTA_BA_API_SET_ENC_KEY*)p_msg)->stream_idx,
+                              ((tBTA_BA_API_SET_ENC_KEY*)p_msg)->enc_key);
+        break;
+    case BTA_BA_SET_CODEC_REQ:
+        bta_ba_handle_set_codec_req(
+                          ((tBTA_BA_API_SET_CODEC*)p_msg)->stream_idx,
+                          ((tBTA_BA_API_SET_CODEC*)p_msg)->max_packet_size,
+                          ((tBTA_BA_API_SET_CODEC*)p_msg)->sample_size);
         break;
         // cmds send to HCI
     case BTA_BA_CMD_SET_LT_ADDR:
-        btsnd_hcic_set_reserved_lt_addr(bat_lt_addr);
+        btsnd_hcic_set_reserved_lt_addr(p_stream->lt_addr);
         break;
     case BTA_BA_CMD_VS_TX_CONFIG:
         param[index++] = VS_HCI_BAT_TX_CONFIG;
         // first parameter is Stream ID
         if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_PAUSE_DONE_EVT) {
-            param[index++] = VS_HCI_STREAM_ID_INVALID;
+            stream_id = VS_HCI_STREAM_ID_INVALID;
         }
         else if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_STREAM_DONE_EVT) {
-            param[index++] = VS_HCI_STREAM_ID_VALID;
+            stream_id = VS_HCI_STREAM_ID(bta_ba_cb.curr_stream);
         }
-        else if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_ENC_KEY_UPDATE_DONE_EVT) {
-            switch(bta_ba_cb.curr_playing_state) {
+        else {
+            // enc key or codec update, keep current playing state
+            switch(p_stream->curr_playing_state) {
               case BTA_BA_STATE_PAUSED:
               case BTA_BA_STATE_DISABLED:
-                 param[index++] = VS_HCI_STREAM_ID_INVALID;
+                 stream_id = VS_HCI_STREAM_ID_INVALID;
                  break;
               case BTA_BA_STATE_STREAMING:
-                 param[index++] = VS_HCI_STREAM_ID_VALID;
+                 stream_id = VS_HCI_STREAM_ID(bta_ba_cb.curr_stream);
                  break;
             }
         }
+        param[index++] = stream_id;
         //LT_ADDR
-        param[index++] = bat_lt_addr;
+        param[index++] = p_stream->lt_addr;
         //CODEC type
         param[index++] = VS_HCI_CODEC_TYPE_CELT;
         //sampling frequency
-        param[index++] = VS_HCI_SAMPLING_FREQ_48;
+        param[index++] = p_stream->sampl_freq;
         // packet size: 2 bytes
-        param[index++] = VS_HCI_MAX_PACKET_SIZE_48;
-        param[index++] = 0x00;
+        param[index++] = p_stream->max_packet_size & 0x00FF;
+        param[index++] = (p_stream->max_packet_size >> 8) & 0x00FF;
         // encoding scheme
         param[index++] = VS_HCI_ENCODING_SCHEME_2_5;
         // TTP offset: 3 bytes
@@ -357,13 +815,13 @@ bool bta_ba_hdl_msg(BT_HDR* p_msg) {
         param[index++] = (VS_HCI_TTP_OFFSET >> 16);
         param[index++] = 0;
         // Initialization vector
-        memcpy(&param[index], bta_ba_cb.enc_key, ENCRYPTION_KEY_LEN);
+        memcpy(&param[index], p_stream->enc_key, ENCRYPTION_KEY_LEN);
         index = index + ENCRYPTION_KEY_LEN;
         //Initialization vector
-        //memcpy(&param[index], bta_ba_cb.div_key, DIV_KEY_LEN);
+        //memcpy(&param[index], p_stream->div_key, DIV_KEY_LEN);
         //index += DIV_KEY_LEN
-        param[index++] = bta_ba_cb.div_key[1];
-        param[index++] = bta_ba_cb.div_key[0];
+        param[index++] = p_stream->div_key[1];
+        param[index++] = p_stream->div_key[0];
         //
         param[index++] = 0xBE;
         param[index++] = 0xEF;
@@ -373,24 +831,30 @@ bool bta_ba_hdl_msg(BT_HDR* p_msg) {
         param[index++] = 0xDE;
         //vol level
         // because vol level for MM ( 0-15 ). BA (0-31)
-        param[index++] = 2*bta_ba_cb.curr_vol_level;
+        param[index++] = 2*p_stream->curr_vol_level;
         // Power Level
         param[index++] = VS_HCI_TX_POWER_LEVEL;
         // sample size
-        param[index++] = VS_HCI_SAMPLE_SIZE & 0x00FF;
-        param[index++] = (VS_HCI_SAMPLE_SIZE >> 8) & 0x00FF;
+        param[index++] = p_stream->sample_size & 0x00FF;
+        param[index++] = (p_stream->sample_size >> 8) & 0x00FF;
 
-        BTM_VendorSpecificCommand(VS_BA_CMD_OPCODE, index, param, ba_vs_cmd_cback);
         APPL_TRACE_DEBUG(" %s param_len = %d",__func__, index);
+        if (bta_ba_send_vs_cmd(param, index, BTA_BA_RSP_VS_TX_CONFIG))
+            bta_ba_write_csb_metadata(p_stream, stream_id);
         break;
     case BTA_BA_CMD_ENABLE_CSB:
-        if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_PAUSE_DONE_EVT) {
-            btsnd_hcic_set_csb(HCI_ENABLE_CSB, bat_lt_addr, 0,
-                HCI_CSB_PACKET_TYPE, HCI_CSB_INTEVAL_LONG_MIN, HCI_CSB_INTEVAL_LONG_MAX, HCI_CSB_TIMEOUT);
-        }
-        else if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_STREAM_DONE_EVT) {
-            btsnd_hcic_set_csb(HCI_ENABLE_CSB, bat_lt_addr, 0,
-                HCI_CSB_PACKET_TYPE, HCI_CSB_INTEVAL_SHORT, HCI_CSB_INTEVAL_SHORT, HCI_CSB_TIMEOUT);
+        if ((bta_ba_cb.ack_pending_req == BTIF_BA_RSP_PAUSE_DONE_EVT) ||
+            (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_STREAM_DONE_EVT) ||
+            (bta_ba_cb.ack_pending_req == 0)) {
+            bta_ba_get_csb_interval(bta_ba_cb.curr_stream,
+                (bta_ba_cb.ack_pending_req != BTIF_BA_RSP_PAUSE_DONE_EVT),
+                &csb_min_interval, &csb_max_interval);
+            APPL_TRACE_DEBUG(" %s stream = %d csb interval = %d - %d",
+                __func__, bta_ba_cb.curr_stream, csb_min_interval,
+                csb_max_interval);
+            btsnd_hcic_set_csb(HCI_ENABLE_CSB, p_stream->lt_addr, 0,
+                HCI_CSB_PACKET_TYPE, csb_min_interval, csb_max_interval,
+                HCI_CSB_TIMEOUT);
         }
         break;
     case BTA_BA_CMD_SEND_SYNC_TRAIN_PARAM:
@@ -401,22 +865,29 @@ bool bta_ba_hdl_msg(BT_HDR* p_msg) {
         btsnd_hcic_start_synch_train();
         break;
     case BTA_BA_CMD_DISABLE_CSB:
-         btsnd_hcic_set_csb(HCI_DISABLE_CSB, bat_lt_addr, 0,
+         btsnd_hcic_set_csb(HCI_DISABLE_CSB, p_stream->lt_addr, 0,
            HCI_CSB_PACKET_TYPE, HCI_CSB_INTEVAL_LONG_MAX, HCI_CSB_INTEVAL_LONG_MAX, HCI_CSB_TIMEOUT);
         break;
     case BTA_BA_CMD_DELETE_LT_ADDR:
-        btsnd_hcic_delete_reserved_lt_addr(bat_lt_addr);
+        btsnd_hcic_delete_reserved_lt_addr(p_stream->lt_addr);
         break;
     case BTA_BA_CMD_VS_VOL:
         param[index++] = VS_HCI_BAT_TX_VOL;
-        param[index++] = 2*bta_ba_cb.curr_vol_level;
-        BTM_VendorSpecificCommand(VS_BA_CMD_OPCODE, index, param, ba_vs_cmd_cback);
+        param[index++] = 2*p_stream->curr_vol_level;
+        bta_ba_send_vs_cmd(param, index, BTA_BA_RSP_VS_VOL);
         break;
     }
   return true;
 }
 
-static const tBTA_SYS_REG bta_ba_reg = {bta_ba_hdl_msg, BTA_BADisable};
+// stack goes down, a deregister in progress won't complete.
+static void bta_ba_sys_disable() {
+    bta_ba_cb.deregister_pending = false;
+    bta_ba_cb.register_pending = false;
+    BTA_BADisable();
+}
+
+static const tBTA_SYS_REG bta_ba_reg = {bta_ba_hdl_msg, bta_ba_sys_disable};
 
 // as this api is also called from btm, which is same as btu thread context
 // we can directly acnknowledge btif from this api.
@@ -424,29 +895,39 @@ void  bta_ba_handle_hci_event(uint16_t event, uint8_t result, uint8_t* p_data,
                               uint8_t data_len) {
     APPL_TRACE_DEBUG(" %s event= %s result = %x data_len = %d", __func__,
                                   dump_ba_event(event), result, data_len);
-    APPL_TRACE_DEBUG(" pending_cmd[0] = %s ack_pending = %s num_cmds_pending = %d"
+    APPL_TRACE_DEBUG(" stream = %d pending_cmd[0] = %s ack_pending = %s"
+     " num_cmds_pending = %d", bta_ba_cb.curr_stream
      ,dump_ba_event(bta_ba_cb.pending_cmds[0])
      ,dump_btif_event(bta_ba_cb.ack_pending_req), bta_ba_cb.num_cmd_pending);
 
     uint16_t topmost_pending_cmd = 0;
     uint8_t command_status = BTA_HCI_CMD_SUCCESS;
+    uint8_t idx = bta_ba_cb.curr_stream;
+    bta_ba_stream_t* p_stream = BTA_BA_CURR_STREAM;
     switch(event) {
       case BTA_BA_RSP_SET_LT_ADDR:
          topmost_pending_cmd = BTA_BA_CMD_SET_LT_ADDR;
          if (result == HCI_ERR_CONNECTION_EXISTS) {
-             bat_lt_addr ++;
-             if (bat_lt_addr > MAX_LT_ADDR) {
+             p_stream->lt_addr =
+                 bta_ba_get_free_lt_addr(idx, p_stream->lt_addr + 1);
+             if (p_stream->lt_addr == 0) {
                  // we have tried all possible lt_addrs.treat this as
                  // command failure and return.
                command_status =  BTA_HCI_CMD_FAILURE;
-               bat_lt_addr = START_LT_ADDR;
              } else {
                command_status = BTA_HCI_CMD_RETRY;
              }
+         } else if (result != HCI_SUCCESS) {
+             // nothing reserved, CSB can't be enabled on this lt_addr
+             command_status = BTA_HCI_CMD_FAILURE;
          }
          break;
       case BTA_BA_RSP_SEND_SYNC_TRAIN_PARAM:
         topmost_pending_cmd = BTA_BA_CMD_SEND_SYNC_TRAIN_PARAM;
+        // sync train can't be started without its parameters
+        if (result != HCI_SUCCESS) {
+            command_status = BTA_HCI_CMD_FAILURE;
+        }
         break;
       case BTA_BA_RSP_VS_TX_CONFIG:
         topmost_pending_cmd = BTA_BA_CMD_VS_TX_CONFIG;
@@ -487,12 +968,34 @@ void  bta_ba_handle_hci_event(uint16_t event, uint8_t result, uint8_t* p_data,
         topmost_pending_cmd = BTA_BA_CMD_DELETE_LT_ADDR;
         break;
       case BTA_BA_HCI_EVT_CSB_TIMEOUT:
+        if ((p_data != NULL) && (data_len > 0)) {
+            idx = BTA_BA_MAX_STREAMS;
+            if (p_data[0] != 0)
+                idx = bta_ba_get_stream_by_lt_addr(p_data[0]);
+            if (idx == BTA_BA_MAX_STREAMS) {
+                // better to stop the primary stream than to keep
+                // broadcasting to receivers which lost sync.
+                APPL_TRACE_ERROR(" %s CSB timeout for unknown lt_addr %d,"
+                                 " using primary stream", __func__, p_data[0]);
+                idx = BTA_BA_PRIMARY_STREAM;
+            }
+        }
+        // goes ahead of the timeout itself, rate control still sees the
+        // stream streaming.
+        if (idx == BTA_BA_PRIMARY_STREAM)
+            btif_ba_report_link_feedback(0, 0, true);
+        if ((idx != bta_ba_cb.curr_stream) ||
+            (bta_ba_cb.ack_pending_req == 0) ||
+            (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_VOL_UPDATE_DONE_EVT)) {
+            // CSB timeout happened while we were not sending any state
+            // command for this stream. Report it and carry on with whatever
+            // is in flight.
+            btif_ba_bta_callback(idx, BTIF_BA_CSB_TIMEOUT_EVT,
+                                         HCI_ERR_HOST_REJECT_RESOURCES);
+            return;
+        }
         command_status = BTA_HCI_CMD_FAILURE;
         result = HCI_ERR_HOST_REJECT_RESOURCES;
-        if (bta_ba_cb.ack_pending_req == 0) {
-            // CSB timeout happened while we were not sending any command.
-            bta_ba_cb.ack_pending_req = BTIF_BA_CSB_TIMEOUT_EVT;
-        }
         break;
       default:
         APPL_TRACE_ERROR(" %s UNKNOWN event ", __func__);
@@ -526,21 +1029,37 @@ void  bta_ba_handle_hci_event(uint16_t event, uint8_t result, uint8_t* p_data,
     if (bta_ba_cb.num_cmd_pending == 0) {
         // if theere is a failure, don't change state.
         if (command_status == BTA_HCI_CMD_SUCCESS) {
+            bool was_streaming =
+                (p_stream->curr_playing_state == BTA_BA_STATE_STREAMING);
             switch(bta_ba_cb.ack_pending_req) {
               case BTIF_BA_RSP_PAUSE_DONE_EVT:
-                  bta_ba_cb.curr_playing_state = BTA_BA_STATE_PAUSED;
-              break;
-              case BTIF_BA_RSP_STOP_DONE_EVT:
-                  bta_ba_cb.curr_playing_state = BTA_BA_STATE_DISABLED;
+                  p_stream->curr_playing_state = BTA_BA_STATE_PAUSED;
               break;
               case BTIF_BA_RSP_STREAM_DONE_EVT:
-                  bta_ba_cb.curr_playing_state = BTA_BA_STATE_STREAMING;
+                  p_stream->curr_playing_state = BTA_BA_STATE_STREAMING;
               break;
             }
+            if (was_streaming !=
+                (p_stream->curr_playing_state == BTA_BA_STATE_STREAMING))
+                bta_ba_reschedule_csb(idx);
+        }
+        if (bta_ba_cb.ack_pending_req == BTIF_BA_RSP_STOP_DONE_EVT) {
+            // btif moves to idle even if stop failed, release LT_ADDR anyway
+            if (p_stream->curr_playing_state == BTA_BA_STATE_STREAMING)
+                bta_ba_reschedule_csb(idx);
+            p_stream->curr_playing_state = BTA_BA_STATE_DISABLED;
+            p_stream->lt_addr = 0;
         }
         // no more HCI command to process. acknowledge btif from here..
-        btif_ba_bta_callback(bta_ba_cb.ack_pending_req, result);
+        // btif has let go of its streams once it asked for deregister.
+        if ((bta_ba_cb.ack_pending_req != 0) && !bta_ba_cb.deregister_pending)
+            btif_ba_bta_callback(idx, bta_ba_cb.ack_pending_req, result);
         bta_ba_cb.ack_pending_req = 0;
+        if (bta_ba_cb.deregister_pending) {
+            bta_ba_continue_deregister();
+            return;
+        }
+        bta_ba_process_deferred_reqs();
         return;
     }
     process_hci_cmds(bta_ba_cb.pending_cmds[0]);
@@ -579,75 +1098,126 @@ void BTA_BARegister() {
     bta_sys_sendmsg(p_buf);
 }
 
-void BTA_PauseBA(bool start_sync_train, uint8_t* p_enc_key, uint8_t* p_div_key,
-                                               uint8_t vol_level)
+void BTA_PauseBA(uint8_t stream_idx, bool start_sync_train, uint8_t* p_enc_key,
+                 uint8_t* p_div_key, uint8_t vol_level, uint8_t sampl_freq)
 {
     /*
      *  this api will send list of command required to move to PAUSE_STATE
      *  It can be called either from OFF state or from streaming state.
      *  If called from off state, start_sync_train should be true.
      */
-    APPL_TRACE_DEBUG(" %s start_sync_train =%d ", __func__, start_sync_train);
-    BT_HDR* p_buf =
-      (BT_HDR*)osi_malloc(sizeof(BT_HDR));
+    APPL_TRACE_DEBUG(" %s stream = %d start_sync_train =%d ", __func__,
+                                             stream_idx, start_sync_train);
+    tBTA_BA_API_PAUSE* p_buf =
+      (tBTA_BA_API_PAUSE*)osi_malloc(sizeof(tBTA_BA_API_PAUSE));
 
     if (start_sync_train)
     {
-        p_buf->event = BTA_BA_ENABLE_REQ;
+        p_buf->hdr.event = BTA_BA_ENABLE_REQ;
     }
     else
     {
-        p_buf->event = BTA_BA_PAUSE_REQ;
+        p_buf->hdr.event = BTA_BA_PAUSE_REQ;
     }
-    memcpy(bta_ba_cb.enc_key, p_enc_key, ENCRYPTION_KEY_LEN);
-    memcpy(bta_ba_cb.div_key, p_div_key, DIV_KEY_LEN);
-    bta_ba_cb.curr_vol_level = vol_level;
+    p_buf->stream_idx = stream_idx;
+    memcpy(p_buf->enc_key, p_enc_key, ENCRYPTION_KEY_LEN);
+    memcpy(p_buf->div_key, p_div_key, DIV_KEY_LEN);
+    p_buf->vol_level = vol_level;
+    p_buf->sampl_freq = sampl_freq;
     bta_sys_sendmsg(p_buf);
 }
 
-void BTA_StreamBA()
+void BTA_StreamBA(uint8_t stream_idx)
 {
-    APPL_TRACE_DEBUG(" %s ", __func__);
-    BT_HDR* p_buf =
-      (BT_HDR*)osi_malloc(sizeof(BT_HDR));
-    p_buf->event = BTA_BA_STREAM_REQ;
+    APPL_TRACE_DEBUG(" %s stream = %d ", __func__, stream_idx);
+    tBTA_BA_API_REQ* p_buf =
+      (tBTA_BA_API_REQ*)osi_malloc(sizeof(tBTA_BA_API_REQ));
+    p_buf->hdr.event = BTA_BA_STREAM_REQ;
+    p_buf->stream_idx = stream_idx;
     bta_sys_sendmsg(p_buf);
 }
 
-void BTA_StopBA()
+void BTA_StopBA(uint8_t stream_idx)
 {
-    APPL_TRACE_DEBUG(" %s ", __func__);
-    BT_HDR* p_buf =
-      (BT_HDR*)osi_malloc(sizeof(BT_HDR));
-    p_buf->event = BTA_BA_STOP_REQ;
+    APPL_TRACE_DEBUG(" %s stream = %d ", __func__, stream_idx);
+    tBTA_BA_API_REQ* p_buf =
+      (tBTA_BA_API_REQ*)osi_malloc(sizeof(tBTA_BA_API_REQ));
+    p_buf->hdr.event = BTA_BA_STOP_REQ;
+    p_buf->stream_idx = stream_idx;
     bta_sys_sendmsg(p_buf);
 }
 
-void BTA_SetVol(uint8_t curr_vol_level)
+void BTA_SetVol(uint8_t stream_idx, uint8_t curr_vol_level)
 {
-    APPL_TRACE_DEBUG(" %s ", __func__);
-    BT_HDR* p_buf =
-      (BT_HDR*)osi_malloc(sizeof(BT_HDR));
-    p_buf->event = BTA_BA_SET_VOL_REQ;
-    bta_ba_cb.curr_vol_level = curr_vol_level;
+    APPL_TRACE_DEBUG(" %s stream = %d ", __func__, stream_idx);
+    tBTA_BA_API_SET_VOL* p_buf =
+      (tBTA_BA_API_SET_VOL*)osi_malloc(sizeof(tBTA_BA_API_SET_VOL));
+    p_buf->hdr.event = BTA_BA_SET_VOL_REQ;
+    p_buf->stream_idx = stream_idx;
+    p_buf->vol_level = curr_vol_level;
     bta_sys_sendmsg(p_buf);
 }
 
-void BTA_SetEncKey(uint8_t* enc_key)
+void BTA_SetEncKey(uint8_t stream_idx, uint8_t* enc_key)
 {
-    APPL_TRACE_DEBUG(" %s ", __func__);
-    BT_HDR* p_buf =
-      (BT_HDR*)osi_malloc(sizeof(BT_HDR));
-    p_buf->event = BTA_BA_SET_ENC_KEY;
-    memcpy(bta_ba_cb.enc_key, enc_key, ENCRYPTION_KEY_LEN);
+    APPL_TRACE_DEBUG(" %s stream = %d ", __func__, stream_idx);
+    tBTA_BA_API_SET_ENC_KEY* p_buf =
+      (tBTA_BA_API_SET_ENC_KEY*)osi_malloc(sizeof(tBTA_BA_API_SET_ENC_KEY));
+    p_buf->hdr.event = BTA_BA_SET_ENC_KEY;
+    p_buf->stream_idx = stream_idx;
+    memcpy(p_buf->enc_key, enc_key, ENCRYPTION_KEY_LEN);
     bta_sys_sendmsg(p_buf);
 }
+
+/*******************************************************************************
+ *
+ * Function         BTA_BASetCodec
+ *
+ * Description      Updates max packet size and samples per frame of the CELT
+ *                  stream. If the stream is on air, VS_TX_CONFIG is re-sent
+ *                  without touching CSB or the sync train.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void BTA_BASetCodec(uint8_t stream_idx, uint16_t max_packet_size,
+                    uint16_t sample_size)
+{
+    APPL_TRACE_DEBUG(" %s stream = %d ", __func__, stream_idx);
+    tBTA_BA_API_SET_CODEC* p_buf =
+      (tBTA_BA_API_SET_CODEC*)osi_malloc(sizeof(tBTA_BA_API_SET_CODEC));
+    p_buf->hdr.event = BTA_BA_SET_CODEC_REQ;
+    p_buf->stream_idx = stream_idx;
+    p_buf->max_packet_size = max_packet_size;
+    p_buf->sample_size = sample_size;
+    bta_sys_sendmsg(p_buf);
+}
+
+/*******************************************************************************
+ *
+ * Function         BTA_BAGetUpdateStats
+ *
+ * Description      Returns how many vol/enc key updates were sent to the
+ *                  controller and how many were superseded by a newer value
+ *                  before they could be sent. The counters are only
+ *                  written from BTU context; a dumpsys read from another
+ *                  thread may be a few updates behind.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void BTA_BAGetUpdateStats(tBTA_BA_UPDATE_STATS* p_stats)
+{
+    *p_stats = bta_ba_cb.stats;
+}
 /*******************************************************************************
  *
  * Function         BTA_BADeregister
  *
  * Description      DeRegisters Broadcast Audio Transmitter profile.
- *                  We deregister SDP record as part of enable
+ *                  Every enabled stream is stopped first, then the SDP
+ *                  record is removed. BA stays registered with BTA system
+ *                  manager until the stack is disabled.
  *
  * Returns          void
  *
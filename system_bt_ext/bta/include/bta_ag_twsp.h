@@ -40,6 +40,7 @@
 #define VS_QHCI_TWS_ESCO_SETUP_OPCODE 0x0D
 #define VS_QHCI_TWS_ESCO_SETUP_SUBOPCODE 0x00
 #define VS_TWS_SCO_SETUP_CMD_LEN 14
+#define TWSP_VSC_TIMEOUT_MS 2000
 
 /* Unsolicited AT commands frm AG side
  * Request earbud State */
@@ -82,5 +83,6 @@ bool is_twsp_connected();
 void twsp_select_microphone(tBTA_AG_SCB *scb1, tBTA_AG_SCB *scb2);
 void twsp_update_microphone_selection(tBTA_AG_SCB *curr_pscb,
                                              tBTA_AG_SCB *selected_pscb);
+void twsp_cancel_microphone_selection(tBTA_AG_SCB *p_scb);
 
 #endif//_BTA_AG_TWS_H_
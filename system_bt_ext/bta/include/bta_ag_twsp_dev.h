@@ -37,9 +37,16 @@
 
 #include "bta_ag_int.h"
 
-#define MAX_TWSPLUS_DEVICES 2
+/* The device table holds MAX_TWSPLUS_PAIRS pairs, the two earbuds of pair
+ * k are at index 2k (primary) and 2k+1 (secondary). */
+#define MAX_TWSPLUS_PAIRS 2
+#define TWSPLUS_EBS_PER_PAIR 2
+#define MAX_TWSPLUS_DEVICES (MAX_TWSPLUS_PAIRS * TWSPLUS_EBS_PER_PAIR)
 #define PRIMARY_EB_IDX 0
 #define SECONDARY_EB_IDX 1
+#define TWSPLUS_INVALID_PAIR (-1)
+#define TWSPLUS_PAIR_IDX(eb_idx) ((eb_idx) / TWSPLUS_EBS_PER_PAIR)
+#define TWSPLUS_PEER_IDX(eb_idx) ((eb_idx) ^ SECONDARY_EB_IDX)
 
 #define TWSPLUS_MIN_BATTERY_CHARGE 0
 #define TWSPLUS_MIN_BATTERY_CHARGE_STATE_CHARGING 0
@@ -57,6 +64,16 @@
 #define TWSPLUS_MAX_MIC_QUALITY 15
 #define TWSPLUS_MIN_MIC_QUALITY 0
 
+/* Mic selection hysteresis. The averaged quality is kept in 1/256 units.
+ * Margin (in quality points) and dwell time can be tuned with properties. */
+#define TWSPLUS_MIC_QUALITY_SCALE 256
+#define TWSPLUS_MIC_QUALITY_TAU_MS 2000
+#define TWSPLUS_MIC_SWITCH_MARGIN_DEFAULT 2
+#define TWSPLUS_MIC_DWELL_MS_DEFAULT 3000
+#define TWSPLUS_MIC_SWITCH_MARGIN_PROP \
+  "persist.vendor.btstack.twsp.mic_switch_margin"
+#define TWSPLUS_MIC_DWELL_MS_PROP "persist.vendor.btstack.twsp.mic_dwell_ms"
+
 #define TWSPLUS_MIN_QDSP 0
 #define TWSPLUS_MAX_QDSP 3
 
@@ -85,6 +102,8 @@ enum {
 typedef struct {
    tBTA_AG_SCB *p_scb;
    uint8_t mic_quality;
+   uint16_t mic_quality_avg;      /* time weighted, TWSPLUS_MIC_QUALITY_SCALE */
+   uint64_t mic_quality_time_ms;  /* time of the last quality report */
    uint16_t battery_state;
    uint16_t battery_level;
    uint8_t state;
@@ -103,11 +122,13 @@ bool twsp_set_ring_sent(tBTA_AG_SCB *p_scb, bool ring_sent);
 void twsp_clr_all_ring_sent();
 bool twsp_ring_needed(tBTA_AG_SCB *p_scb);
 
-bool twsp_get_right_eb_addr(RawAddress& eb_addr);
-bool twsp_get_left_eb_addr(RawAddress& eb_addr);
+/* Pair scoped helpers, |p_scb| is any earbud of the pair */
+bool twsp_get_right_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& eb_addr);
+bool twsp_get_left_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& eb_addr);
+tBTA_AG_SCB* twsp_get_best_mic_scb (tBTA_AG_SCB* p_scb);
 uint8_t get_twsp_role(tBTA_AG_SCB *p_scb);
 uint8_t get_twsp_state(tBTA_AG_SCB *p_scb);
-tBTA_AG_SCB* twsp_get_best_mic_scb ();
 int twsp_get_idx_by_scb(tBTA_AG_SCB* p_scb);
+int twsp_get_pair_idx_by_scb(tBTA_AG_SCB* p_scb);
 
 #endif//__BTA_AG_TWSPLUS_DEV_H_
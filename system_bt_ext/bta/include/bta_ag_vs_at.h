@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017-2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the
+ * disclaimer below) provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ *  * Neither the name of The Linux Foundation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+ * GRANTED BY THIS LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+ * HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BTA_AG_VS_AT_H_
+#define __BTA_AG_VS_AT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tokenizer for the comma separated parameters of vendor AT commands
+ * (+QBC, +QAC, ...). It walks the received string in place, it neither
+ * copies nor modifies it. */
+typedef struct {
+  const char* p_cur; /* start of the next field */
+  const char* p_end; /* end of the string */
+  bool done;         /* last field consumed */
+} tBTA_AG_AT_TOK;
+
+void bta_ag_at_tok_init(tBTA_AG_AT_TOK* p_tok, const char* p_s,
+                        size_t max_len);
+bool bta_ag_at_tok_has_more(const tBTA_AG_AT_TOK* p_tok);
+bool bta_ag_at_tok_next_int(tBTA_AG_AT_TOK* p_tok, int32_t min_val,
+                            int32_t max_val, int32_t* p_val);
+bool bta_ag_at_tok_next_str(tBTA_AG_AT_TOK* p_tok, const char** pp_s,
+                            size_t* p_len);
+
+#endif  //__BTA_AG_VS_AT_H_
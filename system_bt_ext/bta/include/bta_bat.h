@@ -57,7 +57,8 @@ enum {
     BTA_BA_RSP_DISABLE_CSB,
     BTA_BA_RSP_VS_VOL,
     BTA_BA_HCI_EVT_CSB_TIMEOUT,
-    BTA_BA_DEREGISTER_REQ
+    BTA_BA_DEREGISTER_REQ,
+    BTA_BA_SET_CODEC_REQ// packet size/sample size changed, refresh VS_TX_CONFIG
 };
 
 // VS command parameters
@@ -69,6 +70,8 @@ enum {
 // stream IDs
 #define VS_HCI_STREAM_ID_VALID    0x01
 #define VS_HCI_STREAM_ID_INVALID  0xFF
+// each broadcast stream gets its own ID, primary stream uses ID_VALID
+#define VS_HCI_STREAM_ID(stream_idx) (VS_HCI_STREAM_ID_VALID + (stream_idx))
 //codec Type
 #define VS_HCI_CODEC_TYPE_CELT    0x00
 //sampling frequency
@@ -86,6 +89,13 @@ enum {
 // Sample size
 #define VS_HCI_SAMPLE_SIZE  512
 
+// broadcast metadata written as CSB data of each stream: version, stream
+// ID, codec type, sampling frequency, packet size, sample size and key
+// generation. Lets receivers pick a stream without connecting and notice a
+// key change. The key itself is only handed out by GattBroadcastService.
+#define BTA_BA_CSB_METADATA_VERSION 0x02
+#define BTA_BA_CSB_METADATA_LEN     9
+
 #define HCI_ENABLE_CSB            0x01
 #define HCI_DISABLE_CSB           0x00
 #define HCI_CSB_PACKET_TYPE       0xEE1C
@@ -99,6 +109,13 @@ enum {
 #define HCI_SYNC_TRAIN_MAX_INTERVAL 0x0630
 #define HCI_SYNC_TRAIN_TIMEOUT      0x07FFFFFE
 
+// reserved LT_ADDR range, one LT_ADDR per broadcast stream
+#define START_LT_ADDR    2
+#define MAX_LT_ADDR      7
+#define BTA_BA_MAX_STREAMS     (MAX_LT_ADDR - START_LT_ADDR + 1)
+// stream driven by the audio HAL, others are additional broadcast streams
+#define BTA_BA_PRIMARY_STREAM  0
+
 #define BTA_BA_STATE_DISABLED   1
 #define BTA_BA_STATE_PAUSED    2
 #define BTA_BA_STATE_STREAMING 3
@@ -106,20 +123,33 @@ enum {
 #define BTA_HCI_CMD_SUCCESS 0
 #define BTA_HCI_CMD_RETRY 1
 #define BTA_HCI_CMD_FAILURE 2
+
+// vol and enc key updates received while a command sequence is in flight
+// are coalesced, only the latest value gets sent to the controller.
+typedef struct {
+    uint32_t vol_updates_sent;
+    uint32_t vol_updates_coalesced;
+    uint32_t enc_key_updates_sent;
+    uint32_t enc_key_updates_coalesced;
+} tBTA_BA_UPDATE_STATS;
 /*******************************************************************************
  *  BTIF BA API
  ******************************************************************************/
 
 //bta public apis, would be called from btif_ba
-void BTA_PauseBA(bool, uint8_t* , uint8_t* ,uint8_t);
+void BTA_PauseBA(uint8_t stream_idx, bool, uint8_t* , uint8_t* ,uint8_t,
+                 uint8_t sampl_freq);
 void BTA_BAEnable();
 void BTA_BADisable();
 void BTA_BARegister();
 void BTA_BADeregister();
-void BTA_StreamBA();
-void BTA_StopBA();
-void BTA_SetVol(uint8_t curr_vol_level);
-void BTA_SetEncKey(uint8_t* enc_key);
+void BTA_StreamBA(uint8_t stream_idx);
+void BTA_StopBA(uint8_t stream_idx);
+void BTA_SetVol(uint8_t stream_idx, uint8_t curr_vol_level);
+void BTA_SetEncKey(uint8_t stream_idx, uint8_t* enc_key);
+void BTA_BAGetUpdateStats(tBTA_BA_UPDATE_STATS* p_stats);
+void BTA_BASetCodec(uint8_t stream_idx, uint16_t max_packet_size,
+                    uint16_t sample_size);
 
 void bta_ba_handle_hci_event(uint16_t event, uint8_t result, uint8_t* p_data,
                                                uint8_t data_len);
@@ -80,7 +80,8 @@ typedef uint8_t tBTA_TWS_PLUS_STATUS;
 #define BTA_TWS_PLUS_SDP_SEARCH_EVT 2         /* TwsPlus SDP Service started */
 #define BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT 3    /* TwsPlus SDP search complete */
 #define BTA_TWS_PLUS_LK_DERIVED_EVT 4         /* TwsPlus LK derived for 2nd EB */
-#define BTA_TWS_PLUS_MAX_EVT 5                /* max number of SDP events */
+#define BTA_TWS_PLUS_SDP_SET_COMP_EVT 5       /* TwsPlus SDP of both EBs done */
+#define BTA_TWS_PLUS_MAX_EVT 6                /* max number of SDP events */
 
 typedef uint16_t tBTA_TWS_PLUS_EVT;
 
@@ -100,10 +101,18 @@ typedef struct {
 
 } tBTA_TWS_PLUS_SDP_SEARCH_COMP;
 
+/* data associated with BTA_TWS_PLUS_SDP_SET_COMP_EVT */
+typedef struct {
+  tBTA_TWS_PLUS_STATUS status;             /* status of eb_comp */
+  tBTA_TWS_PLUS_SDP_SEARCH_COMP eb_comp;   /* earbud the search was issued for */
+  tBTA_TWS_PLUS_SDP_SEARCH_COMP peer_comp; /* its peer earbud */
+} tBTA_TWS_PLUS_SDP_SET_COMP;
+
 typedef union {
   tBTA_TWS_PLUS_STATUS status;                   /* BTA_TWS_PLUS_SEARCH_EVT */
   tBTA_TWS_PLUS_SDP_SEARCH_COMP sdp_search_comp; /* BTA_TWS_PLUS_SEARCH_COMP_EVT */
   tBTA_TWS_PLUS_LK_DERIVED lk_derived;           /* BTA_TWS_PLUS_LK_DERIVED_EVT */
+  tBTA_TWS_PLUS_SDP_SET_COMP sdp_set_comp;       /* BTA_TWS_PLUS_SDP_SET_COMP_EVT */
 } tBTA_TWS_PLUS;
 
 /* SDP DM Interface callback */
@@ -111,8 +120,8 @@ typedef void(tBTA_TWS_PLUS_DM_CBACK)(tBTA_TWS_PLUS_EVT event, tBTA_TWS_PLUS* p_d
 
 /* TWS_PLUS configuration structure */
 typedef struct {
-  uint16_t sdp_db_size;        /* The size of p_sdp_db */
-  tSDP_DISCOVERY_DB* p_sdp_db; /* The data buffer to keep SDP database */
+  uint16_t sdp_db_size;        /* The size of each SDP database */
+  tSDP_DISCOVERY_DB* p_sdp_db; /* BTA_TWS_PLUS_MAX_SDP_SEARCH databases */
 } tBTA_TWS_PLUS_SDP_CFG;
 
 /*******************************************************************************
@@ -161,6 +170,20 @@ extern tBTA_TWS_PLUS_STATUS BTA_TwsPlusDisable(void);
  ******************************************************************************/
 extern tBTA_TWS_PLUS_STATUS BTA_TwsPlusSdpSearch(RawAddress bd_addr);
 
+/*******************************************************************************
+ *
+ * Function         BTA_TwsPlusSdpSearchSet
+ *
+ * Description      Start the TWS+ sdp search of an earbud and of its peer
+ *                  earbud at the same time. Both results are merged and
+ *                  reported with a single BTA_TWS_PLUS_SDP_SET_COMP_EVT.
+ * Returns          BTA_TWS_PLUS_SUCCESS if successful.
+ *                  BTA_TWS_PLUS_FAIL if internal failure.
+ *
+ ******************************************************************************/
+extern tBTA_TWS_PLUS_STATUS BTA_TwsPlusSdpSearchSet(RawAddress bd_addr,
+                                                    RawAddress peer_eb_addr);
+
 extern tBTA_TWS_PLUS_STATUS BTA_TwsPlusDeriveLinkKey(RawAddress eb_addr,
                     RawAddress peer_eb_addr, LinkKey key, uint8_t reason);
 
@@ -29,10 +29,12 @@
 
 #include <unistd.h>
 #include "bta_ag_swb.h"
+#include "bta_ag_vs_at.h"
 #include "internal_include/bt_trace.h"
 #include "bta_ag_int.h"
 #include "utl.h"
 #include "device/include/interop.h"
+#include "btif_config.h"
 #include <hardware/vendor_hf.h>
 #include <cutils/properties.h>
 
@@ -41,28 +43,153 @@
 #define SWB_CODECS_SUPPORTED "0,4,6,7"
 #define SWB_CODECS_UNSUPPORTD "0xFFFF"
 
+/* Per-device SWB negotiation cache, stored in the device section of the
+ * bt config. It is only a hint for the codec tried first, +%QCS is always
+ * sent so the entry is refreshed or dropped by every negotiation. Bump the
+ * version whenever the meaning of the keys changes so stale entries are
+ * ignored rather than misread. */
+#define BTA_AG_SWB_CACHE_VERSION 2
+#define BTA_AG_SWB_CACHE_KEY_VERSION "SwbCacheVersion"
+#define BTA_AG_SWB_CACHE_KEY_PEER_CODECS "SwbPeerCodecs"
+#define BTA_AG_SWB_CACHE_KEY_CODEC "SwbCodec"
+
+/* Set while a negotiation started on mSBC because of the cache, its result
+ * says nothing about SWB and is not stored */
+static bool bta_ag_swb_msbc_hint[BTA_AG_MAX_NUM_CLIENTS];
+
+static bool* bta_ag_swb_hint_flag(tBTA_AG_SCB* p_scb) {
+  uint16_t scb_idx = bta_ag_scb_to_idx(p_scb);
+  if (scb_idx == 0 || scb_idx > BTA_AG_MAX_NUM_CLIENTS) return NULL;
+  return &bta_ag_swb_msbc_hint[scb_idx - 1];
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_swb_cache_lookup
+ *
+ * Description      Look up the codec the last negotiation with the peer
+ *                  ended on, provided the peer still advertises the same
+ *                  codec set it had at that time.
+ *
+ * Returns          true if a usable cache entry was found
+ *
+ ******************************************************************************/
+static bool bta_ag_swb_cache_lookup(tBTA_AG_SCB* p_scb, uint16_t* p_codec) {
+  std::string bdstr = p_scb->peer_addr.ToString();
+  const char* section = bdstr.c_str();
+  int version = 0, peer_codecs = 0, codec = 0;
+
+  if (!btif_config_get_int(section, BTA_AG_SWB_CACHE_KEY_VERSION, &version) ||
+      version != BTA_AG_SWB_CACHE_VERSION)
+    return false;
+  if (!btif_config_get_int(section, BTA_AG_SWB_CACHE_KEY_PEER_CODECS,
+                           &peer_codecs) ||
+      !btif_config_get_int(section, BTA_AG_SWB_CACHE_KEY_CODEC, &codec))
+    return false;
+  if (peer_codecs != p_scb->peer_codecs) {
+    APPL_TRACE_DEBUG("%s: peer codecs changed 0x%x -> 0x%x", __func__,
+                     peer_codecs, p_scb->peer_codecs);
+    return false;
+  }
+
+  *p_codec = (uint16_t)codec;
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_swb_cache_store
+ *
+ * Description      Remember the codec negotiated with the peer together with
+ *                  the codec set it advertised.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void bta_ag_swb_cache_store(tBTA_AG_SCB* p_scb, uint16_t codec) {
+  std::string bdstr = p_scb->peer_addr.ToString();
+  const char* section = bdstr.c_str();
+  int cur_codec = 0, cur_peer_codecs = 0;
+
+  if (btif_config_get_int(section, BTA_AG_SWB_CACHE_KEY_CODEC, &cur_codec) &&
+      btif_config_get_int(section, BTA_AG_SWB_CACHE_KEY_PEER_CODECS,
+                          &cur_peer_codecs) &&
+      cur_codec == codec && cur_peer_codecs == p_scb->peer_codecs)
+    return;
+
+  btif_config_set_int(section, BTA_AG_SWB_CACHE_KEY_VERSION,
+                      BTA_AG_SWB_CACHE_VERSION);
+  btif_config_set_int(section, BTA_AG_SWB_CACHE_KEY_PEER_CODECS,
+                      p_scb->peer_codecs);
+  btif_config_set_int(section, BTA_AG_SWB_CACHE_KEY_CODEC, codec);
+  btif_config_save();
+}
+
+/*******************************************************************************
+ *
+ * Function         bta_ag_swb_cache_invalidate
+ *
+ * Description      Drop the cached SWB negotiation result of the peer so the
+ *                  next SCO setup starts from the default codec again.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void bta_ag_swb_cache_invalidate(tBTA_AG_SCB* p_scb) {
+  std::string bdstr = p_scb->peer_addr.ToString();
+  const char* section = bdstr.c_str();
+
+  if (!btif_config_exist(section, BTA_AG_SWB_CACHE_KEY_CODEC))
+    return;
+
+  APPL_TRACE_DEBUG("%s: %s", __func__, section);
+  btif_config_remove(section, BTA_AG_SWB_CACHE_KEY_CODEC);
+  btif_config_save();
+}
+
 void bta_ag_swb_handle_vs_at_events(tBTA_AG_SCB* p_scb, uint16_t cmd, int16_t int_arg, tBTA_AG_VAL val)
 {
   APPL_TRACE_DEBUG("%s: p_scb : %x cmd : %d", __func__, p_scb, cmd);
   switch(cmd) {
-    case BTA_AG_AT_QAC_EVT:
+    case BTA_AG_AT_QAC_EVT: {
+      uint16_t cached_codec;
+      bool* p_hint = bta_ag_swb_hint_flag(p_scb);
+
       if (!get_swb_codec_status()) {
         bta_ag_send_qac(p_scb, NULL);
         break;
       }
       p_scb->codec_updated = true;
+      if (p_hint) *p_hint = false;
       if (p_scb->peer_codecs &  BTA_AG_SCO_SWB_SETTINGS_Q0_MASK) {
         p_scb->sco_codec = BTA_AG_SCO_SWB_SETTINGS_Q0;
       } else if (p_scb->peer_codecs & BTA_AG_CODEC_MSBC) {
         p_scb->sco_codec = UUID_CODEC_MSBC;
       }
+      /* The last negotiation with this exact codec set fell back to mSBC,
+       * try mSBC first this time. The entry is dropped so the connection
+       * after this one tries SWB again. */
+      if (p_hint && !p_scb->codec_fallback &&
+          p_scb->sco_codec == BTA_AG_SCO_SWB_SETTINGS_Q0 &&
+          bta_ag_swb_cache_lookup(p_scb, &cached_codec) &&
+          cached_codec == BTA_AG_CODEC_MSBC) {
+        APPL_TRACE_DEBUG("%s: SWB fell back last time, starting with mSBC",
+                         __func__);
+        p_scb->codec_fallback = true;
+        *p_hint = true;
+        bta_ag_swb_cache_invalidate(p_scb);
+      }
       bta_ag_send_qac(p_scb, NULL);
       APPL_TRACE_DEBUG("Received AT+QAC, updating sco codec to SWB: %d", p_scb->sco_codec);
       val.num = p_scb->peer_codecs;
       break;
+    }
     case BTA_AG_AT_QCS_EVT: {
       tBTA_AG_PEER_CODEC codec_type, codec_sent;
+      bool* p_hint = bta_ag_swb_hint_flag(p_scb);
+      bool hinted = p_hint && *p_hint;
       alarm_cancel(p_scb->codec_negotiation_timer);
+      if (p_hint) *p_hint = false;
 
       switch (int_arg) {
         case BTA_AG_SCO_SWB_SETTINGS_Q0:
@@ -91,10 +218,15 @@ void bta_ag_swb_handle_vs_at_events(tBTA_AG_SCB* p_scb, uint16_t cmd, int16_t in
       else
         codec_sent = p_scb->sco_codec;
 
-      if (codec_type == codec_sent)
+      if (codec_type == codec_sent) {
+        /* A fallback to mSBC is remembered too, unless the cache chose it */
+        if (!hinted)
+          bta_ag_swb_cache_store(p_scb, codec_sent);
         bta_ag_sco_codec_nego(p_scb, true);
-      else
+      } else {
+        bta_ag_swb_cache_invalidate(p_scb);
         bta_ag_sco_codec_nego(p_scb, false);
+      }
 
       /* send final codec info to callback */
       val.num = codec_sent;
@@ -156,23 +288,16 @@ void bta_ag_send_qac(tBTA_AG_SCB* p_scb, tBTA_AG_DATA* p_data) {
 
 tBTA_AG_PEER_CODEC bta_ag_parse_qac(tBTA_AG_SCB* p_scb, char* p_s) {
   tBTA_AG_PEER_CODEC retval = BTA_AG_CODEC_NONE;
-  uint16_t codec_modes;
-  bool cont = false; /* Continue processing */
-  char* p;
-
-  while (p_s) {
-    /* skip to comma delimiter */
-    for (p = p_s; *p != ',' && *p != 0; p++)
-      ;
-
-    /* get integre value */
-    if (*p != 0) {
-      *p = 0;
-      cont = true;
-    } else
-      cont = false;
-
-    codec_modes = utl_str2int(p_s);
+  tBTA_AG_AT_TOK tok;
+  int32_t codec_modes;
+
+  bta_ag_at_tok_init(&tok, p_s, BTA_AG_AT_MAX_LEN);
+  while (bta_ag_at_tok_has_more(&tok)) {
+    if (!bta_ag_at_tok_next_int(&tok, 0, UINT16_MAX, &codec_modes)) {
+      APPL_TRACE_ERROR("Invalid Codec UUID received");
+      continue;
+    }
+
     switch (codec_modes) {
       case BTA_AG_SCO_SWB_SETTINGS_Q0:
         retval |= BTA_AG_SCO_SWB_SETTINGS_Q0_MASK;
@@ -190,11 +315,6 @@ tBTA_AG_PEER_CODEC bta_ag_parse_qac(tBTA_AG_SCB* p_scb, char* p_s) {
         APPL_TRACE_ERROR("Unknown Codec UUID(%d) received", codec_modes);
         break;
     }
-
-    if (cont)
-      p_s = p + 1;
-    else
-      break;
   }
 
   return (retval);
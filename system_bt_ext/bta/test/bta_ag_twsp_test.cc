@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      bta_ag_twsp_test.cc
+ *
+ *  Description:   Host tests of the TWS+ earbud microphone selection.
+ *                 bta_ag_twsp_dev.cc and bta_ag_twsp_sco.cc run unmodified
+ *                 against fake AG control blocks, fake alarms and a virtual
+ *                 clock. Everything else they call into is stubbed in this
+ *                 file.
+ *
+ ******************************************************************************/
+
+#include <cutils/properties.h>
+#include <gtest/gtest.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bta_ag_int.h"
+#include "bta_ag_twsp.h"
+#include "bta_ag_twsp_dev.h"
+#include "btm_api.h"
+#include "btm_vendor_cmd.h"
+#include "device/include/controller.h"
+#include "internal_include/bt_trace.h"
+#include "osi/include/alarm.h"
+#include "osi/include/time.h"
+
+void init_twsp_devices();
+
+namespace {
+
+/*******************************************************************************
+ *  Virtual clock and alarms
+ ******************************************************************************/
+
+// Alarms fire in order of due time, the clock jumps to the due time of the
+// alarm that fires. Callbacks run inline, as they would on the main loop.
+struct FakeAlarm {
+  uint64_t due_ms;
+  alarm_callback_t cb;
+  void* data;
+  bool armed;
+};
+
+uint64_t now_ms;
+// the code under test keeps its alarms for good, so they are never freed
+std::vector<FakeAlarm*> alarms;
+
+FakeAlarm* next_alarm(uint64_t end_ms) {
+  FakeAlarm* p_next = NULL;
+  for (FakeAlarm* p_alarm : alarms) {
+    if (!p_alarm->armed || p_alarm->due_ms > end_ms) continue;
+    if (p_next == NULL || p_alarm->due_ms < p_next->due_ms) p_next = p_alarm;
+  }
+  return p_next;
+}
+
+// runs every alarm due in the next delay_ms
+void run_for(uint64_t delay_ms) {
+  uint64_t end_ms = now_ms + delay_ms;
+  FakeAlarm* p_alarm;
+  while ((p_alarm = next_alarm(end_ms)) != NULL) {
+    now_ms = p_alarm->due_ms;
+    p_alarm->armed = false;
+    p_alarm->cb(p_alarm->data);
+  }
+  now_ms = end_ms;
+}
+
+void disarm_all_alarms() {
+  for (FakeAlarm* p_alarm : alarms) p_alarm->armed = false;
+}
+
+/*******************************************************************************
+ *  Earbuds and recorders
+ ******************************************************************************/
+
+// two TWS+ pairs, earbuds 2k and 2k+1 belong to pair k. The odd addresses
+// come up as left earbuds.
+const int kNumEarbuds = 4;
+
+RawAddress earbud_addr(int eb) {
+  RawAddress addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.address[1] = 0x02;
+  addr.address[2] = 0x5b;
+  addr.address[5] = (uint8_t)(eb + 1);
+  return addr;
+}
+
+int earbud_by_addr(const RawAddress& addr) {
+  for (int eb = 0; eb < kNumEarbuds; eb++)
+    if (earbud_addr(eb) == addr) return eb;
+  return -1;
+}
+
+tBTA_AG_SCB* earbud_scb(int eb) { return &bta_ag_cb.scb[eb]; }
+
+int earbud_by_scb(tBTA_AG_SCB* p_scb) {
+  if (p_scb < bta_ag_cb.scb || p_scb >= bta_ag_cb.scb + kNumEarbuds)
+    return -1;
+  return (int)(p_scb - bta_ag_cb.scb);
+}
+
+struct Result {
+  uint64_t time_ms;
+  int eb;
+  size_t code;
+  int16_t int_arg;
+};
+
+struct VscCmd {
+  uint64_t time_ms;
+  uint16_t opcode;
+  std::vector<uint8_t> params;
+};
+
+std::vector<Result> results;
+std::vector<VscCmd> vsc_cmds;
+std::vector<std::pair<int, bool>> created_scos;
+std::map<std::string, int32_t> properties;
+
+controller_t fake_controller;
+
+bool fake_supports_esco() { return true; }
+
+void fake_ag_cback(tBTA_AG_EVT event, tBTA_AG* p_data) {}
+
+}  // namespace
+
+/*******************************************************************************
+ *  Stubs of the rest of the stack
+ ******************************************************************************/
+
+tBTA_AG_CB bta_ag_cb;
+
+// BTA_AG_TWSP_TEST_VERBOSE=1 prints the traces of the code under test
+uint8_t appl_trace_level = getenv("BTA_AG_TWSP_TEST_VERBOSE")
+                               ? BT_TRACE_LEVEL_DEBUG
+                               : BT_TRACE_LEVEL_NONE;
+
+void LogMsg(uint32_t trace_set_mask, const char* fmt_str, ...) {
+  if (getenv("BTA_AG_TWSP_TEST_VERBOSE") == NULL) return;
+  va_list ap;
+  va_start(ap, fmt_str);
+  vprintf(fmt_str, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+int32_t property_get_int32(const char* key, int32_t default_value) {
+  auto it = properties.find(key);
+  return (it == properties.end()) ? default_value : it->second;
+}
+
+uint64_t time_get_os_boottime_ms(void) { return now_ms; }
+
+struct alarm_t {
+  FakeAlarm fake;
+};
+
+alarm_t* alarm_new(const char* name) {
+  alarm_t* alarm = new alarm_t();
+  alarms.push_back(&alarm->fake);
+  return alarm;
+}
+
+void alarm_free(alarm_t* alarm) {
+  ADD_FAILURE() << "TWS+ alarms are kept for good";
+}
+
+void alarm_cancel(alarm_t* alarm) {
+  if (alarm != NULL) alarm->fake.armed = false;
+}
+
+void alarm_set_on_mloop(alarm_t* alarm, uint64_t interval_ms,
+                        alarm_callback_t cb, void* data) {
+  alarm->fake.due_ms = now_ms + interval_ms;
+  alarm->fake.cb = cb;
+  alarm->fake.data = data;
+  alarm->fake.armed = true;
+}
+
+bool BTM_SecGetTwsPlusPeerDev(const RawAddress& eb_addr,
+                              RawAddress& peer_eb_addr) {
+  int eb = earbud_by_addr(eb_addr);
+  if (eb < 0) return false;
+  peer_eb_addr = earbud_addr(eb ^ 1);
+  return true;
+}
+
+bool BTM_SecIsTwsPlusDev(const RawAddress& bd_addr) {
+  return earbud_by_addr(bd_addr) >= 0;
+}
+
+uint16_t BTM_VscSubmit(uint16_t opcode, uint8_t param_len, uint8_t* p_params,
+                       uint32_t timeout_ms, tBTM_VSC_DISPATCH_CBACK* p_cback,
+                       void* context) {
+  vsc_cmds.push_back(
+      {now_ms, opcode, std::vector<uint8_t>(p_params, p_params + param_len)});
+  return (uint16_t)vsc_cmds.size();
+}
+
+const controller_t* controller_get_interface() { return &fake_controller; }
+
+uint16_t bta_ag_scb_to_idx(tBTA_AG_SCB* p_scb) {
+  return ((uint16_t)(p_scb - bta_ag_cb.scb)) + 1;
+}
+
+uint16_t bta_ag_idx_by_bdaddr(const RawAddress* peer_addr) {
+  for (int i = 0; i < BTA_AG_MAX_NUM_CLIENTS; i++) {
+    if (bta_ag_cb.scb[i].in_use && bta_ag_cb.scb[i].peer_addr == *peer_addr)
+      return (uint16_t)(i + 1);
+  }
+  return 0;
+}
+
+tBTA_AG_SCB* bta_ag_scb_by_idx(uint16_t idx) {
+  if (idx == 0 || idx > BTA_AG_MAX_NUM_CLIENTS) return NULL;
+  tBTA_AG_SCB* p_scb = &bta_ag_cb.scb[idx - 1];
+  return p_scb->in_use ? p_scb : NULL;
+}
+
+bool bta_ag_scb_open(tBTA_AG_SCB* p_curr_scb) {
+  return p_curr_scb != NULL && p_curr_scb->in_use && p_curr_scb->svc_conn;
+}
+
+void bta_ag_send_result(tBTA_AG_SCB* p_scb, size_t code, const char* p_arg,
+                        int16_t int_arg) {
+  results.push_back({now_ms, earbud_by_scb(p_scb), code, int_arg});
+}
+
+void bta_ag_cback_sco(tBTA_AG_SCB* p_scb, uint8_t event) {}
+
+void bta_ag_sco_event(tBTA_AG_SCB* p_scb, uint8_t event) {}
+
+bool bta_ag_create_sco(tBTA_AG_SCB* p_scb, bool is_orig) {
+  created_scos.push_back(std::make_pair(earbud_by_scb(p_scb), is_orig));
+  return true;
+}
+
+bool bta_ag_remove_sco(tBTA_AG_SCB* p_scb, bool only_active) { return true; }
+
+void bta_ag_codec_negotiate(tBTA_AG_SCB* p_scb) {}
+
+void bta_ag_post_sco_close(tBTA_AG_SCB* p_scb, tBTA_AG_DATA* p_data) {}
+
+const char* bta_ag_sco_state_str(uint8_t state) { return "state"; }
+
+const char* bta_ag_sco_evt_str(uint8_t event) { return "event"; }
+
+namespace {
+
+const int kDwellMs = TWSPLUS_MIC_DWELL_MS_DEFAULT;
+
+class BtaAgTwspTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // 0 means never to the mic policy, the clock starts later
+    now_ms = 1000;
+    properties.clear();
+    memset(&bta_ag_cb, 0, sizeof(bta_ag_cb));
+    bta_ag_cb.p_cback = fake_ag_cback;
+    fake_controller.supports_enhanced_setup_synchronous_connection =
+        fake_supports_esco;
+    init_twsp_devices();
+    ClearRecords();
+  }
+
+  void TearDown() override {
+    // lets the switches in flight complete, without audio they can't
+    // start any new alarm
+    StopAudio();
+    run_for(60000);
+    init_twsp_devices();
+    run_for(60000);
+    disarm_all_alarms();
+  }
+
+  void ClearRecords() {
+    results.clear();
+    vsc_cmds.clear();
+    created_scos.clear();
+  }
+
+  void Connect(int eb) {
+    tBTA_AG_SCB* p_scb = earbud_scb(eb);
+    p_scb->peer_addr = earbud_addr(eb);
+    p_scb->in_use = true;
+    p_scb->svc_conn = true;
+    p_scb->conn_handle = (uint16_t)(0x100 + eb);
+    p_scb->sco_idx = BTM_INVALID_SCO_INDEX;
+    update_twsp_device(p_scb);
+  }
+
+  void Disconnect(int eb) {
+    tBTA_AG_SCB* p_scb = earbud_scb(eb);
+    reset_twsp_device(twsp_get_idx_by_scb(p_scb));
+    memset(p_scb, 0, sizeof(*p_scb));
+  }
+
+  void VsAt(int eb, uint16_t cmd, int16_t arg) {
+    tBTA_AG_VAL val;
+    memset(&val, 0, sizeof(val));
+    twsp_handle_vs_at_events(earbud_scb(eb), cmd, &val, arg);
+  }
+
+  void SetState(int eb, uint8_t state) {
+    VsAt(eb, BTA_AG_TWSP_AT_QES_EVT, state);
+  }
+
+  void ReportMic(int eb, int quality) {
+    VsAt(eb, BTA_AG_TWSP_AT_QMQ_EVT, (int16_t)quality);
+  }
+
+  // both earbuds of |pair| connected and in ear, the left one (2 * pair)
+  // carries the mic
+  void ConnectPairInEar(int pair) {
+    size_t num_enables = MicEnables().size();
+    Connect(2 * pair);
+    Connect(2 * pair + 1);
+    ASSERT_EQ(TWSPLUS_EB_ROLE_LEFT, get_twsp_role(earbud_scb(2 * pair)));
+    ASSERT_EQ(TWSPLUS_EB_ROLE_RIGHT, get_twsp_role(earbud_scb(2 * pair + 1)));
+    SetState(2 * pair, TWSPLUS_EB_STATE_INEAR);
+    SetState(2 * pair + 1, TWSPLUS_EB_STATE_INEAR);
+    ASSERT_EQ(num_enables, MicEnables().size());
+  }
+
+  // audio of the primary SCO state machine goes to |eb|
+  void StartAudio(int eb) {
+    bta_ag_cb.sco.state = BTA_AG_SCO_OPEN_ST;
+    bta_ag_cb.sco.p_curr_scb = earbud_scb(eb);
+    bta_ag_cb.main_sm_scb = earbud_scb(eb);
+  }
+
+  void StopAudio() {
+    bta_ag_cb.sco.state = BTA_AG_SCO_LISTEN_ST;
+    bta_ag_cb.twsp_sec_sco.state = BTA_AG_SCO_LISTEN_ST;
+  }
+
+  std::vector<Result> MicResults(int16_t int_arg) {
+    std::vector<Result> mic;
+    for (const Result& result : results)
+      if (result.code == BTA_AG_MIC_RES && result.int_arg == int_arg)
+        mic.push_back(result);
+    return mic;
+  }
+
+  std::vector<Result> MicEnables() { return MicResults(MIC_ENABLE); }
+  std::vector<Result> MicDisables() { return MicResults(MIC_DISABLE); }
+
+  // checks the TWS eSCO setup command that selects the mic of |eb|
+  void ExpectEscoSetup(const VscCmd& cmd, int pair, int eb) {
+    EXPECT_EQ(VS_QHCI_TWS_ESCO_SETUP_OPCODE, cmd.opcode);
+    ASSERT_EQ((size_t)VS_TWS_SCO_SETUP_CMD_LEN, cmd.params.size());
+    EXPECT_EQ(VS_QHCI_TWS_ESCO_SETUP_SUBOPCODE, cmd.params[0]);
+    RawAddress left = earbud_addr(2 * pair);
+    RawAddress right = earbud_addr(2 * pair + 1);
+    for (int i = 0; i < BD_ADDR_LEN; i++) {
+      EXPECT_EQ(left.address[BD_ADDR_LEN - 1 - i], cmd.params[1 + i]);
+      EXPECT_EQ(right.address[BD_ADDR_LEN - 1 - i], cmd.params[7 + i]);
+    }
+    EXPECT_EQ(get_twsp_role(earbud_scb(eb)), cmd.params[13]);
+  }
+};
+
+/*******************************************************************************
+ *  Mic switch flow
+ ******************************************************************************/
+
+// a mic switch doesn't hold the BTA thread for the mic path enable delay:
+// the new mic is enabled at once, the eSCO setup and the old mic disable
+// come from an alarm, and other work runs in between.
+class BtaAgTwspMicSwitchTest : public BtaAgTwspTest {
+ protected:
+  void SetUp() override {
+    BtaAgTwspTest::SetUp();
+    ConnectPairInEar(0);
+    // the switch done before the SCO is created sets the eSCO up at once
+    twsp_update_microphone_selection(earbud_scb(1), earbud_scb(0));
+    ASSERT_EQ(1u, vsc_cmds.size());
+    ExpectEscoSetup(vsc_cmds[0], 0, 0);
+    StartAudio(0);
+    ClearRecords();
+  }
+};
+
+TEST_F(BtaAgTwspMicSwitchTest, switch_before_audio_is_done_at_once) {
+  StopAudio();
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  ASSERT_EQ(1u, MicEnables().size());
+  EXPECT_EQ(1, MicEnables()[0].eb);
+  ASSERT_EQ(1u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[0], 0, 1);
+  ASSERT_EQ(1u, MicDisables().size());
+  EXPECT_EQ(0, MicDisables()[0].eb);
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, switch_during_audio_completes_from_alarm) {
+  uint64_t start_ms = now_ms;
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+
+  // returns right after the mic enable, nothing waited for the delay
+  EXPECT_EQ(start_ms, now_ms);
+  ASSERT_EQ(1u, MicEnables().size());
+  EXPECT_EQ(1, MicEnables()[0].eb);
+  EXPECT_TRUE(vsc_cmds.empty());
+  EXPECT_TRUE(MicDisables().empty());
+
+  run_for(MIC_PATH_ENABLE_DELAY - 1);
+  EXPECT_TRUE(vsc_cmds.empty());
+
+  run_for(1);
+  ASSERT_EQ(1u, vsc_cmds.size());
+  EXPECT_EQ(start_ms + MIC_PATH_ENABLE_DELAY, vsc_cmds[0].time_ms);
+  ExpectEscoSetup(vsc_cmds[0], 0, 1);
+  ASSERT_EQ(1u, MicDisables().size());
+  EXPECT_EQ(0, MicDisables()[0].eb);
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, other_events_run_while_switch_is_pending) {
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  ASSERT_EQ(1u, MicEnables().size());
+
+  // secondary SCO state machine event for the same pair
+  bta_ag_cb.twsp_sec_sco.state = BTA_AG_SCO_SHUTDOWN_ST;
+  bta_ag_twsp_sco_event(earbud_scb(1), BTA_AG_SCO_LISTEN_E);
+  EXPECT_EQ(BTA_AG_SCO_LISTEN_ST, bta_ag_cb.twsp_sec_sco.state);
+  ASSERT_EQ(1u, created_scos.size());
+  EXPECT_EQ(1, created_scos[0].first);
+
+  // AT result towards the earbud whose mic goes away
+  tBTA_AG_API_RESULT api_result;
+  memset(&api_result, 0, sizeof(api_result));
+  api_result.result = BTA_AG_TWS_QBC_RES;
+  bta_ag_twsp_hfp_result(earbud_scb(0), &api_result);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ((size_t)BTA_AG_TWS_QBC_RES, results[1].code);
+
+  // a switch of the other pair, which has no audio, is done on its own
+  ConnectPairInEar(1);
+  twsp_update_microphone_selection(earbud_scb(2), earbud_scb(3));
+  ASSERT_EQ(1u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[0], 1, 3);
+  ASSERT_EQ(1u, MicDisables().size());
+  EXPECT_EQ(2, MicDisables()[0].eb);
+
+  // the pending switch still completes as planned
+  run_for(MIC_PATH_ENABLE_DELAY);
+  ASSERT_EQ(2u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[1], 0, 1);
+  ASSERT_EQ(2u, MicDisables().size());
+  EXPECT_EQ(0, MicDisables()[1].eb);
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, request_during_switch_runs_after_it) {
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  twsp_update_microphone_selection(earbud_scb(1), earbud_scb(0));
+  ASSERT_EQ(1u, MicEnables().size());
+
+  // the first switch completes, then the queued one starts
+  run_for(MIC_PATH_ENABLE_DELAY);
+  ASSERT_EQ(1u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[0], 0, 1);
+  ASSERT_EQ(2u, MicEnables().size());
+  EXPECT_EQ(0, MicEnables()[1].eb);
+
+  run_for(MIC_PATH_ENABLE_DELAY);
+  ASSERT_EQ(2u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[1], 0, 0);
+  ASSERT_EQ(2u, MicDisables().size());
+  EXPECT_EQ(0, MicDisables()[0].eb);
+  EXPECT_EQ(1, MicDisables()[1].eb);
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, repeated_request_is_dropped) {
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  twsp_update_microphone_selection(earbud_scb(1), earbud_scb(0));
+  // back to the switch in progress, the queued one is no longer needed
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+
+  run_for(10 * MIC_PATH_ENABLE_DELAY);
+  EXPECT_EQ(1u, MicEnables().size());
+  EXPECT_EQ(1u, vsc_cmds.size());
+  EXPECT_EQ(1u, MicDisables().size());
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, selected_earbud_gone_cancels_switch) {
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  Disconnect(1);
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+
+  run_for(10 * MIC_PATH_ENABLE_DELAY);
+  EXPECT_TRUE(vsc_cmds.empty());
+  EXPECT_TRUE(MicDisables().empty());
+}
+
+TEST_F(BtaAgTwspMicSwitchTest, current_earbud_gone_still_completes) {
+  twsp_update_microphone_selection(earbud_scb(0), earbud_scb(1));
+  Disconnect(0);
+
+  run_for(MIC_PATH_ENABLE_DELAY);
+  ASSERT_EQ(1u, vsc_cmds.size());
+  EXPECT_EQ(VS_QHCI_TWS_ESCO_SETUP_OPCODE, vsc_cmds[0].opcode);
+  // nothing to disable on an earbud that is gone
+  EXPECT_TRUE(MicDisables().empty());
+}
+
+/*******************************************************************************
+ *  Mic selection hysteresis
+ ******************************************************************************/
+
+// mic quality reports of both earbuds of pair 0, as the earbuds send them
+// every kReportMs. Each earbud follows its own trace function of time.
+class BtaAgTwspMicHysteresisTest : public BtaAgTwspTest {
+ protected:
+  static const uint64_t kReportMs = 200;
+
+  void SetUp() override {
+    BtaAgTwspTest::SetUp();
+    ConnectPairInEar(0);
+    rng.seed(1);
+  }
+
+  // feeds |duration_ms| of the traces, the right earbud reports half a
+  // period after the left one. Counts the changes of the better earbud
+  // by the raw reports, that is what a switch on every report would do.
+  template <typename TraceL, typename TraceR>
+  void Run(uint64_t duration_ms, TraceL trace_l, TraceR trace_r) {
+    uint64_t end_ms = now_ms + duration_ms;
+    while (now_ms < end_ms) {
+      int q = Clamp(trace_l(now_ms));
+      ReportMic(0, q);
+      last_raw[0] = q;
+      CountRawLeader();
+      run_for(kReportMs / 2);
+      q = Clamp(trace_r(now_ms));
+      ReportMic(1, q);
+      last_raw[1] = q;
+      CountRawLeader();
+      run_for(kReportMs / 2);
+    }
+  }
+
+  int Clamp(int q) {
+    return std::min(std::max(q, TWSPLUS_MIN_MIC_QUALITY),
+                    TWSPLUS_MAX_MIC_QUALITY);
+  }
+
+  void CountRawLeader() {
+    if (last_raw[0] < 0 || last_raw[1] < 0 || last_raw[0] == last_raw[1])
+      return;
+    int leader = (last_raw[1] > last_raw[0]) ? 1 : 0;
+    if (raw_leader >= 0 && leader != raw_leader) num_raw_changes++;
+    raw_leader = leader;
+  }
+
+  int Noise(int amplitude) {
+    return (int)(rng() % (2 * amplitude + 1)) - amplitude;
+  }
+
+  // every switch of pair 0 so far, in order
+  std::vector<Result> Switches() { return MicEnables(); }
+
+  void ExpectDwellRespected() {
+    std::vector<Result> switches = Switches();
+    for (size_t i = 1; i < switches.size(); i++) {
+      EXPECT_GE(switches[i].time_ms - switches[i - 1].time_ms,
+                (uint64_t)kDwellMs)
+          << "switch " << i;
+    }
+  }
+
+  std::mt19937 rng;
+  int last_raw[2] = {-1, -1};
+  int raw_leader = -1;
+  int num_raw_changes = 0;
+};
+
+TEST_F(BtaAgTwspMicHysteresisTest, noisy_equal_earbuds_do_not_flap) {
+  // the first report sets the average as is, start both from the mean
+  ReportMic(0, 8);
+  ReportMic(1, 8);
+  Run(60000, [this](uint64_t) { return 8 + Noise(3); },
+      [this](uint64_t) { return 8 + Noise(3); });
+
+  // the raw reports change their mind all the time, the mic never moves
+  EXPECT_GT(num_raw_changes, 50);
+  EXPECT_TRUE(Switches().empty());
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, step_change_switches_once) {
+  uint64_t step_ms = now_ms + 20000;
+  Run(40000,
+      [this, step_ms](uint64_t t) {
+        return ((t < step_ms) ? 10 : 2) + Noise(1);
+      },
+      [this](uint64_t) { return 6 + Noise(1); });
+
+  std::vector<Result> switches = Switches();
+  ASSERT_EQ(1u, switches.size());
+  EXPECT_EQ(1, switches[0].eb);
+  // the average needs a few reports to follow the step, not more
+  EXPECT_GT(switches[0].time_ms, step_ms);
+  EXPECT_LT(switches[0].time_ms, step_ms + 5000);
+  ASSERT_EQ(1u, vsc_cmds.size());
+  ExpectEscoSetup(vsc_cmds[0], 0, 1);
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, flapping_earbuds_switch_at_dwell_pace) {
+  // the better earbud changes every second by a wide margin
+  Run(60000, [](uint64_t t) { return ((t / 1000) % 2) ? 14 : 2; },
+      [](uint64_t t) { return ((t / 1000) % 2) ? 2 : 14; });
+
+  std::vector<Result> switches = Switches();
+  EXPECT_GT(switches.size(), 1u);
+  EXPECT_LE(switches.size(), (size_t)(60000 / kDwellMs + 1));
+  EXPECT_GT(num_raw_changes, (int)(2 * switches.size()));
+  ExpectDwellRespected();
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, held_switch_runs_when_dwell_ends) {
+  // right earbud takes over, no dwell time before the first switch
+  ReportMic(0, 2);
+  ReportMic(1, 6);
+  ASSERT_EQ(1u, Switches().size());
+  EXPECT_EQ(1, Switches()[0].eb);
+  uint64_t switch_ms = now_ms;
+
+  // left one gets much better, and then stops reporting
+  run_for(2000);
+  ReportMic(0, 15);
+  EXPECT_EQ(1u, Switches().size());
+
+  run_for(kDwellMs - 2000 - 1);
+  EXPECT_EQ(1u, Switches().size());
+
+  run_for(1);
+  ASSERT_EQ(2u, Switches().size());
+  EXPECT_EQ(0, Switches()[1].eb);
+  EXPECT_EQ(switch_ms + kDwellMs, Switches()[1].time_ms);
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, held_switch_is_decided_again) {
+  ReportMic(0, 2);
+  ReportMic(1, 6);
+  ASSERT_EQ(1u, Switches().size());
+
+  run_for(2000);
+  ReportMic(0, 15);
+  // left one falls back before the dwell time is over
+  run_for(500);
+  ReportMic(0, 0);
+
+  run_for(10 * kDwellMs);
+  EXPECT_EQ(1u, Switches().size());
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, other_switch_drops_held_one) {
+  ReportMic(0, 2);
+  ReportMic(1, 6);
+  ASSERT_EQ(1u, Switches().size());
+
+  run_for(2000);
+  ReportMic(0, 15);
+  ASSERT_NE(nullptr, next_alarm(UINT64_MAX));
+
+  // the right earbud leaves the ear, which moves the mic at once
+  SetState(1, TWSPLUS_EB_STATE_OUT_OF_EAR);
+  ASSERT_EQ(2u, Switches().size());
+  EXPECT_EQ(0, Switches()[1].eb);
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, held_earbud_gone_drops_held_switch) {
+  ReportMic(0, 2);
+  ReportMic(1, 6);
+  ASSERT_EQ(1u, Switches().size());
+
+  run_for(2000);
+  ReportMic(0, 15);
+  ASSERT_NE(nullptr, next_alarm(UINT64_MAX));
+
+  Disconnect(0);
+  EXPECT_EQ(nullptr, next_alarm(UINT64_MAX));
+  run_for(10 * kDwellMs);
+  EXPECT_EQ(1u, Switches().size());
+}
+
+TEST_F(BtaAgTwspMicHysteresisTest, dwell_and_margin_come_from_properties) {
+  properties[TWSPLUS_MIC_SWITCH_MARGIN_PROP] = 0;
+  properties[TWSPLUS_MIC_DWELL_MS_PROP] = 0;
+  init_twsp_devices();
+  ClearRecords();
+  ConnectPairInEar(0);
+
+  ReportMic(0, 5);
+  ReportMic(1, 5);
+  ASSERT_EQ(1u, Switches().size());
+  EXPECT_EQ(1, Switches()[0].eb);
+  run_for(1);
+  ReportMic(0, 15);
+  ASSERT_EQ(2u, Switches().size());
+  EXPECT_EQ(0, Switches()[1].eb);
+}
+
+}  // namespace
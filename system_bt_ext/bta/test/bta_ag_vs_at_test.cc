@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      bta_ag_vs_at_test.cc
+ *
+ *  Description:   Host tests of the tokenizer of vendor AT command
+ *                 parameters.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "bta_ag_vs_at.h"
+
+namespace {
+
+class BtaAgVsAtTest : public ::testing::Test {
+ protected:
+  void Init(const char* p_s) {
+    bta_ag_at_tok_init(&tok, p_s, p_s == NULL ? 0 : strlen(p_s) + 1);
+  }
+
+  bool NextInt(int32_t* p_val) {
+    return bta_ag_at_tok_next_int(&tok, INT32_MIN, INT32_MAX, p_val);
+  }
+
+  std::string NextStr() {
+    const char* p_s = NULL;
+    size_t len = 0;
+    EXPECT_TRUE(bta_ag_at_tok_next_str(&tok, &p_s, &len));
+    return (p_s == NULL) ? std::string() : std::string(p_s, len);
+  }
+
+  tBTA_AG_AT_TOK tok;
+};
+
+TEST_F(BtaAgVsAtTest, ints_with_blanks) {
+  int32_t val = -1;
+  Init("1, 2 ,\t3 ");
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(1, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(2, val);
+  EXPECT_TRUE(bta_ag_at_tok_has_more(&tok));
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(3, val);
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+  EXPECT_FALSE(NextInt(&val));
+}
+
+TEST_F(BtaAgVsAtTest, signs) {
+  int32_t val = 0;
+  Init("-5,+7,-0");
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(-5, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(7, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(0, val);
+}
+
+TEST_F(BtaAgVsAtTest, invalid_field_is_skipped) {
+  const char* p_bad[] = {"", " ", "-", "+", "1a", "a1", "1 2", "--1", "0x10"};
+  for (const char* p_field : p_bad) {
+    std::string s = std::string(p_field) + ",42";
+    int32_t val = 42;
+    Init(s.c_str());
+    EXPECT_FALSE(NextInt(&val)) << "'" << p_field << "'";
+    EXPECT_EQ(42, val) << "'" << p_field << "'";
+    // the bad field is consumed all the same
+    val = 0;
+    ASSERT_TRUE(NextInt(&val)) << "'" << p_field << "'";
+    EXPECT_EQ(42, val);
+  }
+}
+
+TEST_F(BtaAgVsAtTest, range_is_checked) {
+  int32_t val = -1;
+  Init("0,15,16,-1");
+  EXPECT_TRUE(bta_ag_at_tok_next_int(&tok, 0, 15, &val));
+  EXPECT_EQ(0, val);
+  EXPECT_TRUE(bta_ag_at_tok_next_int(&tok, 0, 15, &val));
+  EXPECT_EQ(15, val);
+  EXPECT_FALSE(bta_ag_at_tok_next_int(&tok, 0, 15, &val));
+  EXPECT_FALSE(bta_ag_at_tok_next_int(&tok, 0, 15, &val));
+  EXPECT_EQ(15, val);
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+}
+
+TEST_F(BtaAgVsAtTest, int32_limits_and_overflow) {
+  int32_t val = 0;
+  Init("2147483647,-2147483648,2147483648,-2147483649,"
+       "99999999999999999999999,00000000000000000000001");
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(INT32_MAX, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(INT32_MIN, val);
+  EXPECT_FALSE(NextInt(&val));
+  EXPECT_FALSE(NextInt(&val));
+  EXPECT_FALSE(NextInt(&val));
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(1, val);
+}
+
+TEST_F(BtaAgVsAtTest, strings_are_returned_in_place) {
+  const char* p_s = "abc, d e ,,x";
+  Init(p_s);
+  const char* p_field = NULL;
+  size_t len = 0;
+  ASSERT_TRUE(bta_ag_at_tok_next_str(&tok, &p_field, &len));
+  EXPECT_EQ(p_s, p_field);
+  EXPECT_EQ(3u, len);
+  // blanks around the field are stripped, not the ones inside
+  EXPECT_EQ("d e", NextStr());
+  EXPECT_EQ("", NextStr());
+  EXPECT_EQ("x", NextStr());
+  EXPECT_FALSE(bta_ag_at_tok_next_str(&tok, &p_field, &len));
+}
+
+TEST_F(BtaAgVsAtTest, trailing_delimiter_leaves_empty_field) {
+  int32_t val = 0;
+  Init("1,");
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_TRUE(bta_ag_at_tok_has_more(&tok));
+  EXPECT_EQ("", NextStr());
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+}
+
+TEST_F(BtaAgVsAtTest, empty_string_has_one_empty_field) {
+  Init("");
+  EXPECT_TRUE(bta_ag_at_tok_has_more(&tok));
+  EXPECT_EQ("", NextStr());
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+}
+
+TEST_F(BtaAgVsAtTest, null_string_has_no_field) {
+  int32_t val = 0;
+  const char* p_field = NULL;
+  size_t len = 0;
+  Init(NULL);
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+  EXPECT_FALSE(NextInt(&val));
+  EXPECT_FALSE(bta_ag_at_tok_next_str(&tok, &p_field, &len));
+}
+
+TEST_F(BtaAgVsAtTest, unterminated_string_is_bounded) {
+  // no terminator, and nothing past max_len may be read
+  const char buf[5] = {'1', '2', ',', '3', '4'};
+  int32_t val = 0;
+  bta_ag_at_tok_init(&tok, buf, 4);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(12, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(3, val);
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+}
+
+TEST_F(BtaAgVsAtTest, string_ends_at_terminator) {
+  const char buf[] = {'7', ',', '8', '\0', ',', '9'};
+  int32_t val = 0;
+  bta_ag_at_tok_init(&tok, buf, sizeof(buf));
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(7, val);
+  ASSERT_TRUE(NextInt(&val));
+  EXPECT_EQ(8, val);
+  EXPECT_FALSE(bta_ag_at_tok_has_more(&tok));
+}
+
+}  // namespace
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      bta_ag_vs_at_fuzzer.cc
+ *
+ *  Description:   Fuzzer of the tokenizer of vendor AT command parameters.
+ *                 The input is used as an unterminated string, and every
+ *                 field returned has to lie within it.
+ *
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bta_ag_vs_at.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if (size == 0) return 0;
+
+  // the first byte picks the mix of int and string reads, the rest is the
+  // string, copied so reads past it are caught by the sanitizers
+  uint8_t pattern = data[0];
+  std::vector<char> buf(data + 1, data + size);
+  const char* p_begin = buf.data();
+  const char* p_end = p_begin + buf.size();
+  tBTA_AG_AT_TOK tok;
+
+  bta_ag_at_tok_init(&tok, p_begin, buf.size());
+
+  // every read consumes a field, there are at most size fields
+  for (size_t i = 0; bta_ag_at_tok_has_more(&tok); i++) {
+    if (i > buf.size()) abort();
+
+    if (pattern & (1 << (i % 8))) {
+      int32_t val;
+      int32_t min_val = (i & 1) ? INT32_MIN : 0;
+      if (bta_ag_at_tok_next_int(&tok, min_val, INT32_MAX, &val) &&
+          val < min_val) {
+        abort();
+      }
+    } else {
+      const char* p_s = NULL;
+      size_t len = 0;
+      if (!bta_ag_at_tok_next_str(&tok, &p_s, &len)) abort();
+      if (p_s < p_begin || p_s + len > p_end) abort();
+      if (memchr(p_s, ',', len) != NULL) abort();
+      if (memchr(p_s, '\0', len) != NULL) abort();
+    }
+  }
+  return 0;
+}
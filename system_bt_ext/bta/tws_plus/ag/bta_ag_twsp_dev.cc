@@ -32,11 +32,17 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include <unistd.h>
+#include <cutils/properties.h>
 #include "bta_ag_twsp_dev.h"
 #include "bta_ag_twsp.h"
+#include "bta_ag_vs_at.h"
 #include "internal_include/bt_trace.h"
 #include "bta_ag_int.h"
+#include "btm_api.h"
+#include "osi/include/alarm.h"
+#include "osi/include/time.h"
 #include "utl.h"
 
 
@@ -47,15 +53,77 @@ void select_microphone_path(tBTA_AG_SCB *best_scb);
 
 tTWSPLUS_DEVICE twsp_devices[MAX_TWSPLUS_DEVICES];
 
-uint8_t g_latest_selected_eb_role = TWSPLUS_EB_ROLE_LEFT;
+/* Per pair state. Earbuds 2k and 2k+1 of twsp_devices form pair k. */
+typedef struct {
+   uint8_t selected_eb_role;   /* role of the earbud carrying the mic */
+   uint64_t last_switch_ms;
+   alarm_t* dwell_timer;       /* re-runs a switch held for the dwell time */
+   int dwell_eb_idx;           /* earbud whose switch was held */
+} tTWSPLUS_PAIR;
 
-uint8_t get_lat_selected_mic_eb_role() {
-    return g_latest_selected_eb_role;
+static tTWSPLUS_PAIR twsp_pairs[MAX_TWSPLUS_PAIRS];
+
+/* twsp_devices index + 1 for each AG SCB, 0 if it's no TWS+ earbud */
+static uint8_t twsp_scb_to_dev[BTA_AG_MAX_NUM_CLIENTS];
+
+/* Mic selection policy, common to all pairs */
+typedef struct {
+   int32_t switch_margin;      /* quality points the new mic must win by */
+   int32_t dwell_ms;           /* minimum time between two switches */
+   uint32_t num_switches;
+   uint32_t num_suppressed;
+} tTWSPLUS_MIC_POLICY;
+
+static tTWSPLUS_MIC_POLICY twsp_mic_policy = {
+   TWSPLUS_MIC_SWITCH_MARGIN_DEFAULT, TWSPLUS_MIC_DWELL_MS_DEFAULT, 0, 0};
+
+static bool twsp_is_valid_idx(int eb_idx) {
+    return (eb_idx >= 0 && eb_idx < MAX_TWSPLUS_DEVICES);
+}
+
+static void twsp_evaluate_mic_switch(int eb_idx, uint64_t now_ms);
+
+static void twsp_cancel_dwell_timer(tTWSPLUS_PAIR *p_pair) {
+    if (p_pair->dwell_timer != NULL) alarm_cancel(p_pair->dwell_timer);
+    p_pair->dwell_eb_idx = -1;
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_dev_idx
+ *
+ * Description      Looks up the twsp_devices index of |p_scb| through the
+ *                  AG SCB index, without scanning the device table.
+ *
+ * Returns          device index, -1 if |p_scb| is no TWS+ earbud
+ *
+ ******************************************************************************/
+static int twsp_dev_idx(tBTA_AG_SCB* p_scb) {
+    if (p_scb == NULL) return -1;
+
+    uint16_t scb_idx = bta_ag_scb_to_idx(p_scb);
+    if (scb_idx == 0 || scb_idx > BTA_AG_MAX_NUM_CLIENTS) return -1;
+
+    return (int)twsp_scb_to_dev[scb_idx - 1] - 1;
+}
+
+static void twsp_set_dev_idx(tBTA_AG_SCB* p_scb, int eb_idx) {
+    uint16_t scb_idx = bta_ag_scb_to_idx(p_scb);
+    if (scb_idx == 0 || scb_idx > BTA_AG_MAX_NUM_CLIENTS) {
+        APPL_TRACE_ERROR("%s: Invalid scb index: %d", __func__, scb_idx);
+        return;
+    }
+    twsp_scb_to_dev[scb_idx - 1] = (uint8_t)(eb_idx + 1);
+}
+
+uint8_t get_lat_selected_mic_eb_role(int pair_idx) {
+    return twsp_pairs[pair_idx].selected_eb_role;
 }
 
-tBTA_AG_SCB* get_twsp_with_role(uint8_t role) {
+tBTA_AG_SCB* get_twsp_with_role(int pair_idx, uint8_t role) {
    int i;
-   for (i=0; i<MAX_TWSPLUS_DEVICES; i++) {
+   for (i = pair_idx * TWSPLUS_EBS_PER_PAIR;
+        i < (pair_idx + 1) * TWSPLUS_EBS_PER_PAIR; i++) {
       if (twsp_devices[i].p_scb != NULL &&
           twsp_devices[i].role == role) {
           return twsp_devices[i].p_scb;
@@ -77,17 +145,27 @@ bool twsp_is_odd_eb_addr(tBTA_AG_SCB* p_scb) {
 }
 
 void reset_twsp_device(int  eb_idx) {
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return;
     }
 
-    if (get_lat_selected_mic_eb_role() == twsp_devices[eb_idx].role) {
+    int pair_idx = TWSPLUS_PAIR_IDX(eb_idx);
+
+    if (twsp_devices[eb_idx].p_scb != NULL) {
+        twsp_cancel_microphone_selection(twsp_devices[eb_idx].p_scb);
+    }
+
+    if (twsp_pairs[pair_idx].dwell_eb_idx == eb_idx) {
+        twsp_cancel_dwell_timer(&twsp_pairs[pair_idx]);
+    }
+
+    if (get_lat_selected_mic_eb_role(pair_idx) == twsp_devices[eb_idx].role) {
         //Trigger Microphone Switch
         uint8_t other_twsp_role =
             (twsp_devices[eb_idx].role == TWSPLUS_EB_ROLE_LEFT) ?
                         TWSPLUS_EB_ROLE_RIGHT : TWSPLUS_EB_ROLE_LEFT;
-        tBTA_AG_SCB *peer_scb = get_twsp_with_role(other_twsp_role);
+        tBTA_AG_SCB *peer_scb = get_twsp_with_role(pair_idx, other_twsp_role);
         if (peer_scb != NULL) {
              select_microphone_path(peer_scb);
         } else {
@@ -95,6 +173,10 @@ void reset_twsp_device(int  eb_idx) {
         }
      }
 
+     if (twsp_devices[eb_idx].p_scb != NULL) {
+         twsp_set_dev_idx(twsp_devices[eb_idx].p_scb, -1);
+     }
+
      twsp_devices[eb_idx].p_scb = NULL;
      twsp_devices[eb_idx].battery_state = TWSPLUS_MIN_BATTERY_CHARGE_STATE_DISCHARGING;
      twsp_devices[eb_idx].battery_level = TWSPLUS_MIN_BATTERY_LEVEL;
@@ -102,45 +184,95 @@ void reset_twsp_device(int  eb_idx) {
      twsp_devices[eb_idx].role =  TWSPLUS_EB_ROLE_INVALID;
      twsp_devices[eb_idx].mic_path_delay = TWSPLUS_INVALID_MICPATH_DELAY;
      twsp_devices[eb_idx].mic_quality = TWSPLUS_MIN_MIC_QUALITY;
+     twsp_devices[eb_idx].mic_quality_avg = TWSPLUS_MIN_MIC_QUALITY;
+     twsp_devices[eb_idx].mic_quality_time_ms = 0;
      twsp_devices[eb_idx].qdsp_nr = TWSPLUS_INVALID_QDSP_VALUE;
      twsp_devices[eb_idx].qdsp_ec = TWSPLUS_INVALID_QDSP_VALUE;
      twsp_devices[eb_idx].ring_sent = false;
-}
 
-void update_twsp_device(tBTA_AG_SCB* p_scb) {
-    for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
-        if (twsp_devices[i].p_scb == NULL) {
-            APPL_TRACE_WARNING("%s: idx: %d, p_scb: %x", __func__, i, p_scb);
-            twsp_devices[i].p_scb = p_scb;
-            twsp_devices[i].battery_state =
-                              TWSPLUS_MIN_BATTERY_CHARGE_STATE_DISCHARGING;
-            twsp_devices[i].battery_level = TWSPLUS_MIN_BATTERY_LEVEL;
-            twsp_devices[i].state = TWSPLUS_EB_STATE_OFF;
-
-            int other_idx = (i == PRIMARY_EB_IDX) ? SECONDARY_EB_IDX : PRIMARY_EB_IDX;
-            if (twsp_devices[other_idx].p_scb != NULL) {
-                twsp_devices[i].role =
-                    (twsp_devices[other_idx].role == TWSPLUS_EB_ROLE_LEFT) ?
-                    TWSPLUS_EB_ROLE_RIGHT : TWSPLUS_EB_ROLE_LEFT;
+     if (twsp_devices[TWSPLUS_PEER_IDX(eb_idx)].p_scb == NULL) {
+         //Pair is free again
+         twsp_pairs[pair_idx].selected_eb_role = TWSPLUS_EB_ROLE_LEFT;
+         twsp_pairs[pair_idx].last_switch_ms = 0;
+     }
+}
 
-            } else {
-                twsp_devices[i].role =
-                    (twsp_is_odd_eb_addr(p_scb) == true) ?
-                    TWSPLUS_EB_ROLE_LEFT : TWSPLUS_EB_ROLE_RIGHT;
+/*******************************************************************************
+ *
+ * Function         twsp_find_free_idx
+ *
+ * Description      Picks the device slot for a new earbud: next to its peer
+ *                  when the peer is already known, else the first slot of
+ *                  a free pair.
+ *
+ * Returns          device index, -1 if the table is full
+ *
+ ******************************************************************************/
+static int twsp_find_free_idx(tBTA_AG_SCB* p_scb) {
+    RawAddress peer_addr;
+
+    if (BTM_SecGetTwsPlusPeerDev(p_scb->peer_addr, peer_addr)) {
+        for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
+            if (twsp_devices[i].p_scb != NULL &&
+                twsp_devices[i].p_scb->peer_addr == peer_addr) {
+                int peer_idx = TWSPLUS_PEER_IDX(i);
+                return (twsp_devices[peer_idx].p_scb == NULL) ? peer_idx : -1;
             }
+        }
+    }
 
-            APPL_TRACE_WARNING("%s: idx: %d, role: %d", __func__, i, twsp_devices[i].role);
-            twsp_devices[i].mic_path_delay = TWSPLUS_INVALID_MICPATH_DELAY;
-            twsp_devices[i].mic_quality = TWSPLUS_MIN_MIC_QUALITY;
-            twsp_devices[i].qdsp_nr = TWSPLUS_INVALID_QDSP_VALUE;
-            twsp_devices[i].qdsp_ec = TWSPLUS_INVALID_QDSP_VALUE;
-            twsp_devices[i].ring_sent = false;
-            return;
+    for (int pair_idx=0; pair_idx<MAX_TWSPLUS_PAIRS; pair_idx++) {
+        int i = pair_idx * TWSPLUS_EBS_PER_PAIR;
+        if (twsp_devices[i].p_scb == NULL &&
+            twsp_devices[i + 1].p_scb == NULL) {
+            return i;
         }
     }
+    return -1;
+}
+
+void update_twsp_device(tBTA_AG_SCB* p_scb) {
+    if (twsp_dev_idx(p_scb) != -1) {
+        APPL_TRACE_WARNING("%s: p_scb %x already added", __func__, p_scb);
+        return;
+    }
+
+    int i = twsp_find_free_idx(p_scb);
+    if (i == -1) {
+        APPL_TRACE_WARNING("%s: No free TWS+ slot for p_scb %x", __func__,
+                           p_scb);
+        return;
+    }
 
-    APPL_TRACE_WARNING("%s: Invalid p_scb %d\n", __func__);
-    return;
+    APPL_TRACE_WARNING("%s: idx: %d, p_scb: %x", __func__, i, p_scb);
+    twsp_devices[i].p_scb = p_scb;
+    twsp_set_dev_idx(p_scb, i);
+    twsp_devices[i].battery_state =
+                      TWSPLUS_MIN_BATTERY_CHARGE_STATE_DISCHARGING;
+    twsp_devices[i].battery_level = TWSPLUS_MIN_BATTERY_LEVEL;
+    twsp_devices[i].state = TWSPLUS_EB_STATE_OFF;
+
+    int other_idx = TWSPLUS_PEER_IDX(i);
+    if (twsp_devices[other_idx].p_scb != NULL) {
+        twsp_devices[i].role =
+            (twsp_devices[other_idx].role == TWSPLUS_EB_ROLE_LEFT) ?
+            TWSPLUS_EB_ROLE_RIGHT : TWSPLUS_EB_ROLE_LEFT;
+
+    } else {
+        twsp_devices[i].role =
+            (twsp_is_odd_eb_addr(p_scb) == true) ?
+            TWSPLUS_EB_ROLE_LEFT : TWSPLUS_EB_ROLE_RIGHT;
+    }
+
+    APPL_TRACE_WARNING("%s: idx: %d, pair: %d, role: %d", __func__, i,
+                       TWSPLUS_PAIR_IDX(i), twsp_devices[i].role);
+    twsp_devices[i].mic_path_delay = TWSPLUS_INVALID_MICPATH_DELAY;
+    twsp_devices[i].mic_quality = TWSPLUS_MIN_MIC_QUALITY;
+    twsp_devices[i].mic_quality_avg = TWSPLUS_MIN_MIC_QUALITY;
+    twsp_devices[i].mic_quality_time_ms = 0;
+    twsp_devices[i].qdsp_nr = TWSPLUS_INVALID_QDSP_VALUE;
+    twsp_devices[i].qdsp_ec = TWSPLUS_INVALID_QDSP_VALUE;
+    twsp_devices[i].ring_sent = false;
 }
 
 void init_twsp_devices() {
@@ -148,18 +280,32 @@ void init_twsp_devices() {
   for (i=0; i<MAX_TWSPLUS_DEVICES; i++) {
       reset_twsp_device(i);
   }
+  memset(twsp_scb_to_dev, 0, sizeof(twsp_scb_to_dev));
+  for (i=0; i<MAX_TWSPLUS_PAIRS; i++) {
+      twsp_cancel_dwell_timer(&twsp_pairs[i]);
+  }
+
+  twsp_mic_policy.switch_margin = property_get_int32(
+      TWSPLUS_MIC_SWITCH_MARGIN_PROP, TWSPLUS_MIC_SWITCH_MARGIN_DEFAULT);
+  twsp_mic_policy.dwell_ms = property_get_int32(TWSPLUS_MIC_DWELL_MS_PROP,
+                                                TWSPLUS_MIC_DWELL_MS_DEFAULT);
+  APPL_TRACE_DEBUG("%s: mic switch margin: %d, dwell: %d ms", __func__,
+                   twsp_mic_policy.switch_margin, twsp_mic_policy.dwell_ms);
 }
 
 void print_twsp_device_status(int eb_idx) {
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return;
     }
 
-    APPL_TRACE_DEBUG("%s: idx : %d", __func__, eb_idx);
+    APPL_TRACE_DEBUG("%s: idx : %d, pair : %d", __func__, eb_idx,
+                               TWSPLUS_PAIR_IDX(eb_idx));
     APPL_TRACE_DEBUG("%s: p_scb : %x", __func__, twsp_devices[eb_idx].p_scb);
-    APPL_TRACE_DEBUG("%s: mic_quality : %d", __func__,
-                               twsp_devices[eb_idx].mic_quality);
+    APPL_TRACE_DEBUG("%s: mic_quality : %d (avg %d/%d)", __func__,
+                               twsp_devices[eb_idx].mic_quality,
+                               twsp_devices[eb_idx].mic_quality_avg,
+                               TWSPLUS_MIC_QUALITY_SCALE);
     APPL_TRACE_DEBUG("%s: battery_state : %d", __func__,
                                twsp_devices[eb_idx].battery_state);
     APPL_TRACE_DEBUG("%s: battery_level : %d", __func__,
@@ -179,43 +325,57 @@ void print_twsp_device_status(int eb_idx) {
 void print_twsp_devices_status() {
     int i;
     for (i=0; i<MAX_TWSPLUS_DEVICES; i++) {
-         print_twsp_device_status(i);
+         if (twsp_devices[i].p_scb != NULL) print_twsp_device_status(i);
     }
+    APPL_TRACE_DEBUG("%s: mic switches : %d, suppressed : %d", __func__,
+                     twsp_mic_policy.num_switches,
+                     twsp_mic_policy.num_suppressed);
 }
 
-bool twsp_get_left_eb_addr(RawAddress& addr) {
-  int i;
-  for (i=0; i<MAX_TWSPLUS_DEVICES; i++) {
-     if (twsp_devices[i].p_scb != NULL &&
-          twsp_devices[i].role == TWSPLUS_EB_ROLE_LEFT) {
-         addr =  twsp_devices[i].p_scb->peer_addr;
-         return true;
-     }
-  }
-  return false;
+int twsp_get_pair_idx_by_scb(tBTA_AG_SCB* p_scb) {
+    int eb_idx = twsp_dev_idx(p_scb);
+    return (eb_idx == -1) ? TWSPLUS_INVALID_PAIR : TWSPLUS_PAIR_IDX(eb_idx);
 }
 
-bool twsp_get_right_eb_addr(RawAddress& addr) {
-  int i;
-  for (i=0; i<MAX_TWSPLUS_DEVICES; i++) {
-     if (twsp_devices[i].p_scb != NULL &&
-          twsp_devices[i].role == TWSPLUS_EB_ROLE_RIGHT) {
-         addr = twsp_devices[i].p_scb->peer_addr;
-         return true;
-     }
-  }
-  return false;
+bool twsp_get_left_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& addr) {
+  int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
+  if (pair_idx == TWSPLUS_INVALID_PAIR) return false;
+
+  tBTA_AG_SCB* left_scb = get_twsp_with_role(pair_idx, TWSPLUS_EB_ROLE_LEFT);
+  if (left_scb == NULL) return false;
+
+  addr = left_scb->peer_addr;
+  return true;
 }
 
-tBTA_AG_SCB* twsp_get_best_mic_scb () {
+bool twsp_get_right_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& addr) {
+  int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
+  if (pair_idx == TWSPLUS_INVALID_PAIR) return false;
+
+  tBTA_AG_SCB* right_scb = get_twsp_with_role(pair_idx, TWSPLUS_EB_ROLE_RIGHT);
+  if (right_scb == NULL) return false;
+
+  addr = right_scb->peer_addr;
+  return true;
+}
+
+tBTA_AG_SCB* twsp_get_best_mic_scb (tBTA_AG_SCB* p_scb) {
     int best_mic_quality = -1/*TWSPLUS_MIN_MIC_QUALITY*/;
     int selected_idx = -1;
+    int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
 
-    for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
+    if (pair_idx == TWSPLUS_INVALID_PAIR) {
+        APPL_TRACE_ERROR("%s: p_scb %x is no TWS+ earbud", __func__, p_scb);
+        return nullptr;
+    }
+
+    int first_idx = pair_idx * TWSPLUS_EBS_PER_PAIR;
+    int last_idx = first_idx + TWSPLUS_EBS_PER_PAIR;
+    for (int i=first_idx; i<last_idx; i++) {
         if (twsp_devices[i].p_scb != NULL) {
-            if (twsp_devices[i].mic_quality > best_mic_quality) {
+            if (twsp_devices[i].mic_quality_avg > best_mic_quality) {
                 selected_idx = i;
-                best_mic_quality = twsp_devices[i].mic_quality;
+                best_mic_quality = twsp_devices[i].mic_quality_avg;
             }
         }
     }
@@ -225,25 +385,29 @@ tBTA_AG_SCB* twsp_get_best_mic_scb () {
     } else {
         APPL_TRACE_DEBUG("%s: selected eb state : %d", __func__, twsp_devices[selected_idx].state);
         if (twsp_devices[selected_idx].state != TWSPLUS_EB_STATE_INEAR) {
-            for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
+            for (int i=first_idx; i<last_idx; i++) {
                 if (twsp_devices[i].state == TWSPLUS_EB_STATE_INEAR) {
                     selected_idx = i;
                     APPL_TRACE_DEBUG("%s: selected in ear idx: %d", __func__, selected_idx);
                 }
             }
         }
-        g_latest_selected_eb_role = twsp_devices[selected_idx].role;
-        APPL_TRACE_DEBUG("%s: g_latest_selected_eb_role updated: %d\n", __func__,
-                        g_latest_selected_eb_role);
+        twsp_pairs[pair_idx].selected_eb_role = twsp_devices[selected_idx].role;
+        APPL_TRACE_DEBUG("%s: pair %d selected eb role updated: %d\n", __func__,
+                        pair_idx, twsp_pairs[pair_idx].selected_eb_role);
         return twsp_devices[selected_idx].p_scb;
     }
 }
 
-int get_best_mic_quality_eb_role () {
+int get_best_mic_quality_eb_role (tBTA_AG_SCB* p_scb) {
     int best_mic_quality = -1/*TWSPLUS_MIN_MIC_QUALITY*/;
     int selected_idx = -1;
+    int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
 
-    for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
+    if (pair_idx == TWSPLUS_INVALID_PAIR) return TWSPLUS_EB_ROLE_INVALID;
+
+    for (int i = pair_idx * TWSPLUS_EBS_PER_PAIR;
+         i < (pair_idx + 1) * TWSPLUS_EBS_PER_PAIR; i++) {
         if (twsp_devices[i].mic_quality > best_mic_quality) {
             selected_idx = i;
             best_mic_quality = twsp_devices[i].mic_quality;
@@ -254,57 +418,180 @@ int get_best_mic_quality_eb_role () {
 }
 
 int twsp_get_idx_by_scb(tBTA_AG_SCB* p_scb) {
-    int res = -1;
     if (p_scb == NULL) {
         APPL_TRACE_ERROR("%s: scb is NULL", __func__);
-        return res;
-    }
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (twsp_devices[i].p_scb == p_scb) {
-            res = i;
-            break;
-        }
+        return -1;
     }
-    return res;
+    return twsp_dev_idx(p_scb);
 }
 
 void select_microphone_path(tBTA_AG_SCB *best_scb) {
     APPL_TRACE_DEBUG("%s: best_scb : %x\n", __func__, best_scb);
     tBTA_AG_SCB *peer_scb = get_other_twsp_scb(best_scb->peer_addr);
     twsp_update_microphone_selection(peer_scb, best_scb);
+    twsp_mic_policy.num_switches++;
 
     int idx = twsp_get_idx_by_scb(best_scb);
     if (idx != -1) {
         //Update the earbud role
-        g_latest_selected_eb_role = twsp_devices[idx].role;
+        tTWSPLUS_PAIR *p_pair = &twsp_pairs[TWSPLUS_PAIR_IDX(idx)];
+        p_pair->selected_eb_role = twsp_devices[idx].role;
+        p_pair->last_switch_ms = time_get_os_boottime_ms();
+        twsp_cancel_dwell_timer(p_pair);
+        APPL_TRACE_DEBUG("%s: pair %d selected eb role : %d\n", __func__,
+                         TWSPLUS_PAIR_IDX(idx), p_pair->selected_eb_role);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function         update_twsp_mic_quality_avg
+ *
+ * Description      Folds |mic_quality| into the time weighted average of the
+ *                  earbud. A report replaces more of the average the longer
+ *                  the previous value was held.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void update_twsp_mic_quality_avg(int eb_idx, uint8_t mic_quality,
+                                        uint64_t now_ms) {
+    tTWSPLUS_DEVICE *p_dev = &twsp_devices[eb_idx];
+    int32_t sample = mic_quality * TWSPLUS_MIC_QUALITY_SCALE;
+
+    if (p_dev->mic_quality_time_ms == 0) {
+        p_dev->mic_quality_avg = sample;
+    } else {
+        uint64_t dt_ms = now_ms - p_dev->mic_quality_time_ms;
+        int32_t weight = (int32_t)((dt_ms * TWSPLUS_MIC_QUALITY_SCALE) /
+                                   (dt_ms + TWSPLUS_MIC_QUALITY_TAU_MS));
+        p_dev->mic_quality_avg +=
+            ((sample - p_dev->mic_quality_avg) * weight) /
+            TWSPLUS_MIC_QUALITY_SCALE;
+    }
+    p_dev->mic_quality_time_ms = now_ms;
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_mic_dwell_timer_cback
+ *
+ * Description      The dwell time that held back a mic switch is over, the
+ *                  switch is decided again on the current averages.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void twsp_mic_dwell_timer_cback(void* data) {
+    tTWSPLUS_PAIR *p_pair = (tTWSPLUS_PAIR *)data;
+    int eb_idx = p_pair->dwell_eb_idx;
+
+    p_pair->dwell_eb_idx = -1;
+    if (!twsp_is_valid_idx(eb_idx) || twsp_devices[eb_idx].p_scb == NULL) {
+        return;
     }
 
-    APPL_TRACE_DEBUG("%s: g_latest_selected_eb_role : %d\n", __func__, g_latest_selected_eb_role);
+    APPL_TRACE_DEBUG("%s: dwell time over, EB%d", __func__, eb_idx);
+    twsp_evaluate_mic_switch(eb_idx, time_get_os_boottime_ms());
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_hold_mic_switch
+ *
+ * Description      Re-runs the switch to |eb_idx| once |wait_ms| of dwell
+ *                  time are left, so a switch held back while no further
+ *                  reports come in still happens.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void twsp_hold_mic_switch(tTWSPLUS_PAIR *p_pair, int eb_idx,
+                                 uint64_t wait_ms) {
+    if (p_pair->dwell_timer == NULL) {
+        p_pair->dwell_timer = alarm_new("bta_ag.twsp_mic_dwell");
+    }
+    p_pair->dwell_eb_idx = eb_idx;
+    alarm_set_on_mloop(p_pair->dwell_timer, wait_ms,
+                       twsp_mic_dwell_timer_cback, p_pair);
 }
 
 void process_mic_quality_change(int eb_idx, uint8_t mic_quality) {
-    int last_sel_role;
+    uint64_t now_ms = time_get_os_boottime_ms();
     APPL_TRACE_DEBUG("%s: >> : %d %d\n", __func__, eb_idx, mic_quality);
 
-    last_sel_role = get_lat_selected_mic_eb_role();
+    update_twsp_mic_quality_avg(eb_idx, mic_quality, now_ms);
+    twsp_evaluate_mic_switch(eb_idx, now_ms);
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_evaluate_mic_switch
+ *
+ * Description      Moves the mic to |eb_idx| when it is in ear and its
+ *                  average quality beats the current mic by the margin,
+ *                  once the dwell time since the last switch is over.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void twsp_evaluate_mic_switch(int eb_idx, uint64_t now_ms) {
+    int last_sel_role;
+    int curr_idx = -1;
+    int peer_idx = TWSPLUS_PEER_IDX(eb_idx);
+    tTWSPLUS_PAIR *p_pair = &twsp_pairs[TWSPLUS_PAIR_IDX(eb_idx)];
+
+    last_sel_role = p_pair->selected_eb_role;
     APPL_TRACE_DEBUG("%s: last_sel_role : %d\n", __func__, last_sel_role);
-    if (get_best_mic_quality_eb_role() == twsp_devices[eb_idx].role &&
-            last_sel_role != twsp_devices[eb_idx].role &&
-            twsp_devices[eb_idx].state == TWSPLUS_EB_STATE_INEAR) {
-            //Trigger the swap
-            APPL_TRACE_DEBUG("%s: Select EB%d  mic, SWAP", __func__, eb_idx);
-            select_microphone_path(twsp_devices[eb_idx].p_scb);
-    } else {
-            APPL_TRACE_DEBUG("%s: EB%d is not of best mic quality for now", __func__, eb_idx);
+    if (last_sel_role == twsp_devices[eb_idx].role ||
+            twsp_devices[eb_idx].state != TWSPLUS_EB_STATE_INEAR) {
+        APPL_TRACE_DEBUG("%s: EB%d is not a mic candidate", __func__, eb_idx);
+        print_twsp_devices_status();
+        return;
+    }
+
+    if (twsp_devices[peer_idx].p_scb != NULL &&
+            twsp_devices[peer_idx].role == last_sel_role) {
+        curr_idx = peer_idx;
+    }
+
+    if (curr_idx != -1 &&
+            twsp_devices[curr_idx].state == TWSPLUS_EB_STATE_INEAR) {
+        /* Only move when clearly better and the current mic has settled */
+        if (twsp_devices[eb_idx].mic_quality_avg <
+                twsp_devices[curr_idx].mic_quality_avg +
+                twsp_mic_policy.switch_margin * TWSPLUS_MIC_QUALITY_SCALE) {
+            APPL_TRACE_DEBUG("%s: EB%d is not better by the margin", __func__,
+                             eb_idx);
+            twsp_mic_policy.num_suppressed++;
+            print_twsp_devices_status();
+            return;
+        }
+        if (p_pair->last_switch_ms != 0 &&
+                now_ms - p_pair->last_switch_ms <
+                (uint64_t)twsp_mic_policy.dwell_ms) {
+            APPL_TRACE_DEBUG("%s: EB%d mic switch held for dwell time",
+                             __func__, eb_idx);
+            twsp_mic_policy.num_suppressed++;
+            twsp_hold_mic_switch(p_pair, eb_idx,
+                                 twsp_mic_policy.dwell_ms -
+                                 (now_ms - p_pair->last_switch_ms));
+            print_twsp_devices_status();
+            return;
+        }
     }
 
+    //Trigger the swap
+    APPL_TRACE_DEBUG("%s: Select EB%d  mic, SWAP", __func__, eb_idx);
+    select_microphone_path(twsp_devices[eb_idx].p_scb);
+
     print_twsp_devices_status();
 }
 
 bool set_twsp_mic_quality(int eb_idx, uint8_t mic_quality) {
     APPL_TRACE_DEBUG("%s: mic_qual : %d\n", __func__, mic_quality);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -322,7 +609,7 @@ bool set_twsp_mic_quality(int eb_idx, uint8_t mic_quality) {
 bool set_twsp_mic_path_delay(int eb_idx, uint16_t mic_path_delay) {
     APPL_TRACE_DEBUG("%s: mic_path_delay : %d\n", __func__, mic_path_delay);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -339,7 +626,7 @@ bool set_twsp_mic_path_delay(int eb_idx, uint16_t mic_path_delay) {
 uint16_t get_twsp_mic_path_delay(int eb_idx) {
     APPL_TRACE_DEBUG("%s:  %d\n", __func__);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -350,7 +637,7 @@ uint16_t get_twsp_mic_path_delay(int eb_idx) {
 uint8_t get_twsp_qdsp_nr(int eb_idx) {
     APPL_TRACE_DEBUG("%s:  %d\n", __func__);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -361,7 +648,7 @@ uint8_t get_twsp_qdsp_nr(int eb_idx) {
 uint8_t get_twsp_qdsp_ec(int eb_idx) {
     APPL_TRACE_DEBUG("%s:  %d\n", __func__);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -372,7 +659,7 @@ uint8_t get_twsp_qdsp_ec(int eb_idx) {
 bool set_twsp_battery_charge(int eb_idx, int16_t state, int16_t level) {
     APPL_TRACE_DEBUG("%s: state : %d, level : %d\n", __func__, state, level);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -393,10 +680,11 @@ bool set_twsp_battery_charge(int eb_idx, int16_t state, int16_t level) {
 }
 
 void process_twsp_state_change (int eb_idx, uint8_t state) {
+    int pair_idx = TWSPLUS_PAIR_IDX(eb_idx);
     APPL_TRACE_DEBUG("%s: state : %d\n", __func__, state);
     if (state == TWSPLUS_EB_STATE_OUT_OF_EAR) {
         //Delay for XXX
-        if (get_lat_selected_mic_eb_role() == twsp_devices[eb_idx].role) {
+        if (get_lat_selected_mic_eb_role(pair_idx) == twsp_devices[eb_idx].role) {
           //Trigger Microphone Switch
           tBTA_AG_SCB *p_scb =  twsp_devices[eb_idx].p_scb;
           if (p_scb != NULL) {
@@ -409,7 +697,7 @@ void process_twsp_state_change (int eb_idx, uint8_t state) {
           }
         }
     } else if (state == TWSPLUS_EB_STATE_INEAR) {
-        if (get_lat_selected_mic_eb_role() != twsp_devices[eb_idx].role) {
+        if (get_lat_selected_mic_eb_role(pair_idx) != twsp_devices[eb_idx].role) {
             tBTA_AG_SCB *p_scb = twsp_devices[eb_idx].p_scb;
             APPL_TRACE_DEBUG("%s: current earbud is not selected mic eb", __func__);
             if (p_scb != NULL) {
@@ -427,18 +715,20 @@ void process_twsp_state_change (int eb_idx, uint8_t state) {
 }
 
 void process_twsp_role_change (int eb_idx, uint8_t role) {
+    int pair_idx = TWSPLUS_PAIR_IDX(eb_idx);
     APPL_TRACE_DEBUG("%s: role : %d\n", __func__, role);
-    if (get_lat_selected_mic_eb_role() == twsp_devices[eb_idx].role) {
+    if (get_lat_selected_mic_eb_role(pair_idx) == twsp_devices[eb_idx].role) {
         //Trigger Microphone Switch
-        g_latest_selected_eb_role = role;
-        APPL_TRACE_DEBUG("%s: g_latest_selected_eb_role updated: %d\n", __func__, g_latest_selected_eb_role);
+        twsp_pairs[pair_idx].selected_eb_role = role;
+        APPL_TRACE_DEBUG("%s: pair %d selected eb role updated: %d\n", __func__,
+                         pair_idx, role);
     }
 }
 
 bool set_twsp_state(int eb_idx, uint8_t state) {
     APPL_TRACE_DEBUG("%s: current state: %d new state : %d\n", __func__, twsp_devices[eb_idx].state, state);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -462,7 +752,7 @@ bool set_twsp_state(int eb_idx, uint8_t state) {
 bool set_twsp_role(int eb_idx, uint8_t role) {
     APPL_TRACE_DEBUG("%s: role : %d\n", __func__, role);
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -483,7 +773,7 @@ bool set_twsp_qdsp_features(int eb_idx, uint8_t features_mask) {
     uint8_t feature = 0;
     uint8_t value = 0;
 
-    if (eb_idx < PRIMARY_EB_IDX || eb_idx > SECONDARY_EB_IDX) {
+    if (!twsp_is_valid_idx(eb_idx)) {
         APPL_TRACE_WARNING("%s: Invalid eb_idx: %d\n", __func__, eb_idx);
         return false;
     }
@@ -504,40 +794,22 @@ bool set_twsp_qdsp_features(int eb_idx, uint8_t features_mask) {
 
 uint8_t get_twsp_role(tBTA_AG_SCB *p_scb) {
     APPL_TRACE_DEBUG("%s: p_scb : %d\n", __func__, p_scb);
-    uint8_t role = 0;
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (p_scb == twsp_devices[i].p_scb)
-        {
-           role = twsp_devices[i].role;
-           break;
-        }
-    }
-    return role;
+    int idx = twsp_dev_idx(p_scb);
+    return (idx == -1) ? 0 : twsp_devices[idx].role;
 }
 
 uint8_t get_twsp_state(tBTA_AG_SCB *p_scb) {
     APPL_TRACE_DEBUG("%s: p_scb : %d\n", __func__, p_scb);
-    uint8_t state = TWSPLUS_EB_STATE_UNKNOWN;
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (p_scb == twsp_devices[i].p_scb)
-        {
-           state = twsp_devices[i].state;
-           break;
-        }
-    }
+    int idx = twsp_dev_idx(p_scb);
+    uint8_t state = (idx == -1) ? (uint8_t)TWSPLUS_EB_STATE_UNKNOWN :
+                                  twsp_devices[idx].state;
     APPL_TRACE_DEBUG("%s: returns  : %d", __func__, state);
     return state;
 }
 
 bool twsp_is_ring_sent(tBTA_AG_SCB *p_scb) {
-    int sel_idx = -1;
+    int sel_idx = twsp_dev_idx(p_scb);
     bool ret = false;
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (twsp_devices[i].p_scb == p_scb) {
-            sel_idx = i;
-            break;
-        }
-    }
 
     if (sel_idx == -1) {
         ret = false;
@@ -549,14 +821,8 @@ bool twsp_is_ring_sent(tBTA_AG_SCB *p_scb) {
 }
 
 bool twsp_set_ring_sent(tBTA_AG_SCB *p_scb, bool ring_sent) {
-    int sel_idx = -1;
+    int sel_idx = twsp_dev_idx(p_scb);
     bool ret = false;
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (twsp_devices[i].p_scb == p_scb) {
-            sel_idx = i;
-            break;
-        }
-    }
 
     if (sel_idx == -1) {
         ret = false;
@@ -569,42 +835,27 @@ bool twsp_set_ring_sent(tBTA_AG_SCB *p_scb, bool ring_sent) {
 }
 
 bool twsp_ring_needed(tBTA_AG_SCB *p_scb) {
-    int sel_idx = -1;
-    bool ring_already_sent = false;
-    int prev_sent_idx = -1;
+    int sel_idx = twsp_dev_idx(p_scb);
     bool ret = false;
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
-        if (twsp_devices[i].ring_sent) {
-            ring_already_sent = true;
-            if (twsp_devices[i].p_scb == p_scb) {
-                //If ring was send to same scb before
-                //should send it to same scb again
-                prev_sent_idx = i;
-            }
-        }
-        else if (twsp_devices[i].p_scb == p_scb) {
-            sel_idx = i;
-        }
-    }
-    if (ring_already_sent) {
-        if (prev_sent_idx == -1) {
-            ret = false;
-        } else {
-            APPL_TRACE_DEBUG("%s: resent timer to same scb", __func__);
-            ret = true;
-        }
+
+    if (sel_idx == -1) {
+        APPL_TRACE_ERROR("%s: Invalid sel_idx: %d", __func__, sel_idx);
+        ret = false;
+    } else if (twsp_devices[sel_idx].ring_sent) {
+        //If ring was send to same scb before
+        //should send it to same scb again
+        APPL_TRACE_DEBUG("%s: resent timer to same scb", __func__);
+        ret = true;
+    } else if (twsp_devices[TWSPLUS_PEER_IDX(sel_idx)].ring_sent) {
+        //Ring already goes to the other earbud of the pair
+        ret = false;
     } else {
-        if (sel_idx == -1) {
-            APPL_TRACE_ERROR("%s: Invalid sel_idx: %d", __func__, sel_idx);
-            ret = false;
+        //If ring is not sent to any of them
+        //check if it is in ear
+        if (twsp_devices[sel_idx].state == TWSPLUS_EB_STATE_INEAR) {
+            ret = true;
         } else {
-            //If ring is not sent to any of them
-            //check if it is in ear
-            if (twsp_devices[sel_idx].state == TWSPLUS_EB_STATE_INEAR) {
-                ret = true;
-            } else {
-                ret = false;
-            }
+            ret = false;
         }
     }
 
@@ -613,54 +864,38 @@ bool twsp_ring_needed(tBTA_AG_SCB *p_scb) {
 }
 
 void twsp_clr_all_ring_sent () {
-    for (int i=0; i<=SECONDARY_EB_IDX; i++) {
+    for (int i=0; i<MAX_TWSPLUS_DEVICES; i++) {
             twsp_devices[i].ring_sent = false;
     }
 }
 
-bool bta_ag_twsp_parse_qbc(tBTA_AG_SCB* p_scb, char* p_s,
+bool bta_ag_twsp_parse_qbc(tBTA_AG_SCB* p_scb, const char* p_s,
                            int16_t *state, int16_t *level) {
-    int16_t n[2] = {-1, -1};
-    int i;
-    char* p;
+    tBTA_AG_AT_TOK tok;
+    int32_t n[2];
 
     if (p_s == NULL) {
         APPL_TRACE_ERROR("%s: Invalid Argument", __func__);
         return false;
     }
 
-    for (i = 0; i < 2; i++) {
-        /* skip to comma delimiter */
-        for (p = p_s; *p != ',' && *p != 0; p++)
-        ;
+    bta_ag_at_tok_init(&tok, p_s, BTA_AG_AT_MAX_LEN);
 
-        if (*p == 0) {
-            n[i] = utl_str2int(p_s);
-            break;
-        } else {
-            /* get integer value */
-            *p = 0;
-            n[i] = utl_str2int(p_s);
-            p_s = p + 1;
-        }
-    }
-
-    if (i != 1) {
-        //String doesn't have two parts with a comma delimiter
-        APPL_TRACE_ERROR("%s: Invalid QBC string", __func__);
+    if (!bta_ag_at_tok_next_int(&tok, TWSPLUS_MIN_BATTERY_CHARGE_STATE_CHARGING,
+                                TWSPLUS_MAX_BATTERY_CHARGE, &n[0])) {
+        APPL_TRACE_ERROR("%s: Invalid QBC state", __func__);
         return false;
     }
 
-    /* process values */
-    if (n[0] < TWSPLUS_MIN_BATTERY_CHARGE_STATE_CHARGING ||
-      n[0] > TWSPLUS_MAX_BATTERY_CHARGE) {
-        APPL_TRACE_ERROR("%s: Invalid QBC state: %d", __func__, n[0]);
+    if (!bta_ag_at_tok_next_int(&tok, TWSPLUS_MIN_BATTERY_CHARGE_STATE_CHARGING,
+                                TWSPLUS_MAX_BATTERY_CHARGE, &n[1])) {
+        APPL_TRACE_ERROR("%s: Invalid QBC level", __func__);
         return false;
     }
 
-    if (n[1] < TWSPLUS_MIN_BATTERY_CHARGE_STATE_CHARGING ||
-      n[1] > TWSPLUS_MAX_BATTERY_CHARGE) {
-        APPL_TRACE_ERROR("%s: Invalid QBC level: %d", __func__, n[1]);
+    if (bta_ag_at_tok_has_more(&tok)) {
+        //String doesn't have exactly two parts
+        APPL_TRACE_ERROR("%s: Invalid QBC string", __func__);
         return false;
     }
 
@@ -674,7 +909,6 @@ void twsp_handle_vs_at_events(tBTA_AG_SCB* p_scb, uint16_t cmd,
 {
     APPL_TRACE_DEBUG("%s: p_scb : %x cmd : %d", __func__, p_scb, cmd);
     int16_t state, level;
-    char str_to_parse[BTA_AG_AT_MAX_LEN];
     int idx = twsp_get_idx_by_scb(p_scb);
     if (idx < 0) {
         APPL_TRACE_ERROR("%s: Invalid SCB handle: %x", __func__, p_scb);
@@ -697,9 +931,7 @@ void twsp_handle_vs_at_events(tBTA_AG_SCB* p_scb, uint16_t cmd,
             set_twsp_role(idx, int_arg);
         } break;
         case BTA_AG_TWSP_AT_QBC_EVT: {
-            strlcpy(str_to_parse, val->str, sizeof(str_to_parse));
-            int ret = bta_ag_twsp_parse_qbc(p_scb,
-                                   str_to_parse, &state, &level);
+            int ret = bta_ag_twsp_parse_qbc(p_scb, val->str, &state, &level);
             if (ret) {
                 APPL_TRACE_DEBUG("%s: QBC=%d, %d", __func__, state, level);
                 if(set_twsp_battery_charge(idx, state, level)) {
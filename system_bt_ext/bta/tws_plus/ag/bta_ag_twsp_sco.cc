@@ -57,15 +57,40 @@
 #include "btm_api.h"
 #include <cutils/properties.h>
 #include "bta_ag_twsp_dev.h"
+#include "btm_vendor_cmd.h"
+#include "osi/include/alarm.h"
+#include "osi/include/osi.h"
 
 #if (TWS_AG_ENABLED == TRUE)
 
-RawAddress g_latest_left_addr;
-RawAddress g_latest_right_addr;
+/* Microphone path switch, one per TWS+ pair. The new mic is enabled first,
+ * and the eSCO setup and the old mic disable follow MIC_PATH_ENABLE_DELAY
+ * later from an alarm, so the BTA thread is never blocked. */
+enum {
+  TWSP_MIC_SWITCH_IDLE,
+  TWSP_MIC_SWITCH_ENABLING,
+};
+
+typedef struct {
+  alarm_t* timer;
+  uint8_t state;
+  tBTA_AG_SCB* p_curr_scb;      /* mic path to disable */
+  tBTA_AG_SCB* p_selected_scb;  /* mic path being enabled */
+  RawAddress left_eb_addr;
+  RawAddress right_eb_addr;
+  bool pending;                 /* a newer request arrived meanwhile */
+  tBTA_AG_SCB* p_pending_curr_scb;
+  tBTA_AG_SCB* p_pending_selected_scb;
+  RawAddress latest_left_addr;  /* earbud addresses of the last eSCO setup */
+  RawAddress latest_right_addr;
+} tTWSP_MIC_SWITCH_CB;
+
+static tTWSP_MIC_SWITCH_CB twsp_mic_switch_cb[MAX_TWSPLUS_PAIRS];
 
 void send_twsp_esco_setup (const RawAddress& left_eb_addr, const RawAddress& rght_eb_addr,
     uint8_t selected_mic);
 void print_bdaddr(const RawAddress& addr);
+static bool twsp_sco_owned_by_other_pair(tBTA_AG_SCB* p_scb);
 
 bool is_rfc_connected (tBTA_AG_SCB* p_scb) {
     return (p_scb && p_scb->conn_handle);
@@ -203,6 +228,13 @@ void bta_ag_twsp_sco_event(tBTA_AG_SCB* p_scb, uint8_t event) {
 
    APPL_TRACE_IMP("%s: TWS+ peer p_scb: %x", __func__, p_scb);
 
+   if (event == BTA_AG_SCO_OPEN_E && twsp_sco_owned_by_other_pair(p_scb)) {
+       APPL_TRACE_WARNING("%s: TWS eSCO is in use by another pair, ignore open"
+                          " for %x", __func__, p_scb);
+       bta_ag_cback_sco(p_scb, BTA_AG_AUDIO_CLOSE_EVT);
+       return;
+   }
+
    switch (p_sco->state) {
        case BTA_AG_SCO_SHUTDOWN_ST:
            switch (event) {
@@ -607,14 +639,70 @@ tBTA_AG_SCB* get_sco_connected_scb() {
    return ret_scb;
 }
 
-void get_left_eb_addr(RawAddress& eb_addr) {
+void get_left_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& eb_addr) {
    APPL_TRACE_ERROR("%s:>", __func__);
-   twsp_get_left_eb_addr(eb_addr);
+   twsp_get_left_eb_addr(p_scb, eb_addr);
 }
 
-void get_right_eb_addr(RawAddress& eb_addr) {
+void get_right_eb_addr(tBTA_AG_SCB* p_scb, RawAddress& eb_addr) {
    APPL_TRACE_ERROR("%s:>", __func__);
-   twsp_get_right_eb_addr(eb_addr);
+   twsp_get_right_eb_addr(p_scb, eb_addr);
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_pair_audio_active
+ *
+ * Description      Checks whether the primary or the secondary SCO state
+ *                  machine is opening or carrying audio for an earbud of
+ *                  TWS+ pair |pair_idx|.
+ *
+ * Returns          bool
+ *
+ ******************************************************************************/
+static bool twsp_pair_audio_active(int pair_idx) {
+   bool ret = false;
+   if ((bta_ag_cb.sco.state == BTA_AG_SCO_OPEN_ST ||
+        bta_ag_cb.sco.state == BTA_AG_SCO_OPENING_ST) &&
+       twsp_get_pair_idx_by_scb(bta_ag_cb.main_sm_scb) == pair_idx) {
+      ret = true;
+   } else if ((bta_ag_cb.twsp_sec_sco.state == BTA_AG_SCO_OPEN_ST ||
+               bta_ag_cb.twsp_sec_sco.state == BTA_AG_SCO_OPENING_ST) &&
+              twsp_get_pair_idx_by_scb(bta_ag_cb.sec_sm_scb) == pair_idx) {
+      ret = true;
+   }
+   APPL_TRACE_DEBUG("%s: pair %d returns : %d", __func__, pair_idx, ret);
+   return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function         twsp_sco_owned_by_other_pair
+ *
+ * Description      There is one TWS eSCO on the host, made of the primary
+ *                  SCO state machine and the secondary one. It belongs to
+ *                  the pair whose earbud uses the primary state machine, or
+ *                  the secondary one, so the other pairs have to wait until
+ *                  both are back in listen or shutdown.
+ *
+ * Returns          true if |p_scb| may not open the secondary SCO now
+ *
+ ******************************************************************************/
+static bool twsp_sco_owned_by_other_pair(tBTA_AG_SCB* p_scb) {
+   int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
+   int owner_pair = TWSPLUS_INVALID_PAIR;
+
+   if (bta_ag_cb.sco.state != BTA_AG_SCO_SHUTDOWN_ST &&
+       bta_ag_cb.sco.state != BTA_AG_SCO_LISTEN_ST) {
+      owner_pair = twsp_get_pair_idx_by_scb(bta_ag_cb.main_sm_scb);
+   }
+   if (owner_pair == TWSPLUS_INVALID_PAIR &&
+       bta_ag_cb.twsp_sec_sco.state != BTA_AG_SCO_SHUTDOWN_ST &&
+       bta_ag_cb.twsp_sec_sco.state != BTA_AG_SCO_LISTEN_ST) {
+      owner_pair = twsp_get_pair_idx_by_scb(bta_ag_cb.twsp_sec_sco.p_curr_scb);
+   }
+
+   return (owner_pair != TWSPLUS_INVALID_PAIR && owner_pair != pair_idx);
 }
 
 /*******************************************************************************
@@ -645,7 +733,7 @@ void twsp_select_microphone(tBTA_AG_SCB *scb1,
                                         tBTA_AG_SCB *scb2) {
 
    APPL_TRACE_DEBUG("%s: scb1: %x, scb2: %x", __func__, scb1, scb2);
-   tBTA_AG_SCB *best_scb = twsp_get_best_mic_scb();
+   tBTA_AG_SCB *best_scb = twsp_get_best_mic_scb(scb2);
 
    tBTA_AG_SCB* other_scb = (best_scb == scb1) ? scb2 : scb1;
 
@@ -653,8 +741,62 @@ void twsp_select_microphone(tBTA_AG_SCB *scb1,
 
 }
 
+/*******************************************************************************
+ *
+ * Function         twsp_mic_switch_complete
+ *
+ * Description      Second phase of a mic switch: sets up the TWS eSCO for the
+ *                  selected earbud and disables the mic path of the other
+ *                  one, then starts the latest request queued meanwhile.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void twsp_mic_switch_complete(tTWSP_MIC_SWITCH_CB* p_cb) {
+    tBTA_AG_SCB* selected_scb = p_cb->p_selected_scb;
+    tBTA_AG_SCB* curr_scb = p_cb->p_curr_scb;
+
+    p_cb->state = TWSP_MIC_SWITCH_IDLE;
+    p_cb->p_selected_scb = NULL;
+    p_cb->p_curr_scb = NULL;
+
+    /* Either earbud may have disconnected while the mic was being enabled */
+    if (twsp_get_idx_by_scb(selected_scb) != -1) {
+        int role = get_twsp_role(selected_scb);
+        if (role == TWSPLUS_EB_ROLE_INVALID) {
+            APPL_TRACE_DEBUG("%s: invalid role, set to default left", __func__);
+            role = TWSPLUS_EB_ROLE_LEFT;
+        }
+
+        send_twsp_esco_setup(p_cb->left_eb_addr, p_cb->right_eb_addr, role);
+
+        if (curr_scb != NULL && curr_scb != selected_scb &&
+            twsp_get_idx_by_scb(curr_scb) != -1) {
+            bta_ag_send_result(curr_scb, BTA_AG_MIC_RES, nullptr, MIC_DISABLE);
+            APPL_TRACE_DEBUG("%s: Disabling Mic path for %x", __func__, curr_scb);
+        }
+    } else {
+        APPL_TRACE_WARNING("%s: selected scb %x is gone, switch dropped",
+                           __func__, selected_scb);
+    }
+
+    if (p_cb->pending) {
+        p_cb->pending = false;
+        twsp_update_microphone_selection(p_cb->p_pending_curr_scb,
+                                         p_cb->p_pending_selected_scb);
+    }
+}
+
+static void twsp_mic_switch_timer_cback(void* data) {
+    tTWSP_MIC_SWITCH_CB* p_cb = (tTWSP_MIC_SWITCH_CB*)data;
+
+    if (p_cb->state != TWSP_MIC_SWITCH_ENABLING) return;
+    twsp_mic_switch_complete(p_cb);
+}
+
 void twsp_update_microphone_selection(tBTA_AG_SCB *curr_scb,
                                         tBTA_AG_SCB *selected_scb) {
+    tTWSP_MIC_SWITCH_CB* p_cb;
     RawAddress left_eb_addr;
     RawAddress right_eb_addr;
     APPL_TRACE_DEBUG("%s: curr_pscb: %x, selected_pscb: %x", __func__,
@@ -664,58 +806,135 @@ void twsp_update_microphone_selection(tBTA_AG_SCB *curr_scb,
         return;
     }
 
-    if (!(is_sco_connected_to_twsp() || is_sco_opening_to_twsp())) {
-       if (twsp_get_left_eb_addr(left_eb_addr) == true) {
-           if (twsp_get_right_eb_addr(right_eb_addr) == false) {
+    int pair_idx = twsp_get_pair_idx_by_scb(selected_scb);
+    if (pair_idx == TWSPLUS_INVALID_PAIR) {
+        APPL_TRACE_WARNING("%s: selected scb %x is no TWS+ earbud", __func__,
+                           selected_scb);
+        return;
+    }
+    p_cb = &twsp_mic_switch_cb[pair_idx];
+
+    if (p_cb->state == TWSP_MIC_SWITCH_ENABLING) {
+        /* Only the last request matters, it is run once this one is done */
+        if (selected_scb == p_cb->p_selected_scb) {
+            APPL_TRACE_DEBUG("%s: switch to %x already in progress", __func__,
+                             selected_scb);
+            p_cb->pending = false;
+            return;
+        }
+        APPL_TRACE_DEBUG("%s: switch in progress, queue %x", __func__,
+                         selected_scb);
+        p_cb->pending = true;
+        p_cb->p_pending_curr_scb = curr_scb;
+        p_cb->p_pending_selected_scb = selected_scb;
+        return;
+    }
+
+    bool audio_active = twsp_pair_audio_active(pair_idx);
+    if (!audio_active) {
+       if (twsp_get_left_eb_addr(selected_scb, left_eb_addr) == true) {
+           if (twsp_get_right_eb_addr(selected_scb, right_eb_addr) == false) {
               get_peer_twsp_addr(left_eb_addr, right_eb_addr);
            }
        } else {
-             if (twsp_get_right_eb_addr(right_eb_addr) == true) {
+             if (twsp_get_right_eb_addr(selected_scb, right_eb_addr) == true) {
                  get_peer_twsp_addr(right_eb_addr, left_eb_addr);
              } else {
                  APPL_TRACE_DEBUG("there are no valid scbs");
                  return;
              }
        }
-       g_latest_left_addr = left_eb_addr;
-       g_latest_right_addr = right_eb_addr;
-       APPL_TRACE_DEBUG("%s: g_latest_left_addr: %s, g_latest_right_addr: %s", __func__,
-            g_latest_left_addr.ToString().c_str(), g_latest_right_addr.ToString().c_str());
+       p_cb->latest_left_addr = left_eb_addr;
+       p_cb->latest_right_addr = right_eb_addr;
+       APPL_TRACE_DEBUG("%s: pair %d latest left: %s, latest right: %s",
+            __func__, pair_idx, p_cb->latest_left_addr.ToString().c_str(),
+            p_cb->latest_right_addr.ToString().c_str());
     } else {
-        if (!g_latest_left_addr.IsEmpty() && !g_latest_right_addr.IsEmpty()){
-           left_eb_addr = g_latest_left_addr;
-           right_eb_addr = g_latest_right_addr;
+        if (!p_cb->latest_left_addr.IsEmpty() &&
+            !p_cb->latest_right_addr.IsEmpty()) {
+           left_eb_addr = p_cb->latest_left_addr;
+           right_eb_addr = p_cb->latest_right_addr;
            APPL_TRACE_DEBUG("%s: left_eb_addr: %s, right_eb_addr: %s", __func__,
                 left_eb_addr.ToString().c_str(), right_eb_addr.ToString().c_str());
         } else {
-           APPL_TRACE_DEBUG("the g_latest_left_addr or g_latest_right_addr is empty");
+           APPL_TRACE_DEBUG("the latest left or right eb addr is empty");
            return;
         }
     }
 
+    p_cb->state = TWSP_MIC_SWITCH_ENABLING;
+    p_cb->p_curr_scb = curr_scb;
+    p_cb->p_selected_scb = selected_scb;
+    p_cb->left_eb_addr = left_eb_addr;
+    p_cb->right_eb_addr = right_eb_addr;
+
     bta_ag_send_result(selected_scb, BTA_AG_MIC_RES, nullptr, MIC_ENABLE);
-    //Have a timer for MIC_PATH_ENABLE_DELAY
-    usleep(MIC_PATH_ENABLE_DELAY*1000);
-    int  role = get_twsp_role(selected_scb);
-    if (role == TWSPLUS_EB_ROLE_INVALID) {
-        APPL_TRACE_DEBUG("%s: invalid role, set to default left", __func__);
-        role = TWSPLUS_EB_ROLE_LEFT;
+
+    if (!audio_active) {
+        /* No audio flows yet, so the eSCO setup doesn't need to wait for
+         * the mic path and must precede the SCO creation that follows */
+        twsp_mic_switch_complete(p_cb);
+        return;
     }
 
-    send_twsp_esco_setup(left_eb_addr, right_eb_addr, role);
+    if (p_cb->timer == NULL) {
+        p_cb->timer = alarm_new("bta_ag.twsp_mic_switch");
+    }
+    alarm_set_on_mloop(p_cb->timer, MIC_PATH_ENABLE_DELAY,
+                       twsp_mic_switch_timer_cback, p_cb);
+}
 
-    if (curr_scb != NULL) {
-        bta_ag_send_result(curr_scb, BTA_AG_MIC_RES, nullptr, MIC_DISABLE);
-        APPL_TRACE_DEBUG("%s: Disabling Mic path for %x", __func__, curr_scb);
+/*******************************************************************************
+ *
+ * Function         twsp_cancel_microphone_selection
+ *
+ * Description      Cancels the mic switch in progress, and any queued one,
+ *                  involving |p_scb|. Called when the earbud goes away.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void twsp_cancel_microphone_selection(tBTA_AG_SCB* p_scb) {
+    int pair_idx = twsp_get_pair_idx_by_scb(p_scb);
+    if (pair_idx == TWSPLUS_INVALID_PAIR) return;
+
+    tTWSP_MIC_SWITCH_CB* p_cb = &twsp_mic_switch_cb[pair_idx];
+
+    if (p_cb->pending && (p_cb->p_pending_curr_scb == p_scb ||
+                          p_cb->p_pending_selected_scb == p_scb)) {
+        p_cb->pending = false;
+    }
+
+    if (p_cb->state != TWSP_MIC_SWITCH_ENABLING) return;
+
+    if (p_cb->p_curr_scb == p_scb) {
+        /* Nothing left to disable, the rest of the switch still applies */
+        p_cb->p_curr_scb = NULL;
+    } else if (p_cb->p_selected_scb == p_scb) {
+        APPL_TRACE_DEBUG("%s: cancel switch to %x", __func__, p_scb);
+        alarm_cancel(p_cb->timer);
+        p_cb->state = TWSP_MIC_SWITCH_IDLE;
+        p_cb->p_selected_scb = NULL;
+        p_cb->p_curr_scb = NULL;
+        if (p_cb->pending) {
+            p_cb->pending = false;
+            twsp_update_microphone_selection(p_cb->p_pending_curr_scb,
+                                             p_cb->p_pending_selected_scb);
+        }
     }
 }
 
 /*
  * Callback handle for TWS SCo VS command
  */
-void twsp_sco_setup_callback(tBTM_VSC_CMPL *param) {
+void twsp_sco_setup_callback(uint16_t cmd_id, uint8_t cmd_status,
+                             tBTM_VSC_CMPL *param, UNUSED_ATTR void* context) {
     unsigned char status = 0;
     unsigned char sub_opcode = 0;
+    if (cmd_status == BTM_VSC_STATUS_TIMEOUT) {
+        APPL_TRACE_ERROR("%s: TWS eSCO setup %d timed out", __func__, cmd_id);
+        return;
+    }
     APPL_TRACE_DEBUG("%s: param_len = %d subopcode = %d status = %d",
          __func__,param->param_len, param->p_param_buf[1], param->p_param_buf[0]);
 
@@ -759,9 +978,8 @@ void send_twsp_esco_setup (const RawAddress& left_eb_addr, const RawAddress& rgh
                                   BD_ADDR_LEN);
    *p_param++ = selected_mic;
 
-   BTM_VendorSpecificCommand(VS_QHCI_TWS_ESCO_SETUP_OPCODE,
-                              VS_TWS_SCO_SETUP_CMD_LEN,
-                               param, twsp_sco_setup_callback);
+   BTM_VscSubmit(VS_QHCI_TWS_ESCO_SETUP_OPCODE, VS_TWS_SCO_SETUP_CMD_LEN,
+                 param, TWSP_VSC_TIMEOUT_MS, twsp_sco_setup_callback, NULL);
 }
 
 #endif //TWS_AG_ENABLED
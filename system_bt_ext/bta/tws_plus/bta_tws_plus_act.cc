@@ -80,13 +80,17 @@
 #define BTA_TWS_PLUS_SDP_DB_SIZE 2000
 #endif
 
-static uint8_t __attribute__((aligned(4))) bta_tws_plus_sdp_db_data[BTA_TWS_PLUS_SDP_DB_SIZE];
+/* One database per concurrent search, so both earbuds of a set can be
+ * discovered in parallel */
+static uint8_t __attribute__((aligned(4)))
+    bta_tws_plus_sdp_db_data[BTA_TWS_PLUS_MAX_SDP_SEARCH]
+                            [BTA_TWS_PLUS_SDP_DB_SIZE];
 
 /* TwsPlus SDP configuration structure */
 const tBTA_TWS_PLUS_SDP_CFG bta_tws_plus_sdp_cfg = {
     BTA_TWS_PLUS_SDP_DB_SIZE,
     (tSDP_DISCOVERY_DB*)
-        bta_tws_plus_sdp_db_data /* The data buffer to keep SDP database */
+        bta_tws_plus_sdp_db_data /* The data buffers to keep SDP databases */
 };
 
 tBTA_TWS_PLUS_SDP_CFG* p_bta_tws_plus_sdp_cfg = (tBTA_TWS_PLUS_SDP_CFG*)&bta_tws_plus_sdp_cfg;
@@ -161,6 +165,124 @@ static bool bta_tws_plus_get_str_attr(tSDP_DISC_REC* p_rec, uint16_t attr_id,
   return status;
 }
 
+static void bta_tws_plus_reverse_addr(RawAddress* addr) {
+  uint8_t tmp;
+  for (size_t i = 0; i < sizeof(addr->address) / 2; i++) {
+    tmp = addr->address[i];
+    addr->address[i] = addr->address[sizeof(addr->address) - 1 - i];
+    addr->address[sizeof(addr->address) - 1 - i] = tmp;
+  }
+}
+
+static void bta_tws_plus_report_search_fail(const RawAddress& bd_addr,
+                                            tBTA_TWS_PLUS_STATUS status) {
+  if (bta_tws_plus_cb.p_dm_cback) {
+    tBTA_TWS_PLUS result;
+    memset(&result, 0, sizeof(result));
+    result.sdp_search_comp.eb_addr = bd_addr;
+    result.sdp_search_comp.status = status;
+    bta_tws_plus_cb.p_dm_cback(BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT, &result);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Function     bta_tws_plus_alloc_search
+ *
+ * Description  Gets a free search slot. A search already running for
+ *              |bd_addr| makes the request busy.
+ *
+ * Returns      slot index, or BTA_TWS_PLUS_MAX_SDP_SEARCH if none
+ *
+ ******************************************************************************/
+static uint8_t bta_tws_plus_alloc_search(const RawAddress& bd_addr) {
+  uint8_t free_idx = BTA_TWS_PLUS_MAX_SDP_SEARCH;
+
+  for (uint8_t i = 0; i < BTA_TWS_PLUS_MAX_SDP_SEARCH; i++) {
+    tBTA_TWS_PLUS_SDP_SEARCH_CB* p_search = &bta_tws_plus_cb.sdp[i];
+    if (p_search->sdp_active != BTA_TWS_PLUS_SDP_ACTIVE_NONE) {
+      if (p_search->remote_addr == bd_addr)
+        return BTA_TWS_PLUS_MAX_SDP_SEARCH;
+    } else if (free_idx == BTA_TWS_PLUS_MAX_SDP_SEARCH) {
+      free_idx = i;
+    }
+  }
+
+  if (free_idx != BTA_TWS_PLUS_MAX_SDP_SEARCH) {
+    tBTA_TWS_PLUS_SDP_SEARCH_CB* p_search = &bta_tws_plus_cb.sdp[free_idx];
+    memset(&p_search->result, 0, sizeof(p_search->result));
+    p_search->result.status = BTA_TWS_PLUS_FAILURE;
+    p_search->result.eb_addr = bd_addr;
+    p_search->remote_addr = bd_addr;
+    p_search->set_idx = BTA_TWS_PLUS_SDP_NO_SET;
+    p_search->is_set_primary = false;
+    p_search->done = false;
+    p_search->p_sdp_db =
+        (tSDP_DISCOVERY_DB*)((uint8_t*)p_bta_tws_plus_sdp_cfg->p_sdp_db +
+                             free_idx * p_bta_tws_plus_sdp_cfg->sdp_db_size);
+  }
+  return free_idx;
+}
+
+/*******************************************************************************
+ *
+ * Function     bta_tws_plus_report_set
+ *
+ * Description  Merges the results of both earbuds of a set search and
+ *              reports them once. An earbud whose own record could not be
+ *              read still gets its peer address from the record of the
+ *              other earbud, when that one links back to it.
+ *
+ * Returns      void
+ *
+ ******************************************************************************/
+static void bta_tws_plus_report_set(tBTA_TWS_PLUS_SDP_SEARCH_CB* p_primary,
+                                    tBTA_TWS_PLUS_SDP_SEARCH_CB* p_peer) {
+  tBTA_TWS_PLUS evt_data;
+  RawAddress linked_addr;
+
+  memset(&evt_data, 0, sizeof(evt_data));
+  evt_data.sdp_set_comp.eb_comp = p_primary->result;
+  evt_data.sdp_set_comp.peer_comp = p_peer->result;
+
+  tBTA_TWS_PLUS_SDP_SEARCH_COMP* p_eb = &evt_data.sdp_set_comp.eb_comp;
+  tBTA_TWS_PLUS_SDP_SEARCH_COMP* p_pe = &evt_data.sdp_set_comp.peer_comp;
+
+  /* The linked earbud attribute is in reversed byte order */
+  if (p_eb->status != BTA_TWS_PLUS_SUCCESS &&
+      p_pe->status == BTA_TWS_PLUS_SUCCESS) {
+    linked_addr = p_pe->peer_eb_addr;
+    bta_tws_plus_reverse_addr(&linked_addr);
+    if (linked_addr == p_eb->eb_addr) {
+      p_eb->peer_eb_addr = p_pe->eb_addr;
+      bta_tws_plus_reverse_addr(&p_eb->peer_eb_addr);
+      p_eb->status = BTA_TWS_PLUS_SUCCESS;
+      APPL_TRACE_DEBUG("%s() - peer record links back to %s", __func__,
+                       p_eb->eb_addr.ToString().c_str());
+    }
+  } else if (p_pe->status != BTA_TWS_PLUS_SUCCESS &&
+             p_eb->status == BTA_TWS_PLUS_SUCCESS) {
+    linked_addr = p_eb->peer_eb_addr;
+    bta_tws_plus_reverse_addr(&linked_addr);
+    if (linked_addr == p_pe->eb_addr) {
+      p_pe->peer_eb_addr = p_eb->eb_addr;
+      bta_tws_plus_reverse_addr(&p_pe->peer_eb_addr);
+      p_pe->status = BTA_TWS_PLUS_SUCCESS;
+    }
+  }
+  evt_data.sdp_set_comp.status = p_eb->status;
+
+  APPL_TRACE_DEBUG("%s() - %s: %d, %s: %d", __func__,
+                   p_eb->eb_addr.ToString().c_str(), p_eb->status,
+                   p_pe->eb_addr.ToString().c_str(), p_pe->status);
+
+  p_primary->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+  p_peer->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+
+  if (bta_tws_plus_cb.p_dm_cback)
+    bta_tws_plus_cb.p_dm_cback(BTA_TWS_PLUS_SDP_SET_COMP_EVT, &evt_data);
+}
+
 /*******************************************************************************
  *
  * Function     bta_tws_plus_search_cback
@@ -173,34 +295,49 @@ static bool bta_tws_plus_get_str_attr(tSDP_DISC_REC* p_rec, uint16_t attr_id,
 static void bta_tws_plus_search_cback(uint16_t result, void* user_data) {
   tSDP_DISC_REC* p_rec = NULL;
   tBTA_TWS_PLUS evt_data;
-  tBTA_TWS_PLUS_STATUS status = BTA_TWS_PLUS_FAILURE;
-  bluetooth::Uuid& uuid = *(reinterpret_cast<bluetooth::Uuid*>(user_data));
+  tBTA_TWS_PLUS_SDP_SEARCH_CB* p_search =
+      (tBTA_TWS_PLUS_SDP_SEARCH_CB*)user_data;
   APPL_TRACE_DEBUG("%s() -  res: 0x%x", __func__, result);
 
-  memset(&evt_data, 0, sizeof(evt_data));
-  bta_tws_plus_cb.sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
-
-  if (bta_tws_plus_cb.p_dm_cback == NULL) return;
-
-  evt_data.sdp_search_comp.eb_addr = bta_tws_plus_cb.remote_addr;
+  if (bta_tws_plus_cb.p_dm_cback == NULL ||
+      p_search->sdp_active == BTA_TWS_PLUS_SDP_ACTIVE_NONE) {
+    p_search->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+    return;
+  }
 
   if (result == SDP_SUCCESS || result == SDP_DB_FULL) {
-      p_rec = SDP_FindServiceUUIDInDb(p_bta_tws_plus_sdp_cfg->p_sdp_db, uuid, p_rec);
+      p_rec = SDP_FindServiceUUIDInDb(p_search->p_sdp_db, p_search->uuid, p_rec);
       /* generate the matching record data pointer */
-      if ((p_rec != NULL) && ( uuid == bluetooth::Uuid::From128BitBE(UUID_TWS_PLUS_SINK))) {
+      if ((p_rec != NULL) && ( p_search->uuid == bluetooth::Uuid::From128BitBE(UUID_TWS_PLUS_SINK))) {
         if(bta_tws_plus_get_str_attr(p_rec, ATTR_ID_TWS_PLUS_LINKED_EARBUD,
-                           evt_data.sdp_search_comp.peer_eb_addr)) {
-            status = BTA_TWS_PLUS_SUCCESS;
+                           p_search->result.peer_eb_addr)) {
+            p_search->result.status = BTA_TWS_PLUS_SUCCESS;
         }
         APPL_TRACE_DEBUG("%s() - found TWS_PLUS SINK uuid", __func__);
       } else {
         APPL_TRACE_DEBUG("%s() - UUID not found", __func__);
       }
-      evt_data.sdp_search_comp.status = status;
+  }
 
+  if (p_search->set_idx == BTA_TWS_PLUS_SDP_NO_SET) {
+    p_search->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+    if (result == SDP_SUCCESS || result == SDP_DB_FULL) {
+      memset(&evt_data, 0, sizeof(evt_data));
+      evt_data.sdp_search_comp = p_search->result;
       bta_tws_plus_cb.p_dm_cback(BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT, &evt_data);
-      osi_free(user_data);  // We no longer need the user data to track the search
+    }
+    return;
   }
+
+  /* Set search: report when the other earbud is done as well */
+  tBTA_TWS_PLUS_SDP_SEARCH_CB* p_other = &bta_tws_plus_cb.sdp[p_search->set_idx];
+  p_search->done = true;
+  if (!p_other->done) return;
+
+  if (p_search->is_set_primary)
+    bta_tws_plus_report_set(p_search, p_other);
+  else
+    bta_tws_plus_report_set(p_other, p_search);
 }
 
 /*******************************************************************************
@@ -213,7 +350,7 @@ static void bta_tws_plus_search_cback(uint16_t result, void* user_data) {
  *
  ******************************************************************************/
 void bta_tws_plus_enable(tBTA_TWS_PLUS_MSG* p_data) {
-  APPL_TRACE_DEBUG("%s in, sdp_active:%d", __func__, bta_tws_plus_cb.sdp_active);
+  APPL_TRACE_DEBUG("%s in", __func__);
   tBTA_TWS_PLUS evt_data;
   evt_data.status = BTA_TWS_PLUS_SUCCESS;
   bta_tws_plus_cb.p_dm_cback = p_data->enable.p_cback;
@@ -235,10 +372,14 @@ void bta_tws_plus_enable(tBTA_TWS_PLUS_MSG* p_data) {
  *
  ******************************************************************************/
 void bta_tws_plus_disable(tBTA_TWS_PLUS_MSG* p_data) {
-  APPL_TRACE_DEBUG("%s in, sdp_active:%d", __func__, bta_tws_plus_cb.sdp_active);
+  APPL_TRACE_DEBUG("%s in", __func__);
 
-  if(bta_tws_plus_cb.sdp_active == BTA_TWS_PLUS_SDP_ACTIVE_YES)  {
-    SDP_CancelServiceSearch(p_bta_tws_plus_sdp_cfg->p_sdp_db);
+  for (uint8_t i = 0; i < BTA_TWS_PLUS_MAX_SDP_SEARCH; i++) {
+    tBTA_TWS_PLUS_SDP_SEARCH_CB* p_search = &bta_tws_plus_cb.sdp[i];
+    if (p_search->sdp_active == BTA_TWS_PLUS_SDP_ACTIVE_YES) {
+      p_search->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+      SDP_CancelServiceSearch(p_search->p_sdp_db);
+    }
   }
 
   if(bta_tws_plus_cb.sdp_tws_plus_handle) {
@@ -248,6 +389,36 @@ void bta_tws_plus_disable(tBTA_TWS_PLUS_MSG* p_data) {
   memset(&bta_tws_plus_cb, 0, sizeof(bta_tws_plus_cb));
 }
 
+/*******************************************************************************
+ *
+ * Function     bta_tws_plus_start_search
+ *
+ * Description  Issues the TWS+ sink search of search slot |idx|
+ *
+ * Returns      true if the search was started
+ *
+ ******************************************************************************/
+static bool bta_tws_plus_start_search(uint8_t idx) {
+  tBTA_TWS_PLUS_SDP_SEARCH_CB* p_search = &bta_tws_plus_cb.sdp[idx];
+
+  p_search->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_YES;
+  /* set the uuid used in the search */
+  p_search->uuid = bluetooth::Uuid::From128BitBE(UUID_TWS_PLUS_SINK);
+
+  /* initialize the search for the uuid */
+  SDP_InitDiscoveryDb(p_search->p_sdp_db, p_bta_tws_plus_sdp_cfg->sdp_db_size,
+                      1, &p_search->uuid, 0, NULL);
+
+  if (!SDP_ServiceSearchAttributeRequest2(p_search->remote_addr,
+                                          p_search->p_sdp_db,
+                                          bta_tws_plus_search_cback,
+                                          (void*)p_search)) {
+    p_search->sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
+    return false;
+  }
+  return true;
+}
+
 /*******************************************************************************
  *
  * Function     bta_tws_plus_sdp_search
@@ -262,52 +433,82 @@ void bta_tws_plus_sdp_search(tBTA_TWS_PLUS_MSG* p_data) {
     APPL_TRACE_DEBUG("SDP control block handle is null");
     return;
   }
-  tBTA_TWS_PLUS_STATUS status = BTA_TWS_PLUS_FAILURE;
 
-  APPL_TRACE_DEBUG("%s in, sdp_active:%d", __func__, bta_tws_plus_cb.sdp_active);
+  APPL_TRACE_DEBUG("%s in", __func__);
 
-  if (bta_tws_plus_cb.sdp_active != BTA_TWS_PLUS_SDP_ACTIVE_NONE) {
+  uint8_t idx = bta_tws_plus_alloc_search(p_data->sdp_search.bd_addr);
+  if (idx == BTA_TWS_PLUS_MAX_SDP_SEARCH) {
     /* SDP is still in progress */
-    status = BTA_TWS_PLUS_BUSY;
-    if (bta_tws_plus_cb.p_dm_cback) {
-      tBTA_TWS_PLUS result;
-      memset(&result, 0, sizeof(result));
-      result.sdp_search_comp.eb_addr = p_data->sdp_search.bd_addr;
-      result.sdp_search_comp.status = status;
-      bta_tws_plus_cb.p_dm_cback(BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT, &result);
-    }
+    bta_tws_plus_report_search_fail(p_data->sdp_search.bd_addr,
+                                    BTA_TWS_PLUS_BUSY);
     return;
   }
 
-  bta_tws_plus_cb.sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_YES;
-  bta_tws_plus_cb.remote_addr = p_data->sdp_search.bd_addr;
-  /* set the uuid used in the search */
-  bluetooth::Uuid *bta_tws_plus_search_uuid =  (bluetooth::Uuid *)osi_malloc(sizeof(bluetooth::Uuid));
-  *bta_tws_plus_search_uuid = bluetooth::Uuid::From128BitBE(UUID_TWS_PLUS_SINK);
-
-  /* initialize the search for the uuid */
-  SDP_InitDiscoveryDb(p_bta_tws_plus_sdp_cfg->p_sdp_db, p_bta_tws_plus_sdp_cfg->sdp_db_size, 1,
-                      bta_tws_plus_search_uuid, 0, NULL);
-
-  if (!SDP_ServiceSearchAttributeRequest2(
-          p_data->sdp_search.bd_addr, p_bta_tws_plus_sdp_cfg->p_sdp_db,
-          bta_tws_plus_search_cback, (void*) bta_tws_plus_search_uuid)) {
-    bta_tws_plus_cb.sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_NONE;
-
+  if (!bta_tws_plus_start_search(idx)) {
     /* failed to start SDP. report the failure right away */
-    if (bta_tws_plus_cb.p_dm_cback) {
-      tBTA_TWS_PLUS result;
-      memset(&result, 0, sizeof(result));
-      result.sdp_search_comp.eb_addr =  p_data->sdp_search.bd_addr;
-      result.sdp_search_comp.status = status;
-      bta_tws_plus_cb.p_dm_cback(BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT, &result);
-    }
+    bta_tws_plus_report_search_fail(p_data->sdp_search.bd_addr,
+                                    BTA_TWS_PLUS_FAILURE);
   }
   /*
   else report the result when the cback is called
   */
 }
 
+/*******************************************************************************
+ *
+ * Function     bta_tws_plus_sdp_search_set
+ *
+ * Description  Discovers both earbuds of a TWS+ set in parallel. Falls back
+ *              to the search of the first earbud only when no second slot
+ *              is free or the peer search can't be started.
+ *
+ * Returns      void
+ *
+ ******************************************************************************/
+void bta_tws_plus_sdp_search_set(tBTA_TWS_PLUS_MSG* p_data) {
+  tBTA_TWS_PLUS_API_SDP_SEARCH_SET* p_set = &p_data->sdp_search_set;
+
+  APPL_TRACE_DEBUG("%s in, %s and %s", __func__,
+                   p_set->bd_addr.ToString().c_str(),
+                   p_set->peer_eb_addr.ToString().c_str());
+
+  uint8_t idx = bta_tws_plus_alloc_search(p_set->bd_addr);
+  if (idx == BTA_TWS_PLUS_MAX_SDP_SEARCH) {
+    bta_tws_plus_report_search_fail(p_set->bd_addr, BTA_TWS_PLUS_BUSY);
+    return;
+  }
+  /* Hold the slot while looking for the second one */
+  bta_tws_plus_cb.sdp[idx].sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_YES;
+  uint8_t peer_idx = BTA_TWS_PLUS_MAX_SDP_SEARCH;
+  if (p_set->peer_eb_addr != RawAddress::kEmpty &&
+      p_set->peer_eb_addr != p_set->bd_addr) {
+    peer_idx = bta_tws_plus_alloc_search(p_set->peer_eb_addr);
+  }
+
+  if (peer_idx != BTA_TWS_PLUS_MAX_SDP_SEARCH) {
+    bta_tws_plus_cb.sdp[idx].set_idx = peer_idx;
+    bta_tws_plus_cb.sdp[idx].is_set_primary = true;
+    bta_tws_plus_cb.sdp[peer_idx].set_idx = idx;
+
+    if (!bta_tws_plus_start_search(peer_idx)) {
+      APPL_TRACE_WARNING("%s: peer search not started, search %s alone",
+                         __func__, p_set->bd_addr.ToString().c_str());
+      bta_tws_plus_cb.sdp[idx].set_idx = BTA_TWS_PLUS_SDP_NO_SET;
+      bta_tws_plus_cb.sdp[idx].is_set_primary = false;
+    }
+  }
+
+  if (!bta_tws_plus_start_search(idx)) {
+    if (bta_tws_plus_cb.sdp[idx].set_idx != BTA_TWS_PLUS_SDP_NO_SET) {
+      /* Let the peer search complete the set with a failed first earbud */
+      bta_tws_plus_cb.sdp[idx].sdp_active = BTA_TWS_PLUS_SDP_ACTIVE_YES;
+      bta_tws_plus_cb.sdp[idx].done = true;
+    } else {
+      bta_tws_plus_report_search_fail(p_set->bd_addr, BTA_TWS_PLUS_FAILURE);
+    }
+  }
+}
+
 /*******************************************************************************
  *
  * Function     bta_tws_plus_derive_linkkey
@@ -321,7 +522,7 @@ void bta_tws_plus_derive_linkkey(tBTA_TWS_PLUS_MSG* p_data) {
   tBTA_TWS_PLUS_STATUS status = BTA_TWS_PLUS_FAILURE;
   tBTA_TWS_PLUS result;
   memset(&result, 0, sizeof(result));
-  APPL_TRACE_DEBUG("%s in, sdp_active:%d", __func__, bta_tws_plus_cb.sdp_active);
+  APPL_TRACE_DEBUG("%s in", __func__);
 
   int i = 0;
   result.lk_derived.key = SMP_DeriveBrEdrLinkKey(p_data->derive_lk.peer_eb_addr,
@@ -165,6 +165,35 @@ tBTA_TWS_PLUS_STATUS BTA_TwsPlusSdpSearch(RawAddress bd_addr) {
   return BTA_TWS_PLUS_SUCCESS;
 }
 
+/*******************************************************************************
+ *
+ * Function         BTA_TwsPlusSdpSearchSet
+ *
+ * Description      This function performs the TWS+ service discovery on an
+ *                  earbud and on its peer earbud in parallel. When both are
+ *                  completed the tBTA_TWS_PLUS_DM_CBACK callback function will
+ *                  be called with a BTA_TWS_PLUS_SDP_SET_COMP_EVT.
+ *
+ * Returns          BTA_TWS_PLUS_SUCCESS, if the request is being processed.
+ *                  BTA_TWS_PLUS_FAILURE, otherwise.
+ *
+ ******************************************************************************/
+tBTA_TWS_PLUS_STATUS BTA_TwsPlusSdpSearchSet(RawAddress bd_addr,
+                                             RawAddress peer_eb_addr) {
+  tBTA_TWS_PLUS_API_SDP_SEARCH_SET* p_msg =
+      (tBTA_TWS_PLUS_API_SDP_SEARCH_SET*)osi_malloc(
+          sizeof(tBTA_TWS_PLUS_API_SDP_SEARCH_SET));
+
+  APPL_TRACE_API("%s", __func__);
+
+  p_msg->hdr.event = BTA_TWS_PLUS_API_SDP_SEARCH_SET_EVT;
+  p_msg->bd_addr = bd_addr;
+  p_msg->peer_eb_addr = peer_eb_addr;
+  bta_sys_sendmsg(p_msg);
+
+  return BTA_TWS_PLUS_SUCCESS;
+}
+
 /*******************************************************************************
  *
  * Function         BTA_TwsPlusDeriveLinkKey
@@ -78,6 +78,7 @@ enum {
   BTA_TWS_PLUS_API_SDP_SEARCH_EVT,
   BTA_TWS_PLUS_API_DERIVE_LINK_KEY_EVT,
   BTA_TWS_PLUS_API_UPDATE_PEER_EB_ADDR_EVT,
+  BTA_TWS_PLUS_API_SDP_SEARCH_SET_EVT,
   BTA_TWS_PLUS_MAX_INT_EVT
 };
 
@@ -98,6 +99,13 @@ typedef struct {
   RawAddress bd_addr;
 } tBTA_TWS_PLUS_API_SDP_SEARCH;
 
+/* data type for BTA_TWS_PLUS_API_SDP_SEARCH_SET_EVT */
+typedef struct {
+  BT_HDR hdr;
+  RawAddress bd_addr;
+  RawAddress peer_eb_addr;
+} tBTA_TWS_PLUS_API_SDP_SEARCH_SET;
+
 /* data type for tBTA_TWS_PLUS_LK_DERIVED_EVT */
 typedef struct {
   BT_HDR hdr;
@@ -119,15 +127,36 @@ typedef union {
   BT_HDR hdr;
   tBTA_TWS_PLUS_API_ENABLE enable;
   tBTA_TWS_PLUS_API_SDP_SEARCH sdp_search;
+  tBTA_TWS_PLUS_API_SDP_SEARCH_SET sdp_search_set;
   tBTA_TWS_PLUS_API_DERIVE_LINKKEY derive_lk;
   tBTA_TWS_PLUS_API_UPDATE_PEER_EB_ADDR update_peer_eb;
 } tBTA_TWS_PLUS_MSG;
 
-/* SDP control block */
+/* Number of SDP searches that can run at the same time, each one has its
+ * own discovery database */
+#ifndef BTA_TWS_PLUS_MAX_SDP_SEARCH
+#define BTA_TWS_PLUS_MAX_SDP_SEARCH 2
+#endif
+
+#define BTA_TWS_PLUS_SDP_NO_SET 0xFF
+
+/* SDP search slot */
 typedef struct {
-  uint32_t sdp_tws_plus_handle;     /* SDP record handle for TWS+ */
   uint8_t sdp_active;               /* see BTA_TWS_PLUS_SDP_ACT_* */
   RawAddress remote_addr;
+  bluetooth::Uuid uuid;             /* uuid being searched */
+  tSDP_DISCOVERY_DB* p_sdp_db;
+  uint8_t set_idx;                  /* slot of the peer earbud in a set search,
+                                       BTA_TWS_PLUS_SDP_NO_SET otherwise */
+  bool is_set_primary;              /* earbud the set search was issued for */
+  bool done;                        /* set search: result held for merging */
+  tBTA_TWS_PLUS_SDP_SEARCH_COMP result;
+} tBTA_TWS_PLUS_SDP_SEARCH_CB;
+
+/* SDP control block */
+typedef struct {
+  uint32_t sdp_tws_plus_handle;     /* SDP record handle for TWS+ */
+  tBTA_TWS_PLUS_SDP_SEARCH_CB sdp[BTA_TWS_PLUS_MAX_SDP_SEARCH];
   tBTA_TWS_PLUS_DM_CBACK* p_dm_cback;
 } tBTA_TWS_PLUS_CB;
 
@@ -142,6 +171,7 @@ extern bool bta_tws_plus_sm_execute(BT_HDR* p_msg);
 extern void bta_tws_plus_enable(tBTA_TWS_PLUS_MSG* p_data);
 extern void bta_tws_plus_disable(tBTA_TWS_PLUS_MSG* p_data);
 extern void bta_tws_plus_sdp_search(tBTA_TWS_PLUS_MSG* p_data);
+extern void bta_tws_plus_sdp_search_set(tBTA_TWS_PLUS_MSG* p_data);
 extern void bta_tws_plus_derive_linkkey(tBTA_TWS_PLUS_MSG* p_data);
 extern void bta_tws_plus_update_peer_eb_addr(tBTA_TWS_PLUS_MSG* p_data);
 #endif /* BTA_TWS_PLUS_INT_H */
@@ -82,7 +82,8 @@ const tBTA_TWS_PLUS_ACTION bta_tws_plus_action[] = {
     bta_tws_plus_disable,            /* BTA_TWS_PLUS_API_DISABLE_EVT */
     bta_tws_plus_sdp_search,        /* BTA_TWS_PLUS_API_SDP_SEARCH_EVT */
     bta_tws_plus_derive_linkkey,    /* BTA_TWS_PLUS_API_DERIVE_LINK_KEY_EVT */
-    bta_tws_plus_update_peer_eb_addr /* BTA_TWS_PLUS_API_UPDATE_PEER_EB_ADDR_EVT */
+    bta_tws_plus_update_peer_eb_addr, /* BTA_TWS_PLUS_API_UPDATE_PEER_EB_ADDR_EVT */
+    bta_tws_plus_sdp_search_set     /* BTA_TWS_PLUS_API_SDP_SEARCH_SET_EVT */
 };
 
 /*******************************************************************************
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_afh_analytics.h
+ *
+ *  Description:   Per-link AFH channel map history and Wi-Fi coexistence
+ *                 overlap analytics.
+ *
+ ******************************************************************************/
+
+#ifndef BTIF_AFH_ANALYTICS_H
+#define BTIF_AFH_ANALYTICS_H
+
+#include <stdint.h>
+#include "bt_types.h"
+
+#define BTIF_AFH_BR_EDR_NUM_CHANNELS 79
+#define BTIF_AFH_LE_NUM_CHANNELS 37
+#define BTIF_AFH_MAX_CHANNELS BTIF_AFH_BR_EDR_NUM_CHANNELS
+#define BTIF_AFH_MAX_LINKS 7
+#define BTIF_AFH_HISTORY_SIZE 16
+
+/* Channel k is in use when bit k is set */
+typedef struct {
+  uint64_t bits[2];
+} tBTIF_AFH_CHANNEL_MAP;
+
+/* Converts a little endian HCI channel map, reserved bits are dropped */
+void btif_afh_map_from_stream(tBTIF_AFH_CHANNEL_MAP* p_map,
+                              const uint8_t* p_data, uint8_t len,
+                              uint8_t num_channels);
+uint8_t btif_afh_map_count(const tBTIF_AFH_CHANNEL_MAP* p_map);
+
+void btif_afh_analytics_init(void);
+void btif_afh_analytics_cleanup(void);
+
+/* Records a channel map read on the link with ACL |handle| */
+void btif_afh_analytics_update(uint16_t handle, tBT_TRANSPORT transport,
+                               const uint8_t* p_data, uint8_t len);
+
+/* Forgets every link whose handle is not in |p_handles| */
+void btif_afh_analytics_retain(const uint16_t* p_handles, uint8_t num_handles);
+
+/* Wi-Fi channel used for the overlap computation, 0 MHz clears it */
+void btif_afh_analytics_set_wifi_channel(uint16_t center_mhz,
+                                         uint16_t width_mhz);
+
+void btif_afh_analytics_dump(int fd);
+
+#endif /* BTIF_AFH_ANALYTICS_H */
@@ -92,6 +92,7 @@ typedef enum {
     BTIF_BA_AUDIO_PAUSE_REQ_EVT,
     BTIF_BA_AUDIO_STOP_REQ_EVT,
     BTIF_BA_API_DEINIT_REQ_EVT,
+    BTIF_BA_API_SET_STREAM_CONFIG_EVT,// additional streams only
 } btif_ba_sm_event_t;
 
 #define ENCRYPTION_KEY_LEN  16
@@ -123,16 +124,40 @@ typedef enum {
 #define A2D_CELT_VBR_MASK         0x01
 //4-7 bytes: actual value of bit rate.
 #define A2D_CELT_BIT_RATE_48_2_5    0x0220EC // 139500
+#define A2D_CELT_BIT_RATE_48_2_0    0x01D4C0 // 120000
+#define A2D_CELT_BIT_RATE_48_1_5    0x017700 // 96000
+#define A2D_CELT_BIT_RATE_48_1_0    0x00FA00 // 64000
 
 #define STREAM_ID_48 1
 #define STREAM_ID_PAUSED 0
 
+// CELT codec configuration of one broadcast stream, values as in codec_info
+typedef struct {
+    uint8_t codec_type;
+    uint8_t sampl_freq;
+    uint8_t ch_mode;
+    uint8_t frame_size;
+    uint8_t complexity;
+    uint8_t prediction_mode;
+    uint8_t vbr_mode;
+    uint32_t bit_rate;
+} btif_ba_codec_cfg_t;
+
+// bytes written by getBACodecConfig and btif_ba_get_stream_codec_config
+#define BA_CODEC_CONFIG_LEN 10
+
 // public ba apis called by other modules.
 btif_ba_state_t btif_ba_get_state();
 void getBACodecConfig(uint8_t* p_codec_config);
-void btif_ba_bta_callback(uint16_t event, uint8_t result);
+void btif_ba_get_stream_codec_config(uint8_t stream_idx,
+                                     uint8_t* p_codec_config);
+uint8_t btif_ba_get_vs_sampl_freq(uint8_t celt_sampl_freq);
+void btif_ba_bta_callback(uint8_t stream_idx, uint16_t event, uint8_t result);
+void btif_ba_report_link_feedback(uint16_t missed_pkts, uint16_t flushed_pkts,
+                                  bool sync_lost);
 void ba_send_message(uint8_t event, uint8_t size, char* ptr, bool is_btif_thread);
 uint16_t btif_get_ba_latency();
+void btif_ba_dump(int fd);
 bool btif_ba_is_active();
 uint8_t btif_ba_get_sample_rate();
 uint8_t btif_ba_get_channel_mode();
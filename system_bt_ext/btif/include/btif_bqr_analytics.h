@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_bqr_analytics.h
+ *
+ *  Description:   Native analytics of Bluetooth Quality Report (BQR) events.
+ *                 Keeps rolling per-link statistics so link health can be
+ *                 queried without going through the framework.
+ *
+ ******************************************************************************/
+
+#ifndef BTIF_BQR_ANALYTICS_H
+#define BTIF_BQR_ANALYTICS_H
+
+#include <stdint.h>
+#include "raw_address.h"
+
+/* Quality report ids, first byte of every BQR sub-event */
+#define BTIF_BQR_ID_MONITOR_MODE 0x01
+#define BTIF_BQR_ID_APPROACH_LSTO 0x02
+#define BTIF_BQR_ID_A2DP_AUDIO_CHOPPY 0x03
+#define BTIF_BQR_ID_SCO_VOICE_CHOPPY 0x04
+#define BTIF_BQR_ID_ROOT_INFLAMMATION 0x05
+
+/* Length of the link quality part of sub-events 0x01 - 0x04 */
+#define BTIF_BQR_LINK_QUALITY_LEN 48
+#define BTIF_BQR_ROOT_INFLAMMATION_LEN 3
+
+#define BTIF_BQR_MAX_LINKS 7
+#define BTIF_BQR_WINDOW_SIZE 32
+
+/* Same order as bt_link_quality_metric_t of the vendor interface */
+typedef enum {
+  BTIF_BQR_METRIC_RSSI = 0,       /* dBm */
+  BTIF_BQR_METRIC_SNR,            /* dB */
+  BTIF_BQR_METRIC_RETRANSMISSION, /* retransmissions per report */
+  BTIF_BQR_METRIC_PACKET_LOSS,    /* no rx + nak per report */
+  BTIF_BQR_METRIC_UNUSED_CHANNELS,/* AFH channels not in use */
+  BTIF_BQR_METRIC_MAX
+} tBTIF_BQR_METRIC;
+
+/* Link quality sub-event (monitor mode, approach LSTO, choppy audio) */
+typedef struct {
+  uint8_t quality_report_id;
+  uint8_t packet_types;
+  uint16_t connection_handle;
+  uint8_t connection_role;
+  int8_t tx_power_level;
+  int8_t rssi;
+  uint8_t snr;
+  uint8_t unused_afh_channel_count;
+  uint8_t afh_select_unideal_channel_count;
+  uint16_t lsto;
+  uint32_t connection_piconet_clock;
+  uint32_t retransmission_count;
+  uint32_t no_rx_count;
+  uint32_t nak_count;
+  uint32_t last_tx_ack_timestamp;
+  uint32_t flow_off_count;
+  uint32_t last_flow_on_timestamp;
+  uint32_t buffer_overflow_bytes;
+  uint32_t buffer_underflow_bytes;
+} tBTIF_BQR_LINK_QUALITY;
+
+typedef struct {
+  uint8_t error_code;
+  uint8_t vendor_error_code;
+} tBTIF_BQR_ROOT_INFLAMMATION;
+
+/* Statistics over the rolling window of one metric of one link */
+typedef struct {
+  uint8_t num_samples;
+  int32_t min;
+  int32_t max;
+  int32_t avg;
+  int32_t p50;
+  int32_t p90;
+  bool breached;          /* average currently past the threshold */
+  uint32_t breach_count;  /* number of times the threshold was crossed */
+} tBTIF_BQR_STATS;
+
+/* Parse helpers, return false if the report is too short */
+bool btif_bqr_parse_link_quality(const uint8_t* p_data, uint32_t len,
+                                 tBTIF_BQR_LINK_QUALITY* p_lq);
+bool btif_bqr_parse_root_inflammation(const uint8_t* p_data, uint32_t len,
+                                      tBTIF_BQR_ROOT_INFLAMMATION* p_ri);
+
+void btif_bqr_analytics_init(void);
+void btif_bqr_analytics_cleanup(void);
+
+/* Feed one raw BQR sub-event received for |bd_addr| */
+void btif_bqr_analytics_process(const RawAddress& bd_addr,
+                                const uint8_t* p_data, uint32_t len);
+
+/* Returns false if no samples of |metric| are known for |bd_addr| */
+bool btif_bqr_analytics_get_stats(const RawAddress& bd_addr,
+                                  tBTIF_BQR_METRIC metric,
+                                  tBTIF_BQR_STATS* p_stats);
+
+void btif_bqr_analytics_dump(int fd);
+
+#endif /* BTIF_BQR_ANALYTICS_H */
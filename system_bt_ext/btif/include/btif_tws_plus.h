@@ -79,6 +79,7 @@ bool btif_tws_plus_set_dev_type(RawAddress *addr, int tws_plus_dev_type);
 bool btif_tws_plus_get_dev_type(RawAddress *addr, int *tws_plus_dev_type);
 
 bool btif_is_tws_plus_device(const RawAddress *remote_bd_addr);
+void btif_tws_plus_forget_device(const RawAddress *addr);
 
 bool btif_tws_plus_derive_link_key ( RawAddress eb_addr, RawAddress peer_eb_addr,
                     LinkKey src_key, tLK_DERIVATION_REASON reason);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_vendor.h
+ *
+ *  Description:   Entry points of the vendor interface used by the rest of
+ *                 the stack.
+ *
+ ******************************************************************************/
+
+#ifndef BTIF_VENDOR_API_H
+#define BTIF_VENDOR_API_H
+
+#include <hardware/vendor.h>
+#include "bt_types.h"
+
+/*******************************************************************************
+ *  Functions
+ ******************************************************************************/
+
+void btif_vendor_iot_device_broadcast_event(RawAddress* bd_addr,
+        uint16_t error, uint16_t error_info, uint32_t event_mask,
+        uint8_t power_level, int8_t rssi, uint8_t link_quality,
+        uint16_t glitch_count);
+void btif_vendor_cleanup_iot_broadcast_timer(void);
+void btif_vendor_bqr_delivery_event(const RawAddress* bd_addr,
+        const uint8_t* bqr_raw_data, uint32_t bqr_raw_data_len);
+void btif_vendor_aptx_tws_delivery_event(const uint8_t* p_data, uint32_t len);
+void btif_vendor_le_acl_disconnected(RawAddress bd_addr);
+
+/* Dumps vendor interface state for dumpsys */
+void btif_vendor_dump(int fd);
+
+#endif /* BTIF_VENDOR_API_H */
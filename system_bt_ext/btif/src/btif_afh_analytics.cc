@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_afh_analytics.cc
+ *
+ *  Description:   Per-link AFH channel map history and Wi-Fi coexistence
+ *                 overlap analytics
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "bt_btif_afh"
+
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+#include "btif_afh_analytics.h"
+#include "osi/include/log.h"
+
+#define BTIF_AFH_BR_EDR_BASE_MHZ 2402
+#define BTIF_AFH_MAP_WORD_BITS 64
+
+typedef struct {
+  bool in_use;
+  uint16_t handle;
+  tBT_TRANSPORT transport;
+  uint8_t num_channels;
+  tBTIF_AFH_CHANNEL_MAP history[BTIF_AFH_HISTORY_SIZE];
+  uint8_t head;
+  uint8_t count;
+  uint16_t good_sum;  /* sum of good channel counts over the history */
+  /* Number of maps in the history in which the channel was excluded */
+  uint8_t bad_count[BTIF_AFH_MAX_CHANNELS];
+} tBTIF_AFH_LINK;
+
+typedef struct {
+  tBT_TRANSPORT transport;
+  uint8_t num_channels;       /* 79 for BR/EDR, 37 for LE */
+  uint8_t good_channels;      /* in the latest map */
+  uint8_t avg_good_channels;  /* over the history */
+  uint8_t num_samples;
+  uint8_t wifi_channels;      /* channels inside the Wi-Fi band */
+  uint8_t wifi_good_channels; /* of those, still in use in the latest map */
+} tBTIF_AFH_LINK_STATS;
+
+typedef struct {
+  tBTIF_AFH_LINK links[BTIF_AFH_MAX_LINKS];
+  uint16_t wifi_low_mhz;
+  uint16_t wifi_high_mhz;
+  std::mutex lock;
+} tBTIF_AFH_CB;
+
+static tBTIF_AFH_CB afh_cb;
+
+static inline bool btif_afh_map_test(const tBTIF_AFH_CHANNEL_MAP* p_map,
+                                     uint8_t ch) {
+  return (p_map->bits[ch / BTIF_AFH_MAP_WORD_BITS] >>
+          (ch % BTIF_AFH_MAP_WORD_BITS)) & 1;
+}
+
+void btif_afh_map_from_stream(tBTIF_AFH_CHANNEL_MAP* p_map,
+                              const uint8_t* p_data, uint8_t len,
+                              uint8_t num_channels) {
+  memset(p_map, 0, sizeof(*p_map));
+  if (len > (num_channels + 7) / 8) len = (num_channels + 7) / 8;
+
+  for (uint8_t i = 0; i < len; i++) {
+    p_map->bits[i / 8] |= (uint64_t)p_data[i] << ((i % 8) * 8);
+  }
+
+  /* Clear the reserved bits above the last channel */
+  if (num_channels < BTIF_AFH_MAP_WORD_BITS) {
+    p_map->bits[0] &= (1ULL << num_channels) - 1;
+    p_map->bits[1] = 0;
+  } else {
+    p_map->bits[1] &= (1ULL << (num_channels - BTIF_AFH_MAP_WORD_BITS)) - 1;
+  }
+}
+
+uint8_t btif_afh_map_count(const tBTIF_AFH_CHANNEL_MAP* p_map) {
+  return (uint8_t)(__builtin_popcountll(p_map->bits[0]) +
+                   __builtin_popcountll(p_map->bits[1]));
+}
+
+/* Center frequency of channel |ch|, LE uses the data channel numbering */
+static uint16_t btif_afh_channel_mhz(tBT_TRANSPORT transport, uint8_t ch) {
+  if (transport != BT_TRANSPORT_LE) return BTIF_AFH_BR_EDR_BASE_MHZ + ch;
+  /* 2404 - 2424 MHz for 0 - 10, 2428 - 2478 MHz for 11 - 36 */
+  return (ch <= 10) ? 2404 + 2 * ch : 2428 + 2 * (ch - 11);
+}
+
+/* Must be called with afh_cb.lock held */
+static tBTIF_AFH_LINK* btif_afh_find_link(uint16_t handle) {
+  for (int i = 0; i < BTIF_AFH_MAX_LINKS; i++) {
+    if (afh_cb.links[i].in_use && afh_cb.links[i].handle == handle)
+      return &afh_cb.links[i];
+  }
+  return NULL;
+}
+
+/* Must be called with afh_cb.lock held */
+static void btif_afh_link_stats(const tBTIF_AFH_LINK* p_link,
+                                tBTIF_AFH_LINK_STATS* p_stats) {
+  const tBTIF_AFH_CHANNEL_MAP* p_last =
+      &p_link->history[(p_link->head + BTIF_AFH_HISTORY_SIZE - 1) %
+                       BTIF_AFH_HISTORY_SIZE];
+
+  memset(p_stats, 0, sizeof(*p_stats));
+  p_stats->transport = p_link->transport;
+  p_stats->num_channels = p_link->num_channels;
+  p_stats->num_samples = p_link->count;
+  if (p_link->count == 0) return;
+
+  p_stats->good_channels = btif_afh_map_count(p_last);
+  p_stats->avg_good_channels = p_link->good_sum / p_link->count;
+
+  if (afh_cb.wifi_high_mhz == 0) return;
+  for (uint8_t ch = 0; ch < p_link->num_channels; ch++) {
+    uint16_t mhz = btif_afh_channel_mhz(p_link->transport, ch);
+    if (mhz < afh_cb.wifi_low_mhz || mhz > afh_cb.wifi_high_mhz) continue;
+    p_stats->wifi_channels++;
+    if (btif_afh_map_test(p_last, ch)) p_stats->wifi_good_channels++;
+  }
+}
+
+void btif_afh_analytics_init(void) {
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+
+  memset(afh_cb.links, 0, sizeof(afh_cb.links));
+}
+
+void btif_afh_analytics_cleanup(void) {
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+
+  memset(afh_cb.links, 0, sizeof(afh_cb.links));
+  afh_cb.wifi_low_mhz = 0;
+  afh_cb.wifi_high_mhz = 0;
+}
+
+/*******************************************************************************
+**
+** Function         btif_afh_analytics_update
+**
+** Description      Adds a channel map read from the controller to the
+**                  history of the link and updates the per-channel heatmap
+**
+** Returns          void
+**
+*******************************************************************************/
+void btif_afh_analytics_update(uint16_t handle, tBT_TRANSPORT transport,
+                               const uint8_t* p_data, uint8_t len) {
+  tBTIF_AFH_CHANNEL_MAP map;
+  tBTIF_AFH_LINK* p_link;
+  uint8_t num_channels = (transport == BT_TRANSPORT_LE)
+                             ? BTIF_AFH_LE_NUM_CHANNELS
+                             : BTIF_AFH_BR_EDR_NUM_CHANNELS;
+
+  if (p_data == NULL || len == 0) return;
+  btif_afh_map_from_stream(&map, p_data, len, num_channels);
+
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+  p_link = btif_afh_find_link(handle);
+  for (int i = 0; i < BTIF_AFH_MAX_LINKS && p_link == NULL; i++) {
+    if (!afh_cb.links[i].in_use) p_link = &afh_cb.links[i];
+  }
+  if (p_link == NULL) {
+    LOG_WARN(LOG_TAG, "%s: no room for handle 0x%04x", __func__, handle);
+    return;
+  }
+  if (!p_link->in_use || p_link->transport != transport) {
+    memset(p_link, 0, sizeof(*p_link));
+    p_link->in_use = true;
+    p_link->handle = handle;
+    p_link->transport = transport;
+    p_link->num_channels = num_channels;
+  }
+
+  /* Drop the oldest map from the running counts before overwriting it */
+  if (p_link->count == BTIF_AFH_HISTORY_SIZE) {
+    const tBTIF_AFH_CHANNEL_MAP* p_old = &p_link->history[p_link->head];
+    p_link->good_sum -= btif_afh_map_count(p_old);
+    for (uint8_t ch = 0; ch < num_channels; ch++) {
+      if (!btif_afh_map_test(p_old, ch)) p_link->bad_count[ch]--;
+    }
+  } else {
+    p_link->count++;
+  }
+
+  p_link->history[p_link->head] = map;
+  p_link->head = (p_link->head + 1) % BTIF_AFH_HISTORY_SIZE;
+  p_link->good_sum += btif_afh_map_count(&map);
+  for (uint8_t ch = 0; ch < num_channels; ch++) {
+    if (!btif_afh_map_test(&map, ch)) p_link->bad_count[ch]++;
+  }
+}
+
+void btif_afh_analytics_retain(const uint16_t* p_handles,
+                               uint8_t num_handles) {
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+
+  for (int i = 0; i < BTIF_AFH_MAX_LINKS; i++) {
+    tBTIF_AFH_LINK* p_link = &afh_cb.links[i];
+    bool found = false;
+
+    if (!p_link->in_use) continue;
+    for (uint8_t j = 0; j < num_handles && !found; j++) {
+      found = (p_handles[j] == p_link->handle);
+    }
+    if (!found) p_link->in_use = false;
+  }
+}
+
+void btif_afh_analytics_set_wifi_channel(uint16_t center_mhz,
+                                         uint16_t width_mhz) {
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+
+  if (center_mhz == 0) {
+    afh_cb.wifi_low_mhz = 0;
+    afh_cb.wifi_high_mhz = 0;
+    return;
+  }
+  afh_cb.wifi_low_mhz = center_mhz - width_mhz / 2;
+  afh_cb.wifi_high_mhz = center_mhz + width_mhz / 2;
+}
+
+void btif_afh_analytics_dump(int fd) {
+  std::unique_lock<std::mutex> guard(afh_cb.lock);
+  tBTIF_AFH_LINK_STATS stats;
+
+  dprintf(fd, "\nAFH channel map analytics:\n");
+  if (afh_cb.wifi_high_mhz)
+    dprintf(fd, "  Wi-Fi band: %u - %u MHz\n", afh_cb.wifi_low_mhz,
+            afh_cb.wifi_high_mhz);
+
+  for (int i = 0; i < BTIF_AFH_MAX_LINKS; i++) {
+    tBTIF_AFH_LINK* p_link = &afh_cb.links[i];
+    if (!p_link->in_use) continue;
+
+    btif_afh_link_stats(p_link, &stats);
+    dprintf(fd, "  handle 0x%04x %s: good %u/%u, avg %u over %u maps",
+            p_link->handle,
+            p_link->transport == BT_TRANSPORT_LE ? "LE" : "BR/EDR",
+            stats.good_channels, stats.num_channels, stats.avg_good_channels,
+            stats.num_samples);
+    if (stats.wifi_channels)
+      dprintf(fd, ", Wi-Fi overlap %u/%u in use", stats.wifi_good_channels,
+              stats.wifi_channels);
+    dprintf(fd, "\n    excluded %%:");
+    for (uint8_t ch = 0; ch < p_link->num_channels; ch++) {
+      if (ch % 20 == 0) dprintf(fd, "\n     ");
+      dprintf(fd, " %3u", (p_link->bad_count[ch] * 100) / p_link->count);
+    }
+    dprintf(fd, "\n");
+  }
+}
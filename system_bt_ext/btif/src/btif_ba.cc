@@ -28,6 +28,7 @@
  */
 
 #include <hardware/bt_ba.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -51,11 +52,17 @@
 #include "bta_bat.h"
 #include "btif_av.h"
 #include "btif_config.h"
+#include "osi/include/osi.h"
+#include "osi/include/alarm.h"
+#include "osi/include/time.h"
 
 extern void btif_av_trigger_suspend();
 
 static ba_transmitter_callbacks_t *ba_transmitter_callback = NULL;
 
+static_assert(BA_MAX_STREAMS == BTA_BA_MAX_STREAMS,
+              "HAL and BTA must agree on number of broadcast streams");
+
 
 #define MSG_QUE_LEN 100
 
@@ -70,14 +77,7 @@ typedef struct {
     uint8_t encryption_key[ENCRYPTION_KEY_LEN];
     uint8_t div[DIV_KEY_LEN];
     uint8_t active_stream_id;
-    uint32_t bit_rate;
-    uint8_t codec_type;
-    uint8_t sampl_freq;
-    uint8_t ch_mode;
-    uint8_t frame_size;
-    uint8_t complexity;
-    uint8_t prediction_mode;
-    uint8_t vbr_mode;
+    btif_ba_codec_cfg_t codec;
     uint8_t audio_cmd_pending;
     uint8_t curr_vol_level;
     uint8_t max_vol_level;
@@ -85,9 +85,50 @@ typedef struct {
 }btif_ba_cb_t;
 
 static btif_ba_cb_t btif_ba_cb = {
-    NULL,{0},{0},0,0,0,0,0,0,0,0,0,0,0,0,0
+    NULL,{0},{0},0,{0,0,0,0,0,0,0,0},0,0,0,0
     };
 
+/*
+ * Additional broadcast streams. Primary stream is driven by the audio HAL
+ * through the state machine above, these are driven by the app only and
+ * move towards target_state one BTA transition at a time.
+ */
+typedef struct {
+    ba_state_t state;
+    uint8_t target_state;// BA_STREAM_REQ_*
+    uint8_t encryption_key[ENCRYPTION_KEY_LEN];
+    uint8_t div[DIV_KEY_LEN];
+    uint8_t curr_vol_level;
+    uint8_t max_vol_level;
+    btif_ba_codec_cfg_t codec;
+}btif_ba_stream_t;
+
+// time the primary stream spends in PENDING, per [from state][to state].
+// Covers the whole BTA command sequence of enable, stream, pause and stop.
+#define BTIF_BA_NUM_STATES (BTIF_BA_STATE_STREAMING_AUDIO_NS + 1)
+typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+}btif_ba_transition_stats_t;
+
+static btif_ba_transition_stats_t
+    btif_ba_trans_stats[BTIF_BA_NUM_STATES][BTIF_BA_NUM_STATES];
+static uint64_t btif_ba_trans_start_us = 0;
+static uint8_t btif_ba_trans_from = BTIF_BA_STATE_IDLE_AUDIO_NS;
+
+// entry BTA_BA_PRIMARY_STREAM is unused, primary stream lives in btif_ba_cb
+static btif_ba_stream_t btif_ba_streams[BTA_BA_MAX_STREAMS];
+
+// context switch payload for BTA responses and per stream requests.
+// data comes first so that state handlers can keep reading it as uint8_t.
+typedef struct {
+    uint8_t data;
+    uint8_t stream_idx;
+    uint8_t max_vol;
+    btif_ba_codec_cfg_t codec;
+}btif_ba_stream_evt_t;
+
 static bool btif_ba_state_idle_audio_ns_handler(btif_sm_event_t event,
     void* data, int idx);
 static bool btif_ba_state_idle_audio_pending_handler(btif_sm_event_t event,
@@ -156,23 +197,73 @@ const char* dump_ba_sm_event_name(btif_ba_sm_event_t event) {
   }
 }
 
+const char* dump_ba_state_name(uint8_t state) {
+  switch (state) {
+    CASE_RETURN_STR(BTIF_BA_STATE_IDLE_AUDIO_PENDING)
+    CASE_RETURN_STR(BTIF_BA_STATE_IDLE_AUDIO_STREAMING)
+    CASE_RETURN_STR(BTIF_BA_STATE_IDLE_AUDIO_NS)
+    CASE_RETURN_STR(BTIF_BA_STATE_PENDING_AUDIO_NS)
+    CASE_RETURN_STR(BTIF_BA_STATE_PAUSED_AUDIO_NS)
+    CASE_RETURN_STR(BTIF_BA_STATE_STREAMING_AUDIO_NS)
+    default:
+      return "UNKNOWN_STATE";
+  }
+}
+
+static void btif_ba_streams_reset();
+static void btif_ba_dump_transition_stats();
+static void btif_ba_send_codec(uint8_t stream_idx,
+                               const btif_ba_codec_cfg_t* p_codec);
+static void btif_ba_rate_ctrl_init();
+static void btif_ba_rate_ctrl_cleanup();
+static void btif_ba_rate_ctrl_reset();
+static void btif_ba_rate_ctrl_start();
+static void btif_ba_rate_ctrl_stop();
+static void btif_ba_notify_codec(uint8_t stream_idx);
+
 static void btif_ba_handle_event(uint16_t event, char* p_param) {
     BTIF_TRACE_EVENT("%s  event = %d", __FUNCTION__, event);
+    if (event == BTIF_BA_API_DEINIT_REQ_EVT) {
+        // BTA stops every enabled stream before it deregisters
+        btif_ba_streams_reset();
+        btif_ba_rate_ctrl_cleanup();
+        btif_ba_dump_transition_stats();
+    }
     btif_sm_dispatch(btif_ba_cb.sm_handle, event, (void*)p_param);
 }
 
-void btif_ba_bta_callback(uint16_t event, uint8_t result)
+static void btif_ba_stream_handle_event(uint16_t event, char* p_param);
+
+static void btif_ba_handle_bta_event(uint16_t event, char* p_param) {
+    btif_ba_stream_evt_t* p_evt = (btif_ba_stream_evt_t*)p_param;
+    BTIF_TRACE_EVENT("%s  event = %d stream = %d", __FUNCTION__, event,
+                                                    p_evt->stream_idx);
+    if (p_evt->stream_idx == BTA_BA_PRIMARY_STREAM) {
+        btif_sm_dispatch(btif_ba_cb.sm_handle, event, (void*)&p_evt->data);
+    } else {
+        btif_ba_stream_handle_event(event, p_param);
+    }
+}
+
+void btif_ba_bta_callback(uint8_t stream_idx, uint16_t event, uint8_t result)
 {
-    BTIF_TRACE_DEBUG(" %s  event = %d, result = %x ",__FUNCTION__, event, result);
+    BTIF_TRACE_DEBUG(" %s stream = %d event = %d, result = %x ",__FUNCTION__,
+                                                  stream_idx, event, result);
+    btif_ba_stream_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
     if(result != BT_STATUS_SUCCESS)
       result = BT_STATUS_FAIL;// right now we are using just success and fail
-    btif_transfer_context(btif_ba_handle_event, event,
-        (char*)&result, sizeof(uint8_t), NULL);
+    evt.data = result;
+    evt.stream_idx = stream_idx;
+    btif_transfer_context(btif_ba_handle_bta_event, event,
+        (char*)&evt, sizeof(evt), NULL);
 }
 static bt_status_t bat_init( ba_transmitter_callbacks_t* callbacks)
 {
     LOG_INFO(LOG_TAG,"bat_init");
     ba_transmitter_callback = callbacks;
+    btif_ba_streams_reset();
+    btif_ba_rate_ctrl_init();
     btif_ba_cb.sm_handle = btif_sm_init(
      (const btif_sm_handler_t*)btif_ba_state_handlers, BTIF_BA_STATE_IDLE_AUDIO_NS, 0);
     btif_transfer_context(btif_ba_handle_event, BTIF_BA_API_INIT_REQ_EVT,
@@ -214,6 +305,94 @@ static bt_status_t set_volume(uint8_t vol, uint8_t max_vol)
     return BT_STATUS_SUCCESS;
 }
 
+static bool btif_ba_is_valid_ext_stream(uint8_t stream)
+{
+    if ((stream == BTA_BA_PRIMARY_STREAM) || (stream >= BTA_BA_MAX_STREAMS)) {
+        BTIF_TRACE_ERROR(" %s invalid stream %d ", __FUNCTION__, stream);
+        return false;
+    }
+    return true;
+}
+
+static bt_status_t set_stream_config(uint8_t stream,
+                                     const ba_stream_config_t* config)
+{
+    btif_ba_stream_evt_t evt;
+    BTIF_TRACE_DEBUG(" %s stream = %d ", __FUNCTION__, stream);
+    if (!btif_ba_is_valid_ext_stream(stream) || (config == NULL))
+        return BT_STATUS_PARM_INVALID;
+    memset(&evt, 0, sizeof(evt));
+    evt.stream_idx = stream;
+    evt.codec.codec_type = CODEC_TYPE_CELT;
+    evt.codec.complexity = A2D_CELT_COMPLEXITY_BA;
+    evt.codec.bit_rate = config->bit_rate;
+    switch (config->sample_rate) {
+      case 32000: evt.codec.sampl_freq = A2D_CELT_SAMP_FREQ_32; break;
+      case 44100: evt.codec.sampl_freq = A2D_CELT_SAMP_FREQ_44; break;
+      case 48000: evt.codec.sampl_freq = A2D_CELT_SAMP_FREQ_48; break;
+      default: return BT_STATUS_PARM_INVALID;
+    }
+    switch (config->channel_mode) {
+      case 1: evt.codec.ch_mode = A2D_CELT_CH_MONO; break;
+      case 2: evt.codec.ch_mode = A2D_CELT_CH_STEREO; break;
+      default: return BT_STATUS_PARM_INVALID;
+    }
+    switch (config->frame_size) {
+      case 64: evt.codec.frame_size = A2D_CELT_FRAME_SIZE_64; break;
+      case 128: evt.codec.frame_size = A2D_CELT_FRAME_SIZE_128; break;
+      case 256: evt.codec.frame_size = A2D_CELT_FRAME_SIZE_256; break;
+      case 512: evt.codec.frame_size = A2D_CELT_FRAME_SIZE_512; break;
+      default: return BT_STATUS_PARM_INVALID;
+    }
+    btif_transfer_context(btif_ba_stream_handle_event,
+        BTIF_BA_API_SET_STREAM_CONFIG_EVT, (char*)&evt, sizeof(evt), NULL);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t set_stream_state(uint8_t stream, uint8_t state)
+{
+    btif_ba_stream_evt_t evt;
+    BTIF_TRACE_DEBUG(" %s stream = %d state = %d", __FUNCTION__, stream, state);
+    if (!btif_ba_is_valid_ext_stream(stream) ||
+        (state > BA_STREAM_REQ_STREAM))
+        return BT_STATUS_PARM_INVALID;
+    memset(&evt, 0, sizeof(evt));
+    evt.stream_idx = stream;
+    evt.data = state;
+    btif_transfer_context(btif_ba_stream_handle_event,
+        BTIF_BA_API_SET_STATE_START_REQ_EVT, (char*)&evt, sizeof(evt), NULL);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t refresh_stream_enc_key(uint8_t stream)
+{
+    btif_ba_stream_evt_t evt;
+    BTIF_TRACE_DEBUG(" %s stream = %d ", __FUNCTION__, stream);
+    if (!btif_ba_is_valid_ext_stream(stream))
+        return BT_STATUS_PARM_INVALID;
+    memset(&evt, 0, sizeof(evt));
+    evt.stream_idx = stream;
+    btif_transfer_context(btif_ba_stream_handle_event,
+        BTIF_BA_API_REFRESH_ENC_KEY_REQ_EVT, (char*)&evt, sizeof(evt), NULL);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t set_stream_vol(uint8_t stream, uint8_t vol, uint8_t max_vol)
+{
+    btif_ba_stream_evt_t evt;
+    BTIF_TRACE_DEBUG(" %s stream = %d vol = %d max_vol = %d", __FUNCTION__,
+                                                       stream, vol, max_vol);
+    if (!btif_ba_is_valid_ext_stream(stream))
+        return BT_STATUS_PARM_INVALID;
+    memset(&evt, 0, sizeof(evt));
+    evt.stream_idx = stream;
+    evt.data = vol;
+    evt.max_vol = max_vol;
+    btif_transfer_context(btif_ba_stream_handle_event,
+        BTIF_BA_API_SET_VOL_LEVEL, (char*)&evt, sizeof(evt), NULL);
+    return BT_STATUS_SUCCESS;
+}
+
 static void cleanup(void)
 {
     LOG_INFO(LOG_TAG,"cleanup");
@@ -230,6 +409,10 @@ static const ba_transmitter_interface_t batInterface = {
     refresh_enc_key,
     set_volume,
     cleanup,
+    set_stream_config,
+    set_stream_state,
+    refresh_stream_enc_key,
+    set_stream_vol,
 };
 
 /*******************************************************************************
@@ -279,6 +462,28 @@ uint16_t btif_get_ba_latency() {
     return (VS_HCI_TTP_OFFSET/1000);
 }
 
+/*******************************************************************************
+**
+** Function         btif_ba_dump
+**
+** Description      Dumps the BA state and the vol/enc key update counters of
+**                  the BTA BA layer for dumpsys
+**
+** Returns          void
+**
+*******************************************************************************/
+void btif_ba_dump(int fd)
+{
+    tBTA_BA_UPDATE_STATS stats;
+
+    BTA_BAGetUpdateStats(&stats);
+    dprintf(fd, "\nBA state: %s\n", dump_ba_state_name(btif_ba_get_state()));
+    dprintf(fd, "  volume updates: %u sent, %u coalesced\n",
+            stats.vol_updates_sent, stats.vol_updates_coalesced);
+    dprintf(fd, "  encryption key updates: %u sent, %u coalesced\n",
+            stats.enc_key_updates_sent, stats.enc_key_updates_coalesced);
+}
+
 void ba_send_message(uint8_t event, uint8_t size, char* ptr, bool is_btif_thread)
 {
     if (ba_transmitter_callback == NULL)
@@ -338,23 +543,23 @@ void ba_acknowledge_audio_cmd(uint8_t pending_cmd, uint8_t result)
     }
 }
 
-void getBACodecConfig(uint8_t* p_codec_config)
+static void ba_pack_codec_config(const btif_ba_codec_cfg_t* p_codec,
+                                 uint8_t* p_codec_config)
 {
-    dump_curr_codec_config();
-    uint32_t bit_rate = btif_ba_cb.bit_rate;
+    uint32_t bit_rate = p_codec->bit_rate;
     //media codec header
     *p_codec_config = 10; p_codec_config ++;// len of codec values
     *p_codec_config = 0; p_codec_config ++;// media_type = 0: Audio
-    *p_codec_config = btif_ba_cb.codec_type; p_codec_config ++;// codec_type
+    *p_codec_config = p_codec->codec_type; p_codec_config ++;// codec_type
     // codec info element
-    *p_codec_config = btif_ba_cb.sampl_freq;// freq
-    *p_codec_config |= btif_ba_cb.ch_mode; // channel mode
+    *p_codec_config = p_codec->sampl_freq;// freq
+    *p_codec_config |= p_codec->ch_mode; // channel mode
     p_codec_config ++;
-    *p_codec_config = btif_ba_cb.frame_size; // fr_aize
-    *p_codec_config |= btif_ba_cb.complexity; // complexity
+    *p_codec_config = p_codec->frame_size; // fr_aize
+    *p_codec_config |= p_codec->complexity; // complexity
     p_codec_config ++;
-    *p_codec_config = btif_ba_cb.prediction_mode;//prediction mode.
-    *p_codec_config |= btif_ba_cb.vbr_mode; // vbr mask
+    *p_codec_config = p_codec->prediction_mode;//prediction mode.
+    *p_codec_config |= p_codec->vbr_mode; // vbr mask
     p_codec_config ++;
     // next 4 bytes for bit rate.
     *p_codec_config = bit_rate >> 24;p_codec_config ++;
@@ -363,39 +568,108 @@ void getBACodecConfig(uint8_t* p_codec_config)
     *p_codec_config = bit_rate;p_codec_config ++;
 }
 
+void getBACodecConfig(uint8_t* p_codec_config)
+{
+    dump_curr_codec_config();
+    ba_pack_codec_config(&btif_ba_cb.codec, p_codec_config);
+}
+
+void btif_ba_get_stream_codec_config(uint8_t stream_idx,
+                                     uint8_t* p_codec_config)
+{
+    if (stream_idx == BTA_BA_PRIMARY_STREAM) {
+        getBACodecConfig(p_codec_config);
+        return;
+    }
+    if (stream_idx >= BTA_BA_MAX_STREAMS) {
+        BTIF_TRACE_ERROR(" %s invalid stream %d ", __FUNCTION__, stream_idx);
+        return;
+    }
+    ba_pack_codec_config(&btif_ba_streams[stream_idx].codec, p_codec_config);
+}
+
+uint8_t btif_ba_get_vs_sampl_freq(uint8_t celt_sampl_freq)
+{
+    if (celt_sampl_freq == A2D_CELT_SAMP_FREQ_44)
+        return VS_HCI_SAMPLING_FREQ_44;
+    return VS_HCI_SAMPLING_FREQ_48;
+}
+
 uint8_t btif_ba_get_sample_rate()
 {
-  return btif_ba_cb.sampl_freq;
+  return btif_ba_cb.codec.sampl_freq;
 }
 
 uint8_t btif_ba_get_channel_mode()
 {
-  return btif_ba_cb.ch_mode;
+  return btif_ba_cb.codec.ch_mode;
 }
 
 uint8_t btif_ba_get_frame_size()
 {
-  return btif_ba_cb.frame_size;
+  return btif_ba_cb.codec.frame_size;
 }
 
 uint8_t btif_ba_get_complexity()
 {
-  return btif_ba_cb.complexity;
+  return btif_ba_cb.codec.complexity;
 }
 
 uint8_t btif_ba_get_prediction_mode()
 {
-  return btif_ba_cb.prediction_mode;
+  return btif_ba_cb.codec.prediction_mode;
 }
 
 uint8_t btif_ba_get_vbr_flag()
 {
-  return btif_ba_cb.vbr_mode;
+  return btif_ba_cb.codec.vbr_mode;
 }
 
 uint32_t btif_ba_get_bitrate()
 {
-  return btif_ba_cb.bit_rate;
+  return btif_ba_cb.codec.bit_rate;
+}
+
+// called on entering a stable state, accounts the transition if it went
+// through PENDING.
+static void btif_ba_transition_done(uint8_t to_state)
+{
+    if (btif_ba_trans_start_us == 0)
+        return;
+    uint64_t elapsed_us = time_get_os_boottime_us() - btif_ba_trans_start_us;
+    btif_ba_trans_start_us = 0;
+    if ((btif_ba_trans_from >= BTIF_BA_NUM_STATES) ||
+        (to_state >= BTIF_BA_NUM_STATES))
+        return;
+    btif_ba_transition_stats_t* p_stats =
+        &btif_ba_trans_stats[btif_ba_trans_from][to_state];
+    p_stats->count++;
+    p_stats->total_us += elapsed_us;
+    if (elapsed_us > p_stats->max_us)
+        p_stats->max_us = elapsed_us;
+    BTIF_TRACE_DEBUG(" %s %s -> %s took %llu us (avg %llu max %llu over %d)",
+        __FUNCTION__, dump_ba_state_name(btif_ba_trans_from),
+        dump_ba_state_name(to_state), (unsigned long long)elapsed_us,
+        (unsigned long long)(p_stats->total_us / p_stats->count),
+        (unsigned long long)p_stats->max_us, p_stats->count);
+}
+
+static void btif_ba_dump_transition_stats()
+{
+    for (uint8_t from = 0; from < BTIF_BA_NUM_STATES; from++) {
+        for (uint8_t to = 0; to < BTIF_BA_NUM_STATES; to++) {
+            btif_ba_transition_stats_t* p_stats = &btif_ba_trans_stats[from][to];
+            if (p_stats->count == 0)
+                continue;
+            LOG_INFO(LOG_TAG, "%s: %s -> %s count %d avg %llu us max %llu us",
+                __func__, dump_ba_state_name(from), dump_ba_state_name(to),
+                p_stats->count,
+                (unsigned long long)(p_stats->total_us / p_stats->count),
+                (unsigned long long)p_stats->max_us);
+        }
+    }
+    memset(btif_ba_trans_stats, 0, sizeof(btif_ba_trans_stats));
+    btif_ba_trans_start_us = 0;
 }
 
 static void memorize_msg(uint8_t event, btif_ba_state_t state)
@@ -516,14 +790,14 @@ void refresh_stream_id(bool ba_streaming)
 }
 
 void dump_curr_codec_config() {
-    BTIF_TRACE_DEBUG(" codec_type = %x = %d", btif_ba_cb.codec_type, btif_ba_cb.codec_type);
-    BTIF_TRACE_DEBUG(" bit_rate = %x = %d", btif_ba_cb.bit_rate, btif_ba_cb.bit_rate);
-    BTIF_TRACE_DEBUG(" channel mode = %x = %d", btif_ba_cb.ch_mode, btif_ba_cb.ch_mode);
-    BTIF_TRACE_DEBUG(" complexity = %x = %d", btif_ba_cb.complexity, btif_ba_cb.complexity);
-    BTIF_TRACE_DEBUG(" fr_size = %x = %d", btif_ba_cb.frame_size, btif_ba_cb.frame_size);
-    BTIF_TRACE_DEBUG(" prediction_mode = %x = %d", btif_ba_cb.prediction_mode, btif_ba_cb.prediction_mode);
-    BTIF_TRACE_DEBUG(" sampl_freq = %x = %d", btif_ba_cb.sampl_freq, btif_ba_cb.sampl_freq);
-    BTIF_TRACE_DEBUG(" vbr_mode = %x = %d", btif_ba_cb.vbr_mode, btif_ba_cb.vbr_mode);
+    BTIF_TRACE_DEBUG(" codec_type = %x = %d", btif_ba_cb.codec.codec_type, btif_ba_cb.codec.codec_type);
+    BTIF_TRACE_DEBUG(" bit_rate = %x = %d", btif_ba_cb.codec.bit_rate, btif_ba_cb.codec.bit_rate);
+    BTIF_TRACE_DEBUG(" channel mode = %x = %d", btif_ba_cb.codec.ch_mode, btif_ba_cb.codec.ch_mode);
+    BTIF_TRACE_DEBUG(" complexity = %x = %d", btif_ba_cb.codec.complexity, btif_ba_cb.codec.complexity);
+    BTIF_TRACE_DEBUG(" fr_size = %x = %d", btif_ba_cb.codec.frame_size, btif_ba_cb.codec.frame_size);
+    BTIF_TRACE_DEBUG(" prediction_mode = %x = %d", btif_ba_cb.codec.prediction_mode, btif_ba_cb.codec.prediction_mode);
+    BTIF_TRACE_DEBUG(" sampl_freq = %x = %d", btif_ba_cb.codec.sampl_freq, btif_ba_cb.codec.sampl_freq);
+    BTIF_TRACE_DEBUG(" vbr_mode = %x = %d", btif_ba_cb.codec.vbr_mode, btif_ba_cb.codec.vbr_mode);
 }
 
 static bool btif_ba_state_idle_audio_pending_handler(btif_sm_event_t event,
@@ -541,7 +815,6 @@ static bool btif_ba_state_idle_audio_pending_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_API_DEINIT_REQ_EVT:
             BTA_BADeregister();
-            BTA_BADisable();
             break;
         case BTIF_BA_API_SET_STATE_START_REQ_EVT:
             memorize_msg(event, BTIF_BA_STATE_IDLE_AUDIO_PENDING);
@@ -600,7 +873,6 @@ static bool btif_ba_state_idle_audio_streaming_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_API_DEINIT_REQ_EVT:
             BTA_BADeregister();
-            BTA_BADisable();
             break;
         case BTIF_BA_BT_A2DP_DISC_EVT:
         case BTIF_BA_BT_A2DP_PAUSED_EVT:
@@ -644,14 +916,16 @@ static bool btif_ba_state_idle_audio_ns_handler(btif_sm_event_t event,
     {
         case BTIF_SM_ENTER_EVT:
              btif_ba_cb.active_stream_id = STREAM_ID_PAUSED;
-             btif_ba_cb.bit_rate = A2D_CELT_BIT_RATE_48_2_5;
-             btif_ba_cb.ch_mode = A2D_CELT_CH_STEREO;
-             btif_ba_cb.codec_type = CODEC_TYPE_CELT;
-             btif_ba_cb.complexity = A2D_CELT_COMPLEXITY_BA;
-             btif_ba_cb.frame_size = A2D_CELT_FRAME_SIZE_512;
-             btif_ba_cb.prediction_mode = 0;
-             btif_ba_cb.sampl_freq = A2D_CELT_SAMP_FREQ_48;
-             btif_ba_cb.vbr_mode = 0;
+             btif_ba_cb.codec.bit_rate = A2D_CELT_BIT_RATE_48_2_5;
+             btif_ba_cb.codec.ch_mode = A2D_CELT_CH_STEREO;
+             btif_ba_cb.codec.codec_type = CODEC_TYPE_CELT;
+             btif_ba_cb.codec.complexity = A2D_CELT_COMPLEXITY_BA;
+             btif_ba_cb.codec.frame_size = A2D_CELT_FRAME_SIZE_512;
+             btif_ba_cb.codec.prediction_mode = 0;
+             btif_ba_cb.codec.sampl_freq = A2D_CELT_SAMP_FREQ_48;
+             btif_ba_cb.codec.vbr_mode = 0;
+             btif_ba_rate_ctrl_reset();
+             btif_ba_transition_done(BTIF_BA_STATE_IDLE_AUDIO_NS);
              HAL_CBACK(ba_transmitter_callback, state_cb, BA_STATE_IDLE);
              handle_memorized_msgs();
              dump_curr_codec_config();
@@ -663,7 +937,6 @@ static bool btif_ba_state_idle_audio_ns_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_API_DEINIT_REQ_EVT:
             BTA_BADeregister();
-            BTA_BADisable();
             break;
         case BTIF_BA_API_SET_VOL_LEVEL:
              // just cache vol level here. BA is not enabled even here
@@ -719,6 +992,8 @@ static bool btif_ba_state_pending_audio_ns_handler(btif_sm_event_t event,
              * Pending state. Audio_pending and Enable_pending.Better send
              * from place where its triggered from
              */
+            btif_ba_trans_start_us = time_get_os_boottime_us();
+            btif_ba_trans_from = btif_ba_cb.prev_state;
             break;
         case BTIF_BA_API_SET_STATE_START_REQ_EVT:
         case BTIF_BA_API_SET_STATE_STOP_REQ_EVT:
@@ -729,27 +1004,31 @@ static bool btif_ba_state_pending_audio_ns_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_API_DEINIT_REQ_EVT:
             BTA_BADeregister();
-            BTA_BADisable();
             break;
         case BTIF_BA_BT_A2DP_STARTED_EVT:
         case BTIF_BA_BT_A2DP_STARTING_EVT:
             BTIF_TRACE_DEBUG("  %s This shld not happen ", __FUNCTION__);
             break;
-            // we might be waiting for some commands from BTA. so memorize
-            // this command.
+            // BTA keeps the latest vol level while other commands are in
+            // flight and sends it once they are done, no need to memorize.
         case BTIF_BA_API_SET_VOL_LEVEL:
              btif_ba_cb.curr_vol_level = *((uint8_t*)p_data);
              BTIF_TRACE_DEBUG("%s: curr_vol_level: %d",
                               __FUNCTION__, btif_ba_cb.curr_vol_level);
-             memorize_msg(event, BTIF_BA_STATE_PENDING_AUDIO_NS);
+             BTA_SetVol(BTA_BA_PRIMARY_STREAM, btif_ba_cb.curr_vol_level);
              break;
         case BTIF_BA_CMD_PAUSE_REQ_EVT:
-            if (*((uint8_t*)p_data))
-              BTA_PauseBA(true, &btif_ba_cb.encryption_key[0],
-                                &btif_ba_cb.div[0], btif_ba_cb.curr_vol_level);
-            else
-              BTA_PauseBA(false, &btif_ba_cb.encryption_key[0],
-                               &btif_ba_cb.div[0], btif_ba_cb.curr_vol_level);
+            if (*((uint8_t*)p_data)) {
+              btif_ba_send_codec(BTA_BA_PRIMARY_STREAM, &btif_ba_cb.codec);
+              BTA_PauseBA(BTA_BA_PRIMARY_STREAM, true,
+                 &btif_ba_cb.encryption_key[0], &btif_ba_cb.div[0],
+                 btif_ba_cb.curr_vol_level,
+                 btif_ba_get_vs_sampl_freq(btif_ba_cb.codec.sampl_freq));
+            } else
+              BTA_PauseBA(BTA_BA_PRIMARY_STREAM, false,
+                 &btif_ba_cb.encryption_key[0], &btif_ba_cb.div[0],
+                 btif_ba_cb.curr_vol_level,
+                 btif_ba_get_vs_sampl_freq(btif_ba_cb.codec.sampl_freq));
             break;
         case BTIF_BA_RSP_PAUSE_DONE_EVT:
 
@@ -792,7 +1071,7 @@ static bool btif_ba_state_pending_audio_ns_handler(btif_sm_event_t event,
             }
             break;
         case BTIF_BA_CMD_STREAM_REQ_EVT:
-            BTA_StreamBA();
+            BTA_StreamBA(BTA_BA_PRIMARY_STREAM);
             break;
         case BTIF_BA_RSP_STREAM_DONE_EVT:
             btif_sm_change_state(btif_ba_cb.sm_handle,
@@ -802,7 +1081,7 @@ static bool btif_ba_state_pending_audio_ns_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_CMD_STOP_REQ_EVT:
             refresh_div(false);
-            BTA_StopBA();
+            BTA_StopBA(BTA_BA_PRIMARY_STREAM);
             break;
         case BTIF_BA_RSP_STOP_DONE_EVT:
             deinit_audio_hal();
@@ -812,16 +1091,14 @@ static bool btif_ba_state_pending_audio_ns_handler(btif_sm_event_t event,
                                                       &(btif_ba_cb.div[0]));
             break;
         case BTIF_BA_CMD_SEND_VOL_UPDATE:
-            BTA_SetVol(btif_ba_cb.curr_vol_level);
+            BTA_SetVol(BTA_BA_PRIMARY_STREAM, btif_ba_cb.curr_vol_level);
             break;
         case BTIF_BA_RSP_VOL_UPDATE_DONE_EVT:
-            BTIF_TRACE_EVENT(" %s moving to %d state ",__FUNCTION__,
-                                        btif_ba_cb.prev_state);
-            btif_sm_change_state(btif_ba_cb.sm_handle,
-                                   btif_ba_cb.prev_state);
+            // vol updates don't move us to pending state, nothing to do.
+            BTIF_TRACE_DEBUG(" %s vol update done ", __FUNCTION__);
             break;
         case BTIF_BA_CMD_UPDATE_ENC_KEY:
-            BTA_SetEncKey(&btif_ba_cb.encryption_key[0]);
+            BTA_SetEncKey(BTA_BA_PRIMARY_STREAM, &btif_ba_cb.encryption_key[0]);
             break;
         case BTIF_BA_RSP_ENC_KEY_UPDATE_DONE_EVT:
             BTIF_TRACE_EVENT(" %s moving to %d state ",__FUNCTION__,
@@ -854,6 +1131,7 @@ static bool btif_ba_state_paused_audio_ns_handler(btif_sm_event_t event,
     switch(event)
     {
         case BTIF_SM_ENTER_EVT:
+            btif_ba_transition_done(BTIF_BA_STATE_PAUSED_AUDIO_NS);
             HAL_CBACK(ba_transmitter_callback, state_cb, BA_STATE_PAUSED);
             handle_memorized_msgs();
             break;
@@ -886,7 +1164,6 @@ static bool btif_ba_state_paused_audio_ns_handler(btif_sm_event_t event,
             break;
         case BTIF_BA_API_DEINIT_REQ_EVT:
             BTA_BADeregister();
-            BTA_BADisable();
             break;
         case BTIF_BA_API_REFRESH_ENC_KEY_REQ_EVT:
             refresh_encryption_key(true);
@@ -896,11 +1173,12 @@ static bool btif_ba_state_paused_audio_ns_handler(btif_sm_event_t event,
                                                  NULL);
             break;
         case BTIF_BA_API_SET_VOL_LEVEL:
+            // no state change, BTA coalesces back to back vol updates.
             btif_ba_cb.curr_vol_level = *((uint8_t*)p_data);
-            btif_sm_change_state(btif_ba_cb.sm_handle,
-                                          BTIF_BA_STATE_PENDING_AUDIO_NS);
-            btif_sm_dispatch(btif_ba_cb.sm_handle, BTIF_BA_CMD_SEND_VOL_UPDATE,
-                                                 NULL);
+            BTA_SetVol(BTA_BA_PRIMARY_STREAM, btif_ba_cb.curr_vol_level);
+            break;
+        case BTIF_BA_RSP_VOL_UPDATE_DONE_EVT:
+            BTIF_TRACE_DEBUG(" %s vol update done ", __FUNCTION__);
             break;
         case BTIF_SM_EXIT_EVT:
             btif_ba_cb.prev_state = BTIF_BA_STATE_PAUSED_AUDIO_NS;
@@ -920,8 +1198,10 @@ static bool btif_ba_state_streaming_audio_ns_handler(btif_sm_event_t event,
     switch(event)
     {
       case BTIF_SM_ENTER_EVT:
+          btif_ba_transition_done(BTIF_BA_STATE_STREAMING_AUDIO_NS);
           HAL_CBACK(ba_transmitter_callback, state_cb, BA_STATE_STREAMING);
           refresh_stream_id(true);
+          btif_ba_rate_ctrl_start();
           handle_memorized_msgs();
           break;
       case BTIF_BA_CSB_TIMEOUT_EVT:
@@ -954,7 +1234,6 @@ static bool btif_ba_state_streaming_audio_ns_handler(btif_sm_event_t event,
           break;
       case BTIF_BA_API_DEINIT_REQ_EVT:
           BTA_BADeregister();
-          BTA_BADisable();
           break;
       case BTIF_BA_API_REFRESH_ENC_KEY_REQ_EVT:
           refresh_encryption_key(true);
@@ -970,12 +1249,14 @@ static bool btif_ba_state_streaming_audio_ns_handler(btif_sm_event_t event,
              BTIF_TRACE_DEBUG("%s: p_data is null, curr_vol_level: %d",
                               __FUNCTION__, btif_ba_cb.curr_vol_level);
            }
-           btif_sm_change_state(btif_ba_cb.sm_handle,
-                                           BTIF_BA_STATE_PENDING_AUDIO_NS);
-           btif_sm_dispatch(btif_ba_cb.sm_handle, BTIF_BA_CMD_SEND_VOL_UPDATE,
-                                                  NULL);
+           // no state change, BTA coalesces back to back vol updates.
+           BTA_SetVol(BTA_BA_PRIMARY_STREAM, btif_ba_cb.curr_vol_level);
+           break;
+      case BTIF_BA_RSP_VOL_UPDATE_DONE_EVT:
+           BTIF_TRACE_DEBUG(" %s vol update done ", __FUNCTION__);
            break;
       case BTIF_SM_EXIT_EVT:
+           btif_ba_rate_ctrl_stop();
            refresh_stream_id(false);
            btif_ba_cb.prev_state = BTIF_BA_STATE_STREAMING_AUDIO_NS;
            break;
@@ -985,3 +1266,430 @@ static bool btif_ba_state_streaming_audio_ns_handler(btif_sm_event_t event,
     }
     return true;
 }
+
+/*******************************************************************************
+** Codec rate control
+*******************************************************************************/
+
+// samples per frame and max packet size of a CELT config, as VS_TX_CONFIG
+// wants them.
+static void btif_ba_send_codec(uint8_t stream_idx,
+                               const btif_ba_codec_cfg_t* p_codec)
+{
+    uint32_t sampl_freq = 48000;
+    uint16_t sample_size = VS_HCI_SAMPLE_SIZE;
+    switch (p_codec->sampl_freq) {
+      case A2D_CELT_SAMP_FREQ_32: sampl_freq = 32000; break;
+      case A2D_CELT_SAMP_FREQ_44: sampl_freq = 44100; break;
+    }
+    switch (p_codec->frame_size) {
+      case A2D_CELT_FRAME_SIZE_64: sample_size = 64; break;
+      case A2D_CELT_FRAME_SIZE_128: sample_size = 128; break;
+      case A2D_CELT_FRAME_SIZE_256: sample_size = 256; break;
+    }
+    uint32_t bits_per_frame =
+        ((uint64_t)p_codec->bit_rate * sample_size + sampl_freq - 1) / sampl_freq;
+    uint16_t max_packet_size = (bits_per_frame + 7) / 8;
+    BTIF_TRACE_DEBUG(" %s stream = %d packet_size = %d sample_size = %d",
+                 __FUNCTION__, stream_idx, max_packet_size, sample_size);
+    BTA_BASetCodec(stream_idx, max_packet_size, sample_size);
+    btif_ba_notify_codec(stream_idx);
+}
+
+// the encoder of a stream is set up from the packed codec config, tell its
+// owner whenever the controller gets a new one.
+static void btif_ba_notify_codec(uint8_t stream_idx)
+{
+    uint8_t codec_config[BA_CODEC_CONFIG_LEN];
+    btif_ba_get_stream_codec_config(stream_idx, codec_config);
+    HAL_CBACK(ba_transmitter_callback, stream_codec_update_cb, stream_idx,
+              BA_CODEC_CONFIG_LEN, codec_config);
+}
+
+/*
+ * Primary stream only. Missed and flushed packets reported while streaming
+ * are counted per window. Bit rate and frame size go one step down after a
+ * couple of bad windows in a row and only one step back up after a long run
+ * of clean ones, so that a busy venue doesn't make the codec flap.
+ */
+#define BA_RC_WINDOW_MS          1000
+#define BA_RC_BAD_WINDOW_LOSS    4 // missed + flushed pkts in one window
+#define BA_RC_STEP_DOWN_WINDOWS  2
+#define BA_RC_STEP_UP_WINDOWS    10
+
+typedef struct {
+    uint32_t bit_rate;
+    uint8_t frame_size;
+}btif_ba_rate_step_t;
+
+// best quality first
+static const btif_ba_rate_step_t ba_rate_steps[] = {
+    {A2D_CELT_BIT_RATE_48_2_5, A2D_CELT_FRAME_SIZE_512},
+    {A2D_CELT_BIT_RATE_48_2_0, A2D_CELT_FRAME_SIZE_512},
+    {A2D_CELT_BIT_RATE_48_1_5, A2D_CELT_FRAME_SIZE_512},
+    {A2D_CELT_BIT_RATE_48_1_5, A2D_CELT_FRAME_SIZE_256},
+    {A2D_CELT_BIT_RATE_48_1_0, A2D_CELT_FRAME_SIZE_256},
+};
+#define BA_RC_NUM_STEPS (sizeof(ba_rate_steps)/sizeof(ba_rate_steps[0]))
+
+typedef struct {
+    bool enabled;
+    uint8_t top_step;// envelope, index in ba_rate_steps
+    uint8_t bottom_step;
+    uint8_t curr_step;
+    uint8_t bad_windows;
+    uint8_t good_windows;
+    uint32_t missed_pkts;
+    uint32_t flushed_pkts;
+    alarm_t* window_timer;
+}btif_ba_rate_ctrl_t;
+
+static btif_ba_rate_ctrl_t btif_ba_rc;
+
+typedef struct {
+    uint16_t missed_pkts;
+    uint16_t flushed_pkts;
+    bool sync_lost;
+}btif_ba_link_feedback_t;
+
+static void btif_ba_rate_ctrl_init()
+{
+    uint32_t max_bit_rate = property_get_int32(
+        "persist.vendor.btstack.ba.max_bitrate", A2D_CELT_BIT_RATE_48_2_5);
+    uint32_t min_bit_rate = property_get_int32(
+        "persist.vendor.btstack.ba.min_bitrate", A2D_CELT_BIT_RATE_48_1_0);
+    uint8_t i = 0;
+
+    btif_ba_rc.enabled = property_get_bool(
+        "persist.vendor.btstack.ba.rate_ctrl", true);
+    btif_ba_rc.top_step = BA_RC_NUM_STEPS - 1;
+    btif_ba_rc.bottom_step = 0;
+    for (i = 0; i < BA_RC_NUM_STEPS; i++) {
+        if (ba_rate_steps[i].bit_rate <= max_bit_rate) {
+            btif_ba_rc.top_step = i;
+            break;
+        }
+    }
+    for (i = btif_ba_rc.top_step; i < BA_RC_NUM_STEPS; i++) {
+        if (ba_rate_steps[i].bit_rate < min_bit_rate)
+            break;
+        btif_ba_rc.bottom_step = i;
+    }
+    if (btif_ba_rc.bottom_step < btif_ba_rc.top_step)
+        btif_ba_rc.bottom_step = btif_ba_rc.top_step;
+    BTIF_TRACE_DEBUG(" %s enabled = %d steps %d - %d", __FUNCTION__,
+        btif_ba_rc.enabled, btif_ba_rc.top_step, btif_ba_rc.bottom_step);
+}
+
+static void btif_ba_rate_ctrl_cleanup()
+{
+    alarm_free(btif_ba_rc.window_timer);
+    btif_ba_rc.window_timer = NULL;
+}
+
+static void btif_ba_rate_ctrl_clear_window()
+{
+    btif_ba_rc.missed_pkts = 0;
+    btif_ba_rc.flushed_pkts = 0;
+}
+
+static void btif_ba_rate_ctrl_set_step(uint8_t step)
+{
+    btif_ba_rc.curr_step = step;
+    btif_ba_rc.bad_windows = 0;
+    btif_ba_rc.good_windows = 0;
+    btif_ba_cb.codec.bit_rate = ba_rate_steps[step].bit_rate;
+    btif_ba_cb.codec.frame_size = ba_rate_steps[step].frame_size;
+}
+
+// every session starts at the best quality the envelope allows.
+static void btif_ba_rate_ctrl_reset()
+{
+    btif_ba_rate_ctrl_set_step(btif_ba_rc.top_step);
+    btif_ba_rate_ctrl_clear_window();
+}
+
+static void btif_ba_rate_ctrl_window_timeout(UNUSED_ATTR void* data);
+
+// controller gets a new VS_TX_CONFIG and the encoder is set up again with
+// the new values. CSB and sync train are not touched.
+static void btif_ba_rate_ctrl_apply_step(uint8_t step)
+{
+    BTIF_TRACE_DEBUG(" %s step %d -> %d", __FUNCTION__,
+                                        btif_ba_rc.curr_step, step);
+    btif_ba_rate_ctrl_set_step(step);
+    dump_curr_codec_config();
+    btif_ba_send_codec(BTA_BA_PRIMARY_STREAM, &btif_ba_cb.codec);
+}
+
+static void btif_ba_rate_ctrl_start()
+{
+    if (!btif_ba_rc.enabled)
+        return;
+    // allocated on btif thread, where deinit frees it. An init racing with
+    // the deinit of the previous session can't lose it this way.
+    if (btif_ba_rc.window_timer == NULL)
+        btif_ba_rc.window_timer = alarm_new("btif_ba.rate_ctrl");
+    btif_ba_rate_ctrl_clear_window();
+    alarm_set(btif_ba_rc.window_timer, BA_RC_WINDOW_MS,
+              btif_ba_rate_ctrl_window_timeout, NULL);
+}
+
+static void btif_ba_rate_ctrl_stop()
+{
+    if (btif_ba_rc.window_timer != NULL)
+        alarm_cancel(btif_ba_rc.window_timer);
+}
+
+static void btif_ba_rate_ctrl_evaluate(UNUSED_ATTR uint16_t event,
+                                       UNUSED_ATTR char* p_param)
+{
+    if ((btif_ba_get_state() != BTIF_BA_STATE_STREAMING_AUDIO_NS) ||
+        (btif_ba_rc.window_timer == NULL))
+        return;
+    uint32_t loss = btif_ba_rc.missed_pkts + btif_ba_rc.flushed_pkts;
+    uint8_t step = btif_ba_rc.curr_step;
+    btif_ba_rate_ctrl_clear_window();
+
+    if (loss >= BA_RC_BAD_WINDOW_LOSS) {
+        btif_ba_rc.good_windows = 0;
+        btif_ba_rc.bad_windows++;
+        if ((btif_ba_rc.bad_windows >= BA_RC_STEP_DOWN_WINDOWS) &&
+            (step < btif_ba_rc.bottom_step))
+            step++;
+    } else if (loss == 0) {
+        btif_ba_rc.bad_windows = 0;
+        btif_ba_rc.good_windows++;
+        if ((btif_ba_rc.good_windows >= BA_RC_STEP_UP_WINDOWS) &&
+            (step > btif_ba_rc.top_step))
+            step--;
+    } else {
+        // some loss but not bad enough, neither way counts.
+        btif_ba_rc.bad_windows = 0;
+        btif_ba_rc.good_windows = 0;
+    }
+
+    if (step != btif_ba_rc.curr_step) {
+        BTIF_TRACE_DEBUG(" %s loss = %d", __FUNCTION__, loss);
+        btif_ba_rate_ctrl_apply_step(step);
+    }
+    alarm_set(btif_ba_rc.window_timer, BA_RC_WINDOW_MS,
+              btif_ba_rate_ctrl_window_timeout, NULL);
+}
+
+static void btif_ba_rate_ctrl_window_timeout(UNUSED_ATTR void* data)
+{
+    btif_transfer_context(btif_ba_rate_ctrl_evaluate, 0, NULL, 0, NULL);
+}
+
+static void btif_ba_handle_link_feedback(UNUSED_ATTR uint16_t event,
+                                         char* p_param)
+{
+    btif_ba_link_feedback_t* p_fb = (btif_ba_link_feedback_t*)p_param;
+    if (btif_ba_get_state() != BTIF_BA_STATE_STREAMING_AUDIO_NS)
+        return;
+    btif_ba_rc.missed_pkts += p_fb->missed_pkts;
+    btif_ba_rc.flushed_pkts += p_fb->flushed_pkts;
+    // receivers lost sync and the stream is about to be stopped, no window
+    // will be evaluated. Go one step down now so that the stream comes back
+    // with a config that has a better chance.
+    if (p_fb->sync_lost && btif_ba_rc.enabled &&
+        (btif_ba_rc.curr_step < btif_ba_rc.bottom_step))
+        btif_ba_rate_ctrl_apply_step(btif_ba_rc.curr_step + 1);
+}
+
+/*******************************************************************************
+**
+** Function         btif_ba_report_link_feedback
+**
+** Description      Reports broadcast packets missed or flushed by the
+**                  controller on the primary stream, sync_lost when the
+**                  CSB of the primary stream timed out. Can be called from
+**                  any thread.
+**
+** Returns          void
+**
+*******************************************************************************/
+void btif_ba_report_link_feedback(uint16_t missed_pkts, uint16_t flushed_pkts,
+                                  bool sync_lost)
+{
+    btif_ba_link_feedback_t fb;
+    fb.missed_pkts = missed_pkts;
+    fb.flushed_pkts = flushed_pkts;
+    fb.sync_lost = sync_lost;
+    btif_transfer_context(btif_ba_handle_link_feedback, 0, (char*)&fb,
+                          sizeof(fb), NULL);
+}
+
+/*******************************************************************************
+** Additional broadcast streams
+*******************************************************************************/
+
+static void btif_ba_streams_reset()
+{
+    memset(btif_ba_streams, 0, sizeof(btif_ba_streams));
+    for (uint8_t i = 0; i < BTA_BA_MAX_STREAMS; i++) {
+        btif_ba_stream_t* p_stream = &btif_ba_streams[i];
+        p_stream->state = BA_STATE_IDLE;
+        p_stream->target_state = BA_STREAM_REQ_STOP;
+        p_stream->codec.codec_type = CODEC_TYPE_CELT;
+        p_stream->codec.bit_rate = A2D_CELT_BIT_RATE_48_2_5;
+        p_stream->codec.ch_mode = A2D_CELT_CH_STEREO;
+        p_stream->codec.complexity = A2D_CELT_COMPLEXITY_BA;
+        p_stream->codec.frame_size = A2D_CELT_FRAME_SIZE_512;
+        p_stream->codec.sampl_freq = A2D_CELT_SAMP_FREQ_48;
+    }
+}
+
+static void btif_ba_stream_set_state(uint8_t idx, ba_state_t state)
+{
+    BTIF_TRACE_DEBUG(" %s stream = %d state %d -> %d", __FUNCTION__, idx,
+                                           btif_ba_streams[idx].state, state);
+    btif_ba_streams[idx].state = state;
+    HAL_CBACK(ba_transmitter_callback, stream_state_cb, idx, state);
+}
+
+// keys of additional streams are not persisted, a new one is used every time
+// the stream gets enabled.
+static void btif_ba_stream_refresh_keys(uint8_t idx, bool enable_ba)
+{
+    btif_ba_stream_t* p_stream = &btif_ba_streams[idx];
+    uint8_t i = 0;
+    if (!enable_ba) {
+        memset(p_stream->div, 0, DIV_KEY_LEN);
+        return;
+    }
+    for (i = 0; i < ENCRYPTION_KEY_LEN; i++) {
+        p_stream->encryption_key[i] = (uint8_t)(osi_rand() % 256);
+    }
+    for (i = 0; i < DIV_KEY_LEN; i++) {
+        p_stream->div[i] = (uint8_t)(osi_rand() % 256);
+    }
+}
+
+// moves stream one step towards its target state, if it is not already in
+// transition.
+static void btif_ba_stream_update(uint8_t idx)
+{
+    btif_ba_stream_t* p_stream = &btif_ba_streams[idx];
+    BTIF_TRACE_DEBUG(" %s stream = %d state = %d target = %d", __FUNCTION__,
+                        idx, p_stream->state, p_stream->target_state);
+    switch (p_stream->state) {
+      case BA_STATE_IDLE:
+        if (p_stream->target_state == BA_STREAM_REQ_STOP)
+            break;
+        btif_ba_stream_refresh_keys(idx, true);
+        btif_ba_stream_set_state(idx, BA_STATE_PENDING);
+        btif_ba_send_codec(idx, &p_stream->codec);
+        BTA_PauseBA(idx, true, &p_stream->encryption_key[0],
+                    &p_stream->div[0], p_stream->curr_vol_level,
+                    btif_ba_get_vs_sampl_freq(p_stream->codec.sampl_freq));
+        break;
+      case BA_STATE_PAUSED:
+        if (p_stream->target_state == BA_STREAM_REQ_STOP) {
+            btif_ba_stream_refresh_keys(idx, false);
+            btif_ba_stream_set_state(idx, BA_STATE_PENDING);
+            BTA_StopBA(idx);
+        } else if (p_stream->target_state == BA_STREAM_REQ_STREAM) {
+            btif_ba_stream_set_state(idx, BA_STATE_AUDIO_PENDING);
+            BTA_StreamBA(idx);
+        }
+        break;
+      case BA_STATE_STREAMING:
+        if (p_stream->target_state == BA_STREAM_REQ_STOP) {
+            btif_ba_stream_refresh_keys(idx, false);
+            btif_ba_stream_set_state(idx, BA_STATE_PENDING);
+            BTA_StopBA(idx);
+        } else if (p_stream->target_state == BA_STREAM_REQ_PAUSE) {
+            btif_ba_stream_set_state(idx, BA_STATE_AUDIO_PENDING);
+            BTA_PauseBA(idx, false, &p_stream->encryption_key[0],
+                    &p_stream->div[0], p_stream->curr_vol_level,
+                    btif_ba_get_vs_sampl_freq(p_stream->codec.sampl_freq));
+        }
+        break;
+      default:
+        // transition ongoing, we come back here once BTA responds.
+        break;
+    }
+}
+
+static void btif_ba_stream_handle_event(uint16_t event, char* p_param)
+{
+    btif_ba_stream_evt_t* p_evt = (btif_ba_stream_evt_t*)p_param;
+    uint8_t idx = p_evt->stream_idx;
+    btif_ba_stream_t* p_stream = &btif_ba_streams[idx];
+    BTIF_TRACE_EVENT("%s stream = %d event = %s state = %d", __FUNCTION__,
+       idx, dump_ba_sm_event_name((btif_ba_sm_event_t)event), p_stream->state);
+
+    switch (event) {
+      case BTIF_BA_API_SET_STREAM_CONFIG_EVT:
+        if (p_stream->state != BA_STATE_IDLE) {
+            BTIF_TRACE_ERROR(" %s stream %d not idle, config ignored ",
+                                                       __FUNCTION__, idx);
+            break;
+        }
+        p_stream->codec = p_evt->codec;
+        break;
+      case BTIF_BA_API_SET_STATE_START_REQ_EVT:
+        // last request wins, it is applied once ongoing transition is over.
+        p_stream->target_state = p_evt->data;
+        btif_ba_stream_update(idx);
+        break;
+      case BTIF_BA_API_REFRESH_ENC_KEY_REQ_EVT:
+        for (uint8_t i = 0; i < ENCRYPTION_KEY_LEN; i++) {
+            p_stream->encryption_key[i] = (uint8_t)(osi_rand() % 256);
+        }
+        // idle stream picks the key up when it gets enabled
+        if (p_stream->state != BA_STATE_IDLE)
+            BTA_SetEncKey(idx, &p_stream->encryption_key[0]);
+        break;
+      case BTIF_BA_API_SET_VOL_LEVEL:
+        p_stream->curr_vol_level = p_evt->data;
+        p_stream->max_vol_level = p_evt->max_vol;
+        if (p_stream->state != BA_STATE_IDLE)
+            BTA_SetVol(idx, p_stream->curr_vol_level);
+        break;
+      case BTIF_BA_RSP_PAUSE_DONE_EVT:
+      case BTIF_BA_RSP_STREAM_DONE_EVT:
+        if (p_evt->data != BT_STATUS_SUCCESS) {
+            BTIF_TRACE_ERROR(" %s stream %d transition failed, stop ",
+                                                       __FUNCTION__, idx);
+            p_stream->target_state = BA_STREAM_REQ_STOP;
+            btif_ba_stream_refresh_keys(idx, false);
+            btif_ba_stream_set_state(idx, BA_STATE_PENDING);
+            BTA_StopBA(idx);
+            break;
+        }
+        if (event == BTIF_BA_RSP_STREAM_DONE_EVT) {
+            btif_ba_stream_set_state(idx, BA_STATE_STREAMING);
+        } else {
+            if (p_stream->state == BA_STATE_PENDING) {
+                // stream just got enabled, publish its keys
+                HAL_CBACK(ba_transmitter_callback, stream_enc_update_key_cb,
+                   idx, ENCRYPTION_KEY_LEN, &(p_stream->encryption_key[0]));
+                HAL_CBACK(ba_transmitter_callback, stream_div_update_cb,
+                   idx, DIV_KEY_LEN, &(p_stream->div[0]));
+            }
+            btif_ba_stream_set_state(idx, BA_STATE_PAUSED);
+        }
+        btif_ba_stream_update(idx);
+        break;
+      case BTIF_BA_RSP_STOP_DONE_EVT:
+        btif_ba_stream_set_state(idx, BA_STATE_IDLE);
+        HAL_CBACK(ba_transmitter_callback, stream_div_update_cb,
+                   idx, DIV_KEY_LEN, &(p_stream->div[0]));
+        btif_ba_stream_update(idx);
+        break;
+      case BTIF_BA_RSP_ENC_KEY_UPDATE_DONE_EVT:
+        HAL_CBACK(ba_transmitter_callback, stream_enc_update_key_cb,
+                   idx, ENCRYPTION_KEY_LEN, &(p_stream->encryption_key[0]));
+        break;
+      case BTIF_BA_CSB_TIMEOUT_EVT:
+        p_stream->target_state = BA_STREAM_REQ_STOP;
+        btif_ba_stream_update(idx);
+        break;
+      default:
+        BTIF_TRACE_DEBUG(" %s  UNHANDLED event ", __FUNCTION__);
+        break;
+    }
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_bqr_analytics.cc
+ *
+ *  Description:   Native analytics of Bluetooth Quality Report (BQR) events
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "bt_btif_bqr"
+
+#include <algorithm>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+#include "bt_types.h"
+#include "btif_bqr_analytics.h"
+#include "osi/include/log.h"
+#include "osi/include/time.h"
+
+#define BTIF_BQR_RSSI_THR_PROP "persist.vendor.btstack.bqr.rssi_thr"
+#define BTIF_BQR_SNR_THR_PROP "persist.vendor.btstack.bqr.snr_thr"
+#define BTIF_BQR_RETRANS_THR_PROP "persist.vendor.btstack.bqr.retrans_thr"
+#define BTIF_BQR_LOSS_THR_PROP "persist.vendor.btstack.bqr.loss_thr"
+#define BTIF_BQR_UNUSED_CH_THR_PROP "persist.vendor.btstack.bqr.unused_ch_thr"
+
+typedef struct {
+  const char* name;
+  const char* prop;
+  int32_t def_threshold;
+  bool below;             /* breach when the average drops below */
+} tBTIF_BQR_METRIC_INFO;
+
+static const tBTIF_BQR_METRIC_INFO metric_info[BTIF_BQR_METRIC_MAX] = {
+    {"rssi", BTIF_BQR_RSSI_THR_PROP, -85, true},
+    {"snr", BTIF_BQR_SNR_THR_PROP, 10, true},
+    {"retransmission", BTIF_BQR_RETRANS_THR_PROP, 50, false},
+    {"packet_loss", BTIF_BQR_LOSS_THR_PROP, 50, false},
+    {"unused_channels", BTIF_BQR_UNUSED_CH_THR_PROP, 59, false},
+};
+
+typedef struct {
+  int32_t samples[BTIF_BQR_WINDOW_SIZE];
+  int64_t sum;
+  uint8_t head;
+  uint8_t count;
+  bool breached;
+  uint32_t breach_count;
+} tBTIF_BQR_WINDOW;
+
+typedef struct {
+  bool in_use;
+  RawAddress bd_addr;
+  uint16_t handle;
+  uint64_t last_report_ms;
+  uint32_t num_reports[BTIF_BQR_ID_SCO_VOICE_CHOPPY + 1];
+  tBTIF_BQR_WINDOW window[BTIF_BQR_METRIC_MAX];
+} tBTIF_BQR_LINK;
+
+typedef struct {
+  tBTIF_BQR_LINK links[BTIF_BQR_MAX_LINKS];
+  int32_t threshold[BTIF_BQR_METRIC_MAX];
+  uint32_t num_root_inflammation;
+  tBTIF_BQR_ROOT_INFLAMMATION last_root_inflammation;
+  std::mutex lock;
+} tBTIF_BQR_CB;
+
+static tBTIF_BQR_CB bqr_analytics_cb;
+
+/*******************************************************************************
+**
+** Function         btif_bqr_parse_link_quality
+**
+** Description      Decodes the link quality part of a BQR sub-event
+**
+** Returns          true if the report was long enough to decode
+**
+*******************************************************************************/
+bool btif_bqr_parse_link_quality(const uint8_t* p_data, uint32_t len,
+                                 tBTIF_BQR_LINK_QUALITY* p_lq) {
+  const uint8_t* p = p_data;
+  uint8_t u8;
+
+  if (p_data == NULL || p_lq == NULL || len < BTIF_BQR_LINK_QUALITY_LEN)
+    return false;
+
+  STREAM_TO_UINT8(p_lq->quality_report_id, p);
+  STREAM_TO_UINT8(p_lq->packet_types, p);
+  STREAM_TO_UINT16(p_lq->connection_handle, p);
+  STREAM_TO_UINT8(p_lq->connection_role, p);
+  STREAM_TO_UINT8(u8, p);
+  p_lq->tx_power_level = (int8_t)u8;
+  STREAM_TO_UINT8(u8, p);
+  p_lq->rssi = (int8_t)u8;
+  STREAM_TO_UINT8(p_lq->snr, p);
+  STREAM_TO_UINT8(p_lq->unused_afh_channel_count, p);
+  STREAM_TO_UINT8(p_lq->afh_select_unideal_channel_count, p);
+  STREAM_TO_UINT16(p_lq->lsto, p);
+  STREAM_TO_UINT32(p_lq->connection_piconet_clock, p);
+  STREAM_TO_UINT32(p_lq->retransmission_count, p);
+  STREAM_TO_UINT32(p_lq->no_rx_count, p);
+  STREAM_TO_UINT32(p_lq->nak_count, p);
+  STREAM_TO_UINT32(p_lq->last_tx_ack_timestamp, p);
+  STREAM_TO_UINT32(p_lq->flow_off_count, p);
+  STREAM_TO_UINT32(p_lq->last_flow_on_timestamp, p);
+  STREAM_TO_UINT32(p_lq->buffer_overflow_bytes, p);
+  STREAM_TO_UINT32(p_lq->buffer_underflow_bytes, p);
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function         btif_bqr_parse_root_inflammation
+**
+** Description      Decodes a root inflammation BQR sub-event
+**
+** Returns          true if the report was long enough to decode
+**
+*******************************************************************************/
+bool btif_bqr_parse_root_inflammation(const uint8_t* p_data, uint32_t len,
+                                      tBTIF_BQR_ROOT_INFLAMMATION* p_ri) {
+  if (p_data == NULL || p_ri == NULL || len < BTIF_BQR_ROOT_INFLAMMATION_LEN)
+    return false;
+
+  p_ri->error_code = p_data[1];
+  p_ri->vendor_error_code = p_data[2];
+  return true;
+}
+
+static bool btif_bqr_is_breach(tBTIF_BQR_METRIC metric, int32_t avg) {
+  int32_t threshold = bqr_analytics_cb.threshold[metric];
+
+  return metric_info[metric].below ? avg < threshold : avg > threshold;
+}
+
+/* Adds a sample to the rolling window and re-evaluates the threshold */
+static void btif_bqr_window_add(tBTIF_BQR_LINK* p_link,
+                                tBTIF_BQR_METRIC metric, int32_t value) {
+  tBTIF_BQR_WINDOW* p_win = &p_link->window[metric];
+  bool breached;
+
+  if (p_win->count == BTIF_BQR_WINDOW_SIZE) {
+    p_win->sum -= p_win->samples[p_win->head];
+  } else {
+    p_win->count++;
+  }
+  p_win->samples[p_win->head] = value;
+  p_win->sum += value;
+  p_win->head = (p_win->head + 1) % BTIF_BQR_WINDOW_SIZE;
+
+  breached = btif_bqr_is_breach(metric, (int32_t)(p_win->sum / p_win->count));
+  if (breached && !p_win->breached) {
+    p_win->breach_count++;
+    LOG_WARN(LOG_TAG, "%s: %s %s average %d past threshold %d", __func__,
+             p_link->bd_addr.ToString().c_str(), metric_info[metric].name,
+             (int32_t)(p_win->sum / p_win->count),
+             bqr_analytics_cb.threshold[metric]);
+  }
+  p_win->breached = breached;
+}
+
+static void btif_bqr_window_stats(const tBTIF_BQR_WINDOW* p_win,
+                                  tBTIF_BQR_STATS* p_stats) {
+  int32_t sorted[BTIF_BQR_WINDOW_SIZE];
+
+  memcpy(sorted, p_win->samples, p_win->count * sizeof(int32_t));
+  std::sort(sorted, sorted + p_win->count);
+
+  p_stats->num_samples = p_win->count;
+  p_stats->min = sorted[0];
+  p_stats->max = sorted[p_win->count - 1];
+  p_stats->avg = (int32_t)(p_win->sum / p_win->count);
+  p_stats->p50 = sorted[(p_win->count - 1) / 2];
+  p_stats->p90 = sorted[((p_win->count - 1) * 9) / 10];
+  p_stats->breached = p_win->breached;
+  p_stats->breach_count = p_win->breach_count;
+}
+
+/* Must be called with bqr_analytics_cb.lock held */
+static tBTIF_BQR_LINK* btif_bqr_find_link(const RawAddress& bd_addr) {
+  for (int i = 0; i < BTIF_BQR_MAX_LINKS; i++) {
+    tBTIF_BQR_LINK* p_link = &bqr_analytics_cb.links[i];
+    if (p_link->in_use && p_link->bd_addr == bd_addr) return p_link;
+  }
+  return NULL;
+}
+
+/* Returns the link of |bd_addr|, reusing the least recently reported slot
+ * when the table is full. A new ACL handle restarts the statistics. */
+static tBTIF_BQR_LINK* btif_bqr_get_link(const RawAddress& bd_addr,
+                                         uint16_t handle) {
+  tBTIF_BQR_LINK* p_link = btif_bqr_find_link(bd_addr);
+
+  if (p_link == NULL) {
+    for (int i = 0; i < BTIF_BQR_MAX_LINKS; i++) {
+      tBTIF_BQR_LINK* p_cand = &bqr_analytics_cb.links[i];
+      if (!p_cand->in_use) {
+        p_link = p_cand;
+        break;
+      }
+      if (p_link == NULL || p_cand->last_report_ms < p_link->last_report_ms)
+        p_link = p_cand;
+    }
+  } else if (p_link->handle == handle) {
+    return p_link;
+  }
+
+  memset(p_link, 0, sizeof(*p_link));
+  p_link->in_use = true;
+  p_link->bd_addr = bd_addr;
+  p_link->handle = handle;
+  return p_link;
+}
+
+/*******************************************************************************
+**
+** Function         btif_bqr_analytics_init
+**
+** Description      Resets the statistics and loads the breach thresholds
+**
+** Returns          void
+**
+*******************************************************************************/
+void btif_bqr_analytics_init(void) {
+  std::unique_lock<std::mutex> guard(bqr_analytics_cb.lock);
+
+  memset(bqr_analytics_cb.links, 0, sizeof(bqr_analytics_cb.links));
+  bqr_analytics_cb.num_root_inflammation = 0;
+  for (int i = 0; i < BTIF_BQR_METRIC_MAX; i++) {
+    bqr_analytics_cb.threshold[i] =
+        property_get_int32(metric_info[i].prop, metric_info[i].def_threshold);
+  }
+}
+
+void btif_bqr_analytics_cleanup(void) {
+  std::unique_lock<std::mutex> guard(bqr_analytics_cb.lock);
+
+  memset(bqr_analytics_cb.links, 0, sizeof(bqr_analytics_cb.links));
+}
+
+/*******************************************************************************
+**
+** Function         btif_bqr_analytics_process
+**
+** Description      Decodes one BQR sub-event and updates the statistics of
+**                  the link it belongs to
+**
+** Returns          void
+**
+*******************************************************************************/
+void btif_bqr_analytics_process(const RawAddress& bd_addr,
+                                const uint8_t* p_data, uint32_t len) {
+  tBTIF_BQR_LINK_QUALITY lq;
+  tBTIF_BQR_ROOT_INFLAMMATION ri;
+  tBTIF_BQR_LINK* p_link;
+
+  if (p_data == NULL || len == 0) return;
+
+  std::unique_lock<std::mutex> guard(bqr_analytics_cb.lock);
+  switch (p_data[0]) {
+    case BTIF_BQR_ID_MONITOR_MODE:
+    case BTIF_BQR_ID_APPROACH_LSTO:
+    case BTIF_BQR_ID_A2DP_AUDIO_CHOPPY:
+    case BTIF_BQR_ID_SCO_VOICE_CHOPPY:
+      if (!btif_bqr_parse_link_quality(p_data, len, &lq)) {
+        LOG_ERROR(LOG_TAG, "%s: short report id %d len %d", __func__,
+                  p_data[0], len);
+        return;
+      }
+      p_link = btif_bqr_get_link(bd_addr, lq.connection_handle);
+      p_link->last_report_ms = time_get_os_boottime_ms();
+      p_link->num_reports[lq.quality_report_id]++;
+      btif_bqr_window_add(p_link, BTIF_BQR_METRIC_RSSI, lq.rssi);
+      btif_bqr_window_add(p_link, BTIF_BQR_METRIC_SNR, lq.snr);
+      btif_bqr_window_add(p_link, BTIF_BQR_METRIC_RETRANSMISSION,
+                          (int32_t)std::min<uint32_t>(lq.retransmission_count,
+                                                      INT32_MAX));
+      btif_bqr_window_add(p_link, BTIF_BQR_METRIC_PACKET_LOSS,
+                          (int32_t)std::min<uint64_t>(
+                              (uint64_t)lq.no_rx_count + lq.nak_count,
+                              INT32_MAX));
+      btif_bqr_window_add(p_link, BTIF_BQR_METRIC_UNUSED_CHANNELS,
+                          lq.unused_afh_channel_count);
+      break;
+
+    case BTIF_BQR_ID_ROOT_INFLAMMATION:
+      if (!btif_bqr_parse_root_inflammation(p_data, len, &ri)) return;
+      bqr_analytics_cb.num_root_inflammation++;
+      bqr_analytics_cb.last_root_inflammation = ri;
+      LOG_ERROR(LOG_TAG, "%s: root inflammation error 0x%02x vendor 0x%02x",
+                __func__, ri.error_code, ri.vendor_error_code);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*******************************************************************************
+**
+** Function         btif_bqr_analytics_get_stats
+**
+** Description      Returns min/avg/max/percentiles of |metric| over the
+**                  rolling window of the link to |bd_addr|
+**
+** Returns          false if no samples are known
+**
+*******************************************************************************/
+bool btif_bqr_analytics_get_stats(const RawAddress& bd_addr,
+                                  tBTIF_BQR_METRIC metric,
+                                  tBTIF_BQR_STATS* p_stats) {
+  if (p_stats == NULL || metric >= BTIF_BQR_METRIC_MAX) return false;
+
+  std::unique_lock<std::mutex> guard(bqr_analytics_cb.lock);
+  tBTIF_BQR_LINK* p_link = btif_bqr_find_link(bd_addr);
+  if (p_link == NULL || p_link->window[metric].count == 0) return false;
+
+  btif_bqr_window_stats(&p_link->window[metric], p_stats);
+  return true;
+}
+
+void btif_bqr_analytics_dump(int fd) {
+  std::unique_lock<std::mutex> guard(bqr_analytics_cb.lock);
+  uint64_t now_ms = time_get_os_boottime_ms();
+  tBTIF_BQR_STATS stats;
+
+  dprintf(fd, "\nBQR link quality analytics:\n");
+  dprintf(fd, "  root inflammation events: %u",
+          bqr_analytics_cb.num_root_inflammation);
+  if (bqr_analytics_cb.num_root_inflammation)
+    dprintf(fd, " (last error 0x%02x vendor 0x%02x)",
+            bqr_analytics_cb.last_root_inflammation.error_code,
+            bqr_analytics_cb.last_root_inflammation.vendor_error_code);
+  dprintf(fd, "\n");
+
+  for (int i = 0; i < BTIF_BQR_MAX_LINKS; i++) {
+    tBTIF_BQR_LINK* p_link = &bqr_analytics_cb.links[i];
+    if (!p_link->in_use) continue;
+
+    dprintf(fd, "  %s handle 0x%04x, last report %llu ms ago\n",
+            p_link->bd_addr.ToString().c_str(), p_link->handle,
+            (unsigned long long)(now_ms - p_link->last_report_ms));
+    dprintf(fd, "    reports: monitor %u, lsto %u, a2dp choppy %u, "
+            "sco choppy %u\n",
+            p_link->num_reports[BTIF_BQR_ID_MONITOR_MODE],
+            p_link->num_reports[BTIF_BQR_ID_APPROACH_LSTO],
+            p_link->num_reports[BTIF_BQR_ID_A2DP_AUDIO_CHOPPY],
+            p_link->num_reports[BTIF_BQR_ID_SCO_VOICE_CHOPPY]);
+    for (int m = 0; m < BTIF_BQR_METRIC_MAX; m++) {
+      if (p_link->window[m].count == 0) continue;
+      btif_bqr_window_stats(&p_link->window[m], &stats);
+      dprintf(fd, "    %-16s n=%-2u min=%d avg=%d p50=%d p90=%d max=%d "
+              "breaches=%u%s\n",
+              metric_info[m].name, stats.num_samples, stats.min, stats.avg,
+              stats.p50, stats.p90, stats.max, stats.breach_count,
+              stats.breached ? " (in breach)" : "");
+    }
+  }
+}
@@ -61,6 +61,9 @@
 
 #define LOG_TAG "bt_btif_tws_plus"
 
+#include <atomic>
+#include <mutex>
+
 #include "btif_config.h"
 #include "btif_tws_plus.h"
 #include "advertise_data_parser.h"
@@ -69,6 +72,7 @@
 #include "btif_common.h"
 #include "btif_storage.h"
 #include "btif_util.h"
+#include "btm_api.h"
 #include "osi/include/properties.h"
 
 extern void bond_state_changed(bt_status_t status, const RawAddress& bd_addr,
@@ -98,6 +102,189 @@ bt_status_t btif_tws_plus_replace_earbud ( RawAddress *addr,
 }
 
 
+/*******************************************************************************
+** TWS+ PEER REGISTRY
+**
+** In memory copy of the TWS+ config entries, so the per device checks on the
+** A2DP, HFP and ACL paths don't format addresses and search btif_config.
+** Each entry is a pair of 64 bit words: the packed address, and the packed
+** peer address with the device type. Readers are lock-free and confirm the
+** address word again after reading the info word. Writers are serialized by
+** a mutex and update btif_config behind the registry.
+*******************************************************************************/
+
+#define BTIF_TWS_PLUS_REG_MAX_DEVICES 16
+
+#define BTIF_TWS_PLUS_REG_ADDR_MASK 0x0000FFFFFFFFFFFFULL
+#define BTIF_TWS_PLUS_REG_TYPE_SHIFT 48
+#define BTIF_TWS_PLUS_REG_HAS_PEER (1ULL << 56)
+#define BTIF_TWS_PLUS_REG_HAS_TYPE (1ULL << 57)
+
+typedef struct {
+  std::atomic<uint64_t> addr;  /* packed address, 0 if the entry is free */
+  std::atomic<uint64_t> info;  /* peer address, device type and flags */
+} tBTIF_TWS_PLUS_REG_ENTRY;
+
+static tBTIF_TWS_PLUS_REG_ENTRY btif_tws_plus_reg[BTIF_TWS_PLUS_REG_MAX_DEVICES];
+static std::mutex btif_tws_plus_reg_mutex;
+/* Lookups fall back to btif_config until the registry is loaded, and for
+ * good if it ever overflowed */
+static std::atomic<bool> btif_tws_plus_reg_loaded(false);
+static std::atomic<bool> btif_tws_plus_reg_overflow(false);
+
+static uint64_t btif_tws_plus_pack_addr(const RawAddress& addr) {
+  uint64_t val = 0;
+  for (size_t i = 0; i < sizeof(addr.address); i++)
+    val = (val << 8) | addr.address[i];
+  return val;
+}
+
+static RawAddress btif_tws_plus_unpack_addr(uint64_t val) {
+  RawAddress addr;
+  for (int i = sizeof(addr.address) - 1; i >= 0; i--) {
+    addr.address[i] = (uint8_t)(val & 0xFF);
+    val >>= 8;
+  }
+  return addr;
+}
+
+static bool btif_tws_plus_reg_usable(void) {
+  return btif_tws_plus_reg_loaded.load(std::memory_order_acquire) &&
+         !btif_tws_plus_reg_overflow.load(std::memory_order_acquire);
+}
+
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_reg_find
+ *
+ * Description      Lock-free lookup of |addr| in the registry
+ *
+ * Returns          true and the info word if |addr| has an entry
+ *
+ ******************************************************************************/
+static bool btif_tws_plus_reg_find(const RawAddress& addr, uint64_t* p_info) {
+  uint64_t key = btif_tws_plus_pack_addr(addr);
+  if (key == 0) return false;
+
+  for (int i = 0; i < BTIF_TWS_PLUS_REG_MAX_DEVICES; i++) {
+    tBTIF_TWS_PLUS_REG_ENTRY* p_entry = &btif_tws_plus_reg[i];
+    if (p_entry->addr.load(std::memory_order_acquire) != key) continue;
+
+    uint64_t info = p_entry->info.load(std::memory_order_acquire);
+    /* The entry may have been given to another address meanwhile */
+    if (p_entry->addr.load(std::memory_order_acquire) != key) continue;
+
+    *p_info = info;
+    return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_reg_update
+ *
+ * Description      Sets the bits in |set_mask| of the entry of |addr| to the
+ *                  ones of |info|, creating the entry if needed. An entry left
+ *                  without peer and type is released.
+ *
+ * Returns          true if the registry holds the new value
+ *
+ ******************************************************************************/
+static bool btif_tws_plus_reg_update(const RawAddress& addr, uint64_t info,
+                                     uint64_t set_mask) {
+  std::lock_guard<std::mutex> lock(btif_tws_plus_reg_mutex);
+  uint64_t key = btif_tws_plus_pack_addr(addr);
+  tBTIF_TWS_PLUS_REG_ENTRY* p_free = NULL;
+
+  if (key == 0) return false;
+
+  for (int i = 0; i < BTIF_TWS_PLUS_REG_MAX_DEVICES; i++) {
+    tBTIF_TWS_PLUS_REG_ENTRY* p_entry = &btif_tws_plus_reg[i];
+    uint64_t entry_key = p_entry->addr.load(std::memory_order_relaxed);
+
+    if (entry_key == key) {
+      uint64_t new_info =
+          (p_entry->info.load(std::memory_order_relaxed) & ~set_mask) |
+          (info & set_mask);
+      if ((new_info & (BTIF_TWS_PLUS_REG_HAS_PEER |
+                       BTIF_TWS_PLUS_REG_HAS_TYPE)) == 0) {
+        p_entry->addr.store(0, std::memory_order_release);
+      }
+      p_entry->info.store(new_info, std::memory_order_release);
+      return true;
+    }
+    if (entry_key == 0 && p_free == NULL) p_free = p_entry;
+  }
+
+  if ((info & set_mask & (BTIF_TWS_PLUS_REG_HAS_PEER |
+                          BTIF_TWS_PLUS_REG_HAS_TYPE)) == 0) {
+    /* Nothing to remember */
+    return true;
+  }
+
+  if (p_free == NULL) {
+    LOG_ERROR(LOG_TAG, "%s: registry full, falling back to config", __func__);
+    btif_tws_plus_reg_overflow.store(true, std::memory_order_release);
+    return false;
+  }
+
+  /* Publish the info before the address makes the entry visible */
+  p_free->info.store(info & set_mask, std::memory_order_release);
+  p_free->addr.store(key, std::memory_order_release);
+  return true;
+}
+
+static void btif_tws_plus_reg_forget(const RawAddress& addr) {
+  btif_tws_plus_reg_update(addr, 0,
+      BTIF_TWS_PLUS_REG_ADDR_MASK | (0xFFULL << BTIF_TWS_PLUS_REG_TYPE_SHIFT) |
+      BTIF_TWS_PLUS_REG_HAS_PEER | BTIF_TWS_PLUS_REG_HAS_TYPE);
+}
+
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_reg_lookup
+ *
+ * Description      Looks |addr| up in the registry. An entry of a device that
+ *                  is not bonded any more is checked against btif_config,
+ *                  which the unbond path cleans up, and dropped if it is
+ *                  gone from there.
+ *
+ * Returns          true and the info word if |addr| has a valid entry
+ *
+ ******************************************************************************/
+static bool btif_tws_plus_reg_lookup(const RawAddress& addr, uint64_t* p_info) {
+  if (!btif_tws_plus_reg_find(addr, p_info)) return false;
+  if (BTM_IsLinkKeyKnown(addr, BT_TRANSPORT_BR_EDR)) return true;
+
+  /* Not bonded, or still pairing */
+  std::string bdstr = addr.ToString();
+  if (btif_config_exist(bdstr.c_str(), BTIF_STORAGE_PATH_TWS_PLUS_PEER_ADDR) ||
+      btif_config_exist(bdstr.c_str(), BTIF_STORAGE_PATH_TWS_PLUS_DEV_TYPE))
+    return true;
+
+  BTIF_TRACE_DEBUG("%s: dropping stale entry of %s", __func__, bdstr.c_str());
+  btif_tws_plus_reg_forget(addr);
+  return false;
+}
+
+static void btif_tws_plus_reg_set_peer(const RawAddress& addr,
+                                       const RawAddress& peer_addr) {
+  uint64_t info = 0;
+  if (peer_addr != RawAddress::kEmpty) {
+    info = btif_tws_plus_pack_addr(peer_addr) | BTIF_TWS_PLUS_REG_HAS_PEER;
+  }
+  btif_tws_plus_reg_update(addr, info,
+      BTIF_TWS_PLUS_REG_ADDR_MASK | BTIF_TWS_PLUS_REG_HAS_PEER);
+}
+
+static void btif_tws_plus_reg_set_type(const RawAddress& addr, int dev_type) {
+  uint64_t info = ((uint64_t)(uint8_t)dev_type << BTIF_TWS_PLUS_REG_TYPE_SHIFT) |
+                  BTIF_TWS_PLUS_REG_HAS_TYPE;
+  btif_tws_plus_reg_update(addr, info,
+      (0xFFULL << BTIF_TWS_PLUS_REG_TYPE_SHIFT) | BTIF_TWS_PLUS_REG_HAS_TYPE);
+}
+
 /*******************************************************************************
 ** LOCAL FUNCTIONS
 *******************************************************************************/
@@ -186,14 +373,20 @@ bool btif_tws_plus_auto_connect(RawAddress *addr, bool enable) {
   return true;
 }
 
-bool btif_tws_plus_set_peer_eb_addr(RawAddress *addr, RawAddress *peer_addr) {
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_publish_peer_eb_addr
+ *
+ * Description      Hands the peer earbud of |addr| to BTM and the app
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void btif_tws_plus_publish_peer_eb_addr(RawAddress *addr,
+                                               RawAddress *peer_addr) {
   bt_vendor_property_t vnd_props[3];
   uint32_t num_vnd_props = 0;
 
-  if(!addr || !peer_addr) {
-      LOG_ERROR(LOG_TAG," Invalid input address");
-      return false;
-  }
   /* Peer earbud BD_ADDR */
   BTIF_STORAGE_FILL_PROPERTY(&vnd_props[num_vnd_props],
                    BT_VENDOR_PROPERTY_TWS_PLUS_PEER_ADDR,
@@ -206,6 +399,17 @@ bool btif_tws_plus_set_peer_eb_addr(RawAddress *addr, RawAddress *peer_addr) {
 
   HAL_CBACK(bt_vendor_callbacks, rmt_dev_prop_cb, BT_STATUS_SUCCESS,
                                     addr, num_vnd_props, vnd_props);
+}
+
+bool btif_tws_plus_set_peer_eb_addr(RawAddress *addr, RawAddress *peer_addr) {
+  if(!addr || !peer_addr) {
+      LOG_ERROR(LOG_TAG," Invalid input address");
+      return false;
+  }
+
+  btif_tws_plus_reg_set_peer(*addr, *peer_addr);
+  btif_tws_plus_publish_peer_eb_addr(addr, peer_addr);
+
   if (*peer_addr != RawAddress::kEmpty) {
     return btif_config_set_str(addr->ToString().c_str(),
                                 BTIF_STORAGE_PATH_TWS_PLUS_PEER_ADDR,
@@ -218,6 +422,17 @@ bool btif_tws_plus_set_peer_eb_addr(RawAddress *addr, RawAddress *peer_addr) {
 
 bool btif_tws_plus_get_peer_eb_addr(RawAddress *remote_bd_addr,
                                         RawAddress *peer_bd_addr) {
+  if (btif_tws_plus_reg_usable()) {
+    uint64_t info;
+    if (!btif_tws_plus_reg_lookup(*remote_bd_addr, &info) ||
+        !(info & BTIF_TWS_PLUS_REG_HAS_PEER)) {
+      return false;
+    }
+    *peer_bd_addr =
+        btif_tws_plus_unpack_addr(info & BTIF_TWS_PLUS_REG_ADDR_MASK);
+    return true;
+  }
+
   char val[PROPERTY_VALUE_MAX] = "";
   int len = PROPERTY_VALUE_MAX;
   if(btif_config_get_str(remote_bd_addr->ToString().c_str(),
@@ -233,20 +448,52 @@ bool btif_tws_plus_set_dev_type(RawAddress *addr, int tws_plus_dev_type) {
   if(btif_config_set_int(addr->ToString().c_str(),
                          BTIF_STORAGE_PATH_TWS_PLUS_DEV_TYPE,
                          tws_plus_dev_type))  {
-    btif_config_flush();
+    btif_tws_plus_reg_set_type(*addr, tws_plus_dev_type);
+    /* Written to disk by the config settle timer */
+    btif_config_save();
     return true;
   } else {
     return false;
   }
 }
 
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_forget_device
+ *
+ * Description      Drops |addr| from the TWS+ registry once its bonding and
+ *                  config section are removed
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void btif_tws_plus_forget_device(const RawAddress *addr) {
+  btif_tws_plus_reg_forget(*addr);
+}
+
 bool btif_tws_plus_get_dev_type(RawAddress *addr, int *tws_plus_dev_type) {
+  if (btif_tws_plus_reg_usable()) {
+    uint64_t info;
+    if (!btif_tws_plus_reg_lookup(*addr, &info) ||
+        !(info & BTIF_TWS_PLUS_REG_HAS_TYPE)) {
+      return false;
+    }
+    *tws_plus_dev_type = (int)(uint8_t)(info >> BTIF_TWS_PLUS_REG_TYPE_SHIFT);
+    return true;
+  }
+
   return btif_config_get_int(addr->ToString().c_str(),
                              BTIF_STORAGE_PATH_TWS_PLUS_DEV_TYPE,
                              tws_plus_dev_type);
 }
 
 bool btif_is_tws_plus_device(const RawAddress *remote_bd_addr) {
+  if (btif_tws_plus_reg_usable()) {
+    uint64_t info;
+    return btif_tws_plus_reg_lookup(*remote_bd_addr, &info) &&
+           (info & BTIF_TWS_PLUS_REG_HAS_PEER);
+  }
+
   return btif_config_exist(remote_bd_addr->ToString().c_str(),
                         BTIF_STORAGE_PATH_TWS_PLUS_PEER_ADDR);
 }
@@ -296,30 +543,46 @@ bool btif_tws_plus_process_eir(tBTA_DM_SEARCH *p_search_data,
 }
 
 bool btif_tws_plus_get_services(RawAddress *bd_addr) {
-    BTA_TwsPlusSdpSearch(*bd_addr);
+    RawAddress peer_eb_addr = RawAddress::kEmpty;
+
+    /* Discover the peer earbud at the same time when it is already known,
+     * e.g. from the EIR */
+    if (btif_tws_plus_get_peer_eb_addr(bd_addr, &peer_eb_addr) &&
+        peer_eb_addr != RawAddress::kEmpty) {
+      BTA_TwsPlusSdpSearchSet(*bd_addr, peer_eb_addr);
+    } else {
+      BTA_TwsPlusSdpSearch(*bd_addr);
+    }
     return true;
 }
 
 bool btif_tws_plus_load_tws_devices(void) {
-  RawAddress bd_addr;
   RawAddress peer_bd_addr;
   char val[PROPERTY_VALUE_MAX] = "";
-  int len = PROPERTY_VALUE_MAX;
+  int len;
+  int dev_type;
 
  for (auto& bd_addr : btif_config_get_paired_devices()) {
     auto name = bd_addr.ToString();
     if (!RawAddress::IsValidAddress(name)) continue;
 
     BTIF_TRACE_DEBUG("Remote device:%s", name.c_str());
+    if (btif_config_get_int(name, BTIF_STORAGE_PATH_TWS_PLUS_DEV_TYPE,
+                            &dev_type)) {
+       btif_tws_plus_reg_set_type(bd_addr, dev_type);
+    }
+    len = PROPERTY_VALUE_MAX;
     if (btif_config_get_str(name, BTIF_STORAGE_PATH_TWS_PLUS_PEER_ADDR,
                                   (char*) val, &len)) {
        BTIF_TRACE_DEBUG("%s() Bd addr  src %s  dst %s ", __func__,
                name.c_str(), val);
        RawAddress::FromString(val, peer_bd_addr);
-       //RawAddress::FromString(name, bd_addr);
-       btif_tws_plus_set_peer_eb_addr(&bd_addr, &peer_bd_addr);
+       btif_tws_plus_reg_set_peer(bd_addr, peer_bd_addr);
+       /* Already in the config, only BTM and the app need it */
+       btif_tws_plus_publish_peer_eb_addr(&bd_addr, &peer_bd_addr);
     }
   }
+  btif_tws_plus_reg_loaded.store(true, std::memory_order_release);
   return true;
 }
 
@@ -331,40 +594,98 @@ bool btif_tws_plus_derive_link_key ( RawAddress eb_addr, RawAddress peer_eb_addr
   return true;
 }
 
-static void btif_tws_plus_upstreams_evt(uint16_t event, char* p_param) {
-  tBTA_TWS_PLUS* p_data = (tBTA_TWS_PLUS*)p_param;
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_process_sdp_comp
+ *
+ * Description      Handles the TWS+ SDP result of the earbud being bonded:
+ *                  stores the peer earbud and derives its link key, or
+ *                  completes the bonding as a regular device.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void btif_tws_plus_process_sdp_comp(
+    tBTA_TWS_PLUS_SDP_SEARCH_COMP* p_comp) {
   LinkKey link_key;
   uint8_t *key = &link_key[0];
   size_t size = OCTET16_LEN;
 
+  if(BTA_TWS_PLUS_SUCCESS == p_comp->status &&
+     (p_comp->peer_eb_addr != RawAddress::kEmpty)) {
+      btif_tws_plus_reverse_addr(( RawAddress* ) &p_comp->peer_eb_addr);
+      BTIF_TRACE_DEBUG("%s() Bd addr found from SDP query : %s ", __func__,
+      p_comp->peer_eb_addr.ToString().c_str());
+
+      btif_tws_plus_set_peer_eb_addr(&p_comp->eb_addr,
+                                    &p_comp->peer_eb_addr);
+      if (btif_config_get_bin(p_comp->eb_addr.ToString().c_str(),
+                              "LinkKey", key, &size)) {
+        btif_tws_plus_derive_link_key(p_comp->eb_addr,
+                                      p_comp->peer_eb_addr,
+                                      link_key, LK_DERIVATION_REASON_PAIR);
+
+      }
+  } else {
+      // update bond state changed for first device
+      RawAddress eb_bd_addr = RawAddress::kEmpty;
+      bond_state_changed(BT_STATUS_SUCCESS,
+            p_comp->eb_addr, BT_BOND_STATE_BONDED);
+      btif_tws_plus_update_rmt_dev_props(&p_comp->eb_addr,
+                                        &p_comp->eb_addr);
+      btif_tws_plus_set_peer_eb_addr(&p_comp->eb_addr,
+                                     &eb_bd_addr);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Function         btif_tws_plus_process_peer_sdp_comp
+ *
+ * Description      Handles the TWS+ SDP result of the peer of the earbud
+ *                  being bonded, searched in the same set. Records which
+ *                  earbud the peer links back to; its link key comes from
+ *                  the derivation done for the bonded earbud.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void btif_tws_plus_process_peer_sdp_comp(
+    tBTA_TWS_PLUS_SDP_SEARCH_COMP* p_comp, const RawAddress& eb_addr) {
+  if (BTA_TWS_PLUS_SUCCESS != p_comp->status ||
+      p_comp->eb_addr == RawAddress::kEmpty ||
+      p_comp->peer_eb_addr == RawAddress::kEmpty)
+    return;
+
+  btif_tws_plus_reverse_addr((RawAddress*)&p_comp->peer_eb_addr);
+  if (p_comp->peer_eb_addr != eb_addr) {
+    BTIF_TRACE_WARNING("%s() %s links to %s, not to %s", __func__,
+                       p_comp->eb_addr.ToString().c_str(),
+                       p_comp->peer_eb_addr.ToString().c_str(),
+                       eb_addr.ToString().c_str());
+    return;
+  }
+  btif_tws_plus_set_peer_eb_addr(&p_comp->eb_addr, &p_comp->peer_eb_addr);
+}
+
+static void btif_tws_plus_upstreams_evt(uint16_t event, char* p_param) {
+  tBTA_TWS_PLUS* p_data = (tBTA_TWS_PLUS*)p_param;
+
   BTIF_TRACE_EVENT("%s:  event = %d", __func__, event);
   switch (event) {
     case BTA_TWS_PLUS_SDP_SEARCH_COMP_EVT: {
-      if(BTA_TWS_PLUS_SUCCESS == p_data->sdp_search_comp.status &&
-         (p_data->sdp_search_comp.peer_eb_addr != RawAddress::kEmpty)) {
-          btif_tws_plus_reverse_addr(( RawAddress* ) &p_data->sdp_search_comp.peer_eb_addr);
-          BTIF_TRACE_DEBUG("%s() Bd addr found from SDP query : %s ", __func__,
-          p_data->sdp_search_comp.peer_eb_addr.ToString().c_str());
-
-          btif_tws_plus_set_peer_eb_addr(&p_data->sdp_search_comp.eb_addr,
-                                        &p_data->sdp_search_comp.peer_eb_addr);
-          if (btif_config_get_bin(p_data->sdp_search_comp.eb_addr.ToString().c_str(),
-                                  "LinkKey", key, &size)) {
-            btif_tws_plus_derive_link_key(p_data->sdp_search_comp.eb_addr,
-                                          p_data->sdp_search_comp.peer_eb_addr,
-                                          link_key, LK_DERIVATION_REASON_PAIR);
-
-          }
-      } else {
-          // update bond state changed for first device
-          RawAddress eb_bd_addr = RawAddress::kEmpty;
-          bond_state_changed(BT_STATUS_SUCCESS,
-                p_data->sdp_search_comp.eb_addr, BT_BOND_STATE_BONDED);
-          btif_tws_plus_update_rmt_dev_props(&p_data->sdp_search_comp.eb_addr,
-                                            &p_data->sdp_search_comp.eb_addr);
-          btif_tws_plus_set_peer_eb_addr(&p_data->sdp_search_comp.eb_addr,
-                                         &eb_bd_addr);
-      }
+      btif_tws_plus_process_sdp_comp(&p_data->sdp_search_comp);
+      break;
+    }
+    case BTA_TWS_PLUS_SDP_SET_COMP_EVT: {
+      BTIF_TRACE_DEBUG("%s() set search done, %s: %d, %s: %d", __func__,
+          p_data->sdp_set_comp.eb_comp.eb_addr.ToString().c_str(),
+          p_data->sdp_set_comp.eb_comp.status,
+          p_data->sdp_set_comp.peer_comp.eb_addr.ToString().c_str(),
+          p_data->sdp_set_comp.peer_comp.status);
+      btif_tws_plus_process_sdp_comp(&p_data->sdp_set_comp.eb_comp);
+      btif_tws_plus_process_peer_sdp_comp(&p_data->sdp_set_comp.peer_comp,
+                                          p_data->sdp_set_comp.eb_comp.eb_addr);
       break;
     }
     case BTA_TWS_PLUS_ENABLE_EVT: {
@@ -410,6 +731,7 @@ static void btif_tws_plus_upstreams_evt(uint16_t event, char* p_param) {
                     BTIF_TRACE_DEBUG("%s:  BTA_TWS_PLUS_LK_DERIVED_EVT  update for old device ", __func__);
                     RawAddress peer_eb_bdaddr  = RawAddress::kEmpty;
                     btif_storage_remove_bonded_device(&old_eb_bd_addr);
+                    btif_tws_plus_forget_device(&old_eb_bd_addr);
                     BTA_DmRemoveDevice(old_eb_bd_addr);
                     bond_state_changed(BT_STATUS_SUCCESS, old_eb_bd_addr, BT_BOND_STATE_NONE);
                     btif_tws_plus_set_peer_eb_addr(&old_eb_bd_addr, &peer_eb_bdaddr);
@@ -62,6 +62,10 @@
 #include <hardware/vendor.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
 #include <vector>
 
 #define LOG_TAG "bt_btif_vendor"
@@ -81,13 +85,23 @@
 #include "btm_api.h"
 #include "profile_config.h"
 #include "btif_tws_plus.h"
+#include "btif_vendor.h"
+#include "btif_bqr_analytics.h"
+#include "btif_afh_analytics.h"
+#include "btif_bat.h"
 #include "btif_api.h"
+#include "btu.h"
 #include "device/include/controller.h"
 #include "device/include/interop.h"
 #include "interop_config.h"
 #include "stack/btm/btm_int_types.h"
 #include "stack/btm/btm_int.h"
 #include "hardware/vendor.h"
+#include "hci_vendor_cmd.h"
+#include "btm_vendor_cmd.h"
+#include "hcivendorcmds.h"
+#include "osi/include/time.h"
+#include "a2dp_vendor_aptx_tws_sync.h"
 
 #if TEST_APP_INTERFACE == TRUE
 #include <bt_testapp.h>
@@ -102,6 +116,29 @@
 #define HCI_LE_SET_HOST_CHANNEL 0x2014
 #define HCI_LE_READ_AFH_CHANNEL_MAP 0x2015
 #define BR_EDR_MIN_GOOD_CHANNEL 20
+#define BTIF_VENDOR_IOT_INFO_MAX_ENTRIES 8
+/* Period of the background AFH map reads of all links, 0 disables them */
+#define BTIF_VENDOR_AFH_POLL_MS_PROP "persist.vendor.btstack.afh.poll_ms"
+#define WIFI_24GHZ_LOW_MHZ 2400
+#define WIFI_24GHZ_HIGH_MHZ 2500
+
+/* BQR reports are queued and handed to the JNI thread in batches. A batch is
+ * flushed when it reaches the configured size, when the cadence timer fires,
+ * or right away for reports other than periodic link quality monitoring. */
+#define BTIF_VENDOR_BQR_QUEUE_SIZE 16
+#define BTIF_VENDOR_BQR_MAX_LEN 255
+#define BTIF_VENDOR_BQR_BATCH_SIZE_DEFAULT 8
+#define BTIF_VENDOR_BQR_BATCH_MS_DEFAULT 1000
+#define BTIF_VENDOR_BQR_BATCH_SIZE_PROP "persist.vendor.btstack.bqr.batch_size"
+#define BTIF_VENDOR_BQR_BATCH_MS_PROP "persist.vendor.btstack.bqr.batch_ms"
+#define BTIF_VENDOR_BQR_ID_MONITOR_MODE 0x01
+#define BTIF_VENDOR_REMOTE_VER_CACHE_SIZE 8
+
+/* aptX-TWS delivery report: earbud, number of packets, then the 32 bit media
+ * timestamp of every packet that earbud acknowledged since the last report */
+#define BTIF_VENDOR_APTX_TWS_DELIVERY_HDR_LEN 2
+/* Sub event code of the vendor specific HCI event carrying the report */
+#define BTIF_VENDOR_APTX_TWS_DELIVERY_SUB_EVT 0x1D
 
 typedef struct {
   RawAddress bd_addr; /* BD address peer device. */
@@ -115,17 +152,84 @@ typedef struct {
   uint8_t lmp_ver;
   uint16_t lmp_subver;
   uint16_t manufacturer_id;
+  uint32_t num_events;      /* events merged into this entry */
+  uint64_t first_event_ms;
+  uint64_t last_event_ms;
   bool is_valid;
 } BTIF_VND_IOT_INFO_CB_DATA;
 
+typedef struct {
+  RawAddress bd_addr;
+  uint8_t lmp_ver;
+  uint16_t lmp_subver;
+  uint16_t manufacturer_id;
+  uint16_t len;
+  uint8_t data[BTIF_VENDOR_BQR_MAX_LEN];
+} BTIF_VND_BQR_REPORT;
+
+/* Remote version of a connected device, tied to the ACL handle it was read
+ * on so a reconnection (new handle) forces a fresh read. */
+typedef struct {
+  RawAddress bd_addr;
+  uint16_t handle;
+  uint8_t lmp_ver;
+  uint16_t lmp_subver;
+  uint16_t manufacturer_id;
+  bool in_use;
+} BTIF_VND_REMOTE_VER_CACHE;
+
+typedef struct {
+  BTIF_VND_BQR_REPORT queue[BTIF_VENDOR_BQR_QUEUE_SIZE];
+  uint8_t count;
+  uint8_t batch_size;
+  uint32_t batch_ms;
+  alarm_t* batch_timer;
+  BTIF_VND_REMOTE_VER_CACHE ver_cache[BTIF_VENDOR_REMOTE_VER_CACHE_SIZE];
+  uint8_t ver_cache_next;
+  std::mutex lock;
+} BTIF_VND_BQR_CB;
+
 typedef enum {
     LE_HIGH_PRIORITY_MODE_NONE = 0,
     LE_HIGH_PRIORITY_MODE_ENABLED = 1,
     LE_HIGH_PRIORITY_MODE_DISABLED = 2,
 } btle_high_priority_mode_t;
 
-static btle_high_priority_mode_t le_pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
-static RawAddress le_high_priority_bd_addr = {};
+/* Priority classes of LE links asking for high priority mode, a higher
+ * class wins a controller slot over a lower one. */
+typedef enum {
+    LE_HIGH_PRIORITY_CLASS_SENSOR = 0,
+    LE_HIGH_PRIORITY_CLASS_AUDIO = 1,
+    LE_HIGH_PRIORITY_CLASS_HID = 2,
+} btle_high_priority_class_t;
+
+typedef struct {
+    RawAddress bd_addr;
+    btle_high_priority_class_t prio_class;
+    uint32_t seq;       /* request order, earlier requests win within a class */
+    bool requested;     /* the upper layer wants high priority mode */
+    bool granted;       /* high priority mode enabled in the controller */
+    bool unconfirmed;   /* enable timed out, the controller may have applied it */
+    bool in_use;
+} btle_high_priority_req_t;
+
+/* Requests of all LE links, the best max_slots of them are granted */
+typedef struct {
+    btle_high_priority_req_t req[MAX_L2CAP_LINKS];
+    uint8_t max_slots;
+    uint32_t next_seq;
+    /* Controller command in flight, one at a time */
+    btle_high_priority_mode_t pending_mode;
+    RawAddress pending_addr;
+} btle_high_priority_cb_t;
+
+#define LE_HIGH_PRIORITY_SLOTS_PROP "persist.vendor.btstack.le_hp.max_links"
+#define LE_HIGH_PRIORITY_SLOTS_DEFAULT 1
+/* HID over GATT and Audio Streaming for Hearing Aid services */
+#define LE_HIGH_PRIORITY_HID_UUID  0x1812
+#define LE_HIGH_PRIORITY_ASHA_UUID 0xFDF0
+
+static btle_high_priority_cb_t le_hp_cb;
 static std::mutex le_high_priority_mutex_;
 
 extern bt_status_t btif_in_execute_service_request(tBTA_SERVICE_ID service_id,
@@ -137,12 +241,65 @@ extern tBTM_STATUS BTM_ReadRemoteVersion(const RawAddress& addr, uint8_t* lmp_ve
                                   uint16_t* lmp_sub_version);
 extern bool interface_ready(void);
 extern void set_prop_callouts(bt_property_callout_t *callouts);
-void btif_vendor_cleanup_iot_broadcast_timer(void);
 
 btvendor_callbacks_t *bt_vendor_callbacks = NULL;
 static alarm_t *broadcast_cb_timer = NULL;
+static alarm_t *afh_poll_timer = NULL;
+static std::atomic_bool afh_poll_active(false);
+/* batches of the last AFH poll still waiting for their reads. A batch
+ * carries the session it was sent in, batches of an earlier session are not
+ * counted. Both are guarded by afh_read_mutex_ */
+static int afh_poll_batches = 0;
+static uint32_t afh_poll_session = 0;
+/* get_afh_map requests whose result still has to go up, per link. Reads of
+ * links without an entry are background polls and only feed the analytics */
+typedef struct {
+    uint16_t handle;
+    uint8_t transport;
+    uint8_t count;
+} BTIF_VND_AFH_READ;
+static BTIF_VND_AFH_READ afh_read_pending[MAX_L2CAP_LINKS];
+static std::mutex afh_read_mutex_;
+static BTIF_VND_BQR_CB bqr_cb;
+
+using hci_vendor_cmd::HciCmd;
+using hci_vendor_cmd::HciVendorCmd;
+// sub_cmd, voip state, network type
+using VoipNetworkWifiCmd = HciVendorCmd<uint8_t, uint8_t, uint8_t>;
+// sub_cmd, enable, mode, adv interval, channel, jitter, offset
+using ClockSyncConfigCmd =
+    HciVendorCmd<uint8_t, uint8_t, uint8_t, uint16_t, uint8_t, uint8_t, int16_t>;
+// sub_cmd
+using ClockSyncStartCmd = HciVendorCmd<uint8_t>;
+// sub_cmd, LE acl handle, enable
+using LeHighPriorityModeCmd = HciVendorCmd<uint8_t, uint16_t, uint8_t>;
+typedef std::array<uint8_t, HCI_AFH_CHANNEL_MAP_LEN> BtifAfhBrEdrMap;
+typedef std::array<uint8_t, HCI_BTLE_AFH_CHANNEL_MAP_LEN> BtifAfhLeMap;
+// acl handle, returns acl handle, AFH mode, channel map
+using ReadAfhChannelMapCmd =
+    HciCmd<uint16_t>::Returning<uint16_t, uint8_t, BtifAfhBrEdrMap>;
+// acl handle, returns acl handle, channel map
+using LeReadChannelMapCmd = HciCmd<uint16_t>::Returning<uint16_t, BtifAfhLeMap>;
+// channel map
+using SetAfhHostChannelCmd = HciCmd<BtifAfhBrEdrMap>;
+// channel map
+using LeSetHostChannelCmd = HciCmd<BtifAfhLeMap>;
+
+#define BTIF_VENDOR_VSC_TIMEOUT_MS 2000
 static void btif_broadcast_timer_cb(UNUSED_ATTR void *data);
-BTIF_VND_IOT_INFO_CB_DATA broadcast_cb_data;
+static void btif_vendor_bqr_init(void);
+static void btif_vendor_bqr_cleanup(void);
+static void btif_vendor_afh_poll_init(void);
+static void btif_vendor_afh_poll_cleanup(void);
+static bool btif_vendor_afh_read_pending_take(uint16_t handle, uint8_t transport);
+static void btif_vendor_le_hp_init(void);
+static void btif_vendor_vse_cback(uint8_t len, uint8_t* p);
+static void set_le_high_priority_mode_complete(uint16_t cmd_id,
+        uint8_t cmd_status, tBTM_VSC_CMPL* p_data, void* context);
+/* Pending IoT events, one entry per device and event type. All entries are
+ * flushed together when broadcast_cb_timer fires. */
+static BTIF_VND_IOT_INFO_CB_DATA broadcast_cb_data[BTIF_VENDOR_IOT_INFO_MAX_ENTRIES];
+static std::mutex broadcast_cb_mutex_;
 
 #if TEST_APP_INTERFACE == TRUE
 extern const btl2cap_interface_t *btif_l2cap_get_interface(void);
@@ -169,6 +326,10 @@ static bt_status_t init( btvendor_callbacks_t* callbacks)
 {
     bt_vendor_callbacks = callbacks;
     broadcast_cb_timer = alarm_new("btif_vnd.cb_timer");
+    btif_vendor_bqr_init();
+    btif_vendor_afh_poll_init();
+    btif_vendor_le_hp_init();
+    BTM_RegisterForVSEvents(btif_vendor_vse_cback, true);
     LOG_INFO(LOG_TAG,"init");
     LOG_INFO(LOG_TAG,"init done");
     return BT_STATUS_SUCCESS;
@@ -200,14 +361,33 @@ static void btif_vendor_hci_close_event(uint16_t event, char *p_param)
 }
 static void btif_vendor_send_iot_info_cb(uint16_t event, char *p_param)
 {
-    broadcast_cb_data.is_valid = false;
-    HAL_CBACK(bt_vendor_callbacks, iot_device_broadcast_cb,
-            &broadcast_cb_data.bd_addr, broadcast_cb_data.error,
-            broadcast_cb_data.error_info, broadcast_cb_data.event_mask,
-            broadcast_cb_data.lmp_ver, broadcast_cb_data.lmp_subver,
-            broadcast_cb_data.manufacturer_id, broadcast_cb_data.power_level,
-            broadcast_cb_data.rssi, broadcast_cb_data.link_quality,
-            broadcast_cb_data.glitch_count);
+    BTIF_VND_IOT_INFO_CB_DATA pending[BTIF_VENDOR_IOT_INFO_MAX_ENTRIES];
+    int num_pending = 0;
+
+    {
+        std::unique_lock<std::mutex> guard(broadcast_cb_mutex_);
+        for (int i = 0; i < BTIF_VENDOR_IOT_INFO_MAX_ENTRIES; i++) {
+            if (!broadcast_cb_data[i].is_valid)
+                continue;
+            pending[num_pending++] = broadcast_cb_data[i];
+            broadcast_cb_data[i].is_valid = false;
+        }
+    }
+
+    for (int i = 0; i < num_pending; i++) {
+        BTIF_VND_IOT_INFO_CB_DATA* p_data = &pending[i];
+        LOG_INFO(LOG_TAG, "%s: %s error %d, %u events over %llu ms", __func__,
+                p_data->bd_addr.ToString().c_str(), p_data->error,
+                p_data->num_events,
+                (unsigned long long)(p_data->last_event_ms - p_data->first_event_ms));
+        HAL_CBACK(bt_vendor_callbacks, iot_device_broadcast_cb,
+                &p_data->bd_addr, p_data->error,
+                p_data->error_info, p_data->event_mask,
+                p_data->lmp_ver, p_data->lmp_subver,
+                p_data->manufacturer_id, p_data->power_level,
+                p_data->rssi, p_data->link_quality,
+                p_data->glitch_count);
+    }
 }
 
 void btif_vendor_update_add_on_features() {
@@ -301,6 +481,10 @@ void btif_vendor_cleanup_iot_broadcast_timer()
         alarm_free(broadcast_cb_timer);
         broadcast_cb_timer = NULL;
     }
+    btif_vendor_bqr_cleanup();
+    btif_vendor_afh_poll_cleanup();
+    BTM_RegisterForVSEvents(btif_vendor_vse_cback, false);
+    BTM_VscCleanup();
 }
 
 static void btif_vendor_get_remote_version(const RawAddress* bd_addr,
@@ -336,6 +520,15 @@ static void btif_vendor_get_remote_version(const RawAddress* bd_addr,
     }
 }
 
+/* SOC and host A2DP glitches of a device are reported as one event */
+static bool btif_vendor_iot_same_event(uint16_t error1, uint16_t error2)
+{
+    if (error1 == error2)
+        return true;
+    return (error1 == BT_SOC_A2DP_GLITCH || error1 == BT_HOST_A2DP_GLITCH) &&
+           (error2 == BT_SOC_A2DP_GLITCH || error2 == BT_HOST_A2DP_GLITCH);
+}
+
 void btif_vendor_iot_device_broadcast_event(RawAddress* bd_addr,
                 uint16_t error, uint16_t error_info, uint32_t event_mask,
                 uint8_t power_level, int8_t rssi, uint8_t link_quality,
@@ -345,48 +538,271 @@ void btif_vendor_iot_device_broadcast_event(RawAddress* bd_addr,
     uint16_t lmp_subver = 0;
     uint16_t manufacturer_id = 0;
 
-    btif_vendor_get_remote_version(bd_addr, &lmp_ver, &manufacturer_id, &lmp_subver);
-    if((error == BT_SOC_A2DP_GLITCH || error == BT_HOST_A2DP_GLITCH) && (glitch_count == 0))
+    if((error == BT_SOC_A2DP_GLITCH || error == BT_HOST_A2DP_GLITCH) && (glitch_count == 0)
+            && broadcast_cb_timer)
     {
-        if(broadcast_cb_data.is_valid)
-        {
-            broadcast_cb_data.error_info = broadcast_cb_data.error_info|error_info;
-            if(error == BT_SOC_A2DP_GLITCH && broadcast_cb_data.error == BT_HOST_A2DP_GLITCH)
+        std::unique_lock<std::mutex> guard(broadcast_cb_mutex_);
+        BTIF_VND_IOT_INFO_CB_DATA* p_free = NULL;
+        uint64_t now_ms = time_get_os_boottime_ms();
+
+        for (int i = 0; i < BTIF_VENDOR_IOT_INFO_MAX_ENTRIES; i++) {
+            BTIF_VND_IOT_INFO_CB_DATA* p_data = &broadcast_cb_data[i];
+            if (!p_data->is_valid) {
+                if (p_free == NULL)
+                    p_free = p_data;
+                continue;
+            }
+            if (p_data->bd_addr != *bd_addr ||
+                    !btif_vendor_iot_same_event(p_data->error, error))
+                continue;
+
+            p_data->error_info = p_data->error_info|error_info;
+            if(error == BT_SOC_A2DP_GLITCH && p_data->error == BT_HOST_A2DP_GLITCH)
             {
-                broadcast_cb_data.event_mask = broadcast_cb_data.event_mask|event_mask;
-                broadcast_cb_data.power_level = power_level;
-                broadcast_cb_data.rssi = rssi;
-                broadcast_cb_data.link_quality = link_quality;
+                p_data->event_mask = p_data->event_mask|event_mask;
+                p_data->power_level = power_level;
+                p_data->rssi = rssi;
+                p_data->link_quality = link_quality;
             }
-            broadcast_cb_data.glitch_count += glitch_count;
+            p_data->glitch_count += glitch_count;
+            p_data->num_events++;
+            p_data->last_event_ms = now_ms;
             return;
         }
-        else if(broadcast_cb_timer)
+
+        if (p_free)
         {
-            broadcast_cb_data.bd_addr = *bd_addr;
-            broadcast_cb_data.error = error;
-            broadcast_cb_data.error_info = error_info;
-            broadcast_cb_data.event_mask = event_mask;
-            broadcast_cb_data.power_level = power_level;
-            broadcast_cb_data.rssi = rssi;
-            broadcast_cb_data.link_quality = link_quality;
-            broadcast_cb_data.glitch_count = glitch_count;
-            broadcast_cb_data.lmp_ver = lmp_ver;
-            broadcast_cb_data.lmp_subver = lmp_subver;
-            broadcast_cb_data.manufacturer_id = manufacturer_id;
-            broadcast_cb_data.is_valid = true;
-
-            alarm_set(broadcast_cb_timer, CALLBACK_TIMER_PERIOD_MS, btif_broadcast_timer_cb, NULL);
+            btif_vendor_get_remote_version(bd_addr, &lmp_ver, &manufacturer_id, &lmp_subver);
+            p_free->bd_addr = *bd_addr;
+            p_free->error = error;
+            p_free->error_info = error_info;
+            p_free->event_mask = event_mask;
+            p_free->power_level = power_level;
+            p_free->rssi = rssi;
+            p_free->link_quality = link_quality;
+            p_free->glitch_count = glitch_count;
+            p_free->lmp_ver = lmp_ver;
+            p_free->lmp_subver = lmp_subver;
+            p_free->manufacturer_id = manufacturer_id;
+            p_free->num_events = 1;
+            p_free->first_event_ms = now_ms;
+            p_free->last_event_ms = now_ms;
+            p_free->is_valid = true;
+
+            if (!alarm_is_scheduled(broadcast_cb_timer))
+                alarm_set(broadcast_cb_timer, CALLBACK_TIMER_PERIOD_MS,
+                        btif_broadcast_timer_cb, NULL);
             return;
         }
+        /* Table full, report this one right away */
     }
 
+    btif_vendor_get_remote_version(bd_addr, &lmp_ver, &manufacturer_id, &lmp_subver);
     HAL_CBACK(bt_vendor_callbacks, iot_device_broadcast_cb, bd_addr,
             error, error_info, event_mask, lmp_ver, lmp_subver,
             manufacturer_id, power_level, rssi, link_quality,
             glitch_count);
 }
 
+/*******************************************************************************
+**
+** Function         btif_vendor_bqr_init
+**
+** Description     Reads the BQR batching configuration and allocates the
+**                 batch timer
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_bqr_init(void)
+{
+    std::unique_lock<std::mutex> guard(bqr_cb.lock);
+    int32_t batch_size = property_get_int32(BTIF_VENDOR_BQR_BATCH_SIZE_PROP,
+            BTIF_VENDOR_BQR_BATCH_SIZE_DEFAULT);
+    int32_t batch_ms = property_get_int32(BTIF_VENDOR_BQR_BATCH_MS_PROP,
+            BTIF_VENDOR_BQR_BATCH_MS_DEFAULT);
+
+    if (batch_size < 1)
+        batch_size = 1;
+    else if (batch_size > BTIF_VENDOR_BQR_QUEUE_SIZE)
+        batch_size = BTIF_VENDOR_BQR_QUEUE_SIZE;
+    if (batch_ms < 0)
+        batch_ms = 0;
+
+    bqr_cb.batch_size = (uint8_t)batch_size;
+    bqr_cb.batch_ms = (uint32_t)batch_ms;
+    bqr_cb.count = 0;
+    memset(bqr_cb.ver_cache, 0, sizeof(bqr_cb.ver_cache));
+    bqr_cb.ver_cache_next = 0;
+    if (bqr_cb.batch_timer == NULL)
+        bqr_cb.batch_timer = alarm_new("btif_vnd.bqr_timer");
+    btif_bqr_analytics_init();
+    LOG_INFO(LOG_TAG, "%s: batch size %d, batch interval %d ms", __func__,
+            bqr_cb.batch_size, bqr_cb.batch_ms);
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_bqr_cleanup
+**
+** Description     Drops the queued BQR reports and frees the batch timer
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_bqr_cleanup(void)
+{
+    alarm_t* batch_timer;
+
+    {
+        std::unique_lock<std::mutex> guard(bqr_cb.lock);
+        batch_timer = bqr_cb.batch_timer;
+        bqr_cb.batch_timer = NULL;
+        bqr_cb.count = 0;
+        memset(bqr_cb.ver_cache, 0, sizeof(bqr_cb.ver_cache));
+    }
+    /* Freed outside the lock, alarm_free waits for a running callback */
+    if (batch_timer)
+        alarm_free(batch_timer);
+    btif_bqr_analytics_cleanup();
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_bqr_get_remote_version
+**
+** Description     Returns the remote version of a connected device, reading
+**                 it from BTM only once per ACL connection.
+**                 Must be called with bqr_cb.lock held
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_bqr_get_remote_version(const RawAddress& bd_addr,
+        uint8_t* lmp_version, uint16_t* manufacturer, uint16_t* lmp_sub_version)
+{
+    BTIF_VND_REMOTE_VER_CACHE* p_entry = NULL;
+    uint16_t handle = BTM_GetHCIConnHandle(bd_addr, BT_TRANSPORT_BR_EDR);
+
+    if (handle == HCI_INVALID_HANDLE)
+        handle = BTM_GetHCIConnHandle(bd_addr, BT_TRANSPORT_LE);
+
+    if (handle == HCI_INVALID_HANDLE) {
+        btif_vendor_get_remote_version(&bd_addr, lmp_version, manufacturer,
+                lmp_sub_version);
+        return;
+    }
+
+    for (int i = 0; i < BTIF_VENDOR_REMOTE_VER_CACHE_SIZE; i++) {
+        if (bqr_cb.ver_cache[i].in_use && bqr_cb.ver_cache[i].bd_addr == bd_addr) {
+            p_entry = &bqr_cb.ver_cache[i];
+            break;
+        }
+    }
+
+    if (p_entry && p_entry->handle == handle) {
+        *lmp_version = p_entry->lmp_ver;
+        *manufacturer = p_entry->manufacturer_id;
+        *lmp_sub_version = p_entry->lmp_subver;
+        return;
+    }
+
+    btif_vendor_get_remote_version(&bd_addr, lmp_version, manufacturer,
+            lmp_sub_version);
+
+    /* Version exchange not finished yet, try again on the next report */
+    if (*lmp_version == 0 && *manufacturer == 0 && *lmp_sub_version == 0)
+        return;
+
+    if (p_entry == NULL) {
+        p_entry = &bqr_cb.ver_cache[bqr_cb.ver_cache_next];
+        bqr_cb.ver_cache_next =
+            (bqr_cb.ver_cache_next + 1) % BTIF_VENDOR_REMOTE_VER_CACHE_SIZE;
+    }
+    p_entry->bd_addr = bd_addr;
+    p_entry->handle = handle;
+    p_entry->lmp_ver = *lmp_version;
+    p_entry->manufacturer_id = *manufacturer;
+    p_entry->lmp_subver = *lmp_sub_version;
+    p_entry->in_use = true;
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_bqr_deliver_batch
+**
+** Description     Hands the queued BQR reports to the upper layer from the
+**                 JNI thread
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_bqr_deliver_batch(std::vector<BTIF_VND_BQR_REPORT> batch)
+{
+    for (BTIF_VND_BQR_REPORT& report : batch) {
+        HAL_CBACK(bt_vendor_callbacks, bqr_delivery_cb, &report.bd_addr,
+                report.lmp_ver, report.lmp_subver, report.manufacturer_id,
+                std::vector<uint8_t>(report.data, report.data + report.len));
+    }
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_bqr_flush_locked
+**
+** Description     Moves the queued BQR reports into a single JNI thread
+**                 post. Must be called with bqr_cb.lock held
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_bqr_flush_locked(void)
+{
+    if (bqr_cb.batch_timer)
+        alarm_cancel(bqr_cb.batch_timer);
+
+    if (bqr_cb.count == 0)
+        return;
+
+    std::vector<BTIF_VND_BQR_REPORT> batch(bqr_cb.queue,
+            bqr_cb.queue + bqr_cb.count);
+    bqr_cb.count = 0;
+
+    do_in_jni_thread(FROM_HERE,
+            base::Bind(&btif_vendor_bqr_deliver_batch, std::move(batch)));
+}
+
+static void btif_vendor_bqr_flush(void)
+{
+    std::unique_lock<std::mutex> guard(bqr_cb.lock);
+    btif_vendor_bqr_flush_locked();
+}
+
+/* Runs on the alarm thread. bqr_cb.lock is held around alarm_cancel, which
+ * waits for a running callback, so the flush must not take it here. */
+static void btif_vendor_bqr_batch_timer_cb(UNUSED_ATTR void *data)
+{
+    do_in_jni_thread(FROM_HERE, base::Bind(&btif_vendor_bqr_flush));
+}
+
+/* Choppy audio reported while broadcasting counts as loss on the primary
+ * BA stream, rate control drops the codec rate on repeated reports. The
+ * report itself stands for at least one flushed packet. */
+static void btif_vendor_bqr_ba_feedback(const uint8_t* bqr_raw_data,
+        uint32_t bqr_raw_data_len)
+{
+    tBTIF_BQR_LINK_QUALITY lq;
+
+    if (!btif_ba_is_active() ||
+            !btif_bqr_parse_link_quality(bqr_raw_data, bqr_raw_data_len, &lq) ||
+            lq.quality_report_id != BTIF_BQR_ID_A2DP_AUDIO_CHOPPY)
+        return;
+
+    uint32_t missed = lq.no_rx_count + lq.nak_count;
+    btif_ba_report_link_feedback((uint16_t)std::min<uint32_t>(missed, 0xFFFF),
+            1, false);
+}
+
 void btif_vendor_bqr_delivery_event(const RawAddress* bd_addr, const uint8_t* bqr_raw_data,
         uint32_t bqr_raw_data_len)
 {
@@ -400,27 +816,112 @@ void btif_vendor_bqr_delivery_event(const RawAddress* bd_addr, const uint8_t* bq
         return;
     }
 
-    std::vector<uint8_t> raw_data;
-    raw_data.insert(raw_data.begin(), bqr_raw_data, bqr_raw_data + bqr_raw_data_len);
+    btif_bqr_analytics_process(*bd_addr, bqr_raw_data, bqr_raw_data_len);
+    btif_vendor_bqr_ba_feedback(bqr_raw_data, bqr_raw_data_len);
 
+    std::unique_lock<std::mutex> guard(bqr_cb.lock);
     uint8_t lmp_ver = 0;
     uint16_t lmp_subver = 0;
     uint16_t manufacturer_id = 0;
-    btif_vendor_get_remote_version(bd_addr, &lmp_ver, &manufacturer_id, &lmp_subver);
+    btif_vendor_bqr_get_remote_version(*bd_addr, &lmp_ver, &manufacturer_id,
+            &lmp_subver);
 
-    LOG_INFO(LOG_TAG, "%s: len: %d, addr: %s, lmp_ver: %d, manufacturer_id: %d, lmp_subver: %d",
+    LOG_VERBOSE(LOG_TAG, "%s: len: %d, addr: %s, lmp_ver: %d, manufacturer_id: %d, lmp_subver: %d",
             __func__, bqr_raw_data_len, bd_addr->ToString().c_str(), lmp_ver,
             manufacturer_id, lmp_subver);
 
-    do_in_jni_thread(
-        FROM_HERE,
-        base::Bind(
-            [](RawAddress addr, uint8_t lmp_ver, uint16_t lmp_subver, uint16_t manufacturer_id,
-                std::vector<uint8_t> raw_data) {
-                HAL_CBACK(bt_vendor_callbacks, bqr_delivery_cb, &addr,
-                    lmp_ver, lmp_subver, manufacturer_id, std::move(raw_data));
-            },
-            *bd_addr, lmp_ver, lmp_subver, manufacturer_id, std::move(raw_data)));
+    if (bqr_raw_data_len > BTIF_VENDOR_BQR_MAX_LEN) {
+        /* Does not fit a queue slot, keep ordering and send it on its own */
+        btif_vendor_bqr_flush_locked();
+        std::vector<uint8_t> raw_data(bqr_raw_data, bqr_raw_data + bqr_raw_data_len);
+        do_in_jni_thread(
+            FROM_HERE,
+            base::Bind(
+                [](RawAddress addr, uint8_t lmp_ver, uint16_t lmp_subver, uint16_t manufacturer_id,
+                    std::vector<uint8_t> raw_data) {
+                    HAL_CBACK(bt_vendor_callbacks, bqr_delivery_cb, &addr,
+                        lmp_ver, lmp_subver, manufacturer_id, std::move(raw_data));
+                },
+                *bd_addr, lmp_ver, lmp_subver, manufacturer_id, std::move(raw_data)));
+        return;
+    }
+
+    BTIF_VND_BQR_REPORT* p_report = &bqr_cb.queue[bqr_cb.count++];
+    p_report->bd_addr = *bd_addr;
+    p_report->lmp_ver = lmp_ver;
+    p_report->lmp_subver = lmp_subver;
+    p_report->manufacturer_id = manufacturer_id;
+    p_report->len = (uint16_t)bqr_raw_data_len;
+    memcpy(p_report->data, bqr_raw_data, bqr_raw_data_len);
+
+    /* Anything but periodic monitoring (LSTO, choppy audio, ...) is an
+     * event the upper layer wants to see right away. */
+    if (bqr_cb.count >= bqr_cb.batch_size || bqr_cb.batch_ms == 0 ||
+            bqr_cb.batch_timer == NULL ||
+            (bqr_raw_data_len > 0 &&
+             bqr_raw_data[0] != BTIF_VENDOR_BQR_ID_MONITOR_MODE)) {
+        btif_vendor_bqr_flush_locked();
+        return;
+    }
+
+    if (!alarm_is_scheduled(bqr_cb.batch_timer))
+        alarm_set(bqr_cb.batch_timer, bqr_cb.batch_ms,
+                btif_vendor_bqr_batch_timer_cb, NULL);
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_aptx_tws_delivery_event
+**
+** Description     Feeds an aptX-TWS delivery report of one earbud into the
+**                 left/right synchronization. The packets count as delivered
+**                 when the report arrives
+**
+** Returns         void
+**
+*******************************************************************************/
+void btif_vendor_aptx_tws_delivery_event(const uint8_t* p_data, uint32_t len)
+{
+    uint64_t now_us = time_get_os_boottime_us();
+
+    if (p_data == NULL || len < BTIF_VENDOR_APTX_TWS_DELIVERY_HDR_LEN) {
+        LOG_ERROR(LOG_TAG, "%s: invalid report, len: %u", __func__, len);
+        return;
+    }
+
+    uint8_t earbud = p_data[0];
+    uint8_t num_packets = p_data[1];
+    if (len < BTIF_VENDOR_APTX_TWS_DELIVERY_HDR_LEN + 4u * num_packets) {
+        LOG_ERROR(LOG_TAG, "%s: truncated report, %u packets in %u bytes",
+                __func__, num_packets, len);
+        return;
+    }
+
+    const uint8_t* p = p_data + BTIF_VENDOR_APTX_TWS_DELIVERY_HDR_LEN;
+    for (uint8_t i = 0; i < num_packets; i++) {
+        uint32_t timestamp;
+        STREAM_TO_UINT32(timestamp, p);
+        a2dp_vendor_aptx_tws_sync_report_delivery(earbud, timestamp, now_us);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_vse_cback
+**
+** Description     Vendor specific HCI events, called on the stack main thread.
+**                 |p| starts at the sub event code
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_vse_cback(uint8_t len, uint8_t* p)
+{
+    if (len < 1 || p == NULL)
+        return;
+
+    if (p[0] == BTIF_VENDOR_APTX_TWS_DELIVERY_SUB_EVT)
+        btif_vendor_aptx_tws_delivery_event(p + 1, len - 1);
 }
 
 static void bredrstartup(void)
@@ -444,92 +945,131 @@ static void hciclose(void)
 }
 
 
-#if HCI_RAW_CMD_INCLUDED == TRUE
-// Callback invoked on receiving HCI event
-static void btif_vendor_hci_cmd_cmpl_callback (tBTM_RAW_CMPL *p_data)
-{
-    uint8_t *stream, event_code, length ,afh_map_len;
-    std::vector<uint8_t> afh_map;
+/* Context of the AFH commands sent through the dispatcher, the opcode and
+ * the link a read is for, which a timed out read has no event to take from */
+#define BTIF_VENDOR_HCI_CTX(opcode, handle) \
+        ((void*)(uintptr_t)(((uint32_t)(opcode) << 16) | (handle)))
+#define BTIF_VENDOR_HCI_CTX_OPCODE(ctx) ((uint16_t)((uintptr_t)(ctx) >> 16))
+#define BTIF_VENDOR_HCI_CTX_HANDLE(ctx) ((uint16_t)(uintptr_t)(ctx))
 
-    if ((p_data != NULL)&&(stream = (uint8_t*)p_data->p_param_buf)) {
-        length = p_data->param_len;
-        event_code = p_data->event_code;
-        if(event_code == HCI_COMMAND_COMPLETE_EVT) {
-            uint8_t status = p_data->p_param_buf[3];
-            uint8_t afh_mode = p_data->p_param_buf[6];
-            uint16_t opcode = p_data->p_param_buf[1]|p_data->p_param_buf[2] << 8;
-            BTIF_TRACE_DEBUG("%s opcode %x", __FUNCTION__, opcode);
-            if(opcode == READ_AFH_CHANNEL_MAP) {
-                afh_map_len = HCI_AFH_CHANNEL_MAP_LEN ;
-                for(int i = 7,j=0 ;i< length ;i++,j++){
-                    afh_map.insert(afh_map.begin()+j,p_data->p_param_buf[i]);
-                }
-
-                do_in_jni_thread(
-                    FROM_HERE,
-                    base::Bind(
-                        [](std::vector<uint8_t> afh_map, uint16_t afh_map_len, uint8_t afh_mode,
-                            uint8_t status) {
-                            HAL_CBACK(bt_vendor_callbacks, afh_map_cb, std::move(afh_map),
-                                                            afh_map_len, afh_mode, status);
-                        },
-                        std::move(afh_map), afh_map_len, afh_mode, status));
-
-            } else if (opcode == HCI_LE_READ_AFH_CHANNEL_MAP) {
-                afh_map_len = HCI_BTLE_AFH_CHANNEL_MAP_LEN ;
-                for(int i = 6,j=0 ;i< length ;i++,j++){
-                    afh_map.insert(afh_map.begin()+j,p_data->p_param_buf[i]);
-                }
-                do_in_jni_thread(
-                    FROM_HERE,
-                    base::Bind(
-                        [](std::vector<uint8_t> afh_map, uint16_t afh_map_len, uint8_t afh_mode,
-                            uint8_t status) {
-                            HAL_CBACK(bt_vendor_callbacks, afh_map_cb, std::move(afh_map),
-                                                                  afh_map_len, -1, status);
-                        },
-                        std::move(afh_map), afh_map_len, afh_mode, status));
-            } else if (opcode == HCI_SET_AFH_HOST_CHANNEL) {
-                uint8_t afh_status = p_data->p_param_buf[3];
-                uint8_t afh_transport = BT_TRANSPORT_BR_EDR;
-                do_in_jni_thread(
-                    FROM_HERE,
-                    base::Bind(
-                        [](uint8_t status, uint8_t transport) {
-                            HAL_CBACK(bt_vendor_callbacks, afh_map_status_cb, status,
-                                                                transport);
-                        },
-                        afh_status, afh_transport));
-            } else if(opcode == HCI_LE_SET_HOST_CHANNEL) {
-                uint8_t afh_status = p_data->p_param_buf[3];
-                uint8_t afh_transport = BT_TRANSPORT_LE;
-                do_in_jni_thread(
-                    FROM_HERE,
-                    base::Bind(
-                        [](uint8_t status, uint8_t transport) {
-                            HAL_CBACK(bt_vendor_callbacks, afh_map_status_cb, status,
-                                                                transport);
-                        },
-                        afh_status, afh_transport));
+static void btif_vendor_afh_map_up(std::vector<uint8_t> afh_map,
+        uint16_t afh_map_len, uint8_t afh_mode, uint8_t status)
+{
+    do_in_jni_thread(
+        FROM_HERE,
+        base::Bind(
+            [](std::vector<uint8_t> afh_map, uint16_t afh_map_len, uint8_t afh_mode,
+                uint8_t status) {
+                HAL_CBACK(bt_vendor_callbacks, afh_map_cb, std::move(afh_map),
+                                                afh_map_len, afh_mode, status);
+            },
+            std::move(afh_map), afh_map_len, afh_mode, status));
+}
 
-            }
-        }
+/*******************************************************************************
+**
+** Function         btif_vendor_hci_cmd_cmpl_callback
+**
+** Description      Completion of the AFH commands, p_data holds the return
+**                  parameters starting with status. On timeout p_data is NULL
+**                  and the opcode and link are taken from the context
+**
+** Returns          void
+**
+*******************************************************************************/
+static void btif_vendor_hci_cmd_cmpl_callback(UNUSED_ATTR uint16_t cmd_id,
+        uint8_t cmd_status, tBTM_VSC_CMPL* p_data, void* context)
+{
+    uint16_t opcode = BTIF_VENDOR_HCI_CTX_OPCODE(context);
+    uint16_t handle = BTIF_VENDOR_HCI_CTX_HANDLE(context);
+    uint8_t status = (cmd_status == BTM_VSC_STATUS_TIMEOUT) ?
+            HCI_ERR_HOST_TIMEOUT : cmd_status;
+    uint8_t* stream = (p_data != NULL) ? p_data->p_param_buf : NULL;
+    uint16_t length = (p_data != NULL) ? p_data->param_len : 0;
+    uint8_t cmpl_status;
+
+    BTIF_TRACE_DEBUG("%s opcode %x status %x", __FUNCTION__, opcode, status);
+    if (opcode == READ_AFH_CHANNEL_MAP) {
+        uint16_t cmpl_handle;
+        uint8_t afh_mode = 0;
+        BtifAfhBrEdrMap map;
+        /* a failed read may come without the map, nothing to analyze then */
+        bool decoded = ReadAfhChannelMapCmd::Cmpl::Decode(stream, length,
+                &cmpl_status, &cmpl_handle, &afh_mode, &map);
+        if (decoded)
+            handle = cmpl_handle;
+        if (decoded && status == HCI_SUCCESS)
+            btif_afh_analytics_update(handle, BT_TRANSPORT_BR_EDR,
+                    map.data(), map.size());
+        if (!btif_vendor_afh_read_pending_take(handle, BT_TRANSPORT_BR_EDR))
+            return;
+        std::vector<uint8_t> afh_map;
+        if (decoded)
+            afh_map.assign(map.begin(), map.end());
+        btif_vendor_afh_map_up(std::move(afh_map), HCI_AFH_CHANNEL_MAP_LEN,
+                afh_mode, status);
+    } else if (opcode == HCI_LE_READ_AFH_CHANNEL_MAP) {
+        uint16_t cmpl_handle;
+        BtifAfhLeMap map;
+        bool decoded = LeReadChannelMapCmd::Cmpl::Decode(stream, length,
+                &cmpl_status, &cmpl_handle, &map);
+        if (decoded)
+            handle = cmpl_handle;
+        if (decoded && status == HCI_SUCCESS)
+            btif_afh_analytics_update(handle, BT_TRANSPORT_LE,
+                    map.data(), map.size());
+        if (!btif_vendor_afh_read_pending_take(handle, BT_TRANSPORT_LE))
+            return;
+        std::vector<uint8_t> afh_map;
+        if (decoded)
+            afh_map.assign(map.begin(), map.end());
+        btif_vendor_afh_map_up(std::move(afh_map),
+                HCI_BTLE_AFH_CHANNEL_MAP_LEN, -1, status);
+    } else if (opcode == HCI_SET_AFH_HOST_CHANNEL ||
+               opcode == HCI_LE_SET_HOST_CHANNEL) {
+        uint8_t afh_transport = (opcode == HCI_SET_AFH_HOST_CHANNEL) ?
+                BT_TRANSPORT_BR_EDR : BT_TRANSPORT_LE;
+        do_in_jni_thread(
+            FROM_HERE,
+            base::Bind(
+                [](uint8_t status, uint8_t transport) {
+                    HAL_CBACK(bt_vendor_callbacks, afh_map_status_cb, status,
+                                                        transport);
+                },
+                status, afh_transport));
     }
 }
-#endif
 
 int hci_cmd_send(uint16_t opcode, uint8_t* buf, uint8_t len)
 {
     BTIF_TRACE_DEBUG("hci_cmd_send");
-    return BTA_DmHciRawCommand(opcode, len, buf, btif_vendor_hci_cmd_cmpl_callback);
+    if (BTM_VscSubmitRaw(opcode, len, buf, BTIF_VENDOR_VSC_TIMEOUT_MS,
+            btif_vendor_hci_cmd_cmpl_callback,
+            BTIF_VENDOR_HCI_CTX(opcode, 0)) == BTM_VSC_INVALID_ID)
+        return BTA_FAILURE;
+    return BTA_SUCCESS;
 }
 
 static void set_wifi_state(bool status)
 {
     LOG_INFO(LOG_TAG,"setWifiState :%d", status);
+    if (!status)
+        btif_afh_analytics_set_wifi_channel(0, 0);
     BTA_DmSetWifiState(status);
 }
 
+static void set_wifi_channel(int center_freq_mhz, int width_mhz)
+{
+    LOG_INFO(LOG_TAG,"setWifiChannel :%d MHz, %d MHz wide", center_freq_mhz,
+            width_mhz);
+    /* Only the 2.4 GHz band shares channels with Bluetooth */
+    if (center_freq_mhz < WIFI_24GHZ_LOW_MHZ ||
+            center_freq_mhz > WIFI_24GHZ_HIGH_MHZ || width_mhz <= 0)
+        btif_afh_analytics_set_wifi_channel(0, 0);
+    else
+        btif_afh_analytics_set_wifi_channel(center_freq_mhz, width_mhz);
+}
+
 static void set_Power_back_off_state(bool status)
 {
     LOG_INFO(LOG_TAG,"setPowerBackOffState :%d ", status);
@@ -554,18 +1094,23 @@ static void cleanup(void)
         bt_vendor_callbacks = NULL;
 }
 
-static void set_voip_network_type_wifi_hci_cmd_complete(tBTM_VSC_CMPL* p_data)
+static void set_voip_network_type_wifi_hci_cmd_complete(uint16_t cmd_id,
+        uint8_t cmd_status, tBTM_VSC_CMPL* p_data, UNUSED_ATTR void* context)
 {
     LOG_INFO(LOG_TAG,"In set_voip_network_type_wifi_hci_cmd_complete");
-    uint8_t         *stream,  status, subcmd;
+    uint8_t         status, subcmd;
     uint16_t        opcode, length;
 
-    if (p_data && (stream = (uint8_t*)p_data->p_param_buf))
+    if (cmd_status == BTM_VSC_STATUS_TIMEOUT)
+    {
+        BTIF_TRACE_ERROR("%s command %d timed out", __FUNCTION__, cmd_id);
+        return;
+    }
+    if (p_data && VoipNetworkWifiCmd::Cmpl::Decode(p_data->p_param_buf,
+                                             p_data->param_len, &status, &subcmd))
     {
         opcode = p_data->opcode;
         length = p_data->param_len;
-        STREAM_TO_UINT8(status, stream);
-        STREAM_TO_UINT8(subcmd, stream);
         BTIF_TRACE_DEBUG("%s opcode = 0x%04X, length = %d, status = %d, subcmd = %d",
                 __FUNCTION__, opcode, length, status, subcmd);
         if (status == HCI_SUCCESS)
@@ -588,18 +1133,14 @@ bt_status_t voip_network_type_wifi(bthf_voip_state_t isVoipStarted,
                                            bthf_voip_call_network_type_t isNetworkWifi)
 {
     LOG_INFO(LOG_TAG,"In voip_network_type_wifi");
-    uint8_t           cmd[3], *p_cursor;
-    uint8_t           sub_cmd = HCI_VSC_SUBCODE_VOIP_NETWORK_WIFI;
-
-    p_cursor = cmd;
-    memset(cmd, 0, 3);
-
-    *p_cursor++ = sub_cmd;
-    *p_cursor++ = isVoipStarted;
-    *p_cursor++ = isNetworkWifi;
-
-    BTM_VendorSpecificCommand(HCI_VSC_VOIP_NETWORK_WIFI_OCF, sizeof(cmd),
-            cmd, set_voip_network_type_wifi_hci_cmd_complete);
+    VoipNetworkWifiCmd::Buffer cmd = VoipNetworkWifiCmd::Encode(
+            HCI_VSC_SUBCODE_VOIP_NETWORK_WIFI, isVoipStarted, isNetworkWifi);
+
+    if (BTM_VscSubmit(HCI_VSC_VOIP_NETWORK_WIFI_OCF, cmd.size(), cmd.data(),
+            BTIF_VENDOR_VSC_TIMEOUT_MS,
+            set_voip_network_type_wifi_hci_cmd_complete, NULL) ==
+            BTM_VSC_INVALID_ID)
+        return BT_STATUS_BUSY;
     return BT_STATUS_SUCCESS;
 }
 
@@ -612,12 +1153,27 @@ bt_status_t voip_network_type_wifi(bthf_voip_state_t isVoipStarted,
 ** Returns          None
 **
 *******************************************************************************/
-static void clock_sync_cback(tBTM_VSC_CMPL *param)
+static void clock_sync_cback(uint16_t cmd_id, uint8_t cmd_status,
+                             tBTM_VSC_CMPL *param, UNUSED_ATTR void* context)
 {
-    CHECK(param->param_len > 1);
+    static_assert(std::is_same<ClockSyncConfigCmd::Cmpl,
+                               ClockSyncStartCmd::Cmpl>::value,
+                  "clock sync commands share their completion");
+    uint8_t status, subcmd;
+    if (cmd_status == BTM_VSC_STATUS_TIMEOUT) {
+        BTIF_TRACE_ERROR("%s: command %d timed out", __func__, cmd_id);
+        return;
+    }
+    bool decoded = ClockSyncConfigCmd::Cmpl::Decode(param->p_param_buf,
+            param->param_len, &status, &subcmd);
+    if (!decoded) {
+        BTIF_TRACE_ERROR("%s: command %d, short event of %d bytes", __func__,
+                cmd_id, param->param_len);
+        return;
+    }
 
     BTIF_TRACE_DEBUG("%s: opcode=%x, subopcode=%x, status=%d",
-        __func__, param->opcode, param->p_param_buf[1], param->p_param_buf[0]);
+        __func__, param->opcode, subcmd, status);
 }
 
 /*******************************************************************************
@@ -642,8 +1198,6 @@ static bool set_clock_sync_config(bool enable, int mode, int adv_interval,
     int channel, int jitter, int offset)
 {
     uint16_t opcode = 0xfc35;
-    uint8_t cmdbuf[128], *ptr = cmdbuf;
-    uint32_t cmdlen = 0;
 
     BTIF_TRACE_DEBUG("%s", __func__);
     if (mode != 0 && mode != 1) {
@@ -651,44 +1205,30 @@ static bool set_clock_sync_config(bool enable, int mode, int adv_interval,
       return false;
     }
 
-    *ptr++ = (uint8_t)0; // subcode
-    cmdlen ++;
-
-    *ptr++ = (uint8_t) enable;  // enable
-    cmdlen ++;
-
-    *ptr++ = (uint8_t) mode;  // mode - 00: GPIO, 1: VSC
-    cmdlen ++;
-
     if (adv_interval < 0xa0)
       adv_interval = 0xa0;
     if (adv_interval > 0x4000)
       adv_interval = 0x4000;
-    *(uint16_t *)ptr = (uint16_t) adv_interval; // advertise interval
-    ptr +=2;
-    cmdlen += 2;
 
     channel &= 0x7;
-    *ptr++ = (uint8_t) channel; // channel
-    cmdlen ++;
 
     if (jitter < 0)
       jitter = 0;
     if (jitter > 8)
       jitter = 8;
-    *ptr++ = (uint8_t) jitter;  // jitter
-    cmdlen ++;
 
     if (offset < -32768)
       offset = -32768;
     if (offset > 32767)
       offset = 32767;
-    *(uint16_t *)ptr = (uint16_t) offset; // offset
-    ptr += 2;
-    cmdlen += 2;
 
-    BTM_VendorSpecificCommand(opcode, cmdlen, cmdbuf, clock_sync_cback);
-    return true;
+    // mode - 00: GPIO, 1: VSC
+    ClockSyncConfigCmd::Buffer cmd = ClockSyncConfigCmd::Encode(0x00,
+        (uint8_t)enable, (uint8_t)mode, (uint16_t)adv_interval,
+        (uint8_t)channel, (uint8_t)jitter, (int16_t)offset);
+
+    return BTM_VscSubmit(opcode, cmd.size(), cmd.data(),
+        BTIF_VENDOR_VSC_TIMEOUT_MS, clock_sync_cback, NULL) != BTM_VSC_INVALID_ID;
 }
 
 /*******************************************************************************
@@ -703,10 +1243,11 @@ static bool set_clock_sync_config(bool enable, int mode, int adv_interval,
 static void start_clock_sync(void)
 {
     uint16_t opcode = 0xfc35;
-    uint8_t cmdbuf[] = {0x01}; // subcode
+    ClockSyncStartCmd::Buffer cmd = ClockSyncStartCmd::Encode(0x01);
 
     BTIF_TRACE_DEBUG("%s", __func__);
-    BTM_VendorSpecificCommand(opcode, 1, cmdbuf, clock_sync_cback);
+    BTM_VscSubmit(opcode, cmd.size(), cmd.data(), BTIF_VENDOR_VSC_TIMEOUT_MS,
+        clock_sync_cback, NULL);
 }
 
 static bool vendor_interop_match_addr(const char* feature_name,
@@ -797,32 +1338,209 @@ static void vendor_interop_database_add_remove_name(bool do_add,
   }
 }
 
+static void btif_vendor_le_hp_init(void)
+{
+    std::unique_lock<std::mutex> guard(le_high_priority_mutex_);
+    int32_t max_slots = property_get_int32(LE_HIGH_PRIORITY_SLOTS_PROP,
+            LE_HIGH_PRIORITY_SLOTS_DEFAULT);
+
+    memset(le_hp_cb.req, 0, sizeof(le_hp_cb.req));
+    le_hp_cb.max_slots = (uint8_t)std::min(std::max(max_slots, 1),
+            (int32_t)MAX_L2CAP_LINKS);
+    le_hp_cb.next_seq = 1;
+    le_hp_cb.pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
+}
+
+static void btif_vendor_le_hp_notify(const RawAddress& bd_addr, uint8_t status,
+        bool mode)
+{
+    do_in_jni_thread(
+        FROM_HERE,
+        base::Bind(
+            [](RawAddress addr, uint8_t status, bool mode) {
+                HAL_CBACK(bt_vendor_callbacks, le_high_priority_mode_cb, status,
+                          &addr, mode);
+            },
+            bd_addr, status, mode));
+}
+
+/* Must be called with le_high_priority_mutex_ held */
+static btle_high_priority_req_t* btif_vendor_le_hp_find(const RawAddress& bd_addr)
+{
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        if (le_hp_cb.req[i].in_use && le_hp_cb.req[i].bd_addr == bd_addr)
+            return &le_hp_cb.req[i];
+    }
+    return NULL;
+}
+
+/* Derives the priority class from the services the device exposes, falling
+ * back to the class of device, which for LE devices is built from the GAP
+ * appearance. */
+static btle_high_priority_class_t btif_vendor_le_hp_get_class(const RawAddress& bd_addr)
+{
+    bt_property_t prop;
+    bluetooth::Uuid uuids[BT_MAX_NUM_UUIDS];
+    uint32_t cod = 0;
+
+    prop.type = BT_PROPERTY_UUIDS;
+    prop.len = sizeof(uuids);
+    prop.val = (void*)uuids;
+    if (btif_storage_get_remote_device_property(&bd_addr, &prop) ==
+            BT_STATUS_SUCCESS) {
+        int num_uuids = prop.len / sizeof(bluetooth::Uuid);
+        btle_high_priority_class_t prio_class = LE_HIGH_PRIORITY_CLASS_SENSOR;
+        for (int i = 0; i < num_uuids; i++) {
+            if (uuids[i] == bluetooth::Uuid::From16Bit(LE_HIGH_PRIORITY_HID_UUID))
+                return LE_HIGH_PRIORITY_CLASS_HID;
+            if (uuids[i] == bluetooth::Uuid::From16Bit(LE_HIGH_PRIORITY_ASHA_UUID))
+                prio_class = LE_HIGH_PRIORITY_CLASS_AUDIO;
+        }
+        if (prio_class != LE_HIGH_PRIORITY_CLASS_SENSOR)
+            return prio_class;
+    }
+
+    prop.type = BT_PROPERTY_CLASS_OF_DEVICE;
+    prop.len = sizeof(cod);
+    prop.val = (void*)&cod;
+    if (btif_storage_get_remote_device_property(&bd_addr, &prop) !=
+            BT_STATUS_SUCCESS)
+        return LE_HIGH_PRIORITY_CLASS_SENSOR;
+
+    /* Only pointing devices and keyboards, a generic peripheral may be a
+     * remote control or a sensor tag */
+    if ((cod & 0x1FC0) == 0x0540 || (cod & 0x1FC0) == 0x0580 ||
+            (cod & 0x1FC0) == 0x05C0)
+        return LE_HIGH_PRIORITY_CLASS_HID;
+    if ((cod & 0x1F00) == 0x0400)
+        return LE_HIGH_PRIORITY_CLASS_AUDIO;
+    return LE_HIGH_PRIORITY_CLASS_SENSOR;
+}
+
+/* true if request |a| should get a slot before request |b|. Within a class
+ * requests are served in order, so a later request never takes the slot of
+ * a link of its own class */
+static bool btif_vendor_le_hp_before(const btle_high_priority_req_t* a,
+        const btle_high_priority_req_t* b)
+{
+    if (a->prio_class != b->prio_class)
+        return a->prio_class > b->prio_class;
+    return a->seq < b->seq;
+}
+
+/* false if the link is gone or the command could not be queued. Must be
+ * called with le_high_priority_mutex_ held */
+static bool btif_vendor_le_hp_send(const RawAddress& bd_addr, bool enable)
+{
+    tACL_CONN* acl = btm_bda_to_acl(bd_addr, BT_TRANSPORT_LE);
+    if (acl == nullptr)
+        return false;
+
+    LeHighPriorityModeCmd::Buffer param = LeHighPriorityModeCmd::Encode(
+        HCI_VSC_LE_HIGH_PRIORITY_MODE_OCF, acl->hci_handle,
+        enable ? 0x01 : 0x00);
+    le_hp_cb.pending_mode = enable ? LE_HIGH_PRIORITY_MODE_ENABLED :
+                                     LE_HIGH_PRIORITY_MODE_DISABLED;
+    le_hp_cb.pending_addr = bd_addr;
+    if (BTM_VscSubmit(HCI_VSC_LE_HIGH_PRIORITY_MODE, param.size(), param.data(),
+            BTIF_VENDOR_VSC_TIMEOUT_MS, set_le_high_priority_mode_complete,
+            NULL) == BTM_VSC_INVALID_ID) {
+        le_hp_cb.pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_le_hp_schedule
+**
+** Description     Works out which requests should hold the controller's high
+**                 priority slots and sends the next command needed to get
+**                 there. Demotions go first so a slot is free before it is
+**                 handed over. Must be called with le_high_priority_mutex_
+**                 held
+**
+** Returns         void
+**
+*******************************************************************************/
+static void btif_vendor_le_hp_schedule(void)
+{
+    bool wanted[MAX_L2CAP_LINKS];
+
+    if (le_hp_cb.pending_mode != LE_HIGH_PRIORITY_MODE_NONE)
+        return;
+
+    /* A request is wanted if fewer than max_slots requests rank above it */
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        int rank = 0;
+        wanted[i] = false;
+        if (!le_hp_cb.req[i].in_use || !le_hp_cb.req[i].requested)
+            continue;
+        for (int j = 0; j < MAX_L2CAP_LINKS; j++) {
+            if (j != i && le_hp_cb.req[j].in_use && le_hp_cb.req[j].requested &&
+                    btif_vendor_le_hp_before(&le_hp_cb.req[j], &le_hp_cb.req[i]))
+                rank++;
+        }
+        wanted[i] = rank < le_hp_cb.max_slots;
+    }
+
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        btle_high_priority_req_t* p_req = &le_hp_cb.req[i];
+        if (!p_req->in_use || !p_req->granted || wanted[i])
+            continue;
+        LOG_INFO(LOG_TAG, "%s: demoting %s", __func__,
+                p_req->bd_addr.ToString().c_str());
+        if (btif_vendor_le_hp_send(p_req->bd_addr, false))
+            return;
+        /* Link already gone, nothing to turn off */
+        p_req->granted = false;
+        p_req->in_use = p_req->requested;
+    }
+
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        btle_high_priority_req_t* p_req = &le_hp_cb.req[i];
+        if (!p_req->in_use || p_req->granted || !wanted[i])
+            continue;
+        LOG_INFO(LOG_TAG, "%s: promoting %s", __func__,
+                p_req->bd_addr.ToString().c_str());
+        if (btif_vendor_le_hp_send(p_req->bd_addr, true))
+            return;
+        p_req->in_use = false;
+    }
+}
+
 void btif_vendor_le_acl_disconnected (RawAddress bd_addr) {
     LOG_INFO(LOG_TAG,"In btif_vendor_le_acl_disconnected");
     std::unique_lock<std::mutex> guard(le_high_priority_mutex_);
-    if(le_high_priority_bd_addr == bd_addr) {
-        le_high_priority_bd_addr = {};
+    btle_high_priority_req_t* p_req = btif_vendor_le_hp_find(bd_addr);
+    if(p_req) {
         LOG_INFO(LOG_TAG," reset LE high priority mode address");
-        HAL_CBACK(bt_vendor_callbacks, le_high_priority_mode_cb,
-                  0, &le_high_priority_bd_addr, false);
-        le_pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
+        if (p_req->granted)
+            btif_vendor_le_hp_notify(bd_addr, 0, false);
+        p_req->in_use = false;
+        /* The link is gone, its slot is free for the next one in line */
+        btif_vendor_le_hp_schedule();
     }
 }
 
-static void set_le_high_priority_mode_complete(tBTM_VSC_CMPL* p_data)
+static void set_le_high_priority_mode_complete(uint16_t cmd_id,
+        uint8_t cmd_status, tBTM_VSC_CMPL* p_data, UNUSED_ATTR void* context)
 {
     LOG_INFO(LOG_TAG,"In set_le_high_priority_mode_complete");
-    uint8_t         *stream,  status, subcmd;
+    uint8_t         status = cmd_status, subcmd;
     uint16_t        opcode, length;
 
     std::unique_lock<std::mutex> guard(le_high_priority_mutex_);
 
-    if (p_data && (stream = (uint8_t*)p_data->p_param_buf))
+    if (cmd_status == BTM_VSC_STATUS_TIMEOUT) {
+        BTIF_TRACE_ERROR("%s command %d timed out", __FUNCTION__, cmd_id);
+        status = HCI_ERR_HOST_TIMEOUT;
+    } else if (p_data && LeHighPriorityModeCmd::Cmpl::Decode(
+                    p_data->p_param_buf, p_data->param_len, &status, &subcmd))
     {
         opcode = p_data->opcode;
         length = p_data->param_len;
-        STREAM_TO_UINT8(status, stream);
-        STREAM_TO_UINT8(subcmd, stream);
         BTIF_TRACE_DEBUG("%s opcode = 0x%04X, length = %d, status = %d, subcmd = %d",
                 __FUNCTION__, opcode, length, status, subcmd);
 
@@ -830,31 +1548,123 @@ static void set_le_high_priority_mode_complete(tBTM_VSC_CMPL* p_data)
         {
             BTIF_TRACE_DEBUG("set_le_high_priority_mode status success");
         }
+    }
 
-        if(le_pending_mode == LE_HIGH_PRIORITY_MODE_ENABLED) {
-            do_in_jni_thread(
-                FROM_HERE,
-                base::Bind(
-                    [](RawAddress addr, uint8_t status, bool mode) {
-                        HAL_CBACK(bt_vendor_callbacks, le_high_priority_mode_cb, status,
-                                  &addr, mode);
-                    },
-                    le_high_priority_bd_addr, status, true));
-        } else if(le_pending_mode == LE_HIGH_PRIORITY_MODE_DISABLED) {
-
-            do_in_jni_thread(
-                FROM_HERE,
-                base::Bind(
-                    [](RawAddress addr, uint8_t status, bool mode) {
-                        HAL_CBACK(bt_vendor_callbacks, le_high_priority_mode_cb, status,
-                                  &addr, mode);
-                    },
-                    le_high_priority_bd_addr, status, false));
-            le_high_priority_bd_addr = {};
+    btle_high_priority_req_t* p_req = btif_vendor_le_hp_find(le_hp_cb.pending_addr);
+    if(le_hp_cb.pending_mode == LE_HIGH_PRIORITY_MODE_ENABLED) {
+        if (p_req == NULL) {
+            /* Link went down while the command was in flight */
+            btif_vendor_le_hp_notify(le_hp_cb.pending_addr, status, false);
+        } else if (status == HCI_SUCCESS) {
+            /* Released while in flight, the scheduler demotes it below and
+             * the upper layer hears about the disable only */
+            p_req->granted = true;
+            if (p_req->requested)
+                btif_vendor_le_hp_notify(le_hp_cb.pending_addr, status, true);
+        } else if (cmd_status == BTM_VSC_STATUS_TIMEOUT) {
+            /* The controller may have applied it all the same. Treat it as
+             * granted and let the scheduler turn it off, so that no slot is
+             * held that nobody accounts for */
+            btif_vendor_le_hp_notify(le_hp_cb.pending_addr, status, false);
+            p_req->granted = true;
+            p_req->unconfirmed = true;
+            p_req->requested = false;
+        } else {
+            /* Drop a request the controller refused so it is not retried */
+            btif_vendor_le_hp_notify(le_hp_cb.pending_addr, status, false);
+            p_req->in_use = false;
+        }
+    } else if(le_hp_cb.pending_mode == LE_HIGH_PRIORITY_MODE_DISABLED) {
+        /* The upper layer was told about a timed out enable already */
+        if (p_req == NULL || !p_req->unconfirmed)
+            btif_vendor_le_hp_notify(le_hp_cb.pending_addr, status, false);
+        if (p_req) {
+            p_req->granted = false;
+            p_req->unconfirmed = false;
+            p_req->in_use = p_req->requested;
         }
-        le_pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
+    }
+    le_hp_cb.pending_mode = LE_HIGH_PRIORITY_MODE_NONE;
+    btif_vendor_le_hp_schedule();
+}
+
+static const char* btif_vendor_le_hp_class_text(btle_high_priority_class_t prio_class)
+{
+    switch (prio_class) {
+        case LE_HIGH_PRIORITY_CLASS_HID:
+            return "hid";
+        case LE_HIGH_PRIORITY_CLASS_AUDIO:
+            return "audio";
+        default:
+            return "sensor";
+    }
+}
+
+/* Latency histograms of the commands sent through the dispatcher */
+static void btif_vendor_vsc_dump(int fd)
+{
+    tBTM_VSC_LATENCY_STATS stats;
+
+    dprintf(fd, "\nHCI command latency, ms:");
+    for (int b = 0; b < BTM_VSC_LATENCY_BUCKETS - 1; b++)
+        dprintf(fd, " <%u", btm_vsc_latency_bucket_ms[b]);
+    dprintf(fd, " >=%u\n",
+            btm_vsc_latency_bucket_ms[BTM_VSC_LATENCY_BUCKETS - 2]);
+    for (uint8_t i = 0; BTM_VscGetLatencyStats(i, &stats); i++) {
+        dprintf(fd, "  opcode 0x%04x: %u done, %u timed out, max %u ms,",
+                stats.opcode, stats.num_cmds, stats.num_timeouts,
+                stats.max_latency_ms);
+        for (int b = 0; b < BTM_VSC_LATENCY_BUCKETS; b++)
+            dprintf(fd, " %u", stats.histogram[b]);
+        dprintf(fd, "\n");
     }
 }
+
+/*******************************************************************************
+**
+** Function         btif_vendor_dump
+**
+** Description     Dumps the LE high priority allocation, the link analytics,
+**                 the HCI command latencies, the vendor command buffer usage
+**                 and the BA update counters for dumpsys
+**
+** Returns         void
+**
+*******************************************************************************/
+void btif_vendor_dump(int fd)
+{
+    {
+        std::unique_lock<std::mutex> guard(le_high_priority_mutex_);
+
+        dprintf(fd, "\nLE high priority mode: %u slot(s)%s\n", le_hp_cb.max_slots,
+                le_hp_cb.pending_mode != LE_HIGH_PRIORITY_MODE_NONE ?
+                ", command pending" : "");
+        for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+            btle_high_priority_req_t* p_req = &le_hp_cb.req[i];
+            if (!p_req->in_use)
+                continue;
+            dprintf(fd, "  %s class %s seq %u: %s%s\n",
+                    p_req->bd_addr.ToString().c_str(),
+                    btif_vendor_le_hp_class_text(p_req->prio_class), p_req->seq,
+                    p_req->granted ? "granted" : "waiting",
+                    p_req->requested ? "" : " (releasing)");
+        }
+    }
+
+    btif_bqr_analytics_dump(fd);
+    btif_afh_analytics_dump(fd);
+    btif_vendor_vsc_dump(fd);
+
+    tHCI_VENDOR_CMD_STATS hcic_stats;
+    btsnd_hcic_get_vendor_cmd_stats(&hcic_stats);
+    dprintf(fd, "\nVendor HCI command buffers: %u commands, %u bytes "
+            "allocated, %u bytes saved, largest parameters %u bytes\n",
+            hcic_stats.num_cmds, hcic_stats.bytes_allocated,
+            hcic_stats.bytes_saved, hcic_stats.max_param_len);
+
+    btif_ba_dump(fd);
+}
+
 static bool is_le_high_priority_mode_set(const RawAddress* addr)
 {
     LOG_INFO(LOG_TAG,"In is_le_high_priority_mode_set");
@@ -867,82 +1677,88 @@ static bool is_le_high_priority_mode_set(const RawAddress* addr)
        return false;
     }
 
-    if(*addr == le_high_priority_bd_addr){
-        return true;
-    }
-    return false;
+    btle_high_priority_req_t* p_req = btif_vendor_le_hp_find(*addr);
+    return p_req && p_req->granted;
 }
 
+/*******************************************************************************
+**
+** Function         set_le_high_priority_mode
+**
+** Description     Adds or removes a high priority request of an LE link.
+**                 Requests beyond the controller's slots wait and are
+**                 promoted when a slot frees up, the upper layer learns
+**                 about every grant and demotion through
+**                 le_high_priority_mode_cb
+**
+** Returns         bt_status_t
+**
+*******************************************************************************/
 static bt_status_t set_le_high_priority_mode(const RawAddress* addr, bool enable)
 {
     LOG_INFO(LOG_TAG,"In set_le_high_priority_mode");
     std::unique_lock<std::mutex> guard(le_high_priority_mutex_);
 
-    uint8_t param[20], *p;
-    p = param;
-    memset(param, 0, 20);
-
-    UINT8_TO_STREAM(p, HCI_VSC_LE_HIGH_PRIORITY_MODE_OCF);
-
     tACL_CONN* acl = btm_bda_to_acl(*addr, BT_TRANSPORT_LE);
     if(acl == nullptr) {
         LOG_INFO(LOG_TAG,"no BLE ACL found return");
         return BT_STATUS_RMT_DEV_DOWN;
     }
-    UINT16_TO_STREAM(p, acl->hci_handle);
-    UINT8_TO_STREAM(p, enable ? 0x01 : 0x00);
-
-    uint16_t param_len = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(enable);
 
+    btle_high_priority_req_t* p_req = btif_vendor_le_hp_find(*addr);
     if(enable) {
-        if (*addr == le_high_priority_bd_addr) {
-            return BT_STATUS_DONE;
-        } else if(le_pending_mode != LE_HIGH_PRIORITY_MODE_NONE) {
-            return BT_STATUS_BUSY;
-        } else if(!le_high_priority_bd_addr.IsEmpty()) {
-            // already other device is active
-            return BT_STATUS_UNSUPPORTED;
+        if (p_req && p_req->requested) {
+            return p_req->granted ? BT_STATUS_DONE : BT_STATUS_SUCCESS;
         }
-        le_high_priority_bd_addr = *addr;
-        le_pending_mode = LE_HIGH_PRIORITY_MODE_ENABLED;
+        for (int i = 0; i < MAX_L2CAP_LINKS && p_req == NULL; i++) {
+            if (!le_hp_cb.req[i].in_use) {
+                p_req = &le_hp_cb.req[i];
+                p_req->granted = false;
+                p_req->unconfirmed = false;
+            }
+        }
+        if (p_req == NULL)
+            return BT_STATUS_NOMEM;
+        p_req->bd_addr = *addr;
+        p_req->prio_class = btif_vendor_le_hp_get_class(*addr);
+        p_req->seq = le_hp_cb.next_seq++;
+        p_req->requested = true;
+        p_req->in_use = true;
     } else {
-        if (le_high_priority_bd_addr.IsEmpty()) {
+        if (p_req == NULL || !p_req->requested) {
             return BT_STATUS_DONE;
-        } else if(le_pending_mode != LE_HIGH_PRIORITY_MODE_NONE) {
-            return BT_STATUS_BUSY;
-        } else if(le_high_priority_bd_addr != *addr) {
-            // can't disable for not active device
-            return BT_STATUS_UNSUPPORTED;
         }
-        le_pending_mode = LE_HIGH_PRIORITY_MODE_DISABLED;
+        /* A granted entry, or one whose enable is still in flight, stays
+         * until the scheduler has turned it off */
+        p_req->requested = false;
+        p_req->in_use = p_req->granted ||
+                (le_hp_cb.pending_mode == LE_HIGH_PRIORITY_MODE_ENABLED &&
+                 le_hp_cb.pending_addr == *addr);
     }
 
-    BTM_VendorSpecificCommand(HCI_VSC_LE_HIGH_PRIORITY_MODE, param_len,
-            param, set_le_high_priority_mode_complete);
+    btif_vendor_le_hp_schedule();
     return BT_STATUS_SUCCESS;
 }
 
 static uint8_t measure_good_channels(uint8_t* afh_map, uint8_t length) {
+    tBTIF_AFH_CHANNEL_MAP map;
+    uint8_t num_channels = BTIF_AFH_BR_EDR_NUM_CHANNELS;
+
     if(length == HCI_AFH_CHANNEL_MAP_LEN) {
         afh_map[length - 1] &= 0x7F;
     } else if(length == HCI_BTLE_AFH_CHANNEL_MAP_LEN) {
         afh_map[length - 1] &= 0x1F;
+        num_channels = BTIF_AFH_LE_NUM_CHANNELS;
     }
-    uint8_t total_good_chl = 0;
-    for(uint8_t i=0; i < length; i++) {
-        uint8_t num = afh_map[i];
-        while (num) {
-            total_good_chl += num & 1;
-            num >>= 1;
-        }
-    }
+    btif_afh_map_from_stream(&map, afh_map, length, num_channels);
+    uint8_t total_good_chl = btif_afh_map_count(&map);
     BTIF_TRACE_DEBUG("%s count of good channels %d",__func__, total_good_chl);
     return total_good_chl;
 }
 
 
 static bool set_afh_map(afh_map* map, int transport) {
-    int bta_status = -1;
+    uint16_t cmd_id = BTM_VSC_INVALID_ID;
     if (map == NULL) {
         return false;
     }
@@ -963,22 +1779,109 @@ static bool set_afh_map(afh_map* map, int transport) {
     }
     if (transport == BT_TRANSPORT_BR_EDR) {
         BTIF_TRACE_DEBUG("%s set_afh_map for BR EDR",__func__);
-        bta_status = BTA_DmHciRawCommand(HCI_SET_AFH_CHANNELS, HCI_AFH_CHANNEL_MAP_LEN,
-                                            map->afhMap, btif_vendor_hci_cmd_cmpl_callback);
+        BtifAfhBrEdrMap channels;
+        memcpy(channels.data(), map->afhMap, channels.size());
+        SetAfhHostChannelCmd::Buffer cmd =
+                SetAfhHostChannelCmd::Encode(channels);
+        cmd_id = BTM_VscSubmitRaw(HCI_SET_AFH_HOST_CHANNEL, cmd.size(),
+                cmd.data(), BTIF_VENDOR_VSC_TIMEOUT_MS,
+                btif_vendor_hci_cmd_cmpl_callback,
+                BTIF_VENDOR_HCI_CTX(HCI_SET_AFH_HOST_CHANNEL, 0));
     } else {
         BTIF_TRACE_DEBUG("%s set_afh_map for BT LE",__func__);
-        bta_status = BTA_DmHciRawCommand(HCI_BLE_SET_AFH_CHANNELS,HCI_BTLE_AFH_CHANNEL_MAP_LEN,
-                                          map->afhMap, btif_vendor_hci_cmd_cmpl_callback);
+        BtifAfhLeMap channels;
+        memcpy(channels.data(), map->afhMap, channels.size());
+        LeSetHostChannelCmd::Buffer cmd = LeSetHostChannelCmd::Encode(channels);
+        cmd_id = BTM_VscSubmitRaw(HCI_LE_SET_HOST_CHANNEL, cmd.size(),
+                cmd.data(), BTIF_VENDOR_VSC_TIMEOUT_MS,
+                btif_vendor_hci_cmd_cmpl_callback,
+                BTIF_VENDOR_HCI_CTX(HCI_LE_SET_HOST_CHANNEL, 0));
+    }
+    return cmd_id != BTM_VSC_INVALID_ID;
+}
+
+/* Both channel map reads only carry the acl handle */
+static_assert(std::is_same<ReadAfhChannelMapCmd::Buffer,
+                           LeReadChannelMapCmd::Buffer>::value,
+              "channel map reads share their parameter layout");
+typedef ReadAfhChannelMapCmd::Buffer BtifAfhReadParams;
+
+/* Fills in the read of the channel map of a link, false for an unknown
+ * transport. p_params has to stay valid until the command is submitted */
+static bool btif_vendor_afh_read_cmd(uint16_t handle, int transport,
+        BtifAfhReadParams* p_params, tBTM_VSC_BATCH_CMD* p_cmd)
+{
+    if (transport == BT_TRANSPORT_BR_EDR) {
+        p_cmd->opcode = READ_AFH_CHANNEL_MAP;
+        *p_params = ReadAfhChannelMapCmd::Encode(handle);
+    } else if (transport == BT_TRANSPORT_LE) {
+        p_cmd->opcode = HCI_LE_READ_AFH_CHANNEL_MAP;
+        *p_params = LeReadChannelMapCmd::Encode(handle);
+    } else {
+        return false;
     }
-    return(bta_status == BTA_SUCCESS) ? true : false;
+    p_cmd->param_len = p_params->size();
+    p_cmd->p_params = p_params->data();
+    p_cmd->raw = true;
+    p_cmd->p_cback = btif_vendor_hci_cmd_cmpl_callback;
+    p_cmd->context = BTIF_VENDOR_HCI_CTX(p_cmd->opcode, handle);
+    return true;
+}
 
+static bool btif_vendor_read_afh_map(uint16_t handle, int transport) {
+    BtifAfhReadParams params;
+    tBTM_VSC_BATCH_CMD cmd;
+
+    if (!btif_vendor_afh_read_cmd(handle, transport, &params, &cmd))
+        return false;
+    return BTM_VscSubmitRaw(cmd.opcode, cmd.param_len, cmd.p_params,
+            BTIF_VENDOR_VSC_TIMEOUT_MS, cmd.p_cback, cmd.context) !=
+            BTM_VSC_INVALID_ID;
+}
+
+/* Must be called with afh_read_mutex_ held */
+static BTIF_VND_AFH_READ* btif_vendor_afh_read_find(uint16_t handle,
+        uint8_t transport)
+{
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        if (afh_read_pending[i].count && afh_read_pending[i].handle == handle &&
+                afh_read_pending[i].transport == transport)
+            return &afh_read_pending[i];
+    }
+    return NULL;
+}
+
+static bool btif_vendor_afh_read_pending_add(uint16_t handle, uint8_t transport)
+{
+    std::unique_lock<std::mutex> guard(afh_read_mutex_);
+    BTIF_VND_AFH_READ* p_read = btif_vendor_afh_read_find(handle, transport);
+
+    for (int i = 0; i < MAX_L2CAP_LINKS && p_read == NULL; i++) {
+        if (afh_read_pending[i].count == 0)
+            p_read = &afh_read_pending[i];
+    }
+    if (p_read == NULL || p_read->count == UINT8_MAX)
+        return false;
+    p_read->handle = handle;
+    p_read->transport = transport;
+    p_read->count++;
+    return true;
+}
+
+/* Returns true if a get_afh_map request was waiting for this link */
+static bool btif_vendor_afh_read_pending_take(uint16_t handle, uint8_t transport)
+{
+    std::unique_lock<std::mutex> guard(afh_read_mutex_);
+    BTIF_VND_AFH_READ* p_read = btif_vendor_afh_read_find(handle, transport);
+
+    if (p_read == NULL)
+        return false;
+    p_read->count--;
+    return true;
 }
 
 static bool get_afh_map(const RawAddress* addr , int transport) {
-    int bta_status = -1;
-    uint8_t param[20], *p;
-    p = param;
-    memset(param, 0, 20);
+    uint16_t handle;
 
     if(transport == BT_TRANSPORT_BR_EDR ) {
         tACL_CONN* acl = btm_bda_to_acl(*addr, BT_TRANSPORT_BR_EDR);
@@ -986,22 +1889,139 @@ static bool get_afh_map(const RawAddress* addr , int transport) {
             LOG_INFO(LOG_TAG,"no BR EDR ACL found return");
             return false;
         }
-        UINT16_TO_STREAM(p, acl->hci_handle);
         BTIF_TRACE_DEBUG("%s get_afh_map for BR EDR",__func__);
-        bta_status = BTA_DmHciRawCommand(HCI_READ_AFH_CH_MAP ,HCI_AFH_CONNECTION_HANDLE_LEN,
-                                          param, btif_vendor_hci_cmd_cmpl_callback);
+        handle = acl->hci_handle;
     } else if (transport == BT_TRANSPORT_LE){
         tACL_CONN* acl = btm_bda_to_acl(*addr, BT_TRANSPORT_LE);
         if(acl == nullptr) {
             LOG_INFO(LOG_TAG,"no BLE ACL found return");
             return false;
         }
-        UINT16_TO_STREAM(p, acl->hci_handle);
         BTIF_TRACE_DEBUG("%s get_afh_map for BLE",__func__);
-        bta_status = BTA_DmHciRawCommand(HCI_BLE_READ_CHNL_MAP ,HCI_AFH_CONNECTION_HANDLE_LEN,
-                                          param, btif_vendor_hci_cmd_cmpl_callback );
+        handle = acl->hci_handle;
+    } else {
+        return false;
+    }
+    if (!btif_vendor_afh_read_pending_add(handle, transport))
+        return false;
+    if (btif_vendor_read_afh_map(handle, transport))
+        return true;
+    btif_vendor_afh_read_pending_take(handle, transport);
+    return false;
+}
+
+static void btif_vendor_afh_poll_done(UNUSED_ATTR uint16_t batch_id,
+        uint8_t num_failed, uint8_t num_cmds,
+        UNUSED_ATTR const uint8_t* p_status, void* context)
+{
+    if (num_failed)
+        BTIF_TRACE_WARNING("%s: %d of %d AFH map reads failed", __func__,
+                num_failed, num_cmds);
+    std::unique_lock<std::mutex> guard(afh_read_mutex_);
+    if ((uint32_t)(uintptr_t)context == afh_poll_session)
+        afh_poll_batches--;
+}
+
+static void btif_vendor_afh_poll_submit(const tBTM_VSC_BATCH_CMD* cmds,
+        uint8_t num_cmds, uint32_t session)
+{
+    if (BTM_VscSubmitBatch(cmds, num_cmds, BTIF_VENDOR_VSC_TIMEOUT_MS,
+            btif_vendor_afh_poll_done, (void*)(uintptr_t)session)
+            == BTM_VSC_INVALID_ID)
+        return;
+    std::unique_lock<std::mutex> guard(afh_read_mutex_);
+    if (session == afh_poll_session)
+        afh_poll_batches++;
+}
+
+/*******************************************************************************
+**
+** Function         btif_vendor_afh_poll
+**
+** Description      Reads the channel map of every connected link in one go
+**                  and drops the analytics of links that went away. The reads
+**                  go out as batches, a poll is skipped while the batches of
+**                  the previous one are still pending. Runs on the main
+**                  thread, which owns the ACL database
+**
+** Returns          void
+**
+*******************************************************************************/
+static void btif_vendor_afh_poll(void)
+{
+    tBTM_VSC_BATCH_CMD cmds[BTM_VSC_MAX_BATCH];
+    BtifAfhReadParams params[BTM_VSC_MAX_BATCH];
+    uint16_t handles[MAX_L2CAP_LINKS];
+    uint8_t num_handles = 0;
+    uint8_t num_cmds = 0;
+    uint32_t session;
+
+    if (!afh_poll_active)
+        return;
+    {
+        std::unique_lock<std::mutex> guard(afh_read_mutex_);
+        if (afh_poll_batches > 0) {
+            BTIF_TRACE_DEBUG("%s: previous poll still pending", __func__);
+            return;
+        }
+        session = afh_poll_session;
+    }
+
+    for (int i = 0; i < MAX_L2CAP_LINKS; i++) {
+        tACL_CONN* acl = &btm_cb.acl_db[i];
+        if (!acl->in_use)
+            continue;
+        handles[num_handles++] = acl->hci_handle;
+        if (!btif_vendor_afh_read_cmd(acl->hci_handle, acl->transport,
+                &params[num_cmds], &cmds[num_cmds]))
+            continue;
+        if (++num_cmds == BTM_VSC_MAX_BATCH) {
+            btif_vendor_afh_poll_submit(cmds, num_cmds, session);
+            num_cmds = 0;
+        }
     }
-    return(bta_status == BTA_SUCCESS) ? true : false;
+    if (num_cmds > 0)
+        btif_vendor_afh_poll_submit(cmds, num_cmds, session);
+    btif_afh_analytics_retain(handles, num_handles);
+}
+
+static void btif_vendor_afh_poll_timer_cb(UNUSED_ATTR void *data)
+{
+    do_in_main_thread(FROM_HERE, base::Bind(&btif_vendor_afh_poll));
+}
+
+static void btif_vendor_afh_poll_init(void)
+{
+    int32_t poll_ms = property_get_int32(BTIF_VENDOR_AFH_POLL_MS_PROP, 0);
+
+    btif_afh_analytics_init();
+    {
+        std::unique_lock<std::mutex> guard(afh_read_mutex_);
+        memset(afh_read_pending, 0, sizeof(afh_read_pending));
+        /* batches of the previous session may still complete, they must not
+         * count against this one */
+        afh_poll_session++;
+        afh_poll_batches = 0;
+    }
+    if (poll_ms <= 0)
+        return;
+
+    LOG_INFO(LOG_TAG, "%s: polling AFH maps every %d ms", __func__, poll_ms);
+    if (afh_poll_timer == NULL)
+        afh_poll_timer = alarm_new_periodic("btif_vnd.afh_poll");
+    afh_poll_active = true;
+    alarm_set(afh_poll_timer, poll_ms, btif_vendor_afh_poll_timer_cb, NULL);
+}
+
+static void btif_vendor_afh_poll_cleanup(void)
+{
+    /* A poll already posted to the main thread finds this and does nothing */
+    afh_poll_active = false;
+    if (afh_poll_timer) {
+        alarm_free(afh_poll_timer);
+        afh_poll_timer = NULL;
+    }
+    btif_afh_analytics_cleanup();
 }
 
 /*******************************************************************************
@@ -1038,6 +2058,28 @@ static const void* get_testapp_interface(int test_app_profile)
 }
 #endif
 
+static bool get_link_quality_stats(const RawAddress* addr,
+        bt_link_quality_metric_t metric, bt_link_quality_stats_t* stats)
+{
+    tBTIF_BQR_STATS bqr_stats;
+
+    if (addr == NULL || stats == NULL || metric >= BT_LINK_QUALITY_METRIC_MAX)
+        return false;
+    if (!btif_bqr_analytics_get_stats(*addr, (tBTIF_BQR_METRIC)metric,
+                                      &bqr_stats))
+        return false;
+
+    stats->num_samples = bqr_stats.num_samples;
+    stats->min = bqr_stats.min;
+    stats->max = bqr_stats.max;
+    stats->avg = bqr_stats.avg;
+    stats->p50 = bqr_stats.p50;
+    stats->p90 = bqr_stats.p90;
+    stats->breached = bqr_stats.breached;
+    stats->breach_count = bqr_stats.breach_count;
+    return true;
+}
+
 static const btvendor_interface_t btvendorInterface = {
     sizeof(btvendorInterface),
     init,
@@ -1072,8 +2114,10 @@ static const btvendor_interface_t btvendorInterface = {
     set_le_high_priority_mode,
     is_le_high_priority_mode_set,
     set_afh_map,
-    get_afh_map
-
+    get_afh_map,
+    set_wifi_channel,
+    btif_vendor_dump,
+    get_link_quality_stats
 };
 
 /*******************************************************************************
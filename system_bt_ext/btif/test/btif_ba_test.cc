@@ -0,0 +1,1171 @@
+/*
+ * Copyright (c) 2019, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btif_ba_test.cc
+ *
+ *  Description:   Host tests of the Broadcast Audio transmitter. btif_ba.cc
+ *                 and bta_ba.cc run unmodified against a fake controller,
+ *                 fake CSB events and a virtual clock. Everything else they
+ *                 call into is stubbed in this file.
+ *
+ ******************************************************************************/
+
+#include <cutils/properties.h>
+#include <gtest/gtest.h>
+#include <hardware/bt_ba.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bt_common.h"
+#include "bta_bat.h"
+#include "bta_sys.h"
+#include "btif_bat.h"
+#include "btm_api.h"
+#include "btm_vendor_cmd.h"
+#include "hcidefs.h"
+#include "hcivendorcmds.h"
+#include "osi/include/alarm.h"
+#include "osi/include/allocator.h"
+#include "osi/include/osi.h"
+#include "osi/include/time.h"
+
+const ba_transmitter_interface_t* btif_bat_get_interface();
+
+namespace {
+
+/*******************************************************************************
+ *  Virtual clock and the single loop standing in for BTIF, BTU and alarms
+ ******************************************************************************/
+
+// Tasks run in order of due time, then in order of posting. The clock jumps
+// to the due time of the task that runs. Timer tasks are the alarms, a loop
+// with only timers left has nothing in flight.
+class FakeLoop {
+ public:
+  void Reset() {
+    tasks_.clear();
+    now_us_ = 0;
+    seq_ = 0;
+  }
+
+  uint64_t NowUs() const { return now_us_; }
+
+  void Post(uint64_t delay_ms, std::function<void()> task,
+            bool timer = false) {
+    PostAt(now_us_ + delay_ms * 1000, std::move(task), timer);
+  }
+
+  void PostAt(uint64_t due_us, std::function<void()> task, bool timer) {
+    tasks_.emplace(std::make_pair(std::max(due_us, now_us_), seq_++),
+                   Task{std::move(task), timer});
+  }
+
+  // runs everything due in the next delay_ms, timers included.
+  void RunFor(uint64_t delay_ms) {
+    uint64_t end_us = now_us_ + delay_ms * 1000;
+    while (!tasks_.empty() && tasks_.begin()->first.first <= end_us)
+      RunNext();
+    now_us_ = end_us;
+  }
+
+  // runs until nothing but timers is left. False if that never happens.
+  bool Settle() {
+    for (int i = 0; i < kMaxTasks; i++) {
+      if (NumPendingWork() == 0) return true;
+      RunNext();
+    }
+    return false;
+  }
+
+ private:
+  struct Task {
+    std::function<void()> run;
+    bool timer;
+  };
+
+  size_t NumPendingWork() const {
+    size_t num = 0;
+    for (const auto& it : tasks_)
+      if (!it.second.timer) num++;
+    return num;
+  }
+
+  void RunNext() {
+    auto it = tasks_.begin();
+    now_us_ = it->first.first;
+    Task task = std::move(it->second);
+    tasks_.erase(it);
+    task.run();
+  }
+
+  static constexpr int kMaxTasks = 200000;
+  std::map<std::pair<uint64_t, uint64_t>, Task> tasks_;
+  uint64_t now_us_ = 0;
+  uint64_t seq_ = 0;
+};
+
+FakeLoop loop;
+std::mt19937 rng;
+
+/*******************************************************************************
+ *  Fake controller
+ ******************************************************************************/
+
+enum FakeCmd {
+  kSetLtAddr = 0,
+  kDeleteLtAddr,
+  kEnableCsb,
+  kDisableCsb,
+  kSyncTrainParam,
+  kStartSyncTrain,
+  kVendor,
+  kNumFakeCmds
+};
+
+// Keeps the broadcast state a real controller would keep, answers every
+// command after a per command delay and in order. violations counts
+// commands a real controller would reject because the host got its own
+// bookkeeping wrong.
+class FakeController {
+ public:
+  std::set<uint8_t> lt_addrs;      // reserved LT_ADDRs
+  std::set<uint8_t> csb_lt_addrs;  // LT_ADDRs with CSB enabled
+  bool sync_train_params = false;
+  bool sync_train = false;
+  int violations = 0;
+  int num_cmds = 0;
+  uint32_t delay_ms[kNumFakeCmds];
+  uint32_t jitter_ms = 0;
+  // failures are only ever injected into the commands that set a stream up,
+  // stop commands always go through.
+  uint32_t fail_per_mille = 0;
+  int fail_next = -1;
+  // the next command of this kind is never answered
+  int drop_next = -1;
+  uint16_t last_cmd_id = BTM_VSC_INVALID_ID;
+  std::vector<std::vector<uint8_t>> vendor_cmds;
+  std::map<uint8_t, std::vector<uint8_t>> csb_data;  // per LT_ADDR
+
+  void Reset() {
+    lt_addrs.clear();
+    csb_lt_addrs.clear();
+    sync_train_params = false;
+    sync_train = false;
+    violations = 0;
+    num_cmds = 0;
+    std::fill(delay_ms, delay_ms + kNumFakeCmds, 2);
+    jitter_ms = 0;
+    fail_per_mille = 0;
+    fail_next = -1;
+    drop_next = -1;
+    vendor_cmds.clear();
+    csb_data.clear();
+    last_due_us_ = 0;
+  }
+
+  uint8_t Status(FakeCmd cmd) {
+    num_cmds++;
+    if ((cmd == kDeleteLtAddr) || (cmd == kDisableCsb)) return HCI_SUCCESS;
+    if (fail_next == cmd) {
+      fail_next = -1;
+      return HCI_ERR_UNSPECIFIED;
+    }
+    if ((fail_per_mille != 0) && ((rng() % 1000) < fail_per_mille))
+      return HCI_ERR_UNSPECIFIED;
+    return HCI_SUCCESS;
+  }
+
+  // responses never overtake each other, whatever the delays are.
+  void Respond(FakeCmd cmd, std::function<void()> rsp) {
+    uint32_t delay = delay_ms[cmd];
+    if (jitter_ms != 0) delay += rng() % (jitter_ms + 1);
+    last_due_us_ = std::max(last_due_us_, loop.NowUs() + delay * 1000);
+    loop.PostAt(last_due_us_, std::move(rsp), false);
+  }
+
+  void Violation(const char* what, uint8_t lt_addr) {
+    violations++;
+    ADD_FAILURE() << what << ", LT_ADDR " << (int)lt_addr;
+  }
+
+  void RespondHci(FakeCmd cmd, uint16_t event, uint8_t status,
+                  std::vector<uint8_t> data) {
+    Respond(cmd, [event, status, data]() mutable {
+      bta_ba_handle_hci_event(event, status,
+                              data.empty() ? NULL : data.data(),
+                              (uint8_t)data.size());
+    });
+  }
+
+  // the CSB supervision timeout the controller reports when no receiver
+  // acknowledged the broadcast for too long.
+  void InjectCsbTimeout(uint8_t lt_addr) {
+    loop.Post(0, [lt_addr]() {
+      uint8_t data = lt_addr;
+      bta_ba_handle_hci_event(BTA_BA_HCI_EVT_CSB_TIMEOUT, HCI_SUCCESS, &data,
+                              1);
+    });
+  }
+
+ private:
+  uint64_t last_due_us_ = 0;
+};
+
+FakeController controller;
+
+/*******************************************************************************
+ *  Recorder of everything reported through the HAL
+ ******************************************************************************/
+
+struct TransitionStats {
+  uint32_t count = 0;
+  uint64_t total_us = 0;
+  uint64_t max_us = 0;
+};
+
+const char* ba_state_name(int state) {
+  switch (state) {
+    case BA_STATE_IDLE:
+      return "IDLE";
+    case BA_STATE_PENDING:
+      return "PENDING";
+    case BA_STATE_PAUSED:
+      return "PAUSED";
+    case BA_STATE_STREAMING:
+      return "STREAMING";
+    case BA_STATE_AUDIO_PENDING:
+      return "AUDIO_PENDING";
+  }
+  return "UNKNOWN";
+}
+
+bool ba_state_is_stable(int state) {
+  return (state == BA_STATE_IDLE) || (state == BA_STATE_PAUSED) ||
+         (state == BA_STATE_STREAMING);
+}
+
+// time from leaving a stable state to reaching the next one, per stream.
+class TransitionTimer {
+ public:
+  void Reset() {
+    stable_ = BA_STATE_IDLE;
+    in_transition_ = false;
+  }
+
+  void OnState(const char* prefix, int state,
+               std::map<std::string, TransitionStats>* p_stats) {
+    if (!ba_state_is_stable(state)) {
+      if (!in_transition_) {
+        in_transition_ = true;
+        start_us_ = loop.NowUs();
+      }
+      return;
+    }
+    if (in_transition_) {
+      std::string name = std::string(prefix) + ba_state_name(stable_) +
+                         " -> " + ba_state_name(state);
+      TransitionStats& stats = (*p_stats)[name];
+      uint64_t elapsed_us = loop.NowUs() - start_us_;
+      stats.count++;
+      stats.total_us += elapsed_us;
+      stats.max_us = std::max(stats.max_us, elapsed_us);
+    }
+    in_transition_ = false;
+    stable_ = state;
+  }
+
+ private:
+  int stable_ = BA_STATE_IDLE;
+  bool in_transition_ = false;
+  uint64_t start_us_ = 0;
+};
+
+struct HalRecorder {
+  std::vector<ba_state_t> states;
+  ba_state_t stream_state[BA_MAX_STREAMS];
+  std::vector<std::vector<uint8_t>> codec_updates[BA_MAX_STREAMS];
+  std::vector<uint8_t> stream_enc_key[BA_MAX_STREAMS];
+  int num_key_updates = 0;
+  int num_started_acks = 0;
+  int num_suspended_acks = 0;
+  int num_stopped_acks = 0;
+  uint8_t last_ack = (uint8_t)BA_CTRL_ACK_UNKNOWN;
+  std::map<std::string, TransitionStats> transitions;
+  TransitionTimer timers[BA_MAX_STREAMS];
+
+  void Reset() {
+    states.clear();
+    for (int i = 0; i < BA_MAX_STREAMS; i++) {
+      stream_state[i] = BA_STATE_IDLE;
+      codec_updates[i].clear();
+      stream_enc_key[i].clear();
+      timers[i].Reset();
+    }
+    num_key_updates = 0;
+    num_started_acks = 0;
+    num_suspended_acks = 0;
+    num_stopped_acks = 0;
+    last_ack = (uint8_t)BA_CTRL_ACK_UNKNOWN;
+    transitions.clear();
+  }
+
+  ba_state_t state() const {
+    return states.empty() ? BA_STATE_IDLE : states.back();
+  }
+};
+
+HalRecorder hal;
+
+void hal_state_cb(ba_state_t state) {
+  hal.states.push_back(state);
+  hal.timers[BA_PRIMARY_STREAM].OnState("", state, &hal.transitions);
+}
+
+void hal_enc_update_key_cb(uint8_t size, uint8_t* p_enc_key) {
+  hal.num_key_updates++;
+}
+
+void hal_div_update_cb(uint8_t size, uint8_t* p_div) {}
+
+void hal_stream_id_update_cb(uint8_t stream_id) {}
+
+void hal_stream_state_cb(uint8_t stream, ba_state_t state) {
+  ASSERT_LT(stream, BA_MAX_STREAMS);
+  hal.stream_state[stream] = state;
+  hal.timers[stream].OnState("stream ", state, &hal.transitions);
+}
+
+void hal_stream_enc_update_key_cb(uint8_t stream, uint8_t size,
+                                  uint8_t* p_enc_key) {
+  ASSERT_LT(stream, BA_MAX_STREAMS);
+  hal.stream_enc_key[stream].assign(p_enc_key, p_enc_key + size);
+}
+
+void hal_stream_div_update_cb(uint8_t stream, uint8_t size, uint8_t* p_div) {}
+
+void hal_stream_codec_update_cb(uint8_t stream, uint8_t size,
+                                uint8_t* p_codec_config) {
+  ASSERT_LT(stream, BA_MAX_STREAMS);
+  hal.codec_updates[stream].push_back(
+      std::vector<uint8_t>(p_codec_config, p_codec_config + size));
+}
+
+ba_transmitter_callbacks_t hal_callbacks = {
+    sizeof(ba_transmitter_callbacks_t),
+    hal_state_cb,
+    hal_enc_update_key_cb,
+    hal_div_update_cb,
+    hal_stream_id_update_cb,
+    hal_stream_state_cb,
+    hal_stream_enc_update_key_cb,
+    hal_stream_div_update_cb,
+    hal_stream_codec_update_cb,
+};
+
+// bit rate of a codec config as packed by btif, big endian from byte 6.
+uint32_t codec_config_bit_rate(const std::vector<uint8_t>& config) {
+  if (config.size() < BA_CODEC_CONFIG_LEN) return 0;
+  return ((uint32_t)config[6] << 24) | ((uint32_t)config[7] << 16) |
+         ((uint32_t)config[8] << 8) | config[9];
+}
+
+/*******************************************************************************
+ *  Stubs of the rest of the stack
+ ******************************************************************************/
+
+std::map<std::string, int32_t> properties;
+std::map<uint8_t, const tBTA_SYS_REG*> bta_sys_regs;
+std::set<uint32_t> sdp_records;
+uint32_t sdp_next_handle = 0x10000;
+std::set<alarm_t*> live_alarms;
+
+struct FakeSm {
+  const btif_sm_handler_t* p_handlers;
+  btif_sm_state_t state;
+  int index;
+};
+FakeSm fake_sm;
+
+// handlers of btif_ba take the state machine index as third argument
+typedef bool (*fake_sm_handler_t)(btif_sm_event_t event, void* data,
+                                  int index);
+
+bool fake_sm_call(btif_sm_event_t event, void* data) {
+  fake_sm_handler_t handler =
+      (fake_sm_handler_t)fake_sm.p_handlers[fake_sm.state];
+  return handler(event, data, fake_sm.index);
+}
+
+}  // namespace
+
+struct alarm_t {
+  uint64_t generation;
+};
+
+// BTIF_BA_TEST_VERBOSE=1 prints the traces of btif_ba and bta_ba
+uint8_t appl_trace_level = getenv("BTIF_BA_TEST_VERBOSE")
+                               ? BT_TRACE_LEVEL_DEBUG
+                               : BT_TRACE_LEVEL_NONE;
+uint8_t btif_trace_level = appl_trace_level;
+
+void LogMsg(uint32_t trace_set_mask, const char* fmt_str, ...) {
+  if (getenv("BTIF_BA_TEST_VERBOSE") == NULL) return;
+  va_list ap;
+  va_start(ap, fmt_str);
+  vprintf(fmt_str, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+int8_t property_get_bool(const char* key, int8_t default_value) {
+  auto it = properties.find(key);
+  return (it == properties.end()) ? default_value : (it->second != 0);
+}
+
+int32_t property_get_int32(const char* key, int32_t default_value) {
+  auto it = properties.find(key);
+  return (it == properties.end()) ? default_value : it->second;
+}
+
+void* osi_malloc(size_t size) { return calloc(1, size); }
+
+void* osi_calloc(size_t size) { return calloc(1, size); }
+
+void osi_free(void* ptr) { free(ptr); }
+
+int osi_rand(void) { return (int)(rng() & 0x7FFFFFFF); }
+
+uint64_t time_get_os_boottime_us(void) { return loop.NowUs(); }
+
+alarm_t* alarm_new(const char* name) {
+  alarm_t* alarm = new alarm_t();
+  alarm->generation = 0;
+  live_alarms.insert(alarm);
+  return alarm;
+}
+
+void alarm_free(alarm_t* alarm) {
+  if (alarm == NULL) return;
+  live_alarms.erase(alarm);
+  delete alarm;
+}
+
+void alarm_cancel(alarm_t* alarm) {
+  if (alarm != NULL) alarm->generation++;
+}
+
+void alarm_set(alarm_t* alarm, uint64_t interval_ms, alarm_callback_t cb,
+               void* data) {
+  if (alarm == NULL) {
+    ADD_FAILURE() << "alarm_set on a NULL alarm";
+    return;
+  }
+  uint64_t generation = ++alarm->generation;
+  loop.Post(interval_ms,
+            [alarm, generation, cb, data]() {
+              if (live_alarms.count(alarm) == 0) return;
+              if (alarm->generation != generation) return;
+              cb(data);
+            },
+            true);
+}
+
+bt_status_t btif_transfer_context(tBTIF_CBACK* p_cback, uint16_t event,
+                                  char* p_params, int param_len,
+                                  tBTIF_COPY_CBACK* p_copy_cback) {
+  // like BTIF, handlers always get a buffer even if nothing was passed.
+  std::vector<char> params(std::max(param_len, 0) + 64, 0);
+  if ((p_params != NULL) && (param_len > 0))
+    memcpy(params.data(), p_params, param_len);
+  loop.Post(0, [p_cback, event, params]() mutable {
+    p_cback(event, params.data());
+  });
+  return BT_STATUS_SUCCESS;
+}
+
+btif_sm_handle_t btif_sm_init(const btif_sm_handler_t* p_handlers,
+                              btif_sm_state_t initial_state, int index) {
+  fake_sm.p_handlers = p_handlers;
+  fake_sm.state = initial_state;
+  fake_sm.index = index;
+  fake_sm_call(BTIF_SM_ENTER_EVT, NULL);
+  return (btif_sm_handle_t)&fake_sm;
+}
+
+btif_sm_state_t btif_sm_get_state(btif_sm_handle_t handle) {
+  return ((FakeSm*)handle)->state;
+}
+
+bt_status_t btif_sm_dispatch(btif_sm_handle_t handle, btif_sm_event_t event,
+                             void* data) {
+  fake_sm_call(event, data);
+  return BT_STATUS_SUCCESS;
+}
+
+bt_status_t btif_sm_change_state(btif_sm_handle_t handle,
+                                 btif_sm_state_t state) {
+  fake_sm_call(BTIF_SM_EXIT_EVT, NULL);
+  ((FakeSm*)handle)->state = state;
+  fake_sm_call(BTIF_SM_ENTER_EVT, NULL);
+  return BT_STATUS_SUCCESS;
+}
+
+bool btif_config_has_section(const char* section) { return false; }
+
+bool btif_config_exist(const std::string& section, const std::string& key) {
+  return false;
+}
+
+bool btif_config_get_bin(const std::string& section, const std::string& key,
+                         uint8_t* value, size_t* length) {
+  return false;
+}
+
+bool btif_config_set_bin(const std::string& section, const std::string& key,
+                         const uint8_t* value, size_t length) {
+  return true;
+}
+
+bool btif_av_is_playing(void) { return false; }
+
+void btif_av_trigger_suspend() {}
+
+void initialize_audio_hidl() {}
+
+void deinit_audio_hal() {}
+
+void btif_ba_audio_on_started(uint8_t status) {
+  hal.num_started_acks++;
+  hal.last_ack = status;
+}
+
+void btif_ba_audio_on_suspended(uint8_t status) {
+  hal.num_suspended_acks++;
+  hal.last_ack = status;
+}
+
+void btif_ba_audio_on_stopped(uint8_t status) {
+  hal.num_stopped_acks++;
+  hal.last_ack = status;
+}
+
+void bta_sys_register(uint8_t id, const tBTA_SYS_REG* p_reg) {
+  bta_sys_regs[id] = p_reg;
+}
+
+void bta_sys_deregister(uint8_t id) { bta_sys_regs.erase(id); }
+
+void bta_sys_sendmsg(void* p_msg) {
+  loop.Post(0, [p_msg]() {
+    BT_HDR* p_hdr = (BT_HDR*)p_msg;
+    auto it = bta_sys_regs.find(p_hdr->event >> 8);
+    if ((it == bta_sys_regs.end()) || it->second->evt_hdlr(p_hdr))
+      osi_free(p_msg);
+  });
+}
+
+uint32_t SDP_CreateRecord(void) {
+  sdp_records.insert(++sdp_next_handle);
+  return sdp_next_handle;
+}
+
+bool SDP_AddAttribute(uint32_t handle, uint16_t attr_id, uint8_t attr_type,
+                      uint32_t attr_len, uint8_t* p_val) {
+  return sdp_records.count(handle) != 0;
+}
+
+bool SDP_DeleteRecord(uint32_t handle) {
+  return sdp_records.erase(handle) != 0;
+}
+
+// the dispatcher's timeout is run off the fake loop like its alarm would
+uint16_t BTM_VscSubmit(uint16_t opcode, uint8_t param_len,
+                       uint8_t* p_param_buf, uint32_t timeout_ms,
+                       tBTM_VSC_DISPATCH_CBACK* p_cback, void* context) {
+  std::vector<uint8_t> params(p_param_buf, p_param_buf + param_len);
+  uint8_t sub_opcode = params.empty() ? 0 : params[0];
+  uint8_t status = controller.Status(kVendor);
+  // VS_TX_CONFIG: sub opcode, stream ID, LT_ADDR, ...
+  if ((sub_opcode == VS_HCI_BAT_TX_CONFIG) && (params.size() > 2) &&
+      (controller.lt_addrs.count(params[2]) == 0))
+    controller.Violation("tx config on unreserved LT_ADDR", params[2]);
+  controller.vendor_cmds.push_back(params);
+  uint16_t cmd_id = ++controller.last_cmd_id;
+  if (controller.drop_next == kVendor) {
+    controller.drop_next = -1;
+    loop.Post(timeout_ms, [cmd_id, p_cback, context]() {
+      p_cback(cmd_id, BTM_VSC_STATUS_TIMEOUT, NULL, context);
+    });
+    return cmd_id;
+  }
+  controller.Respond(kVendor,
+                     [opcode, status, sub_opcode, cmd_id, p_cback, context]() {
+    uint8_t rsp[2] = {status, sub_opcode};
+    tBTM_VSC_CMPL cmpl;
+    cmpl.opcode = HCI_GRP_VENDOR_SPECIFIC | opcode;
+    cmpl.param_len = sizeof(rsp);
+    cmpl.p_param_buf = rsp;
+    p_cback(cmd_id, status, &cmpl, context);
+  });
+  return cmd_id;
+}
+
+void btsnd_hcic_set_reserved_lt_addr(uint8_t lt_addr) {
+  uint8_t status = controller.Status(kSetLtAddr);
+  if ((status == HCI_SUCCESS) && (controller.lt_addrs.count(lt_addr) != 0))
+    status = HCI_ERR_CONNECTION_EXISTS;
+  if (status == HCI_SUCCESS) controller.lt_addrs.insert(lt_addr);
+  controller.RespondHci(kSetLtAddr, BTA_BA_RSP_SET_LT_ADDR, status, {});
+}
+
+void btsnd_hcic_delete_reserved_lt_addr(uint8_t lt_addr) {
+  uint8_t status = controller.Status(kDeleteLtAddr);
+  if (controller.csb_lt_addrs.count(lt_addr) != 0) {
+    controller.Violation("LT_ADDR deleted with CSB running", lt_addr);
+    status = HCI_ERR_COMMAND_DISALLOWED;
+  } else if (controller.lt_addrs.erase(lt_addr) == 0) {
+    // enable failed before it got reserved, stop is sent anyway
+    status = HCI_ERR_NO_CONNECTION;
+  }
+  controller.csb_data.erase(lt_addr);
+  if (controller.lt_addrs.empty()) {
+    controller.sync_train = false;
+    controller.sync_train_params = false;
+  }
+  controller.RespondHci(kDeleteLtAddr, BTA_BA_RSP_DELETE_LT_ADDR, status, {});
+}
+
+void btsnd_hcic_set_csb(uint8_t enable, uint8_t lt_addr, uint8_t lpo_allowed,
+                        uint16_t pkt_type, int16_t min_interval,
+                        uint16_t max_interval, uint16_t csb_supvisnto) {
+  uint8_t status = HCI_SUCCESS;
+  if (enable == HCI_ENABLE_CSB) {
+    status = controller.Status(kEnableCsb);
+    if (controller.lt_addrs.count(lt_addr) == 0) {
+      controller.Violation("CSB enabled on unreserved LT_ADDR", lt_addr);
+      status = HCI_ERR_NO_CONNECTION;
+    }
+    if ((min_interval <= 0) || ((uint16_t)min_interval > max_interval)) {
+      controller.Violation("CSB enabled with bad interval", lt_addr);
+      status = HCI_ERR_ILLEGAL_PARAMETER_FMT;
+    }
+    if (status == HCI_SUCCESS) controller.csb_lt_addrs.insert(lt_addr);
+  } else {
+    status = controller.Status(kDisableCsb);
+    controller.csb_lt_addrs.erase(lt_addr);
+  }
+  // disable completes with the same event as enable
+  controller.RespondHci(
+      (enable == HCI_ENABLE_CSB) ? kEnableCsb : kDisableCsb,
+      BTA_BA_RSP_ENABLE_CSB, status,
+      {lt_addr, (uint8_t)(max_interval & 0xFF), (uint8_t)(max_interval >> 8)});
+}
+
+// completes without an event the BA state machine waits for.
+uint16_t btsnd_hcic_write_csb_data(uint8_t lt_addr, const uint8_t* data,
+                                   uint16_t data_len) {
+  if (controller.lt_addrs.count(lt_addr) == 0) {
+    controller.Violation("CSB data written for unreserved LT_ADDR", lt_addr);
+    return 0;
+  }
+  controller.csb_data[lt_addr].assign(data, data + data_len);
+  return 1;
+}
+
+void btsnd_hcic_write_sync_train_param(uint16_t min_interval,
+                                       uint16_t max_interval,
+                                       uint32_t sync_train, uint8_t data) {
+  uint8_t status = controller.Status(kSyncTrainParam);
+  if (status == HCI_SUCCESS) controller.sync_train_params = true;
+  controller.RespondHci(kSyncTrainParam, BTA_BA_RSP_SEND_SYNC_TRAIN_PARAM,
+                        status, {});
+}
+
+void btsnd_hcic_start_synch_train() {
+  uint8_t status = controller.Status(kStartSyncTrain);
+  if (!controller.sync_train_params)
+    controller.Violation("sync train started without params", 0);
+  if (status == HCI_SUCCESS) controller.sync_train = true;
+  controller.RespondHci(kStartSyncTrain, BTA_BA_RSP_START_SYNC_TRAIN, status,
+                        {});
+}
+
+/*******************************************************************************
+ *  Tests
+ ******************************************************************************/
+
+namespace {
+
+const int kNumExtStreams = BA_MAX_STREAMS - 1;
+
+ba_state_t expected_stream_state(uint8_t target_state) {
+  switch (target_state) {
+    case BA_STREAM_REQ_PAUSE:
+      return BA_STATE_PAUSED;
+    case BA_STREAM_REQ_STREAM:
+      return BA_STATE_STREAMING;
+  }
+  return BA_STATE_IDLE;
+}
+
+class BtifBaTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop.Reset();
+    rng.seed(1);
+    controller.Reset();
+    hal.Reset();
+    properties.clear();
+    sdp_records.clear();
+    bat = btif_bat_get_interface();
+    ASSERT_NE(nullptr, bat);
+    ASSERT_EQ(BT_STATUS_SUCCESS, bat->init(&hal_callbacks));
+    ASSERT_TRUE(loop.Settle());
+    ASSERT_EQ(BA_STATE_IDLE, hal.state());
+    ASSERT_EQ(1u, bta_sys_regs.count(BTA_ID_BAT));
+    ASSERT_EQ(1u, sdp_records.size());
+  }
+
+  void TearDown() override {
+    bat->cleanup();
+    EXPECT_TRUE(loop.Settle());
+    ExpectControllerClean();
+    EXPECT_TRUE(sdp_records.empty());
+    EXPECT_TRUE(live_alarms.empty());
+    loop.Reset();
+  }
+
+  void ExpectControllerClean() {
+    EXPECT_TRUE(controller.lt_addrs.empty());
+    EXPECT_TRUE(controller.csb_lt_addrs.empty());
+    EXPECT_TRUE(controller.csb_data.empty());
+    EXPECT_EQ(0, controller.violations);
+  }
+
+  // audio HAL requests come in on the audio thread
+  void AudioRequest(uint8_t event) { ba_send_message(event, 0, NULL, false); }
+
+  void EnablePrimary() {
+    bat->set_state(1);
+    ASSERT_TRUE(loop.Settle());
+    ASSERT_EQ(BA_STATE_PAUSED, hal.state());
+  }
+
+  void StreamPrimary() {
+    EnablePrimary();
+    AudioRequest(BTIF_BA_AUDIO_START_REQ_EVT);
+    ASSERT_TRUE(loop.Settle());
+    ASSERT_EQ(BA_STATE_STREAMING, hal.state());
+  }
+
+  // number of streams the HAL was told are up, primary included.
+  size_t NumEnabledStreams() {
+    size_t num = (hal.state() != BA_STATE_IDLE) ? 1 : 0;
+    for (int i = 1; i < BA_MAX_STREAMS; i++)
+      if (hal.stream_state[i] != BA_STATE_IDLE) num++;
+    return num;
+  }
+
+  const ba_transmitter_interface_t* bat = nullptr;
+};
+
+TEST_F(BtifBaTest, primary_stream_lifecycle) {
+  EnablePrimary();
+  EXPECT_EQ(1u, controller.lt_addrs.size());
+  EXPECT_EQ(1u, controller.csb_lt_addrs.size());
+  EXPECT_TRUE(controller.sync_train);
+  EXPECT_GE(hal.num_key_updates, 1);
+
+  AudioRequest(BTIF_BA_AUDIO_START_REQ_EVT);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_STREAMING, hal.state());
+  EXPECT_EQ(1, hal.num_started_acks);
+  EXPECT_EQ((uint8_t)BA_CTRL_ACK_SUCCESS, hal.last_ack);
+
+  AudioRequest(BTIF_BA_AUDIO_PAUSE_REQ_EVT);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_PAUSED, hal.state());
+  EXPECT_EQ(1, hal.num_suspended_acks);
+  EXPECT_EQ((uint8_t)BA_CTRL_ACK_SUCCESS, hal.last_ack);
+
+  bat->set_state(0);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+}
+
+TEST_F(BtifBaTest, csb_metadata_follows_stream) {
+  const uint8_t kStream = 1;
+  const size_t kKeyGenOffset = 8;
+  bat->set_stream_state(kStream, BA_STREAM_REQ_PAUSE);
+  ASSERT_TRUE(loop.Settle());
+  ASSERT_EQ(BA_STATE_PAUSED, hal.stream_state[kStream]);
+  ASSERT_EQ(1u, controller.csb_data.size());
+  const std::vector<uint8_t>& data = controller.csb_data.begin()->second;
+  ASSERT_EQ((size_t)BTA_BA_CSB_METADATA_LEN, data.size());
+  EXPECT_EQ(BTA_BA_CSB_METADATA_VERSION, data[0]);
+  EXPECT_EQ(VS_HCI_STREAM_ID_INVALID, data[1]);
+
+  bat->set_stream_state(kStream, BA_STREAM_REQ_STREAM);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(VS_HCI_STREAM_ID(kStream), data[1]);
+
+  // the key is never broadcast in the clear, only its generation
+  const std::vector<uint8_t>& key = hal.stream_enc_key[kStream];
+  ASSERT_EQ((size_t)ENCRYPTION_KEY_LEN, key.size());
+  EXPECT_EQ(data.end(),
+            std::search(data.begin(), data.end(), key.begin(), key.end()));
+  uint8_t key_gen = data[kKeyGenOffset];
+  bat->refresh_stream_enc_key(kStream);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ((uint8_t)(key_gen + 1), data[kKeyGenOffset]);
+
+  bat->set_stream_state(kStream, BA_STREAM_REQ_STOP);
+  ASSERT_TRUE(loop.Settle());
+  ExpectControllerClean();
+}
+
+TEST_F(BtifBaTest, failed_enable_releases_lt_addr) {
+  controller.fail_next = kVendor;
+  bat->set_state(1);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+
+  // next attempt goes through
+  EnablePrimary();
+  EXPECT_EQ(1u, controller.lt_addrs.size());
+}
+
+TEST_F(BtifBaTest, vendor_cmd_timeout_fails_enable) {
+  controller.drop_next = kVendor;
+  bat->set_state(1);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+
+  EnablePrimary();
+  EXPECT_EQ(1u, controller.lt_addrs.size());
+}
+
+TEST_F(BtifBaTest, requests_during_transition_are_replayed) {
+  bat->set_state(1);
+  AudioRequest(BTIF_BA_AUDIO_START_REQ_EVT);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_STREAMING, hal.state());
+
+  AudioRequest(BTIF_BA_AUDIO_PAUSE_REQ_EVT);
+  bat->set_state(0);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+}
+
+TEST_F(BtifBaTest, csb_timeout_stops_primary_and_steps_rate_down) {
+  StreamPrimary();
+  ASSERT_FALSE(hal.codec_updates[BA_PRIMARY_STREAM].empty());
+  uint32_t bit_rate =
+      codec_config_bit_rate(hal.codec_updates[BA_PRIMARY_STREAM].back());
+  size_t num_updates = hal.codec_updates[BA_PRIMARY_STREAM].size();
+
+  controller.InjectCsbTimeout(*controller.csb_lt_addrs.begin());
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+  // receivers lost sync, the encoder was told to go one step down
+  ASSERT_GT(hal.codec_updates[BA_PRIMARY_STREAM].size(), num_updates);
+  EXPECT_LT(codec_config_bit_rate(hal.codec_updates[BA_PRIMARY_STREAM]
+                                      [num_updates]),
+            bit_rate);
+}
+
+TEST_F(BtifBaTest, csb_timeout_of_unknown_lt_addr_stops_primary) {
+  StreamPrimary();
+  controller.InjectCsbTimeout(MAX_LT_ADDR + 1);
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(BA_STATE_IDLE, hal.state());
+  ExpectControllerClean();
+}
+
+TEST_F(BtifBaTest, link_loss_steps_rate_down_per_window) {
+  StreamPrimary();
+  size_t num_updates = hal.codec_updates[BA_PRIMARY_STREAM].size();
+  uint32_t bit_rate =
+      codec_config_bit_rate(hal.codec_updates[BA_PRIMARY_STREAM].back());
+
+  // two bad windows in a row
+  for (int i = 0; i < 2; i++) {
+    btif_ba_report_link_feedback(10, 0, false);
+    loop.RunFor(1000);
+  }
+  ASSERT_TRUE(loop.Settle());
+  ASSERT_EQ(num_updates + 1, hal.codec_updates[BA_PRIMARY_STREAM].size());
+  EXPECT_LT(codec_config_bit_rate(hal.codec_updates[BA_PRIMARY_STREAM].back()),
+            bit_rate);
+  EXPECT_EQ(BA_STATE_STREAMING, hal.state());
+  EXPECT_EQ(0, controller.violations);
+}
+
+TEST_F(BtifBaTest, rate_control_can_be_disabled) {
+  bat->cleanup();
+  ASSERT_TRUE(loop.Settle());
+  properties["persist.vendor.btstack.ba.rate_ctrl"] = 0;
+  ASSERT_EQ(BT_STATUS_SUCCESS, bat->init(&hal_callbacks));
+  ASSERT_TRUE(loop.Settle());
+
+  StreamPrimary();
+  size_t num_updates = hal.codec_updates[BA_PRIMARY_STREAM].size();
+  for (int i = 0; i < 5; i++) {
+    btif_ba_report_link_feedback(10, 10, false);
+    loop.RunFor(1000);
+  }
+  ASSERT_TRUE(loop.Settle());
+  EXPECT_EQ(num_updates, hal.codec_updates[BA_PRIMARY_STREAM].size());
+}
+
+TEST_F(BtifBaTest, vol_updates_during_enable_are_coalesced) {
+  bat->set_state(1);
+  loop.RunFor(1);
+  for (uint8_t vol = 1; vol <= 10; vol++) bat->set_vol(vol, 15);
+  ASSERT_TRUE(loop.Settle());
+  ASSERT_EQ(BA_STATE_PAUSED, hal.state());
+
+  tBTA_BA_UPDATE_STATS stats;
+  BTA_BAGetUpdateStats(&stats);
+  EXPECT_EQ(1u, stats.vol_updates_sent);
+  EXPECT_EQ(9u, stats.vol_updates_coalesced);
+  ASSERT_FALSE(controller.vendor_cmds.empty());
+  const std::vector<uint8_t>& last = controller.vendor_cmds.back();
+  ASSERT_EQ(2u, last.size());
+  EXPECT_EQ(VS_HCI_BAT_TX_VOL, last[0]);
+  EXPECT_EQ(2 * 10, last[1]);
+}
+
+TEST_F(BtifBaTest, all_streams_get_their_own_lt_addr) {
+  EnablePrimary();
+  for (uint8_t i = 1; i < BA_MAX_STREAMS; i++)
+    bat->set_stream_state(i, BA_STREAM_REQ_STREAM);
+  ASSERT_TRUE(loop.Settle());
+  for (uint8_t i = 1; i < BA_MAX_STREAMS; i++)
+    EXPECT_EQ(BA_STATE_STREAMING, hal.stream_state[i]) << "stream " << +i;
+  EXPECT_EQ((size_t)BA_MAX_STREAMS, controller.lt_addrs.size());
+  EXPECT_EQ((size_t)BA_MAX_STREAMS, controller.csb_lt_addrs.size());
+  EXPECT_EQ(0, controller.violations);
+}
+
+TEST_F(BtifBaTest, cleanup_stops_every_stream) {
+  StreamPrimary();
+  bat->set_stream_state(1, BA_STREAM_REQ_PAUSE);
+  bat->set_stream_state(2, BA_STREAM_REQ_STREAM);
+  ASSERT_TRUE(loop.Settle());
+  ASSERT_EQ(3u, controller.lt_addrs.size());
+  // checked by TearDown
+}
+
+TEST_F(BtifBaTest, reinit_right_after_cleanup) {
+  StreamPrimary();
+  bat->set_stream_state(3, BA_STREAM_REQ_STREAM);
+  // first stream command is still in flight when the service restarts
+  loop.RunFor(1);
+  bat->cleanup();
+  ASSERT_EQ(BT_STATUS_SUCCESS, bat->init(&hal_callbacks));
+  ASSERT_TRUE(loop.Settle());
+  ExpectControllerClean();
+  EXPECT_EQ(1u, bta_sys_regs.count(BTA_ID_BAT));
+  EXPECT_EQ(1u, sdp_records.size());
+
+  // nothing of the previous session is left over
+  StreamPrimary();
+  EXPECT_EQ(1u, controller.lt_addrs.size());
+  EXPECT_TRUE(controller.sync_train);
+  // rate control window runs
+  EXPECT_EQ(1u, live_alarms.size());
+}
+
+/*******************************************************************************
+ *  Property based tests: random request sequences from the app and the audio
+ *  HAL, random controller timing, optionally failures and CSB timeouts.
+ ******************************************************************************/
+
+struct RandomRunConfig {
+  int num_ops;
+  uint32_t fail_per_mille;
+  bool csb_timeouts;
+};
+
+class BtifBaRandomTest : public BtifBaTest,
+                         public ::testing::WithParamInterface<uint32_t> {
+ protected:
+  void Run(const RandomRunConfig& config) {
+    uint32_t seed = GetParam();
+    SCOPED_TRACE(::testing::Message() << "seed " << seed);
+    rng.seed(seed);
+    controller.jitter_ms = 10;
+    controller.fail_per_mille = config.fail_per_mille;
+    bool faults = (config.fail_per_mille != 0) || config.csb_timeouts;
+    uint8_t targets[BA_MAX_STREAMS] = {0};
+
+    for (int op = 0; op < config.num_ops; op++) {
+      uint8_t stream = 1 + rng() % kNumExtStreams;
+      switch (rng() % 12) {
+        case 0:
+          bat->set_state(1);
+          break;
+        case 1:
+          bat->set_state(0);
+          break;
+        case 2:
+          AudioRequest(BTIF_BA_AUDIO_START_REQ_EVT);
+          break;
+        case 3:
+          AudioRequest((rng() % 2) ? BTIF_BA_AUDIO_PAUSE_REQ_EVT
+                                   : BTIF_BA_AUDIO_STOP_REQ_EVT);
+          break;
+        case 4:
+          bat->set_vol(rng() % 16, 15);
+          break;
+        case 5:
+          bat->refresh_enc_key();
+          break;
+        case 6:
+        case 7:
+          targets[stream] = rng() % 3;
+          bat->set_stream_state(stream, targets[stream]);
+          break;
+        case 8:
+          bat->set_stream_vol(stream, rng() % 16, 15);
+          break;
+        case 9:
+          bat->refresh_stream_enc_key(stream);
+          break;
+        case 10:
+          if (config.csb_timeouts && !controller.csb_lt_addrs.empty()) {
+            auto it = controller.csb_lt_addrs.begin();
+            std::advance(it, rng() % controller.csb_lt_addrs.size());
+            controller.InjectCsbTimeout(*it);
+          }
+          break;
+        case 11:
+          ASSERT_TRUE(loop.Settle());
+          CheckSettled(targets, faults);
+          break;
+      }
+      loop.RunFor(rng() % 30);
+    }
+    ASSERT_TRUE(loop.Settle());
+    CheckSettled(targets, faults);
+  }
+
+  // nothing is in flight, every stream has to be in a stable state and
+  // the controller has to agree with what the HAL was told.
+  void CheckSettled(uint8_t* targets, bool faults) {
+    EXPECT_TRUE(ba_state_is_stable(hal.state()))
+        << ba_state_name(hal.state());
+    for (int i = 1; i < BA_MAX_STREAMS; i++) {
+      ba_state_t expected = expected_stream_state(targets[i]);
+      ba_state_t state = hal.stream_state[i];
+      // a failure or a CSB timeout stops the stream for good
+      if (faults && (state == BA_STATE_IDLE)) {
+        targets[i] = BA_STREAM_REQ_STOP;
+      } else {
+        EXPECT_EQ(expected, state)
+            << "stream " << i << " " << ba_state_name(state);
+      }
+    }
+    EXPECT_EQ(NumEnabledStreams(), controller.lt_addrs.size());
+    EXPECT_EQ(0, controller.violations);
+  }
+};
+
+TEST_P(BtifBaRandomTest, requests_settle) { Run({300, 0, false}); }
+
+TEST_P(BtifBaRandomTest, requests_settle_with_faults) {
+  Run({300, 50, true});
+}
+
+INSTANTIATE_TEST_CASE_P(Seeds, BtifBaRandomTest,
+                        ::testing::Range<uint32_t>(1, 33));
+
+/*******************************************************************************
+ *  Transition latency with controller timing close to a real SoC
+ ******************************************************************************/
+
+TEST_F(BtifBaTest, transition_latency) {
+  controller.delay_ms[kSetLtAddr] = 3;
+  controller.delay_ms[kDeleteLtAddr] = 3;
+  controller.delay_ms[kEnableCsb] = 5;
+  controller.delay_ms[kDisableCsb] = 5;
+  controller.delay_ms[kSyncTrainParam] = 3;
+  controller.delay_ms[kStartSyncTrain] = 8;
+  controller.delay_ms[kVendor] = 10;
+  controller.jitter_ms = 4;
+
+  for (int i = 0; i < 50; i++) {
+    bat->set_state(1);
+    bat->set_stream_state(1, BA_STREAM_REQ_STREAM);
+    ASSERT_TRUE(loop.Settle());
+    AudioRequest(BTIF_BA_AUDIO_START_REQ_EVT);
+    ASSERT_TRUE(loop.Settle());
+    AudioRequest(BTIF_BA_AUDIO_PAUSE_REQ_EVT);
+    bat->set_stream_state(1, BA_STREAM_REQ_PAUSE);
+    ASSERT_TRUE(loop.Settle());
+    bat->set_state(0);
+    bat->set_stream_state(1, BA_STREAM_REQ_STOP);
+    ASSERT_TRUE(loop.Settle());
+    ASSERT_EQ(BA_STATE_IDLE, hal.state());
+  }
+
+  printf("%-32s %6s %10s %10s\n", "transition", "count", "avg ms", "max ms");
+  for (const auto& it : hal.transitions) {
+    const TransitionStats& stats = it.second;
+    printf("%-32s %6u %10.2f %10.2f\n", it.first.c_str(), stats.count,
+           stats.total_us / 1000.0 / stats.count, stats.max_us / 1000.0);
+    EXPECT_GT(stats.total_us, 0u) << it.first;
+  }
+  EXPECT_EQ(50u, hal.transitions["IDLE -> PAUSED"].count);
+  EXPECT_EQ(50u, hal.transitions["PAUSED -> STREAMING"].count);
+  EXPECT_EQ(50u, hal.transitions["STREAMING -> PAUSED"].count);
+  EXPECT_EQ(50u, hal.transitions["PAUSED -> IDLE"].count);
+  EXPECT_EQ(50u, hal.transitions["stream IDLE -> PAUSED"].count);
+  EXPECT_EQ(50u, hal.transitions["stream PAUSED -> STREAMING"].count);
+}
+
+}  // namespace
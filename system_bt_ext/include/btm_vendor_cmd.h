@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared dispatcher for vendor specific HCI commands.
+ *
+ * Modules submit commands here instead of passing their own completion
+ * callback to BTM_VendorSpecificCommand() or BTM_Hci_Raw_Command(). Every
+ * submitted command gets an id and an optional timeout. Each pending command
+ * is sent with a completion callback of its own slot, so its completion is
+ * routed back to its submitter even when several commands with the same
+ * opcode are outstanding, and independent modules don't have to serialize
+ * against each other. Related commands can be submitted as a batch which
+ * completes once, when the last of them is done.
+ *
+ * Commands may be submitted from any thread. Completions and timeouts are
+ * both handled on the main thread, where BTM delivers command complete
+ * events and the timeout alarms fire.
+ */
+
+#ifndef BTM_VENDOR_CMD_H
+#define BTM_VENDOR_CMD_H
+
+#include <stdint.h>
+#include "btm_api.h"
+
+/* host side status, command complete did not arrive in time */
+#define BTM_VSC_STATUS_TIMEOUT 0xFF
+
+#define BTM_VSC_INVALID_ID 0
+#define BTM_VSC_NO_TIMEOUT 0
+
+#define BTM_VSC_MAX_PENDING 16
+#define BTM_VSC_MAX_BATCH 8
+#define BTM_VSC_MAX_PARAM_LEN 255
+
+/* p_cmpl is NULL when status is BTM_VSC_STATUS_TIMEOUT */
+typedef void(tBTM_VSC_DISPATCH_CBACK)(uint16_t cmd_id, uint8_t status,
+                                      tBTM_VSC_CMPL* p_cmpl, void* context);
+
+typedef struct {
+  uint16_t opcode;
+  uint8_t param_len;
+  uint8_t* p_params;
+  bool raw; /* standard HCI command, as for BTM_VscSubmitRaw() */
+  tBTM_VSC_DISPATCH_CBACK* p_cback; /* optional, result of this command */
+  void* context;
+} tBTM_VSC_BATCH_CMD;
+
+/* p_status holds status of each command in submission order */
+typedef void(tBTM_VSC_BATCH_CBACK)(uint16_t batch_id, uint8_t num_failed,
+                                   uint8_t num_cmds, const uint8_t* p_status,
+                                   void* context);
+
+/* latency histogram buckets, upper bounds in ms, last one is open ended */
+#define BTM_VSC_LATENCY_BUCKETS 8
+extern const uint16_t btm_vsc_latency_bucket_ms[BTM_VSC_LATENCY_BUCKETS - 1];
+
+typedef struct {
+  uint16_t opcode;
+  uint32_t num_cmds;
+  uint32_t num_timeouts;
+  uint32_t max_latency_ms;
+  uint32_t histogram[BTM_VSC_LATENCY_BUCKETS];
+} tBTM_VSC_LATENCY_STATS;
+
+/* Returns command id, BTM_VSC_INVALID_ID if too many commands are pending */
+uint16_t BTM_VscSubmit(uint16_t opcode, uint8_t param_len, uint8_t* p_params,
+                       uint32_t timeout_ms, tBTM_VSC_DISPATCH_CBACK* p_cback,
+                       void* context);
+
+/* Same for a standard HCI command, opcode includes the OGF. p_cmpl holds the
+ * return parameters of the command complete event, starting with status. */
+uint16_t BTM_VscSubmitRaw(uint16_t opcode, uint8_t param_len,
+                          uint8_t* p_params, uint32_t timeout_ms,
+                          tBTM_VSC_DISPATCH_CBACK* p_cback, void* context);
+
+/* Returns batch id, BTM_VSC_INVALID_ID if the batch could not be queued.
+ * Nothing is sent in that case. */
+uint16_t BTM_VscSubmitBatch(const tBTM_VSC_BATCH_CMD* p_cmds, uint8_t num_cmds,
+                            uint32_t timeout_ms,
+                            tBTM_VSC_BATCH_CBACK* p_cback, void* context);
+
+/* Stats of the index-th opcode seen, false once index is past the last one */
+bool BTM_VscGetLatencyStats(uint8_t index, tBTM_VSC_LATENCY_STATS* p_stats);
+
+/* Drops all pending commands and frees their timers, on stack shutdown */
+void BTM_VscCleanup(void);
+
+#endif /* BTM_VENDOR_CMD_H */
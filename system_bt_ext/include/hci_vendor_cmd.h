@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HCI command layouts.
+ *
+ * Each command is declared once as a list of parameter types, and the
+ * return parameters of its command complete event if it has any, e.g.
+ *
+ *   using VoipNetworkWifiCmd = HciVendorCmd<uint8_t, uint8_t, uint8_t>;
+ *   using LeReadChannelMapCmd =
+ *       HciCmd<uint16_t>::Returning<uint16_t, std::array<uint8_t, 5>>;
+ *
+ * kParamLen is the parameter length known at compile time and Encode()
+ * writes the parameters little endian into a stack buffer of that size,
+ * ready for BTM_VendorSpecificCommand() or BTM_Hci_Raw_Command(). The
+ * command's Cmpl decodes its command complete event, with a length check
+ * instead of blind STREAM_TO_* reads. Vendor specific command complete
+ * events start with status and sub opcode, standard ones with status.
+ */
+
+#ifndef HCI_VENDOR_CMD_H
+#define HCI_VENDOR_CMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <array>
+
+namespace hci_vendor_cmd {
+
+template <typename T>
+struct ParamTraits;
+
+template <>
+struct ParamTraits<uint8_t> {
+  static constexpr size_t kSize = 1;
+  static uint8_t* Encode(uint8_t* p, uint8_t v) {
+    *p++ = v;
+    return p;
+  }
+  static const uint8_t* Decode(const uint8_t* p, uint8_t* v) {
+    *v = *p++;
+    return p;
+  }
+};
+
+template <>
+struct ParamTraits<uint16_t> {
+  static constexpr size_t kSize = 2;
+  static uint8_t* Encode(uint8_t* p, uint16_t v) {
+    *p++ = (uint8_t)v;
+    *p++ = (uint8_t)(v >> 8);
+    return p;
+  }
+  static const uint8_t* Decode(const uint8_t* p, uint16_t* v) {
+    *v = (uint16_t)(p[0] | (p[1] << 8));
+    return p + 2;
+  }
+};
+
+template <>
+struct ParamTraits<int16_t> {
+  static constexpr size_t kSize = 2;
+  static uint8_t* Encode(uint8_t* p, int16_t v) {
+    return ParamTraits<uint16_t>::Encode(p, (uint16_t)v);
+  }
+  static const uint8_t* Decode(const uint8_t* p, int16_t* v) {
+    uint16_t u;
+    p = ParamTraits<uint16_t>::Decode(p, &u);
+    *v = (int16_t)u;
+    return p;
+  }
+};
+
+template <>
+struct ParamTraits<uint32_t> {
+  static constexpr size_t kSize = 4;
+  static uint8_t* Encode(uint8_t* p, uint32_t v) {
+    p = ParamTraits<uint16_t>::Encode(p, (uint16_t)v);
+    return ParamTraits<uint16_t>::Encode(p, (uint16_t)(v >> 16));
+  }
+  static const uint8_t* Decode(const uint8_t* p, uint32_t* v) {
+    uint16_t lo, hi;
+    p = ParamTraits<uint16_t>::Decode(p, &lo);
+    p = ParamTraits<uint16_t>::Decode(p, &hi);
+    *v = lo | ((uint32_t)hi << 16);
+    return p;
+  }
+};
+
+/* fixed size byte fields, e.g. channel maps */
+template <size_t N>
+struct ParamTraits<std::array<uint8_t, N>> {
+  static constexpr size_t kSize = N;
+  static uint8_t* Encode(uint8_t* p, const std::array<uint8_t, N>& v) {
+    memcpy(p, v.data(), N);
+    return p + N;
+  }
+  static const uint8_t* Decode(const uint8_t* p, std::array<uint8_t, N>* v) {
+    memcpy(v->data(), p, N);
+    return p + N;
+  }
+};
+
+template <typename... Params>
+struct ParamLen;
+
+template <>
+struct ParamLen<> {
+  static constexpr size_t value = 0;
+};
+
+template <typename T, typename... Rest>
+struct ParamLen<T, Rest...> {
+  static constexpr size_t value = ParamTraits<T>::kSize + ParamLen<Rest...>::value;
+};
+
+inline uint8_t* EncodeParams(uint8_t* p) { return p; }
+
+template <typename T, typename... Rest>
+inline uint8_t* EncodeParams(uint8_t* p, const T& v, const Rest&... rest) {
+  return EncodeParams(ParamTraits<T>::Encode(p, v), rest...);
+}
+
+inline const uint8_t* DecodeParams(const uint8_t* p) { return p; }
+
+template <typename T, typename... Rest>
+inline const uint8_t* DecodeParams(const uint8_t* p, T* v, Rest*... rest) {
+  return DecodeParams(ParamTraits<T>::Decode(p, v), rest...);
+}
+
+/* Return parameters of a standard command complete event, after status */
+template <typename... Returns>
+struct HciCmdCmpl {
+  static constexpr size_t kParamLen = 1 + ParamLen<Returns...>::value;
+
+  /* false if the event is too short to hold all the fields */
+  static bool Decode(const uint8_t* p, size_t len, uint8_t* status,
+                     Returns*... returns) {
+    if (p == NULL || len < kParamLen) return false;
+    DecodeParams(p, status, returns...);
+    return true;
+  }
+};
+
+/* Return parameters of a vendor specific command complete event, vendor
+ * commands always start with status and sub opcode. */
+template <typename... Returns>
+struct HciVendorCmdCmpl : HciCmdCmpl<uint8_t, Returns...> {};
+
+/* Parameters of a command, Cmpl decodes its command complete event */
+template <template <typename...> class CmplT, typename... Params>
+struct HciCmdLayout {
+  static constexpr size_t kParamLen = ParamLen<Params...>::value;
+  static_assert(kParamLen <= 255, "HCI command parameters exceed 255 bytes");
+  typedef std::array<uint8_t, kParamLen> Buffer;
+  typedef CmplT<> Cmpl;
+
+  static Buffer Encode(const Params&... params) {
+    Buffer buf;
+    EncodeParams(buf.data(), params...);
+    return buf;
+  }
+
+  /* same command, its command complete event carries Returns */
+  template <typename... Returns>
+  struct Returning;
+};
+
+template <template <typename...> class CmplT, typename... Params>
+template <typename... Returns>
+struct HciCmdLayout<CmplT, Params...>::Returning
+    : HciCmdLayout<CmplT, Params...> {
+  typedef CmplT<Returns...> Cmpl;
+};
+
+template <typename... Params>
+using HciCmd = HciCmdLayout<HciCmdCmpl, Params...>;
+
+template <typename... Params>
+using HciVendorCmd = HciCmdLayout<HciVendorCmdCmpl, Params...>;
+
+}  // namespace hci_vendor_cmd
+
+#endif /* HCI_VENDOR_CMD_H */
@@ -62,6 +62,7 @@
 #include <hardware/bt_av.h>
 
 #include <string.h>
+#include <mutex>
 
 #include <base/logging.h>
 #include "a2dp_vendor.h"
@@ -80,7 +81,6 @@ typedef struct {
   btav_a2dp_codec_bits_per_sample_t bits_per_sample;
 } tA2DP_APTX_TWS_CIE;
 
-#if 0
 /* aptX-TWS Source codec capabilities */
 static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_src_caps = {
 //static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_caps = {
@@ -91,7 +91,6 @@ static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_src_caps = {
     A2DP_APTX_TWS_CHANNELS_MONO,      /* channelMode */
     BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 /* bits_per_sample */
 };
-#endif
 /* aptX-TWS offload codec capabilities */
 static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_offload_caps = {
 //static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_caps = {
@@ -101,7 +100,6 @@ static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_offload_caps = {
     A2DP_APTX_TWS_CHANNELS_MONO,      /* channelMode */
     BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 /* bits_per_sample */
 };
-#if 0
 /* Default aptX-TWS codec configuration */
 static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_src_config = {
 //static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_config = {
@@ -111,7 +109,6 @@ static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_src_config = {
     A2DP_APTX_TWS_CHANNELS_MONO,      /* channelMode */
     BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 /* bits_per_sample */
 };
-#endif
 /* Default aptX-TWS offload codec configuration */
 static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_offload_config = {
 //static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_config = {
@@ -123,6 +120,60 @@ static const tA2DP_APTX_TWS_CIE a2dp_aptx_tws_default_offload_config = {
 };
 tA2DP_APTX_TWS_CIE a2dp_aptx_tws_caps, a2dp_aptx_tws_default_config;
 
+// Number of remembered codec negotiations. Peers rarely change, so this
+// covers reconnects and suspend/resume of a couple of devices.
+#define A2DP_APTX_TWS_NEGOTIATION_CACHE_SIZE 4
+
+// Everything setCodecConfig() depends on. Zero filled before use so the
+// padding does not break the hash and the comparison.
+typedef struct {
+  uint8_t peer_codec_info[AVDT_CODEC_SIZE];
+  bool is_capability;
+  tA2DP_APTX_TWS_CIE local_caps;
+  btav_a2dp_codec_config_t codec_config;
+  btav_a2dp_codec_config_t codec_capability;
+  btav_a2dp_codec_config_t codec_selectable_capability;
+  btav_a2dp_codec_config_t codec_user_config;
+  btav_a2dp_codec_config_t codec_audio_config;
+} tA2DP_APTX_TWS_NEGOTIATION_KEY;
+
+typedef struct {
+  bool in_use;
+  uint32_t hash;
+  uint32_t last_used;
+  tA2DP_APTX_TWS_NEGOTIATION_KEY key;
+  bool result;
+  btav_a2dp_codec_config_t codec_config;
+  btav_a2dp_codec_config_t codec_capability;
+  btav_a2dp_codec_config_t codec_selectable_capability;
+  uint8_t ota_codec_config[AVDT_CODEC_SIZE];
+  uint8_t ota_codec_peer_info[AVDT_CODEC_SIZE];
+} tA2DP_APTX_TWS_NEGOTIATION_ENTRY;
+
+typedef struct {
+  tA2DP_APTX_TWS_NEGOTIATION_ENTRY
+      entries[A2DP_APTX_TWS_NEGOTIATION_CACHE_SIZE];
+  uint32_t use_counter;
+  size_t hits;
+  size_t misses;
+} tA2DP_APTX_TWS_NEGOTIATION_CACHE;
+
+static tA2DP_APTX_TWS_NEGOTIATION_CACHE a2dp_aptx_tws_negotiation_cache;
+static std::mutex a2dp_aptx_tws_negotiation_lock;
+
+// FNV-1a over the raw bytes of |p_key|.
+static uint32_t a2dp_aptx_tws_negotiation_hash(
+    const tA2DP_APTX_TWS_NEGOTIATION_KEY* p_key) {
+  const uint8_t* p = (const uint8_t*)p_key;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < sizeof(*p_key); i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 static const tA2DP_ENCODER_INTERFACE a2dp_encoder_interface_aptx_tws = {
     a2dp_vendor_aptx_tws_encoder_init,
     a2dp_vendor_aptx_tws_encoder_cleanup,
@@ -130,7 +181,7 @@ static const tA2DP_ENCODER_INTERFACE a2dp_encoder_interface_aptx_tws = {
     a2dp_vendor_aptx_tws_feeding_flush,
     a2dp_vendor_aptx_tws_get_encoder_interval_ms,
     a2dp_vendor_aptx_tws_send_frames,
-    nullptr  // set_transmit_queue_length
+    a2dp_vendor_aptx_tws_set_transmit_queue_length
 };
 
 UNUSED_ATTR static tA2DP_STATUS A2DP_CodecInfoMatchesCapabilityAptxTWS(
@@ -492,10 +543,8 @@ A2dpCodecConfigAptxTWS::A2dpCodecConfigAptxTWS(
       a2dp_aptx_tws_caps = a2dp_aptx_tws_offload_caps;
       a2dp_aptx_tws_default_config = a2dp_aptx_tws_default_offload_config;
     } else {
-      LOG_ERROR(LOG_TAG,"aptX-TWS supported only in offload mode");
-//      a2dp_aptx_tws_caps = a2dp_aptx_tws_src_caps;
-//      a2dp_aptx_tws_default_config = a2dp_aptx_tws_default_src_config;
-      return;
+      a2dp_aptx_tws_caps = a2dp_aptx_tws_src_caps;
+      a2dp_aptx_tws_default_config = a2dp_aptx_tws_default_src_config;
     }
   if (a2dp_aptx_tws_caps.sampleRate & A2DP_APTX_TWS_SAMPLERATE_44100) {
     codec_local_capability_.sample_rate |= BTAV_A2DP_CODEC_SAMPLE_RATE_44100;
@@ -523,6 +572,12 @@ bool A2dpCodecConfigAptxTWS::init() {
     LOG_ERROR(LOG_TAG, "%s: APTX-Tws disabled in both SW and HW mode", __func__);
     return false;
   }
+
+  // Load the encoder
+  if (!A2DP_VendorLoadEncoderAptxTWS()) {
+    LOG_ERROR(LOG_TAG, "%s: cannot load the encoder", __func__);
+    return false;
+  }
   return true;
 }
 
@@ -660,10 +715,113 @@ static bool select_audio_channel_mode(
   return false;
 }
 
+void A2DP_VendorGetNegotiationCacheStatsAptxTWS(size_t* p_hits,
+                                                 size_t* p_misses) {
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_negotiation_lock);
+
+  *p_hits = a2dp_aptx_tws_negotiation_cache.hits;
+  *p_misses = a2dp_aptx_tws_negotiation_cache.misses;
+}
+
+//
+// Reuses the outcome of an earlier negotiation done from the same peer
+// codec info and the same codec state, otherwise negotiates and remembers
+// the outcome. Reconnects and suspend/resume renegotiate with unchanged
+// inputs, so they are served from the cache.
+//
 bool A2dpCodecConfigAptxTWS::setCodecConfig(const uint8_t* p_peer_codec_info,
                                            bool is_capability,
                                            uint8_t* p_result_codec_config) {
   std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
+  tA2DP_APTX_TWS_NEGOTIATION_KEY key;
+  size_t peer_info_len = p_peer_codec_info[0] + 1;
+
+  memset(&key, 0, sizeof(key));
+  if (peer_info_len > AVDT_CODEC_SIZE) peer_info_len = AVDT_CODEC_SIZE;
+  memcpy(key.peer_codec_info, p_peer_codec_info, peer_info_len);
+  key.is_capability = is_capability;
+  key.local_caps = a2dp_aptx_tws_caps;
+  key.codec_config = codec_config_;
+  key.codec_capability = codec_capability_;
+  key.codec_selectable_capability = codec_selectable_capability_;
+  key.codec_user_config = codec_user_config_;
+  key.codec_audio_config = codec_audio_config_;
+  uint32_t hash = a2dp_aptx_tws_negotiation_hash(&key);
+
+  {
+    std::lock_guard<std::mutex> cache_lock(a2dp_aptx_tws_negotiation_lock);
+    tA2DP_APTX_TWS_NEGOTIATION_CACHE* p_cache =
+        &a2dp_aptx_tws_negotiation_cache;
+
+    for (size_t i = 0; i < A2DP_APTX_TWS_NEGOTIATION_CACHE_SIZE; i++) {
+      tA2DP_APTX_TWS_NEGOTIATION_ENTRY* p_entry = &p_cache->entries[i];
+      if (!p_entry->in_use || p_entry->hash != hash ||
+          memcmp(&p_entry->key, &key, sizeof(key)) != 0)
+        continue;
+
+      p_entry->last_used = ++p_cache->use_counter;
+      p_cache->hits++;
+      if (!p_entry->result) return false;
+
+      codec_config_ = p_entry->codec_config;
+      codec_capability_ = p_entry->codec_capability;
+      codec_selectable_capability_ = p_entry->codec_selectable_capability;
+      memcpy(p_result_codec_config, p_entry->ota_codec_config,
+             sizeof(p_entry->ota_codec_config));
+      memcpy(ota_codec_config_, p_entry->ota_codec_config,
+             sizeof(ota_codec_config_));
+      if (is_capability) {
+        memcpy(ota_codec_peer_capability_, p_entry->ota_codec_peer_info,
+               sizeof(ota_codec_peer_capability_));
+      } else {
+        memcpy(ota_codec_peer_config_, p_entry->ota_codec_peer_info,
+               sizeof(ota_codec_peer_config_));
+      }
+      return true;
+    }
+    p_cache->misses++;
+  }
+
+  bool result = negotiateCodecConfig(p_peer_codec_info, is_capability,
+                                     p_result_codec_config);
+
+  std::lock_guard<std::mutex> cache_lock(a2dp_aptx_tws_negotiation_lock);
+  tA2DP_APTX_TWS_NEGOTIATION_CACHE* p_cache = &a2dp_aptx_tws_negotiation_cache;
+  tA2DP_APTX_TWS_NEGOTIATION_ENTRY* p_entry = &p_cache->entries[0];
+
+  // Replace a free entry, or else the least recently used one
+  for (size_t i = 0; i < A2DP_APTX_TWS_NEGOTIATION_CACHE_SIZE; i++) {
+    if (!p_cache->entries[i].in_use) {
+      p_entry = &p_cache->entries[i];
+      break;
+    }
+    if (p_cache->entries[i].last_used < p_entry->last_used)
+      p_entry = &p_cache->entries[i];
+  }
+
+  memset(p_entry, 0, sizeof(*p_entry));
+  p_entry->in_use = true;
+  p_entry->hash = hash;
+  p_entry->last_used = ++p_cache->use_counter;
+  p_entry->key = key;
+  p_entry->result = result;
+  if (result) {
+    p_entry->codec_config = codec_config_;
+    p_entry->codec_capability = codec_capability_;
+    p_entry->codec_selectable_capability = codec_selectable_capability_;
+    memcpy(p_entry->ota_codec_config, ota_codec_config_,
+           sizeof(p_entry->ota_codec_config));
+    memcpy(p_entry->ota_codec_peer_info,
+           is_capability ? ota_codec_peer_capability_ : ota_codec_peer_config_,
+           sizeof(p_entry->ota_codec_peer_info));
+  }
+  return result;
+}
+
+bool A2dpCodecConfigAptxTWS::negotiateCodecConfig(
+    const uint8_t* p_peer_codec_info, bool is_capability,
+    uint8_t* p_result_codec_config) {
+  std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
   tA2DP_APTX_TWS_CIE sink_info_cie;
   tA2DP_APTX_TWS_CIE result_config_cie;
   uint8_t sampleRate;
@@ -55,9 +55,12 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 
 #include "a2dp_vendor.h"
 #include "a2dp_vendor_aptx_tws.h"
+#include "a2dp_vendor_aptx_tws_pcm.h"
+#include "a2dp_vendor_aptx_tws_sync.h"
 #include "bt_common.h"
 #include "osi/include/log.h"
 #include "osi/include/osi.h"
@@ -67,13 +70,27 @@
 // Encoder for aptX-TWS Source Codec
 //
 
+//
+// The aptX-TWS encoder shared library, and the functions to use
+//
+static const char* APTX_TWS_ENCODER_LIB_NAME = "libaptXTWS_encoder.so";
+static void* aptx_tws_encoder_lib_handle = NULL;
+
+static const char* APTX_TWS_ENCODER_INIT_NAME = "aptxtwsbtenc_init";
 typedef int (*tAPTX_TWS_ENCODER_INIT)(void* state, short endian);
 
+static const char* APTX_TWS_ENCODER_ENCODE_STEREO_NAME =
+    "aptxtwsbtenc_encodestereo";
 typedef int (*tAPTX_TWS_ENCODER_ENCODE_STEREO)(void* state, void* pcmL,
                                               void* pcmR, void* buffer);
 
+static const char* APTX_TWS_ENCODER_SIZEOF_PARAMS_NAME = "SizeofAptxtwsbtenc";
 typedef int (*tAPTX_TWS_ENCODER_SIZEOF_PARAMS)(void);
 
+static tAPTX_TWS_ENCODER_INIT aptx_tws_encoder_init_func;
+static tAPTX_TWS_ENCODER_ENCODE_STEREO aptx_tws_encoder_encode_stereo_func;
+static tAPTX_TWS_ENCODER_SIZEOF_PARAMS aptx_tws_encoder_sizeof_params_func;
+
 // offset
 #if (BTA_AV_CO_CP_SCMS_T == TRUE)
 #define A2DP_APTX_TWS_OFFSET (AVDT_MEDIA_OFFSET + 1)
@@ -83,25 +100,46 @@ typedef int (*tAPTX_TWS_ENCODER_SIZEOF_PARAMS)(void);
 
 #define A2DP_APTX_TWS_MAX_PCM_BYTES_PER_READ 1024
 
+// Interval between two encoder ticks (in milliseconds)
+#define A2DP_APTX_TWS_ENCODER_INTERVAL_MS 15
+
+// The encoder consumes 4 samples per channel at a time and turns them into
+// two 16-bit code words.
+#define A2DP_APTX_TWS_SAMPLES_PER_GROUP 4
+#define A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP 4
+
+// A late tick may catch up at most this many intervals worth of audio; any
+// older backlog is dropped instead of flooding the transmit queue.
+#define A2DP_APTX_TWS_MAX_CATCH_UP_TICKS 3
+
+// Drift corrections delay a channel by whole sample groups. An earbud drops
+// a group by shortening its delay, or when it has none, by delaying the
+// other earbud one more group instead.
+#define A2DP_APTX_TWS_MAX_DELAY_GROUPS 64
+#define A2DP_APTX_TWS_MAX_DELAY_SAMPLES \
+  (A2DP_APTX_TWS_MAX_DELAY_GROUPS * A2DP_APTX_TWS_SAMPLES_PER_GROUP)
+// Deinterleaved samples per channel in one PCM read (16-bit mono)
+#define A2DP_APTX_TWS_MAX_PCM_SAMPLES_PER_READ \
+  (A2DP_APTX_TWS_MAX_PCM_BYTES_PER_READ / sizeof(uint16_t))
+
 typedef struct {
-  uint64_t sleep_time_ns;
-  uint32_t pcm_reads;
-  uint32_t pcm_bytes_per_read;
-  uint32_t aptx_hd_bytes;
-  uint32_t frame_size_counter;
+  uint64_t sleep_time_ns;       // Encoder tick interval
+  uint32_t pcm_reads;           // PCM reads needed in the current tick
+  uint32_t pcm_bytes_per_read;  // PCM bytes per read, in whole sample groups
+  uint32_t aptx_tws_bytes;      // Max encoded bytes per media packet
+  uint32_t frame_size_counter;  // PCM sample groups due in the current tick
 } tAPTX_TWS_FRAMING_PARAMS;
 
 typedef struct {
-  uint64_t session_start_us;
+  uint64_t counter;        // Pending PCM, in samples * 1000000
+  uint64_t last_frame_us;  // Timestamp of the previous encoder tick
+} tA2DP_APTX_TWS_FEEDING_STATE;
 
-  size_t media_read_total_expected_packets;
-  size_t media_read_total_expected_reads_count;
-  size_t media_read_total_expected_read_bytes;
-
-  size_t media_read_total_dropped_packets;
-  size_t media_read_total_actual_reads_count;
-  size_t media_read_total_actual_read_bytes;
-} a2dp_aptx_tws_encoder_stats_t;
+typedef struct {
+  uint32_t delay_groups;  // Current delay of the channel
+  // Last input samples of the channel, oldest first
+  uint32_t history[A2DP_APTX_TWS_MAX_DELAY_SAMPLES];
+} tA2DP_APTX_TWS_CHANNEL_DELAY;
 
 typedef struct {
   a2dp_source_read_callback_t read_callback;
@@ -112,23 +150,96 @@ typedef struct {
   bool peer_supports_3mbps;  // True if the peer device supports 3Mbps EDR
   uint16_t peer_mtu;         // // MTU of the A2DP peer
   uint32_t timestamp;        // Timestamp for the A2DP frames
+  uint16_t seq_num;          // Sequence number of the next media packet
 
   tA2DP_FEEDING_PARAMS feeding_params;
   tAPTX_TWS_FRAMING_PARAMS framing_params;
+  tA2DP_APTX_TWS_FEEDING_STATE feeding_state;
+  tA2DP_APTX_TWS_CHANNEL_DELAY channel_delay[A2DP_APTX_TWS_SYNC_NUM_EARBUDS];
   void* aptx_tws_encoder_state;
   a2dp_aptx_tws_encoder_stats_t stats;
 } tA2DP_APTX_TWS_ENCODER_CB;
 
 static tA2DP_APTX_TWS_ENCODER_CB a2dp_aptx_tws_encoder_cb;
 
+static void a2dp_vendor_aptx_tws_encoder_update(
+    A2dpCodecConfig* a2dp_codec_config, bool* p_restart_input,
+    bool* p_restart_output, bool* p_config_updated);
+static void aptx_tws_init_framing_params(
+    tAPTX_TWS_FRAMING_PARAMS* framing_params);
+static void aptx_tws_update_framing_params(
+    tAPTX_TWS_FRAMING_PARAMS* framing_params, uint64_t timestamp_us);
+static uint32_t aptx_tws_pcm_bytes_per_group(void);
+static void aptx_tws_apply_sync_hints(void);
+static void aptx_tws_delay_channel(tA2DP_APTX_TWS_CHANNEL_DELAY* p_delay,
+                                   uint32_t* pcm, uint32_t groups);
+static void aptx_tws_send_due_frames(uint64_t timestamp_us,
+                                     uint32_t pcm_bytes_per_group);
+static void aptx_tws_encode(const uint32_t* pcmL, const uint32_t* pcmR,
+                            uint32_t groups, uint8_t* data_out);
+static bool aptx_tws_enqueue_packet(BT_HDR* p_buf, uint32_t groups,
+                                    uint32_t bytes_read, uint64_t encode_us);
+static void aptx_tws_update_encode_time(a2dp_aptx_tws_encoder_stats_t* stats,
+                                        uint64_t encode_us);
+static void aptx_tws_update_tick_time(a2dp_aptx_tws_encoder_stats_t* stats,
+                                      uint64_t tick_us);
+static void aptx_tws_time_window_add(a2dp_aptx_tws_time_window_t* window,
+                                     uint32_t us);
+
 bool A2DP_VendorLoadEncoderAptxTWS(void) {
-  LOG_ERROR(LOG_TAG,"A2DP_VendorLoadEncoderAptxTWS: Not supported in legacy a2dp");
-  return false;
+  if (aptx_tws_encoder_lib_handle != NULL) return true;  // Already loaded
+
+  // Open the encoder library
+  aptx_tws_encoder_lib_handle = dlopen(APTX_TWS_ENCODER_LIB_NAME, RTLD_NOW);
+  if (aptx_tws_encoder_lib_handle == NULL) {
+    LOG_ERROR(LOG_TAG, "%s: cannot open aptX-TWS encoder library %s: %s",
+              __func__, APTX_TWS_ENCODER_LIB_NAME, dlerror());
+    return false;
+  }
+
+  aptx_tws_encoder_init_func = (tAPTX_TWS_ENCODER_INIT)dlsym(
+      aptx_tws_encoder_lib_handle, APTX_TWS_ENCODER_INIT_NAME);
+  if (aptx_tws_encoder_init_func == NULL) {
+    LOG_ERROR(LOG_TAG,
+              "%s: cannot find function '%s' in the encoder library: %s",
+              __func__, APTX_TWS_ENCODER_INIT_NAME, dlerror());
+    A2DP_VendorUnloadEncoderAptxTWS();
+    return false;
+  }
+
+  aptx_tws_encoder_encode_stereo_func =
+      (tAPTX_TWS_ENCODER_ENCODE_STEREO)dlsym(
+          aptx_tws_encoder_lib_handle, APTX_TWS_ENCODER_ENCODE_STEREO_NAME);
+  if (aptx_tws_encoder_encode_stereo_func == NULL) {
+    LOG_ERROR(LOG_TAG,
+              "%s: cannot find function '%s' in the encoder library: %s",
+              __func__, APTX_TWS_ENCODER_ENCODE_STEREO_NAME, dlerror());
+    A2DP_VendorUnloadEncoderAptxTWS();
+    return false;
+  }
+
+  aptx_tws_encoder_sizeof_params_func =
+      (tAPTX_TWS_ENCODER_SIZEOF_PARAMS)dlsym(
+          aptx_tws_encoder_lib_handle, APTX_TWS_ENCODER_SIZEOF_PARAMS_NAME);
+  if (aptx_tws_encoder_sizeof_params_func == NULL) {
+    LOG_ERROR(LOG_TAG,
+              "%s: cannot find function '%s' in the encoder library: %s",
+              __func__, APTX_TWS_ENCODER_SIZEOF_PARAMS_NAME, dlerror());
+    A2DP_VendorUnloadEncoderAptxTWS();
+    return false;
+  }
+
+  return true;
 }
 
 void A2DP_VendorUnloadEncoderAptxTWS(void) {
-  LOG_ERROR(LOG_TAG,"A2DP_VendorUnloadEncoderAptxTWS: Not supported in legacy a2dp");
-  return;
+  aptx_tws_encoder_init_func = NULL;
+  aptx_tws_encoder_encode_stereo_func = NULL;
+  aptx_tws_encoder_sizeof_params_func = NULL;
+  if (aptx_tws_encoder_lib_handle != NULL) {
+    dlclose(aptx_tws_encoder_lib_handle);
+    aptx_tws_encoder_lib_handle = NULL;
+  }
 }
 
 void a2dp_vendor_aptx_tws_encoder_init(
@@ -141,32 +252,226 @@ void a2dp_vendor_aptx_tws_encoder_init(
     LOG_INFO(LOG_TAG,"aptX-TWS is running in offload mode");
     return;
   }
+
+  if (a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state != NULL) {
+    osi_free(a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state);
+  }
+  memset(&a2dp_aptx_tws_encoder_cb, 0, sizeof(a2dp_aptx_tws_encoder_cb));
+
+  a2dp_aptx_tws_encoder_cb.stats.session_start_us = time_get_os_boottime_us();
+
+  a2dp_aptx_tws_encoder_cb.read_callback = read_callback;
+  a2dp_aptx_tws_encoder_cb.enqueue_callback = enqueue_callback;
+  a2dp_aptx_tws_encoder_cb.is_peer_edr = p_peer_params->is_peer_edr;
+  a2dp_aptx_tws_encoder_cb.peer_supports_3mbps =
+      p_peer_params->peer_supports_3mbps;
+  a2dp_aptx_tws_encoder_cb.peer_mtu = p_peer_params->peer_mtu;
+  a2dp_aptx_tws_encoder_cb.timestamp = 0;
+  a2dp_aptx_tws_encoder_cb.seq_num = 0;
+
+  /* aptX-TWS encoder config */
+  a2dp_aptx_tws_encoder_cb.use_SCMS_T = false;
+#if (BTA_AV_CO_CP_SCMS_T == TRUE)
+  a2dp_aptx_tws_encoder_cb.use_SCMS_T = true;
+#endif
+
+  if (aptx_tws_encoder_sizeof_params_func == NULL &&
+      !A2DP_VendorLoadEncoderAptxTWS()) {
+    LOG_ERROR(LOG_TAG, "%s: aptX-TWS encoder library is not loaded",
+              __func__);
+    return;
+  }
+
+  a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state =
+      osi_malloc(aptx_tws_encoder_sizeof_params_func());
+  aptx_tws_encoder_init_func(a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state,
+                             0);
+
+  // NOTE: Ignore the restart_input / restart_output flags - this initization
+  // happens when the connection is (re)started.
+  bool restart_input = false;
+  bool restart_output = false;
+  bool config_updated = false;
+  a2dp_vendor_aptx_tws_encoder_update(a2dp_codec_config, &restart_input,
+                                      &restart_output, &config_updated);
 }
 
 bool A2dpCodecConfigAptxTWS::updateEncoderUserConfig(
     const tA2DP_ENCODER_INIT_PEER_PARAMS* p_peer_params, bool* p_restart_input,
     bool* p_restart_output, bool* p_config_updated) {
-  LOG_ERROR(LOG_TAG,"updateEncoderUserConfig: Not surpporte in legacy mode");
+  if (A2DP_IsCodecEnabledInOffload((btav_a2dp_codec_index_t)
+                                  BTAV_A2DP_CODEC_INDEX_SOURCE_APTX_TWS)) {
+    LOG_INFO(LOG_TAG, "%s: aptX-TWS is running in offload mode", __func__);
+    return true;
+  }
+
+  a2dp_aptx_tws_encoder_cb.is_peer_edr = p_peer_params->is_peer_edr;
+  a2dp_aptx_tws_encoder_cb.peer_supports_3mbps =
+      p_peer_params->peer_supports_3mbps;
+  a2dp_aptx_tws_encoder_cb.peer_mtu = p_peer_params->peer_mtu;
+  a2dp_aptx_tws_encoder_cb.timestamp = 0;
+
+  if (a2dp_aptx_tws_encoder_cb.peer_mtu == 0) {
+    LOG_ERROR(LOG_TAG,
+              "%s: Cannot update the codec encoder for %s: "
+              "invalid peer MTU",
+              __func__, name().c_str());
+    return false;
+  }
+
+  a2dp_vendor_aptx_tws_encoder_update(this, p_restart_input, p_restart_output,
+                                      p_config_updated);
   return true;
 }
 
+// Update the A2DP aptX-TWS encoder.
+// |a2dp_codec_config| is the A2DP codec to use for the update.
+static void a2dp_vendor_aptx_tws_encoder_update(
+    A2dpCodecConfig* a2dp_codec_config, bool* p_restart_input,
+    bool* p_restart_output, bool* p_config_updated) {
+  uint8_t codec_info[AVDT_CODEC_SIZE];
+
+  *p_restart_input = false;
+  *p_restart_output = false;
+  *p_config_updated = false;
+
+  if (!a2dp_codec_config->copyOutOtaCodecConfig(codec_info)) {
+    LOG_ERROR(LOG_TAG,
+              "%s: Cannot update the codec encoder for %s: "
+              "invalid codec config",
+              __func__, a2dp_codec_config->name().c_str());
+    return;
+  }
+  const uint8_t* p_codec_info = codec_info;
+
+  // The feeding parameters
+  tA2DP_FEEDING_PARAMS* p_feeding_params =
+      &a2dp_aptx_tws_encoder_cb.feeding_params;
+  p_feeding_params->sample_rate =
+      A2DP_VendorGetTrackSampleRateAptxTWS(p_codec_info);
+  p_feeding_params->bits_per_sample =
+      a2dp_codec_config->getAudioBitsPerSample();
+  p_feeding_params->channel_count =
+      A2DP_VendorGetTrackChannelCountAptxTWS(p_codec_info);
+  LOG_DEBUG(LOG_TAG, "%s: sample_rate=%u bits_per_sample=%u channel_count=%u",
+            __func__, p_feeding_params->sample_rate,
+            p_feeding_params->bits_per_sample, p_feeding_params->channel_count);
+
+  if (p_feeding_params->bits_per_sample != 16 &&
+      p_feeding_params->bits_per_sample != 24 &&
+      p_feeding_params->bits_per_sample != 32) {
+    LOG_ERROR(LOG_TAG, "%s: unsupported PCM bits per sample %u", __func__,
+              p_feeding_params->bits_per_sample);
+  }
+
+  a2dp_vendor_aptx_tws_feeding_reset();
+}
+
 void a2dp_vendor_aptx_tws_encoder_cleanup(void) {
-  LOG_ERROR(LOG_TAG,"a2dp_vendor_aptx_tws_encoder_cleanup: Not supported in legacy mode");
-  return;
+  osi_free(a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state);
+  memset(&a2dp_aptx_tws_encoder_cb, 0, sizeof(a2dp_aptx_tws_encoder_cb));
 }
 
-void a2dp_vendor_aptx_tws_feeding_reset(void) {
-  LOG_ERROR(LOG_TAG,"a2dp_vendor_aptx_tws_feeding_reset: Not supported in legacy mode");
-  return;
+//
+// Initialize the framing parameters, and set those that depend on the
+// stream configuration.
+//
+static void aptx_tws_init_framing_params(
+    tAPTX_TWS_FRAMING_PARAMS* framing_params) {
+  uint32_t pcm_bytes_per_group = aptx_tws_pcm_bytes_per_group();
+  uint16_t mtu = a2dp_aptx_tws_encoder_cb.peer_mtu;
+
+  framing_params->sleep_time_ns = A2DP_APTX_TWS_ENCODER_INTERVAL_MS * 1000000;
+  framing_params->pcm_reads = 0;
+  framing_params->frame_size_counter = 0;
+
+  // Each PCM read carries whole sample groups only
+  framing_params->pcm_bytes_per_read = 0;
+  if (pcm_bytes_per_group != 0) {
+    framing_params->pcm_bytes_per_read =
+        A2DP_APTX_TWS_MAX_PCM_BYTES_PER_READ -
+        (A2DP_APTX_TWS_MAX_PCM_BYTES_PER_READ % pcm_bytes_per_group);
+  }
+
+  // The media packet payload is bounded by both the peer MTU and the buffer
+  if (a2dp_aptx_tws_encoder_cb.use_SCMS_T && mtu > 0) mtu--;
+  if (mtu > BT_DEFAULT_BUFFER_SIZE - A2DP_APTX_TWS_OFFSET - sizeof(BT_HDR)) {
+    mtu = BT_DEFAULT_BUFFER_SIZE - A2DP_APTX_TWS_OFFSET - sizeof(BT_HDR);
+  }
+  framing_params->aptx_tws_bytes =
+      mtu - (mtu % A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP);
+
+  LOG_DEBUG(LOG_TAG,
+            "%s: sleep_time_ns=%" PRIu64
+            " pcm_bytes_per_read=%u aptx_tws_bytes=%u",
+            __func__, framing_params->sleep_time_ns,
+            framing_params->pcm_bytes_per_read,
+            framing_params->aptx_tws_bytes);
+}
+
+//
+// Compute how many PCM sample groups are due in this tick, based on the
+// time elapsed since the previous one. The remainder is carried over so
+// 44.1kHz streams do not drift.
+//
+static void aptx_tws_update_framing_params(
+    tAPTX_TWS_FRAMING_PARAMS* framing_params, uint64_t timestamp_us) {
+  tA2DP_APTX_TWS_FEEDING_STATE* p_feeding_state =
+      &a2dp_aptx_tws_encoder_cb.feeding_state;
+  const uint64_t sample_rate =
+      a2dp_aptx_tws_encoder_cb.feeding_params.sample_rate;
+  const uint64_t group_units = 1000000ULL * A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+  const uint64_t max_groups =
+      (sample_rate * A2DP_APTX_TWS_ENCODER_INTERVAL_MS *
+       A2DP_APTX_TWS_MAX_CATCH_UP_TICKS) /
+      (1000 * A2DP_APTX_TWS_SAMPLES_PER_GROUP);
+  uint64_t us_this_tick = A2DP_APTX_TWS_ENCODER_INTERVAL_MS * 1000;
+
+  if (p_feeding_state->last_frame_us != 0 &&
+      timestamp_us > p_feeding_state->last_frame_us) {
+    us_this_tick = timestamp_us - p_feeding_state->last_frame_us;
+  }
+  p_feeding_state->last_frame_us = timestamp_us;
+
+  p_feeding_state->counter += us_this_tick * sample_rate;
+  uint64_t groups = p_feeding_state->counter / group_units;
+  p_feeding_state->counter -= groups * group_units;
+  if (groups > max_groups) {
+    LOG_WARN(LOG_TAG, "%s: tick late by %" PRIu64 " us, dropping %" PRIu64
+             " sample groups", __func__, us_this_tick,
+             groups - max_groups);
+    groups = max_groups;
+  }
 
+  uint32_t groups_per_read = 0;
+  uint32_t pcm_bytes_per_group = aptx_tws_pcm_bytes_per_group();
+  if (pcm_bytes_per_group != 0) {
+    groups_per_read = framing_params->pcm_bytes_per_read / pcm_bytes_per_group;
+  }
+
+  framing_params->frame_size_counter = (uint32_t)groups;
+  framing_params->pcm_reads = 0;
+  if (groups_per_read != 0) {
+    framing_params->pcm_reads =
+        (framing_params->frame_size_counter + groups_per_read - 1) /
+        groups_per_read;
+  }
+}
+
+void a2dp_vendor_aptx_tws_feeding_reset(void) {
   if (A2DP_IsCodecEnabledInOffload((btav_a2dp_codec_index_t)
                                   BTAV_A2DP_CODEC_INDEX_SOURCE_APTX_TWS)) {
     LOG_INFO(LOG_TAG,"a2dp_vendor_aptx_tws_feeding_reset: aptx-TWS is in offload mode");
     return;
-  } else {
-   LOG_ERROR(LOG_TAG,"a2dp_vendor_aptx_tws_feeding_reset: Not supported in legacy mode");
-   return;
   }
+
+  memset(&a2dp_aptx_tws_encoder_cb.feeding_state, 0,
+         sizeof(a2dp_aptx_tws_encoder_cb.feeding_state));
+  aptx_tws_init_framing_params(&a2dp_aptx_tws_encoder_cb.framing_params);
+  memset(a2dp_aptx_tws_encoder_cb.channel_delay, 0,
+         sizeof(a2dp_aptx_tws_encoder_cb.channel_delay));
+  a2dp_vendor_aptx_tws_sync_reset(
+      a2dp_aptx_tws_encoder_cb.feeding_params.sample_rate);
 }
 
 void a2dp_vendor_aptx_tws_feeding_flush(void) {
@@ -174,10 +479,11 @@ void a2dp_vendor_aptx_tws_feeding_flush(void) {
                                   BTAV_A2DP_CODEC_INDEX_SOURCE_APTX_TWS)) {
     LOG_INFO(LOG_TAG,"a2dp_vendor_aptx_tws_feeding_flush: aptx-TWS is in offload mode");
     return;
-  } else {
-    LOG_ERROR(LOG_TAG,"a2dp_vendor_aptx_hd_feeding_flush: Not supported in legacy mode");
-    return;
   }
+
+  a2dp_aptx_tws_encoder_cb.feeding_state.counter = 0;
+  a2dp_aptx_tws_encoder_cb.feeding_state.last_frame_us = 0;
+  aptx_tws_init_framing_params(&a2dp_aptx_tws_encoder_cb.framing_params);
 }
 
 period_ms_t a2dp_vendor_aptx_tws_get_encoder_interval_ms(void) {
@@ -187,15 +493,354 @@ period_ms_t a2dp_vendor_aptx_tws_get_encoder_interval_ms(void) {
              "aptx-TWS is in offload mode");
     return 0;
   }
-  return 0;
+  return A2DP_APTX_TWS_ENCODER_INTERVAL_MS;
 }
 
 void a2dp_vendor_aptx_tws_send_frames(uint64_t timestamp_us) {
   if (A2DP_IsCodecEnabledInOffload((btav_a2dp_codec_index_t)
                                   BTAV_A2DP_CODEC_INDEX_SOURCE_APTX_TWS)) {
-    LOG_INFO(LOG_TAG,"a2dp_vendor_aptx_hd_send_frames: aptx-HD is in offload mode");
+    LOG_INFO(LOG_TAG,"a2dp_vendor_aptx_tws_send_frames: aptx-TWS is in offload mode");
     return;
   }
+
+  tAPTX_TWS_FRAMING_PARAMS* framing_params =
+      &a2dp_aptx_tws_encoder_cb.framing_params;
+  const uint32_t pcm_bytes_per_group = aptx_tws_pcm_bytes_per_group();
+
+  if (a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state == NULL ||
+      pcm_bytes_per_group == 0 ||
+      framing_params->aptx_tws_bytes < A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP) {
+    // Already reported when the encoder was initialized or updated
+    return;
+  }
+
+  uint64_t tick_start_us = time_get_os_boottime_us();
+  aptx_tws_send_due_frames(timestamp_us, pcm_bytes_per_group);
+  aptx_tws_update_tick_time(&a2dp_aptx_tws_encoder_cb.stats,
+                            time_get_os_boottime_us() - tick_start_us);
+}
+
+//
+// Encode the sample groups due at |timestamp_us| and send them in packets
+// of at most the peer MTU.
+//
+static void aptx_tws_send_due_frames(uint64_t timestamp_us,
+                                     uint32_t pcm_bytes_per_group) {
+  tAPTX_TWS_FRAMING_PARAMS* framing_params =
+      &a2dp_aptx_tws_encoder_cb.framing_params;
+
+  aptx_tws_apply_sync_hints();
+  aptx_tws_update_framing_params(framing_params, timestamp_us);
+  if (framing_params->frame_size_counter == 0) return;
+
+  const uint32_t groups_per_read =
+      framing_params->pcm_bytes_per_read / pcm_bytes_per_group;
+  const uint32_t groups_per_packet =
+      framing_params->aptx_tws_bytes / A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP;
+  // Word aligned, so 16 and 32-bit samples can be loaded directly
+  uint32_t read_buffer32[A2DP_APTX_TWS_MAX_PCM_BYTES_PER_READ /
+                         sizeof(uint32_t)];
+  // One read split per channel, sized for the smallest group (16-bit mono)
+  uint32_t pcmL[A2DP_APTX_TWS_MAX_PCM_SAMPLES_PER_READ];
+  uint32_t pcmR[A2DP_APTX_TWS_MAX_PCM_SAMPLES_PER_READ];
+  uint32_t groups_left = framing_params->frame_size_counter;
+  BT_HDR* p_buf = NULL;
+  uint32_t packet_groups = 0;
+  uint32_t packet_bytes_read = 0;
+  uint64_t packet_encode_us = 0;
+
+  a2dp_aptx_tws_encoder_cb.stats.media_read_total_expected_packets +=
+      (groups_left + groups_per_packet - 1) / groups_per_packet;
+  a2dp_aptx_tws_encoder_cb.stats.media_read_total_expected_reads_count +=
+      framing_params->pcm_reads;
+  a2dp_aptx_tws_encoder_cb.stats.media_read_total_expected_read_bytes +=
+      groups_left * pcm_bytes_per_group;
+
+  while (groups_left > 0) {
+    uint32_t read_groups =
+        (groups_left < groups_per_read) ? groups_left : groups_per_read;
+    uint32_t read_bytes = read_groups * pcm_bytes_per_group;
+    uint32_t bytes_read = a2dp_aptx_tws_encoder_cb.read_callback(
+        (uint8_t*)read_buffer32, read_bytes);
+
+    a2dp_aptx_tws_encoder_cb.stats.media_read_total_actual_read_bytes +=
+        bytes_read;
+    if (bytes_read < read_bytes) {
+      a2dp_aptx_tws_encoder_cb.stats.media_read_total_underflows++;
+    }
+    if (bytes_read == 0) {
+      LOG_WARN(LOG_TAG, "%s: underflow, %u sample groups not read", __func__,
+               groups_left);
+      break;
+    }
+    a2dp_aptx_tws_encoder_cb.stats.media_read_total_actual_reads_count++;
+    if (bytes_read < read_bytes) {
+      // Pad a short read with silence so the stream timing is preserved
+      memset((uint8_t*)read_buffer32 + bytes_read, 0, read_bytes - bytes_read);
+    }
+    groups_left -= read_groups;
+    packet_bytes_read += bytes_read;
+
+    // Split the whole read at once, the encoder then takes it in groups
+    a2dp_vendor_aptx_tws_deinterleave(
+        (const uint8_t*)read_buffer32, read_groups,
+        a2dp_aptx_tws_encoder_cb.feeding_params.bits_per_sample,
+        a2dp_aptx_tws_encoder_cb.feeding_params.channel_count, pcmL, pcmR);
+    aptx_tws_delay_channel(
+        &a2dp_aptx_tws_encoder_cb.channel_delay[A2DP_APTX_TWS_SYNC_EARBUD_LEFT],
+        pcmL, read_groups);
+    aptx_tws_delay_channel(
+        &a2dp_aptx_tws_encoder_cb
+             .channel_delay[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT],
+        pcmR, read_groups);
+    uint32_t pcm_offset = 0;
+    while (read_groups > 0) {
+      if (p_buf == NULL) {
+        p_buf = (BT_HDR*)osi_malloc(BT_DEFAULT_BUFFER_SIZE);
+        p_buf->offset = A2DP_APTX_TWS_OFFSET;
+        p_buf->len = 0;
+        p_buf->layer_specific = 0;
+        packet_groups = 0;
+        packet_encode_us = 0;
+      }
+
+      uint32_t encode_groups = groups_per_packet - packet_groups;
+      if (encode_groups > read_groups) encode_groups = read_groups;
+      uint64_t encode_start_us = time_get_os_boottime_us();
+      aptx_tws_encode(pcmL + pcm_offset, pcmR + pcm_offset, encode_groups,
+                      (uint8_t*)(p_buf + 1) + p_buf->offset + p_buf->len);
+      packet_encode_us += time_get_os_boottime_us() - encode_start_us;
+      p_buf->len += encode_groups * A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP;
+      pcm_offset += encode_groups * A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+      packet_groups += encode_groups;
+      read_groups -= encode_groups;
+
+      if (packet_groups == groups_per_packet) {
+        bool enqueued = aptx_tws_enqueue_packet(
+            p_buf, packet_groups, packet_bytes_read, packet_encode_us);
+        p_buf = NULL;
+        packet_bytes_read = 0;
+        if (!enqueued) return;
+      }
+    }
+  }
+
+  // Send whatever is left instead of holding it until the next tick
+  if (p_buf != NULL) {
+    if (p_buf->len > 0) {
+      aptx_tws_enqueue_packet(p_buf, packet_groups, packet_bytes_read,
+                              packet_encode_us);
+    } else {
+      osi_free(p_buf);
+    }
+  }
+}
+
+//
+// Pick up the drift corrections of both earbuds and turn them into channel
+// delays. A positive hint drops groups, a negative one inserts them.
+//
+static void aptx_tws_apply_sync_hints(void) {
+  for (uint8_t earbud = 0; earbud < A2DP_APTX_TWS_SYNC_NUM_EARBUDS; earbud++) {
+    int32_t frames = a2dp_vendor_aptx_tws_sync_get_hint(earbud);
+    if (frames == 0) continue;
+
+    tA2DP_APTX_TWS_CHANNEL_DELAY* p_delay =
+        &a2dp_aptx_tws_encoder_cb.channel_delay[earbud];
+    tA2DP_APTX_TWS_CHANNEL_DELAY* p_other =
+        &a2dp_aptx_tws_encoder_cb.channel_delay[1 - earbud];
+    uint32_t frames_left = (uint32_t)((frames < 0) ? -frames : frames);
+
+    for (; frames_left > 0; frames_left--) {
+      if (frames < 0) {
+        if (p_delay->delay_groups == A2DP_APTX_TWS_MAX_DELAY_GROUPS) break;
+        p_delay->delay_groups++;
+        a2dp_aptx_tws_encoder_cb.stats.sync_inserted_frames++;
+      } else if (p_delay->delay_groups > 0) {
+        p_delay->delay_groups--;
+        a2dp_aptx_tws_encoder_cb.stats.sync_dropped_frames++;
+      } else {
+        if (p_other->delay_groups == A2DP_APTX_TWS_MAX_DELAY_GROUPS) break;
+        p_other->delay_groups++;
+        a2dp_aptx_tws_encoder_cb.stats.sync_inserted_frames++;
+      }
+    }
+    if (frames_left > 0) {
+      LOG_WARN(LOG_TAG, "%s: earbud %u: %u of %d frames not corrected",
+               __func__, earbud, frames_left, frames);
+    }
+  }
+}
+
+//
+// Delay the |groups| sample groups of one channel in |pcm| by the current
+// delay of that channel. The channel history carries the samples that did
+// not fit over into the next read.
+//
+static void aptx_tws_delay_channel(tA2DP_APTX_TWS_CHANNEL_DELAY* p_delay,
+                                   uint32_t* pcm, uint32_t groups) {
+  uint32_t line[A2DP_APTX_TWS_MAX_DELAY_SAMPLES +
+                A2DP_APTX_TWS_MAX_PCM_SAMPLES_PER_READ];
+  const uint32_t samples = groups * A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+  const uint32_t delay_samples =
+      p_delay->delay_groups * A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+
+  memcpy(line, p_delay->history, sizeof(p_delay->history));
+  memcpy(line + A2DP_APTX_TWS_MAX_DELAY_SAMPLES, pcm,
+         samples * sizeof(uint32_t));
+  if (delay_samples > 0) {
+    memcpy(pcm, line + A2DP_APTX_TWS_MAX_DELAY_SAMPLES - delay_samples,
+           samples * sizeof(uint32_t));
+  }
+  memcpy(p_delay->history, line + samples, sizeof(p_delay->history));
+}
+
+//
+// Size (in bytes) of one group of interleaved PCM as delivered by the
+// audio HAL, or 0 if the PCM format is not supported.
+// 24-bit audio is expected packed in 3 bytes per sample.
+//
+static uint32_t aptx_tws_pcm_bytes_per_group(void) {
+  const tA2DP_FEEDING_PARAMS* p_feeding_params =
+      &a2dp_aptx_tws_encoder_cb.feeding_params;
+
+  if (p_feeding_params->channel_count != 1 &&
+      p_feeding_params->channel_count != 2)
+    return 0;
+
+  switch (p_feeding_params->bits_per_sample) {
+    case 16:
+    case 24:
+    case 32:
+      return A2DP_APTX_TWS_SAMPLES_PER_GROUP * p_feeding_params->channel_count *
+             (p_feeding_params->bits_per_sample / 8);
+    default:
+      return 0;
+  }
+}
+
+//
+// Encode |groups| sample groups of deinterleaved PCM from |pcmL| and |pcmR|
+// into |data_out|.
+//
+static void aptx_tws_encode(const uint32_t* pcmL, const uint32_t* pcmR,
+                            uint32_t groups, uint8_t* data_out) {
+  for (uint32_t group = 0; group < groups; group++) {
+    uint16_t encoded_sample[2];
+
+    aptx_tws_encoder_encode_stereo_func(
+        a2dp_aptx_tws_encoder_cb.aptx_tws_encoder_state, (void*)pcmL,
+        (void*)pcmR, &encoded_sample);
+    pcmL += A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+    pcmR += A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+
+    data_out[0] = (uint8_t)((encoded_sample[0] >> 8) & 0xff);
+    data_out[1] = (uint8_t)((encoded_sample[0] >> 0) & 0xff);
+    data_out[2] = (uint8_t)((encoded_sample[1] >> 8) & 0xff);
+    data_out[3] = (uint8_t)((encoded_sample[1] >> 0) & 0xff);
+    data_out += A2DP_APTX_TWS_ENCODED_BYTES_PER_GROUP;
+  }
+}
+
+//
+// Stamp the media timestamp on |p_buf| and hand it to the transmit queue.
+// The RTP sequence number itself is filled in by AVDTP; |seq_num| tracks the
+// packets handed over by this encoder so gaps can be spotted in the logs.
+// |encode_us| is the time spent encoding the packet.
+// Returns false if the packet was dropped.
+//
+static bool aptx_tws_enqueue_packet(BT_HDR* p_buf, uint32_t groups,
+                                    uint32_t bytes_read, uint64_t encode_us) {
+  a2dp_aptx_tws_encoder_stats_t* stats = &a2dp_aptx_tws_encoder_cb.stats;
+
+  // Both earbuds render against this common media clock
+  *((uint32_t*)(p_buf + 1)) = a2dp_aptx_tws_encoder_cb.timestamp;
+  a2dp_vendor_aptx_tws_sync_packet_sent(a2dp_aptx_tws_encoder_cb.timestamp,
+                                        time_get_os_boottime_us());
+  a2dp_aptx_tws_encoder_cb.timestamp +=
+      groups * A2DP_APTX_TWS_SAMPLES_PER_GROUP;
+
+  stats->media_read_total_encoded_frames += groups;
+  stats->media_read_total_encoded_packets++;
+  aptx_tws_update_encode_time(stats, encode_us);
+
+  uint16_t seq_num = a2dp_aptx_tws_encoder_cb.seq_num++;
+  if (!a2dp_aptx_tws_encoder_cb.enqueue_callback(p_buf, 1, bytes_read)) {
+    LOG_WARN(LOG_TAG, "%s: packet %u dropped", __func__, seq_num);
+    stats->media_read_total_dropped_packets++;
+    return false;
+  }
+  stats->media_read_total_sent_packets++;
+  return true;
+}
+
+static void aptx_tws_time_window_add(a2dp_aptx_tws_time_window_t* window,
+                                     uint32_t us) {
+  window->samples[window->next] = us;
+  window->next = (window->next + 1) % A2DP_APTX_TWS_TIME_WINDOW;
+  if (window->count < A2DP_APTX_TWS_TIME_WINDOW) window->count++;
+}
+
+//
+// Account |encode_us| in the encode time statistics.
+//
+static void aptx_tws_update_encode_time(a2dp_aptx_tws_encoder_stats_t* stats,
+                                        uint64_t encode_us) {
+  uint32_t us = (encode_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)encode_us;
+
+  stats->encode_time_total_us += us;
+  if (stats->media_read_total_encoded_packets == 1 ||
+      us < stats->encode_time_min_us)
+    stats->encode_time_min_us = us;
+  if (us > stats->encode_time_max_us) stats->encode_time_max_us = us;
+  aptx_tws_time_window_add(&stats->encode_time_window, us);
+}
+
+//
+// Account |tick_us| in the tick time statistics. A tick that takes longer
+// than the tick interval delays the next one.
+//
+static void aptx_tws_update_tick_time(a2dp_aptx_tws_encoder_stats_t* stats,
+                                      uint64_t tick_us) {
+  uint32_t us = (tick_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)tick_us;
+
+  if (us > stats->tick_time_max_us) stats->tick_time_max_us = us;
+  if (us > A2DP_APTX_TWS_ENCODER_INTERVAL_MS * 1000) stats->tick_overruns++;
+  aptx_tws_time_window_add(&stats->tick_time_window, us);
+}
+
+uint32_t a2dp_vendor_aptx_tws_get_time_percentile_us(
+    const a2dp_aptx_tws_time_window_t* window, uint8_t percentile) {
+  uint32_t sorted[A2DP_APTX_TWS_TIME_WINDOW];
+
+  if (window->count == 0) return 0;
+  if (percentile > 100) percentile = 100;
+
+  memcpy(sorted, window->samples, window->count * sizeof(uint32_t));
+  std::sort(sorted, sorted + window->count);
+
+  // Nearest rank: the smallest sample with |percentile| percent at or below
+  size_t rank = (window->count * percentile + 99) / 100;
+  return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+bool a2dp_vendor_aptx_tws_get_encoder_stats(
+    a2dp_aptx_tws_encoder_stats_t* p_stats) {
+  if (A2DP_IsCodecEnabledInOffload((btav_a2dp_codec_index_t)
+                                  BTAV_A2DP_CODEC_INDEX_SOURCE_APTX_TWS))
+    return false;
+
+  *p_stats = a2dp_aptx_tws_encoder_cb.stats;
+  return true;
+}
+
+void a2dp_vendor_aptx_tws_set_transmit_queue_length(
+    size_t transmit_queue_length) {
+  a2dp_aptx_tws_encoder_stats_t* stats = &a2dp_aptx_tws_encoder_cb.stats;
+
+  stats->transmit_queue_length = transmit_queue_length;
+  if (transmit_queue_length > stats->transmit_queue_max_length)
+    stats->transmit_queue_max_length = transmit_queue_length;
 }
 
 period_ms_t A2dpCodecConfigAptxTWS::encoderIntervalMs() const {
@@ -224,5 +869,68 @@ void A2dpCodecConfigAptxTWS::debug_codec_dump(int fd) {
           "%zu\n",
           stats->media_read_total_expected_read_bytes,
           stats->media_read_total_actual_read_bytes);
+
+  dprintf(fd,
+          "  Packets sent / frames encoded                           : %zu / "
+          "%zu\n",
+          stats->media_read_total_sent_packets,
+          stats->media_read_total_encoded_frames);
+
+  dprintf(fd,
+          "  PCM read underflows                                     : %zu\n",
+          stats->media_read_total_underflows);
+
+  uint64_t encode_time_avg_us = 0;
+  if (stats->media_read_total_encoded_packets > 0) {
+    encode_time_avg_us = stats->encode_time_total_us /
+                         stats->media_read_total_encoded_packets;
+  }
+  dprintf(fd,
+          "  Encode time per packet in us (min/avg/max/p99)          : %u / "
+          "%" PRIu64 " / %u / %u\n",
+          stats->encode_time_min_us, encode_time_avg_us,
+          stats->encode_time_max_us,
+          a2dp_vendor_aptx_tws_get_time_percentile_us(
+              &stats->encode_time_window, 99));
+
+  dprintf(fd,
+          "  Tick time in us (p50/p99/max) / overruns                : %u / "
+          "%u / %u / %zu\n",
+          a2dp_vendor_aptx_tws_get_time_percentile_us(&stats->tick_time_window,
+                                                      50),
+          a2dp_vendor_aptx_tws_get_time_percentile_us(&stats->tick_time_window,
+                                                      99),
+          stats->tick_time_max_us, stats->tick_overruns);
+
+  dprintf(fd,
+          "  Transmit queue length (current/max)                     : %zu / "
+          "%zu\n",
+          stats->transmit_queue_length, stats->transmit_queue_max_length);
+
+  tA2DP_APTX_TWS_SYNC_STATS sync_stats;
+  a2dp_vendor_aptx_tws_sync_get_stats(&sync_stats);
+  dprintf(fd,
+          "  Delivery latency in us (left/right)                     : %u / "
+          "%u\n",
+          sync_stats.latency_us[A2DP_APTX_TWS_SYNC_EARBUD_LEFT],
+          sync_stats.latency_us[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT]);
+  dprintf(fd,
+          "  Inter-ear offset in us (current/max)                    : %d / "
+          "%u\n",
+          sync_stats.offset_us, sync_stats.max_offset_us);
+  dprintf(fd,
+          "  Drift corrections / frames (dropped/inserted)           : %zu / "
+          "%zu / %zu\n",
+          sync_stats.num_corrections, stats->sync_dropped_frames,
+          stats->sync_inserted_frames);
+
+  size_t negotiation_hits = 0;
+  size_t negotiation_misses = 0;
+  A2DP_VendorGetNegotiationCacheStatsAptxTWS(&negotiation_hits,
+                                             &negotiation_misses);
+  dprintf(fd,
+          "  Codec negotiations (cached/negotiated)                  : %zu / "
+          "%zu\n",
+          negotiation_hits, negotiation_misses);
 }
 #endif //TWS_ENABLED
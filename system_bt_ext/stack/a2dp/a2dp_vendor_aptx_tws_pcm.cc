@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "a2dp_vendor_aptx_tws_pcm.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define A2DP_APTX_TWS_PCM_SIMD
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define A2DP_APTX_TWS_PCM_SIMD
+#endif
+
+//
+// Scalar conversions of |samples| samples per channel, also used for what
+// the SIMD paths leave over.
+//
+static void aptx_tws_deinterleave_16(const uint16_t* data_in, uint32_t samples,
+                                     uint8_t channel_count, uint32_t* pcmL,
+                                     uint32_t* pcmR) {
+  const uint8_t right = (channel_count > 1) ? 1 : 0;
+
+  for (uint32_t i = 0; i < samples; i++) {
+    pcmL[i] = data_in[0];
+    pcmR[i] = data_in[right];
+    data_in += channel_count;
+  }
+}
+
+static void aptx_tws_deinterleave_24(const uint8_t* data_in, uint32_t samples,
+                                     uint8_t channel_count, uint32_t* pcmL,
+                                     uint32_t* pcmR) {
+  const uint8_t right = (channel_count > 1) ? 3 : 0;
+
+  // Little endian, keep the two most significant bytes
+  for (uint32_t i = 0; i < samples; i++) {
+    pcmL[i] = data_in[1] | (data_in[2] << 8);
+    pcmR[i] = data_in[right + 1] | (data_in[right + 2] << 8);
+    data_in += 3 * channel_count;
+  }
+}
+
+static void aptx_tws_deinterleave_32(const uint32_t* data_in, uint32_t samples,
+                                     uint8_t channel_count, uint32_t* pcmL,
+                                     uint32_t* pcmR) {
+  const uint8_t right = (channel_count > 1) ? 1 : 0;
+
+  for (uint32_t i = 0; i < samples; i++) {
+    pcmL[i] = data_in[0] >> 16;
+    pcmR[i] = data_in[right] >> 16;
+    data_in += channel_count;
+  }
+}
+
+#if defined(__ARM_NEON)
+//
+// SIMD conversions of as many samples per channel as fit whole vectors.
+// Return the number of samples per channel done.
+//
+static uint32_t aptx_tws_deinterleave_16_simd(const uint16_t* data_in,
+                                              uint32_t samples,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR) {
+  uint32_t i = 0;
+
+  if (channel_count == 2) {
+    for (; i + 8 <= samples; i += 8) {
+      uint16x8x2_t lr = vld2q_u16(data_in + 2 * i);
+      vst1q_u32(pcmL + i, vmovl_u16(vget_low_u16(lr.val[0])));
+      vst1q_u32(pcmL + i + 4, vmovl_u16(vget_high_u16(lr.val[0])));
+      vst1q_u32(pcmR + i, vmovl_u16(vget_low_u16(lr.val[1])));
+      vst1q_u32(pcmR + i + 4, vmovl_u16(vget_high_u16(lr.val[1])));
+    }
+  } else {
+    for (; i + 8 <= samples; i += 8) {
+      uint16x8_t mono = vld1q_u16(data_in + i);
+      uint32x4_t low = vmovl_u16(vget_low_u16(mono));
+      uint32x4_t high = vmovl_u16(vget_high_u16(mono));
+      vst1q_u32(pcmL + i, low);
+      vst1q_u32(pcmL + i + 4, high);
+      vst1q_u32(pcmR + i, low);
+      vst1q_u32(pcmR + i + 4, high);
+    }
+  }
+  return i;
+}
+
+static uint32_t aptx_tws_deinterleave_32_simd(const uint32_t* data_in,
+                                              uint32_t samples,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR) {
+  uint32_t i = 0;
+
+  if (channel_count == 2) {
+    for (; i + 4 <= samples; i += 4) {
+      uint32x4x2_t lr = vld2q_u32(data_in + 2 * i);
+      vst1q_u32(pcmL + i, vshrq_n_u32(lr.val[0], 16));
+      vst1q_u32(pcmR + i, vshrq_n_u32(lr.val[1], 16));
+    }
+  } else {
+    for (; i + 4 <= samples; i += 4) {
+      uint32x4_t mono = vshrq_n_u32(vld1q_u32(data_in + i), 16);
+      vst1q_u32(pcmL + i, mono);
+      vst1q_u32(pcmR + i, mono);
+    }
+  }
+  return i;
+}
+#elif defined(__SSE2__)
+//
+// SIMD conversions of as many samples per channel as fit whole vectors.
+// Return the number of samples per channel done.
+//
+static uint32_t aptx_tws_deinterleave_16_simd(const uint16_t* data_in,
+                                              uint32_t samples,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR) {
+  uint32_t i = 0;
+
+  if (channel_count == 2) {
+    // Each 32-bit lane is one frame, left in the low half
+    const __m128i low_half = _mm_set1_epi32(0xffff);
+    for (; i + 4 <= samples; i += 4) {
+      __m128i lr = _mm_loadu_si128((const __m128i*)(data_in + 2 * i));
+      _mm_storeu_si128((__m128i*)(pcmL + i), _mm_and_si128(lr, low_half));
+      _mm_storeu_si128((__m128i*)(pcmR + i), _mm_srli_epi32(lr, 16));
+    }
+  } else {
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= samples; i += 8) {
+      __m128i mono = _mm_loadu_si128((const __m128i*)(data_in + i));
+      __m128i low = _mm_unpacklo_epi16(mono, zero);
+      __m128i high = _mm_unpackhi_epi16(mono, zero);
+      _mm_storeu_si128((__m128i*)(pcmL + i), low);
+      _mm_storeu_si128((__m128i*)(pcmL + i + 4), high);
+      _mm_storeu_si128((__m128i*)(pcmR + i), low);
+      _mm_storeu_si128((__m128i*)(pcmR + i + 4), high);
+    }
+  }
+  return i;
+}
+
+static uint32_t aptx_tws_deinterleave_32_simd(const uint32_t* data_in,
+                                              uint32_t samples,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR) {
+  uint32_t i = 0;
+
+  if (channel_count == 2) {
+    for (; i + 4 <= samples; i += 4) {
+      __m128i lr01 = _mm_srli_epi32(
+          _mm_loadu_si128((const __m128i*)(data_in + 2 * i)), 16);
+      __m128i lr23 = _mm_srli_epi32(
+          _mm_loadu_si128((const __m128i*)(data_in + 2 * i + 4)), 16);
+      // L0 R0 L1 R1 -> L0 L1 R0 R1
+      lr01 = _mm_shuffle_epi32(lr01, _MM_SHUFFLE(3, 1, 2, 0));
+      lr23 = _mm_shuffle_epi32(lr23, _MM_SHUFFLE(3, 1, 2, 0));
+      _mm_storeu_si128((__m128i*)(pcmL + i), _mm_unpacklo_epi64(lr01, lr23));
+      _mm_storeu_si128((__m128i*)(pcmR + i), _mm_unpackhi_epi64(lr01, lr23));
+    }
+  } else {
+    for (; i + 4 <= samples; i += 4) {
+      __m128i mono =
+          _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(data_in + i)), 16);
+      _mm_storeu_si128((__m128i*)(pcmL + i), mono);
+      _mm_storeu_si128((__m128i*)(pcmR + i), mono);
+    }
+  }
+  return i;
+}
+#endif
+
+static bool aptx_tws_deinterleave(const uint8_t* data_in, uint32_t groups,
+                                  uint8_t bits_per_sample,
+                                  uint8_t channel_count, uint32_t* pcmL,
+                                  uint32_t* pcmR, bool use_simd) {
+  const uint32_t samples = groups * A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP;
+  uint32_t done = 0;
+
+  if (channel_count != 1 && channel_count != 2) return false;
+
+  switch (bits_per_sample) {
+    case 16: {
+      const uint16_t* data16_in = (const uint16_t*)data_in;
+#if defined(A2DP_APTX_TWS_PCM_SIMD)
+      if (use_simd) {
+        done = aptx_tws_deinterleave_16_simd(data16_in, samples,
+                                             channel_count, pcmL, pcmR);
+      }
+#endif
+      aptx_tws_deinterleave_16(data16_in + done * channel_count,
+                               samples - done, channel_count, pcmL + done,
+                               pcmR + done);
+      return true;
+    }
+
+    case 24:
+      aptx_tws_deinterleave_24(data_in, samples, channel_count, pcmL, pcmR);
+      return true;
+
+    case 32: {
+      const uint32_t* data32_in = (const uint32_t*)data_in;
+#if defined(A2DP_APTX_TWS_PCM_SIMD)
+      if (use_simd) {
+        done = aptx_tws_deinterleave_32_simd(data32_in, samples,
+                                             channel_count, pcmL, pcmR);
+      }
+#endif
+      aptx_tws_deinterleave_32(data32_in + done * channel_count,
+                               samples - done, channel_count, pcmL + done,
+                               pcmR + done);
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+bool a2dp_vendor_aptx_tws_deinterleave(const uint8_t* data_in,
+                                       uint32_t groups,
+                                       uint8_t bits_per_sample,
+                                       uint8_t channel_count, uint32_t* pcmL,
+                                       uint32_t* pcmR) {
+  return aptx_tws_deinterleave(data_in, groups, bits_per_sample,
+                               channel_count, pcmL, pcmR, true);
+}
+
+bool a2dp_vendor_aptx_tws_deinterleave_scalar(const uint8_t* data_in,
+                                              uint32_t groups,
+                                              uint8_t bits_per_sample,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR) {
+  return aptx_tws_deinterleave(data_in, groups, bits_per_sample,
+                               channel_count, pcmL, pcmR, false);
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "a2dp_vendor_aptx_tws_sync"
+
+#include "a2dp_vendor_aptx_tws_sync.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <mutex>
+
+#include "osi/include/log.h"
+
+// Number of sent packets remembered to match delivery reports against
+#define A2DP_APTX_TWS_SYNC_HISTORY 64
+
+// Samples per frame, the unit of drift correction
+#define A2DP_APTX_TWS_SYNC_SAMPLES_PER_FRAME 4
+
+// Offsets within this many frames are left alone
+#define A2DP_APTX_TWS_SYNC_DEADBAND_FRAMES 4
+
+// At most one frame of correction in this interval, and never more than
+// A2DP_APTX_TWS_SYNC_MAX_PENDING_FRAMES waiting to be applied per earbud.
+#define A2DP_APTX_TWS_SYNC_CORRECTION_INTERVAL_US 100000
+#define A2DP_APTX_TWS_SYNC_MAX_PENDING_FRAMES 8
+
+// Weight of a new latency sample in the smoothed latency, as 1 / (1 << n)
+#define A2DP_APTX_TWS_SYNC_SMOOTHING_SHIFT 3
+
+typedef struct {
+  uint32_t timestamp;
+  uint64_t sent_us;
+} tA2DP_APTX_TWS_SYNC_PACKET;
+
+typedef struct {
+  bool has_latency;
+  int64_t latency_us;          // Smoothed delivery latency
+  int64_t compensation_us;     // Rendering shift from applied corrections
+  int32_t pending_frames;      // Correction not yet picked up by the path
+  size_t num_reports;
+} tA2DP_APTX_TWS_SYNC_EARBUD;
+
+typedef struct {
+  uint32_t sample_rate;
+  tA2DP_APTX_TWS_SYNC_PACKET history[A2DP_APTX_TWS_SYNC_HISTORY];
+  size_t history_next;
+  size_t history_count;
+  tA2DP_APTX_TWS_SYNC_EARBUD earbuds[A2DP_APTX_TWS_SYNC_NUM_EARBUDS];
+  int64_t offset_us;
+  uint32_t max_offset_us;
+  uint64_t last_correction_us;
+  size_t num_corrections;
+} tA2DP_APTX_TWS_SYNC_CB;
+
+static tA2DP_APTX_TWS_SYNC_CB a2dp_aptx_tws_sync_cb;
+static std::mutex a2dp_aptx_tws_sync_lock;
+
+static int64_t aptx_tws_sync_frame_us(void) {
+  if (a2dp_aptx_tws_sync_cb.sample_rate == 0) return 0;
+  return (int64_t)A2DP_APTX_TWS_SYNC_SAMPLES_PER_FRAME * 1000000 /
+         a2dp_aptx_tws_sync_cb.sample_rate;
+}
+
+//
+// Recompute the inter-ear offset and queue a bounded correction: the late
+// earbud drops a frame, or once it has enough pending the early one
+// inserts one.
+//
+static void aptx_tws_sync_update_offset(uint64_t now_us) {
+  tA2DP_APTX_TWS_SYNC_EARBUD* left =
+      &a2dp_aptx_tws_sync_cb.earbuds[A2DP_APTX_TWS_SYNC_EARBUD_LEFT];
+  tA2DP_APTX_TWS_SYNC_EARBUD* right =
+      &a2dp_aptx_tws_sync_cb.earbuds[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT];
+
+  if (!left->has_latency || !right->has_latency) return;
+
+  int64_t offset_us = (left->latency_us + left->compensation_us) -
+                      (right->latency_us + right->compensation_us);
+  uint32_t abs_offset_us = (uint32_t)((offset_us < 0) ? -offset_us : offset_us);
+
+  a2dp_aptx_tws_sync_cb.offset_us = offset_us;
+  if (abs_offset_us > a2dp_aptx_tws_sync_cb.max_offset_us)
+    a2dp_aptx_tws_sync_cb.max_offset_us = abs_offset_us;
+
+  if (abs_offset_us <=
+      A2DP_APTX_TWS_SYNC_DEADBAND_FRAMES * aptx_tws_sync_frame_us())
+    return;
+
+  // Reports of the two earbuds arrive out of order, |now_us| may be older
+  // than the last correction
+  if (a2dp_aptx_tws_sync_cb.last_correction_us != 0 &&
+      now_us < a2dp_aptx_tws_sync_cb.last_correction_us +
+                   A2DP_APTX_TWS_SYNC_CORRECTION_INTERVAL_US)
+    return;
+
+  tA2DP_APTX_TWS_SYNC_EARBUD* late = (offset_us > 0) ? left : right;
+  tA2DP_APTX_TWS_SYNC_EARBUD* early = (offset_us > 0) ? right : left;
+  if (late->pending_frames < A2DP_APTX_TWS_SYNC_MAX_PENDING_FRAMES) {
+    late->pending_frames++;
+  } else if (early->pending_frames > -A2DP_APTX_TWS_SYNC_MAX_PENDING_FRAMES) {
+    early->pending_frames--;
+  } else {
+    return;
+  }
+
+  a2dp_aptx_tws_sync_cb.last_correction_us = now_us;
+  a2dp_aptx_tws_sync_cb.num_corrections++;
+  LOG_DEBUG(LOG_TAG, "%s: offset %" PRId64 " us, %s earbud late", __func__,
+            offset_us, (late == left) ? "left" : "right");
+}
+
+void a2dp_vendor_aptx_tws_sync_reset(uint32_t sample_rate) {
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_sync_lock);
+
+  memset(&a2dp_aptx_tws_sync_cb, 0, sizeof(a2dp_aptx_tws_sync_cb));
+  a2dp_aptx_tws_sync_cb.sample_rate = sample_rate;
+}
+
+void a2dp_vendor_aptx_tws_sync_packet_sent(uint32_t timestamp,
+                                           uint64_t sent_us) {
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_sync_lock);
+  tA2DP_APTX_TWS_SYNC_PACKET* p_packet =
+      &a2dp_aptx_tws_sync_cb.history[a2dp_aptx_tws_sync_cb.history_next];
+
+  p_packet->timestamp = timestamp;
+  p_packet->sent_us = sent_us;
+  a2dp_aptx_tws_sync_cb.history_next =
+      (a2dp_aptx_tws_sync_cb.history_next + 1) % A2DP_APTX_TWS_SYNC_HISTORY;
+  if (a2dp_aptx_tws_sync_cb.history_count < A2DP_APTX_TWS_SYNC_HISTORY)
+    a2dp_aptx_tws_sync_cb.history_count++;
+}
+
+void a2dp_vendor_aptx_tws_sync_report_delivery(uint8_t earbud,
+                                               uint32_t timestamp,
+                                               uint64_t delivered_us) {
+  if (earbud >= A2DP_APTX_TWS_SYNC_NUM_EARBUDS) {
+    LOG_ERROR(LOG_TAG, "%s: invalid earbud %u", __func__, earbud);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_sync_lock);
+  const tA2DP_APTX_TWS_SYNC_PACKET* p_packet = NULL;
+
+  // Most reports are about recent packets, so search backwards
+  for (size_t i = 1; i <= a2dp_aptx_tws_sync_cb.history_count; i++) {
+    size_t idx = (a2dp_aptx_tws_sync_cb.history_next +
+                  A2DP_APTX_TWS_SYNC_HISTORY - i) %
+                 A2DP_APTX_TWS_SYNC_HISTORY;
+    if (a2dp_aptx_tws_sync_cb.history[idx].timestamp == timestamp) {
+      p_packet = &a2dp_aptx_tws_sync_cb.history[idx];
+      break;
+    }
+  }
+  if (p_packet == NULL || delivered_us < p_packet->sent_us) return;
+
+  tA2DP_APTX_TWS_SYNC_EARBUD* p_earbud =
+      &a2dp_aptx_tws_sync_cb.earbuds[earbud];
+  int64_t latency_us = (int64_t)(delivered_us - p_packet->sent_us);
+
+  if (!p_earbud->has_latency) {
+    p_earbud->latency_us = latency_us;
+    p_earbud->has_latency = true;
+  } else {
+    p_earbud->latency_us += (latency_us - p_earbud->latency_us) >>
+                            A2DP_APTX_TWS_SYNC_SMOOTHING_SHIFT;
+  }
+  p_earbud->num_reports++;
+
+  aptx_tws_sync_update_offset(delivered_us);
+}
+
+int32_t a2dp_vendor_aptx_tws_sync_get_hint(uint8_t earbud) {
+  if (earbud >= A2DP_APTX_TWS_SYNC_NUM_EARBUDS) return 0;
+
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_sync_lock);
+  tA2DP_APTX_TWS_SYNC_EARBUD* p_earbud =
+      &a2dp_aptx_tws_sync_cb.earbuds[earbud];
+  int32_t frames = p_earbud->pending_frames;
+
+  // Dropped frames make this earbud render earlier, inserted ones later
+  p_earbud->compensation_us -= frames * aptx_tws_sync_frame_us();
+  p_earbud->pending_frames = 0;
+  return frames;
+}
+
+void a2dp_vendor_aptx_tws_sync_get_stats(tA2DP_APTX_TWS_SYNC_STATS* p_stats) {
+  std::lock_guard<std::mutex> lock(a2dp_aptx_tws_sync_lock);
+
+  for (size_t i = 0; i < A2DP_APTX_TWS_SYNC_NUM_EARBUDS; i++) {
+    p_stats->num_reports[i] = a2dp_aptx_tws_sync_cb.earbuds[i].num_reports;
+    p_stats->latency_us[i] =
+        (uint32_t)a2dp_aptx_tws_sync_cb.earbuds[i].latency_us;
+  }
+  p_stats->offset_us = (int32_t)a2dp_aptx_tws_sync_cb.offset_us;
+  p_stats->max_offset_us = a2dp_aptx_tws_sync_cb.max_offset_us;
+  p_stats->num_corrections = a2dp_aptx_tws_sync_cb.num_corrections;
+}
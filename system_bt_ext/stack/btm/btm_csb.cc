@@ -55,15 +55,16 @@
  ******************************************************************************/
 void btm_hci_csb_timeout_evt(uint8_t* p) {
   RawAddress  bda;
-  uint8_t status;
   uint8_t lt_addr;
 
   BTM_TRACE_DEBUG("BTM Event: Connectionless Slave Broadcast Timeout");
-  STREAM_TO_UINT8(status, p);
+  // the event carries no status, only BD_ADDR and LT_ADDR
   STREAM_TO_BDADDR(bda, p);
   STREAM_TO_UINT8(lt_addr, p);
 
-  bta_ba_handle_hci_event(BTA_BA_HCI_EVT_CSB_TIMEOUT, status, NULL, 0);
+  // lt_addr tells which broadcast stream timed out.
+  bta_ba_handle_hci_event(BTA_BA_HCI_EVT_CSB_TIMEOUT, HCI_SUCCESS, &lt_addr,
+                          1);
 }
 
 /*******************************************************************************
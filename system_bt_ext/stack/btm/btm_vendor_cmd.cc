@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <base/logging.h>
+#include <string.h>
+#include <array>
+#include <mutex>
+#include <utility>
+
+#include "bt_types.h"
+#include "bt_utils.h"
+#include "btm_api.h"
+#include "btm_int.h"
+#include "btm_vendor_cmd.h"
+#include "hcidefs.h"
+#include "osi/include/alarm.h"
+#include "osi/include/log.h"
+#include "osi/include/osi.h"
+#include "osi/include/time.h"
+
+#define BTM_VSC_MAX_BATCHES 4
+#define BTM_VSC_MAX_STATS_OPCODES 8
+/* late completions of recycled commands tracked per slot */
+#define BTM_VSC_MAX_STALE 2
+/* how long after its timeout a late completion is still expected */
+#define BTM_VSC_STALE_MS 10000
+
+/* a timed out command whose slot was given to another command. Its late
+ * completion, if it ever shows up, is told apart by opcode. */
+typedef struct {
+  uint16_t opcode;  // 0 when unused
+  uint64_t expires_us;
+} tBTM_VSC_STALE;
+
+typedef struct {
+  bool in_use;
+  bool timed_out;  // submitter was told, slot waits for the late completion
+  bool raw;        // standard HCI command, sent with BTM_Hci_Raw_Command
+  uint16_t cmd_id;
+  uint16_t opcode;
+  uint8_t sub_opcode;
+  uint32_t seq;  // submission order, the oldest timed out slot is recycled
+  uint64_t sent_us;
+  uint64_t stale_until_us;  // timed out, late completion expected until then
+  uint16_t batch_id;
+  uint8_t batch_pos;
+  alarm_t* timer;
+  tBTM_VSC_DISPATCH_CBACK* p_cback;
+  void* context;
+  tBTM_VSC_STALE stale[BTM_VSC_MAX_STALE];
+} tBTM_VSC_PENDING;
+
+typedef struct {
+  bool in_use;
+  uint16_t batch_id;
+  uint8_t num_cmds;
+  uint8_t num_done;
+  uint8_t num_failed;
+  uint8_t status[BTM_VSC_MAX_BATCH];
+  tBTM_VSC_BATCH_CBACK* p_cback;
+  void* context;
+} tBTM_VSC_BATCH;
+
+const uint16_t btm_vsc_latency_bucket_ms[BTM_VSC_LATENCY_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100};
+
+static std::mutex btm_vsc_lock;
+static tBTM_VSC_PENDING btm_vsc_pending[BTM_VSC_MAX_PENDING];
+static tBTM_VSC_BATCH btm_vsc_batches[BTM_VSC_MAX_BATCHES];
+static tBTM_VSC_LATENCY_STATS btm_vsc_stats[BTM_VSC_MAX_STATS_OPCODES];
+static uint16_t btm_vsc_next_id = BTM_VSC_INVALID_ID + 1;
+static uint32_t btm_vsc_next_seq = 0;
+
+static void btm_vsc_cmpl(int slot, uint8_t status, tBTM_VSC_CMPL* p_cmpl);
+static void btm_vsc_raw_cmpl(int slot, tBTM_RAW_CMPL* p_raw);
+static void btm_vsc_timeout_cback(void* data);
+
+/* BTM hands a command's own completion callback its command complete event.
+ * Every slot sends with a callback of its own, so a completion lands on the
+ * slot that sent the command, whatever its opcode or status. */
+template <int N>
+static void btm_vsc_slot_cmpl_cback(tBTM_VSC_CMPL* p_cmpl) {
+  uint8_t status =
+      (p_cmpl->param_len > 0) ? p_cmpl->p_param_buf[0] : HCI_ERR_UNSPECIFIED;
+  btm_vsc_cmpl(N, status, p_cmpl);
+}
+
+template <int N>
+static void btm_vsc_slot_raw_cback(tBTM_RAW_CMPL* p_raw) {
+  btm_vsc_raw_cmpl(N, p_raw);
+}
+
+template <int... N>
+static std::array<tBTM_VSC_CMPL_CB*, sizeof...(N)> btm_vsc_make_cmpl_cbacks(
+    std::integer_sequence<int, N...>) {
+  return {{&btm_vsc_slot_cmpl_cback<N>...}};
+}
+
+template <int... N>
+static std::array<tBTM_RAW_CMPL_CB*, sizeof...(N)> btm_vsc_make_raw_cbacks(
+    std::integer_sequence<int, N...>) {
+  return {{&btm_vsc_slot_raw_cback<N>...}};
+}
+
+static const std::array<tBTM_VSC_CMPL_CB*, BTM_VSC_MAX_PENDING>
+    btm_vsc_cmpl_cbacks = btm_vsc_make_cmpl_cbacks(
+        std::make_integer_sequence<int, BTM_VSC_MAX_PENDING>());
+static const std::array<tBTM_RAW_CMPL_CB*, BTM_VSC_MAX_PENDING>
+    btm_vsc_raw_cbacks = btm_vsc_make_raw_cbacks(
+        std::make_integer_sequence<int, BTM_VSC_MAX_PENDING>());
+
+/* vendor commands are tracked with their full opcode, like BTM reports it */
+static uint16_t btm_vsc_full_opcode(uint16_t opcode, bool raw) {
+  return raw ? opcode : (HCI_GRP_VENDOR_SPECIFIC | opcode);
+}
+
+/* must be called with btm_vsc_lock held */
+static uint16_t btm_vsc_alloc_id() {
+  uint16_t id = btm_vsc_next_id++;
+  if (btm_vsc_next_id == BTM_VSC_INVALID_ID) btm_vsc_next_id++;
+  return id;
+}
+
+/* must be called with btm_vsc_lock held. Forgets late completions which
+ * are not expected any more, and timed out commands which never got one. */
+static void btm_vsc_expire_stale(tBTM_VSC_PENDING* p, uint64_t now_us) {
+  for (int i = 0; i < BTM_VSC_MAX_STALE; i++) {
+    if (p->stale[i].opcode != 0 && now_us >= p->stale[i].expires_us)
+      p->stale[i].opcode = 0;
+  }
+  if (p->in_use && p->timed_out && now_us >= p->stale_until_us) {
+    LOG_WARN(LOG_TAG, "%s: no late completion for opcode 0x%04x", __func__,
+             p->opcode);
+    p->in_use = false;
+    p->timed_out = false;
+  }
+}
+
+/* must be called with btm_vsc_lock held */
+static tBTM_VSC_STALE* btm_vsc_find_stale(tBTM_VSC_PENDING* p,
+                                          uint16_t opcode) {
+  for (int i = 0; i < BTM_VSC_MAX_STALE; i++) {
+    if (p->stale[i].opcode != 0 && p->stale[i].opcode == opcode)
+      return &p->stale[i];
+  }
+  return NULL;
+}
+
+/* must be called with btm_vsc_lock held. When all entries are taken the one
+ * due to expire first is given up. */
+static void btm_vsc_add_stale(tBTM_VSC_PENDING* p) {
+  tBTM_VSC_STALE* p_stale = &p->stale[0];
+  for (int i = 0; i < BTM_VSC_MAX_STALE; i++) {
+    if (p->stale[i].opcode == 0) {
+      p_stale = &p->stale[i];
+      break;
+    }
+    if (p->stale[i].expires_us < p_stale->expires_us) p_stale = &p->stale[i];
+  }
+  p_stale->opcode = p->opcode;
+  p_stale->expires_us = p->stale_until_us;
+}
+
+/* must be called with btm_vsc_lock held. A slot which may still see a late
+ * completion for opcode is never used for opcode, a completion would not
+ * tell the two apart. Timed out slots are only recycled when no slot is
+ * free. */
+static tBTM_VSC_PENDING* btm_vsc_find_free(uint16_t opcode, uint64_t now_us) {
+  tBTM_VSC_PENDING* p_oldest_timed_out = NULL;
+  for (int i = 0; i < BTM_VSC_MAX_PENDING; i++) {
+    tBTM_VSC_PENDING* p = &btm_vsc_pending[i];
+    btm_vsc_expire_stale(p, now_us);
+    if (btm_vsc_find_stale(p, opcode) != NULL) continue;
+    if (!p->in_use) return p;
+    if (p->timed_out && p->opcode != opcode &&
+        (p_oldest_timed_out == NULL ||
+         (int32_t)(p->seq - p_oldest_timed_out->seq) < 0))
+      p_oldest_timed_out = p;
+  }
+  return p_oldest_timed_out;
+}
+
+/* must be called with btm_vsc_lock held */
+static tBTM_VSC_PENDING* btm_vsc_alloc_pending(uint16_t opcode, bool raw,
+                                               uint8_t param_len,
+                                               uint8_t* p_params) {
+  uint16_t full_opcode = btm_vsc_full_opcode(opcode, raw);
+  tBTM_VSC_PENDING* p =
+      btm_vsc_find_free(full_opcode, time_get_os_boottime_us());
+  if (p != NULL) {
+    alarm_t* timer = p->timer;
+    tBTM_VSC_STALE stale[BTM_VSC_MAX_STALE];
+    // the late completion of a recycled command may still show up on this
+    // slot, it must not be taken for the new one's
+    if (p->in_use) btm_vsc_add_stale(p);
+    memcpy(stale, p->stale, sizeof(stale));
+    memset(p, 0, sizeof(*p));
+    p->timer = timer;
+    memcpy(p->stale, stale, sizeof(stale));
+    p->in_use = true;
+    p->raw = raw;
+    p->cmd_id = btm_vsc_alloc_id();
+    p->opcode = full_opcode;
+    p->sub_opcode = (param_len > 0 && !raw) ? p_params[0] : 0;
+    p->seq = btm_vsc_next_seq++;
+  }
+  return p;
+}
+
+/* must be called with btm_vsc_lock held */
+static void btm_vsc_record_latency(uint16_t opcode, uint64_t latency_us,
+                                   bool timed_out) {
+  tBTM_VSC_LATENCY_STATS* p_stats = NULL;
+  for (int i = 0; i < BTM_VSC_MAX_STATS_OPCODES; i++) {
+    if (btm_vsc_stats[i].num_cmds == 0 && btm_vsc_stats[i].num_timeouts == 0) {
+      btm_vsc_stats[i].opcode = opcode;
+      p_stats = &btm_vsc_stats[i];
+      break;
+    }
+    if (btm_vsc_stats[i].opcode == opcode) {
+      p_stats = &btm_vsc_stats[i];
+      break;
+    }
+  }
+  if (p_stats == NULL) return;
+
+  if (timed_out) {
+    p_stats->num_timeouts++;
+    return;
+  }
+  uint32_t latency_ms = latency_us / 1000;
+  int bucket = 0;
+  while (bucket < BTM_VSC_LATENCY_BUCKETS - 1 &&
+         latency_ms >= btm_vsc_latency_bucket_ms[bucket])
+    bucket++;
+  p_stats->histogram[bucket]++;
+  p_stats->num_cmds++;
+  if (latency_ms > p_stats->max_latency_ms) p_stats->max_latency_ms = latency_ms;
+}
+
+/*******************************************************************************
+ *
+ * Function         btm_vsc_release
+ *
+ * Description      Frees a completed or timed out command, updates its batch
+ *                  and calls the submitter back. A timed out command keeps
+ *                  its slot until the late completion shows up. Called on
+ *                  the main thread without btm_vsc_lock held.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void btm_vsc_release(tBTM_VSC_PENDING* p, uint8_t status,
+                            tBTM_VSC_CMPL* p_cmpl, bool timed_out) {
+  tBTM_VSC_BATCH batch;
+  bool batch_done = false;
+
+  memset(&batch, 0, sizeof(batch));
+  if (!timed_out) alarm_cancel(p->timer);
+
+  std::unique_lock<std::mutex> lock(btm_vsc_lock);
+  uint16_t cmd_id = p->cmd_id;
+  tBTM_VSC_DISPATCH_CBACK* p_cback = p->p_cback;
+  void* context = p->context;
+  btm_vsc_record_latency(p->opcode, time_get_os_boottime_us() - p->sent_us,
+                         timed_out);
+
+  if (p->batch_id != BTM_VSC_INVALID_ID) {
+    for (int i = 0; i < BTM_VSC_MAX_BATCHES; i++) {
+      tBTM_VSC_BATCH* p_batch = &btm_vsc_batches[i];
+      if (!p_batch->in_use || p_batch->batch_id != p->batch_id) continue;
+      p_batch->status[p->batch_pos] = status;
+      p_batch->num_done++;
+      if (status != HCI_SUCCESS) p_batch->num_failed++;
+      if (p_batch->num_done == p_batch->num_cmds) {
+        batch = *p_batch;
+        p_batch->in_use = false;
+        batch_done = true;
+      }
+      break;
+    }
+  }
+  p->in_use = timed_out;
+  p->timed_out = timed_out;
+  if (timed_out)
+    p->stale_until_us = time_get_os_boottime_us() + BTM_VSC_STALE_MS * 1000;
+  lock.unlock();
+
+  if (p_cback != NULL) (*p_cback)(cmd_id, status, p_cmpl, context);
+  if (batch_done && batch.p_cback != NULL)
+    (*batch.p_cback)(batch.batch_id, batch.num_failed, batch.num_cmds,
+                     batch.status, batch.context);
+}
+
+static void btm_vsc_send(tBTM_VSC_PENDING* p, uint8_t param_len,
+                         uint8_t* p_params, uint32_t timeout_ms) {
+  int slot = p - btm_vsc_pending;
+
+  if (timeout_ms != BTM_VSC_NO_TIMEOUT) {
+    if (p->timer == NULL) p->timer = alarm_new("btm.vsc_timer");
+    alarm_set_on_mloop(p->timer, timeout_ms, btm_vsc_timeout_cback,
+                       (void*)(uintptr_t)p->cmd_id);
+  }
+  if (p->raw)
+    BTM_Hci_Raw_Command(p->opcode, param_len, p_params,
+                        btm_vsc_raw_cbacks[slot]);
+  else
+    BTM_VendorSpecificCommand(p->opcode, param_len, p_params,
+                              btm_vsc_cmpl_cbacks[slot]);
+}
+
+/*******************************************************************************
+ *
+ * Function         btm_vsc_cmpl
+ *
+ * Description      Completion of the command sent on slot. The late
+ *                  completion of a timed out command that gave its slot away
+ *                  is told apart by opcode and dropped, the slot is never
+ *                  given to a command of the same opcode meanwhile.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+static void btm_vsc_cmpl(int slot, uint8_t status, tBTM_VSC_CMPL* p_cmpl) {
+  tBTM_VSC_PENDING* p = &btm_vsc_pending[slot];
+  uint16_t opcode = p_cmpl->opcode;
+
+  {
+    std::lock_guard<std::mutex> lock(btm_vsc_lock);
+    btm_vsc_expire_stale(p, time_get_os_boottime_us());
+    // an event without an opcode can only be for the current command
+    bool current = p->in_use && (opcode == p->opcode || opcode == 0);
+    if (!current || p->timed_out) {
+      tBTM_VSC_STALE* p_stale = btm_vsc_find_stale(p, opcode);
+      if (p_stale != NULL) {
+        p_stale->opcode = 0;
+      } else if (current) {
+        // submitter was already told about the timeout
+        p->in_use = false;
+        p->timed_out = false;
+      } else {
+        LOG_WARN(LOG_TAG, "%s: nothing pending on slot %d, opcode 0x%04x",
+                 __func__, slot, opcode);
+      }
+      return;
+    }
+  }
+  btm_vsc_release(p, status, p_cmpl, false);
+}
+
+/* Raw completions carry the whole event, the submitter gets the return
+ * parameters, starting with the status, like for a vendor command */
+static void btm_vsc_raw_cmpl(int slot, tBTM_RAW_CMPL* p_raw) {
+  tBTM_VSC_CMPL cmpl;
+  uint8_t status = HCI_ERR_UNSPECIFIED;
+  uint8_t* p = p_raw->p_param_buf;
+
+  memset(&cmpl, 0, sizeof(cmpl));
+  if (p_raw->event_code == HCI_COMMAND_COMPLETE_EVT && p_raw->param_len > 3) {
+    // num_hci_cmd_pkts, opcode, return parameters
+    p++;
+    STREAM_TO_UINT16(cmpl.opcode, p);
+    cmpl.param_len = p_raw->param_len - 3;
+    cmpl.p_param_buf = p;
+    status = *p;
+  } else if (p_raw->event_code == HCI_COMMAND_STATUS_EVT &&
+             p_raw->param_len > 3) {
+    // status, num_hci_cmd_pkts, opcode
+    status = p[0];
+    cmpl.param_len = 1;
+    cmpl.p_param_buf = p;
+    p += 2;
+    STREAM_TO_UINT16(cmpl.opcode, p);
+  }
+  btm_vsc_cmpl(slot, status, &cmpl);
+}
+
+static void btm_vsc_timeout_cback(void* data) {
+  uint16_t cmd_id = (uint16_t)(uintptr_t)data;
+  tBTM_VSC_PENDING* p_match = NULL;
+
+  {
+    std::lock_guard<std::mutex> lock(btm_vsc_lock);
+    for (int i = 0; i < BTM_VSC_MAX_PENDING; i++) {
+      tBTM_VSC_PENDING* p = &btm_vsc_pending[i];
+      if (p->in_use && !p->timed_out && p->cmd_id == cmd_id) {
+        p_match = p;
+        break;
+      }
+    }
+  }
+  if (p_match == NULL) return;
+
+  LOG_ERROR(LOG_TAG, "%s: opcode 0x%04x sub 0x%02x timed out", __func__,
+            p_match->opcode, p_match->sub_opcode);
+  btm_vsc_release(p_match, BTM_VSC_STATUS_TIMEOUT, NULL, true);
+}
+
+static uint16_t btm_vsc_submit(uint16_t opcode, bool raw, uint8_t param_len,
+                               uint8_t* p_params, uint32_t timeout_ms,
+                               tBTM_VSC_DISPATCH_CBACK* p_cback,
+                               void* context) {
+  tBTM_VSC_PENDING* p = NULL;
+  {
+    std::lock_guard<std::mutex> lock(btm_vsc_lock);
+    p = btm_vsc_alloc_pending(opcode, raw, param_len, p_params);
+    if (p == NULL) {
+      LOG_ERROR(LOG_TAG, "%s: too many pending commands, opcode 0x%04x",
+                __func__, opcode);
+      return BTM_VSC_INVALID_ID;
+    }
+    p->p_cback = p_cback;
+    p->context = context;
+    p->sent_us = time_get_os_boottime_us();
+  }
+  uint16_t cmd_id = p->cmd_id;
+  btm_vsc_send(p, param_len, p_params, timeout_ms);
+  return cmd_id;
+}
+
+/*******************************************************************************
+ *
+ * Function         BTM_VscSubmit
+ *
+ * Description      Sends a vendor specific command. p_cback is called once,
+ *                  either with the command complete event or on timeout.
+ *
+ * Returns          command id, BTM_VSC_INVALID_ID if nothing was sent
+ *
+ ******************************************************************************/
+uint16_t BTM_VscSubmit(uint16_t opcode, uint8_t param_len, uint8_t* p_params,
+                       uint32_t timeout_ms, tBTM_VSC_DISPATCH_CBACK* p_cback,
+                       void* context) {
+  return btm_vsc_submit(opcode, false, param_len, p_params, timeout_ms,
+                        p_cback, context);
+}
+
+/*******************************************************************************
+ *
+ * Function         BTM_VscSubmitRaw
+ *
+ * Description      Sends a standard HCI command through the dispatcher, for
+ *                  the same timeout and latency tracking as vendor commands.
+ *
+ * Returns          command id, BTM_VSC_INVALID_ID if nothing was sent
+ *
+ ******************************************************************************/
+uint16_t BTM_VscSubmitRaw(uint16_t opcode, uint8_t param_len,
+                          uint8_t* p_params, uint32_t timeout_ms,
+                          tBTM_VSC_DISPATCH_CBACK* p_cback, void* context) {
+  return btm_vsc_submit(opcode, true, param_len, p_params, timeout_ms,
+                        p_cback, context);
+}
+
+/*******************************************************************************
+ *
+ * Function         BTM_VscSubmitBatch
+ *
+ * Description      Sends a group of commands back to back. They are all
+ *                  queued to the controller at once, each command's own
+ *                  callback gets its result and p_cback is called once the
+ *                  last one completed or timed out.
+ *
+ * Returns          batch id, BTM_VSC_INVALID_ID if nothing was sent
+ *
+ ******************************************************************************/
+uint16_t BTM_VscSubmitBatch(const tBTM_VSC_BATCH_CMD* p_cmds, uint8_t num_cmds,
+                            uint32_t timeout_ms,
+                            tBTM_VSC_BATCH_CBACK* p_cback, void* context) {
+  tBTM_VSC_PENDING* p_pending[BTM_VSC_MAX_BATCH];
+  tBTM_VSC_BATCH* p_batch = NULL;
+  uint16_t batch_id;
+  uint8_t num_alloc = 0;
+
+  if (num_cmds == 0 || num_cmds > BTM_VSC_MAX_BATCH) return BTM_VSC_INVALID_ID;
+
+  {
+    std::lock_guard<std::mutex> lock(btm_vsc_lock);
+    for (int i = 0; i < BTM_VSC_MAX_BATCHES && p_batch == NULL; i++)
+      if (!btm_vsc_batches[i].in_use) p_batch = &btm_vsc_batches[i];
+    while (p_batch != NULL && num_alloc < num_cmds) {
+      p_pending[num_alloc] = btm_vsc_alloc_pending(
+          p_cmds[num_alloc].opcode, p_cmds[num_alloc].raw,
+          p_cmds[num_alloc].param_len, p_cmds[num_alloc].p_params);
+      if (p_pending[num_alloc] == NULL) break;
+      num_alloc++;
+    }
+    if (p_batch == NULL || num_alloc < num_cmds) {
+      // nothing was sent yet, give back what was taken
+      for (uint8_t i = 0; i < num_alloc; i++) p_pending[i]->in_use = false;
+      LOG_ERROR(LOG_TAG, "%s: no room for batch of %d", __func__, num_cmds);
+      return BTM_VSC_INVALID_ID;
+    }
+
+    memset(p_batch, 0, sizeof(*p_batch));
+    p_batch->in_use = true;
+    p_batch->batch_id = batch_id = btm_vsc_alloc_id();
+    p_batch->num_cmds = num_cmds;
+    p_batch->p_cback = p_cback;
+    p_batch->context = context;
+
+    uint64_t now_us = time_get_os_boottime_us();
+    for (uint8_t i = 0; i < num_cmds; i++) {
+      p_pending[i]->batch_id = batch_id;
+      p_pending[i]->batch_pos = i;
+      p_pending[i]->sent_us = now_us;
+      p_pending[i]->p_cback = p_cmds[i].p_cback;
+      p_pending[i]->context = p_cmds[i].context;
+    }
+  }
+
+  for (uint8_t i = 0; i < num_cmds; i++) {
+    btm_vsc_send(p_pending[i], p_cmds[i].param_len, p_cmds[i].p_params,
+                 timeout_ms);
+  }
+  return batch_id;
+}
+
+/*******************************************************************************
+ *
+ * Function         BTM_VscGetLatencyStats
+ *
+ * Description      Copies the latency histogram of the index-th opcode seen.
+ *                  Stats are kept for the first BTM_VSC_MAX_STATS_OPCODES
+ *                  opcodes, vendor opcodes include the vendor OGF.
+ *
+ * Returns          false once index is past the last opcode
+ *
+ ******************************************************************************/
+bool BTM_VscGetLatencyStats(uint8_t index, tBTM_VSC_LATENCY_STATS* p_stats) {
+  std::lock_guard<std::mutex> lock(btm_vsc_lock);
+  if (index >= BTM_VSC_MAX_STATS_OPCODES) return false;
+  if (btm_vsc_stats[index].num_cmds == 0 &&
+      btm_vsc_stats[index].num_timeouts == 0)
+    return false;
+  *p_stats = btm_vsc_stats[index];
+  return true;
+}
+
+/*******************************************************************************
+ *
+ * Function         BTM_VscCleanup
+ *
+ * Description      Forgets all pending commands and batches without calling
+ *                  their submitters back and frees the timeout alarms. Late
+ *                  completions are dropped. Called when the stack shuts down.
+ *
+ * Returns          void
+ *
+ ******************************************************************************/
+void BTM_VscCleanup(void) {
+  alarm_t* timers[BTM_VSC_MAX_PENDING];
+
+  {
+    std::lock_guard<std::mutex> lock(btm_vsc_lock);
+    for (int i = 0; i < BTM_VSC_MAX_PENDING; i++)
+      timers[i] = btm_vsc_pending[i].timer;
+    memset(btm_vsc_pending, 0, sizeof(btm_vsc_pending));
+    memset(btm_vsc_batches, 0, sizeof(btm_vsc_batches));
+  }
+  for (int i = 0; i < BTM_VSC_MAX_PENDING; i++) alarm_free(timers[i]);
+}
@@ -37,15 +37,47 @@
 #include <string.h>
 
 #include "btm_int.h"
+#include "hcivendorcmds.h"
+
+/* last CSB data payload written per LT_ADDR, LT_ADDR 0 is never reserved */
+#define HCI_CSB_DATA_NUM_LT_ADDR 8
+
+typedef struct {
+  bool valid;
+  uint16_t len;
+  uint8_t data[HCI_CSB_DATA_CACHE_LEN];
+} tHCI_CSB_DATA_CACHE;
+
+static tHCI_CSB_DATA_CACHE csb_data_cache[HCI_CSB_DATA_NUM_LT_ADDR];
+
+static tHCI_VENDOR_CMD_STATS vendor_cmd_stats;
+
+/* Buffers are owned and freed by the HCI layer once sent, allocate just what
+ * the command needs instead of a full HCI_CMD_BUF_SIZE. */
+static BT_HDR* hcic_vendor_get_cmd_buf(uint8_t param_len) {
+  uint16_t size = sizeof(BT_HDR) + HCIC_PREAMBLE_SIZE + param_len;
+  BT_HDR* p = (BT_HDR*)osi_malloc(size);
+
+  vendor_cmd_stats.num_cmds++;
+  vendor_cmd_stats.bytes_allocated += size;
+  vendor_cmd_stats.bytes_saved += HCI_CMD_BUF_SIZE - size;
+  if (param_len > vendor_cmd_stats.max_param_len)
+    vendor_cmd_stats.max_param_len = param_len;
+
+  p->len = HCIC_PREAMBLE_SIZE + param_len;
+  p->offset = 0;
+  return p;
+}
+
+void btsnd_hcic_get_vendor_cmd_stats(tHCI_VENDOR_CMD_STATS* p_stats) {
+  *p_stats = vendor_cmd_stats;
+}
 
 /* Connectionless Broadcast */
 void btsnd_hcic_set_reserved_lt_addr(uint8_t lt_addr) {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(1);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE + 1;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_SET_RESERVED_LT_ADDR);
   UINT8_TO_STREAM(pp, p->len - HCIC_PREAMBLE_SIZE);
 
@@ -55,27 +87,24 @@ void btsnd_hcic_set_reserved_lt_addr(uint8_t lt_addr) {
 }
 
 void btsnd_hcic_delete_reserved_lt_addr(uint8_t lt_addr) {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(1);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE + 1;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_DELETE_RESERVED_LT_ADDR);
   UINT8_TO_STREAM(pp, p->len - HCIC_PREAMBLE_SIZE);
 
   UINT8_TO_STREAM(pp, lt_addr);
 
   btu_hcif_send_cmd(LOCAL_BR_EDR_CONTROLLER_ID, p);
+
+  /* controller drops CSB data along with the LT_ADDR */
+  btsnd_hcic_reset_csb_data(lt_addr);
 }
 
 void btsnd_hcic_start_synch_train() {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(0);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_START_SYNC_TRAIN);
   UINT8_TO_STREAM(pp, 0);
 
@@ -85,12 +114,9 @@ void btsnd_hcic_start_synch_train() {
 void btsnd_hcic_set_csb(uint8_t enable, uint8_t lt_addr, uint8_t lpo_allowed,
                         uint16_t pkt_type, int16_t min_interval,
                         uint16_t max_interval, uint16_t csb_supvisnto) {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(HCIC_PARAM_SIZE_SET_CSB);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE + HCIC_PARAM_SIZE_SET_CSB;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_SET_CLB);
   UINT8_TO_STREAM(pp, HCIC_PARAM_SIZE_SET_CSB);
 
@@ -107,12 +133,9 @@ void btsnd_hcic_set_csb(uint8_t enable, uint8_t lt_addr, uint8_t lpo_allowed,
 
 void btsnd_hcic_set_csb_data(uint8_t lt_addr, uint8_t fragment,
                              uint8_t data_len, uint8_t* data) {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(3 + data_len);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE + 3 + data_len;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_WRITE_CLB_DATA);
   UINT8_TO_STREAM(pp, p->len - HCIC_PREAMBLE_SIZE);
 
@@ -124,14 +147,66 @@ void btsnd_hcic_set_csb_data(uint8_t lt_addr, uint8_t fragment,
   btu_hcif_send_cmd(LOCAL_BR_EDR_CONTROLLER_ID, p);
 }
 
+void btsnd_hcic_reset_csb_data(uint8_t lt_addr) {
+  if (lt_addr >= HCI_CSB_DATA_NUM_LT_ADDR) return;
+  csb_data_cache[lt_addr].valid = false;
+  csb_data_cache[lt_addr].len = 0;
+}
+
+uint16_t btsnd_hcic_write_csb_data(uint8_t lt_addr, const uint8_t* data,
+                                   uint16_t data_len) {
+  tHCI_CSB_DATA_CACHE* p_cache = NULL;
+  uint16_t offset = 0;
+  uint16_t num_cmds = 0;
+
+  if (lt_addr < HCI_CSB_DATA_NUM_LT_ADDR) p_cache = &csb_data_cache[lt_addr];
+
+  /* A START fragment makes the controller discard what it has, so a payload
+   * can only be replaced as a whole. Skip it if nothing changed. */
+  if (p_cache != NULL && p_cache->valid && p_cache->len == data_len &&
+      (data_len == 0 || memcmp(p_cache->data, data, data_len) == 0)) {
+    return 0;
+  }
+
+  if (data_len <= HCI_CSB_DATA_MAX_FRAGMENT_LEN) {
+    btsnd_hcic_set_csb_data(lt_addr, HCI_CSB_DATA_FRAGMENT_COMPLETE,
+                            (uint8_t)data_len, (uint8_t*)data);
+    num_cmds = 1;
+  } else {
+    while (offset < data_len) {
+      uint16_t frag_len = data_len - offset;
+      uint8_t fragment = HCI_CSB_DATA_FRAGMENT_CONTINUE;
+      if (frag_len > HCI_CSB_DATA_MAX_FRAGMENT_LEN) {
+        frag_len = HCI_CSB_DATA_MAX_FRAGMENT_LEN;
+      } else {
+        fragment = HCI_CSB_DATA_FRAGMENT_END;
+      }
+      if (offset == 0) fragment = HCI_CSB_DATA_FRAGMENT_START;
+      btsnd_hcic_set_csb_data(lt_addr, fragment, (uint8_t)frag_len,
+                              (uint8_t*)data + offset);
+      offset += frag_len;
+      num_cmds++;
+    }
+  }
+
+  if (p_cache != NULL) {
+    if (data_len <= HCI_CSB_DATA_CACHE_LEN) {
+      memcpy(p_cache->data, data, data_len);
+      p_cache->len = data_len;
+      p_cache->valid = true;
+    } else {
+      /* too big to remember, always resend */
+      p_cache->valid = false;
+    }
+  }
+  return num_cmds;
+}
+
 void btsnd_hcic_write_sync_train_param(uint16_t min_interval, uint16_t max_interval,
                              uint32_t sync_train, uint8_t data) {
-  BT_HDR* p = (BT_HDR*)osi_malloc(HCI_CMD_BUF_SIZE);
+  BT_HDR* p = hcic_vendor_get_cmd_buf(HCIC_PARAM_SIZE_SYNC_TRAIN);
   uint8_t* pp = (uint8_t*)(p + 1);
 
-  p->len = HCIC_PREAMBLE_SIZE + HCIC_PARAM_SIZE_SYNC_TRAIN;
-  p->offset = 0;
-
   UINT16_TO_STREAM(pp, HCI_WRITE_SYNC_TRAIN_PARAM);
   UINT8_TO_STREAM(pp,  HCIC_PARAM_SIZE_SYNC_TRAIN);
 
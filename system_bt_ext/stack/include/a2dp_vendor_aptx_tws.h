@@ -69,6 +69,11 @@ class A2dpCodecConfigAptxTWS : public A2dpCodecConfig {
                       uint8_t* p_result_codec_config) override;
 
  private:
+  // Negotiates the codec config with the peer, without the cache used by
+  // setCodecConfig().
+  bool negotiateCodecConfig(const uint8_t* p_peer_codec_info,
+                            bool is_capability,
+                            uint8_t* p_result_codec_config);
   bool useRtpHeaderMarkerBit() const override;
   bool updateEncoderUserConfig(
       const tA2DP_ENCODER_INIT_PEER_PARAMS* p_peer_params,
@@ -182,4 +187,9 @@ const char* A2DP_VendorCodecIndexStrAptxTWS(void);
 // configuration entry pointed by |p_cfg|.
 bool A2DP_VendorInitCodecConfigAptxTWS(tAVDT_CFG* p_cfg);
 
+// Gets the number of aptX-TWS codec negotiations served from the cache in
+// |p_hits| and the number actually negotiated in |p_misses|.
+void A2DP_VendorGetNegotiationCacheStatsAptxTWS(size_t* p_hits,
+                                                size_t* p_misses);
+
 #endif  // A2DP_VENDOR_APTX_TWS_H
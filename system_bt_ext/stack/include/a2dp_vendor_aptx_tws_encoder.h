@@ -57,6 +57,54 @@
 #include "a2dp_codec_api.h"
 #include "osi/include/time.h"
 
+// Number of most recent samples the time percentiles are computed from
+#define A2DP_APTX_TWS_TIME_WINDOW 256
+
+// Window of the most recent time samples (in microseconds). Once full, the
+// oldest sample is overwritten first.
+typedef struct {
+  uint32_t samples[A2DP_APTX_TWS_TIME_WINDOW];
+  size_t count;
+  size_t next;
+} a2dp_aptx_tws_time_window_t;
+
+// Statistics of an aptX-TWS software encoder session.
+// A frame is one group of 4 PCM samples per channel.
+typedef struct {
+  uint64_t session_start_us;
+
+  size_t media_read_total_expected_packets;
+  size_t media_read_total_expected_reads_count;
+  size_t media_read_total_expected_read_bytes;
+
+  size_t media_read_total_dropped_packets;
+  size_t media_read_total_actual_reads_count;
+  size_t media_read_total_actual_read_bytes;
+
+  size_t media_read_total_underflows;  // Reads shorter than requested
+  size_t media_read_total_encoded_frames;
+  size_t media_read_total_encoded_packets;
+  size_t media_read_total_sent_packets;
+
+  uint64_t encode_time_total_us;
+  uint32_t encode_time_min_us;
+  uint32_t encode_time_max_us;
+  a2dp_aptx_tws_time_window_t encode_time_window;  // Per packet
+
+  // Time spent in a whole encoder tick, and the ticks that took longer than
+  // the tick interval
+  uint32_t tick_time_max_us;
+  size_t tick_overruns;
+  a2dp_aptx_tws_time_window_t tick_time_window;
+
+  // Frames dropped and inserted per channel to keep the earbuds in sync
+  size_t sync_dropped_frames;
+  size_t sync_inserted_frames;
+
+  size_t transmit_queue_length;      // Last reported transmit queue length
+  size_t transmit_queue_max_length;  // Longest transmit queue of the session
+} a2dp_aptx_tws_encoder_stats_t;
+
 // Loads the A2DP aptX-HD encoder.
 // Return true on success, otherwise false.
 bool A2DP_VendorLoadEncoderAptxTWS(void);
@@ -91,4 +139,18 @@ period_ms_t a2dp_vendor_aptx_tws_get_encoder_interval_ms(void);
 // |timestamp_us| is the current timestamp (in microseconds).
 void a2dp_vendor_aptx_tws_send_frames(uint64_t timestamp_us);
 
+// Set the transmit queue length of the A2DP aptX-TWS encoder.
+void a2dp_vendor_aptx_tws_set_transmit_queue_length(
+    size_t transmit_queue_length);
+
+// Get the statistics of the current A2DP aptX-TWS encoder session.
+// Returns false if the codec runs in offload mode.
+bool a2dp_vendor_aptx_tws_get_encoder_stats(
+    a2dp_aptx_tws_encoder_stats_t* p_stats);
+
+// Get the time (in microseconds) not exceeded by |percentile| percent of
+// the samples in |window|. Returns 0 if the window is empty.
+uint32_t a2dp_vendor_aptx_tws_get_time_percentile_us(
+    const a2dp_aptx_tws_time_window_t* window, uint8_t percentile);
+
 #endif  // A2DP_VENDOR_APTX_TWS_ENCODER_H
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// PCM deinterleave and conversion for the aptX-TWS encoder feed
+//
+
+#ifndef A2DP_VENDOR_APTX_TWS_PCM_H
+#define A2DP_VENDOR_APTX_TWS_PCM_H
+
+#include <stdint.h>
+
+// Samples per channel the aptX-TWS encoder takes at a time
+#define A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP 4
+
+// Split |groups| groups of interleaved PCM at |data_in| into the separate
+// left and right arrays the encoder takes, 4 * |groups| samples each, and
+// convert every sample to the 16-bit range the encoder expects.
+// |bits_per_sample| is 16, 24 (packed in 3 bytes) or 32, |channel_count| is
+// 1 or 2. Mono input is copied to both channels. |data_in| must be aligned
+// to 16 bits, and to 32 bits for 32-bit input. 16-bit and 32-bit input
+// takes the NEON or SSE2 path where available.
+// Returns false if the PCM format is not supported.
+bool a2dp_vendor_aptx_tws_deinterleave(const uint8_t* data_in,
+                                       uint32_t groups,
+                                       uint8_t bits_per_sample,
+                                       uint8_t channel_count, uint32_t* pcmL,
+                                       uint32_t* pcmR);
+
+// Same as a2dp_vendor_aptx_tws_deinterleave(), without the SIMD paths.
+// This is the reference the SIMD paths are tested against.
+bool a2dp_vendor_aptx_tws_deinterleave_scalar(const uint8_t* data_in,
+                                              uint32_t groups,
+                                              uint8_t bits_per_sample,
+                                              uint8_t channel_count,
+                                              uint32_t* pcmL, uint32_t* pcmR);
+
+#endif  // A2DP_VENDOR_APTX_TWS_PCM_H
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Left/right delivery synchronization for aptX-TWS
+//
+
+#ifndef A2DP_VENDOR_APTX_TWS_SYNC_H
+#define A2DP_VENDOR_APTX_TWS_SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define A2DP_APTX_TWS_SYNC_EARBUD_LEFT 0
+#define A2DP_APTX_TWS_SYNC_EARBUD_RIGHT 1
+#define A2DP_APTX_TWS_SYNC_NUM_EARBUDS 2
+
+typedef struct {
+  size_t num_reports[A2DP_APTX_TWS_SYNC_NUM_EARBUDS];
+  uint32_t latency_us[A2DP_APTX_TWS_SYNC_NUM_EARBUDS];  // Smoothed
+  int32_t offset_us;      // Left minus right, corrections included
+  uint32_t max_offset_us;  // Largest inter-ear offset of the session
+  size_t num_corrections;  // Frame hints handed out
+} tA2DP_APTX_TWS_SYNC_STATS;
+
+// Reset the synchronization state for a new session at |sample_rate|.
+void a2dp_vendor_aptx_tws_sync_reset(uint32_t sample_rate);
+
+// Record that the media packet stamped with the media clock |timestamp|
+// was handed to the transmit queue at |sent_us|.
+void a2dp_vendor_aptx_tws_sync_packet_sent(uint32_t timestamp,
+                                           uint64_t sent_us);
+
+// Report that the media packet stamped with |timestamp| was delivered to
+// |earbud| at |delivered_us|. Reports for packets no longer tracked are
+// ignored. Fed by the vendor delivery report event, see
+// btif_vendor_aptx_tws_delivery_event().
+void a2dp_vendor_aptx_tws_sync_report_delivery(uint8_t earbud,
+                                               uint32_t timestamp,
+                                               uint64_t delivered_us);
+
+// Get and clear the drift correction pending for |earbud|, in frames of
+// 4 samples. A positive value asks the path to drop that many frames, a
+// negative one to insert them.
+int32_t a2dp_vendor_aptx_tws_sync_get_hint(uint8_t earbud);
+
+// Get the synchronization statistics of the current session.
+void a2dp_vendor_aptx_tws_sync_get_stats(tA2DP_APTX_TWS_SYNC_STATS* p_stats);
+
+#endif  // A2DP_VENDOR_APTX_TWS_SYNC_H
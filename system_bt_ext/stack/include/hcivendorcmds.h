@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HCIVENDORCMDS_H
+#define HCIVENDORCMDS_H
+
+#include <stdint.h>
+
+/* Fragment parameter of HCI_Set_Connectionless_Slave_Broadcast_Data */
+#define HCI_CSB_DATA_FRAGMENT_CONTINUE  0x00
+#define HCI_CSB_DATA_FRAGMENT_START     0x01
+#define HCI_CSB_DATA_FRAGMENT_END       0x02
+#define HCI_CSB_DATA_FRAGMENT_COMPLETE  0x03
+
+/* HCI command parameters are limited to 255 bytes, 3 of them are taken by
+ * lt_addr, fragment and data_len */
+#define HCI_CSB_DATA_MAX_FRAGMENT_LEN   252
+
+/* Largest payload remembered per LT_ADDR for change detection */
+#define HCI_CSB_DATA_CACHE_LEN          (4 * HCI_CSB_DATA_MAX_FRAGMENT_LEN)
+
+/* Allocation counters of the senders in hcivendorcmds.cc. bytes_saved is
+ * what a full HCI_CMD_BUF_SIZE buffer per command would have cost on top. */
+typedef struct {
+  uint32_t num_cmds;
+  uint32_t bytes_allocated;
+  uint32_t bytes_saved;
+  uint8_t max_param_len;
+} tHCI_VENDOR_CMD_STATS;
+
+void btsnd_hcic_get_vendor_cmd_stats(tHCI_VENDOR_CMD_STATS* p_stats);
+
+/* Writes a complete CSB data payload of any size for lt_addr, split in
+ * START/CONTINUE/END fragments as needed. Nothing is sent if the payload is
+ * the same as the last one written for this lt_addr.
+ * Returns number of HCI commands sent, up to 261 for a 64K payload.
+ * Must be called from BTU thread. */
+uint16_t btsnd_hcic_write_csb_data(uint8_t lt_addr, const uint8_t* data,
+                                   uint16_t data_len);
+
+/* Forgets the last payload written for lt_addr, next write always goes out */
+void btsnd_hcic_reset_csb_data(uint8_t lt_addr);
+
+#endif /* HCIVENDORCMDS_H */
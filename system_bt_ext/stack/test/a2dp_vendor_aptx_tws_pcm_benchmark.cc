@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      a2dp_vendor_aptx_tws_pcm_benchmark.cc
+ *
+ *  Description:   Cost of splitting one full PCM read for the aptX-TWS
+ *                 encoder, with the SIMD paths of the build and without.
+ *                 Arguments are bits per sample and channel count.
+ *
+ ******************************************************************************/
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "a2dp_vendor_aptx_tws_pcm.h"
+
+namespace {
+
+// One PCM read of the encoder
+const uint32_t kReadBytes = 1024;
+
+typedef bool (*tDEINTERLEAVE)(const uint8_t* data_in, uint32_t groups,
+                              uint8_t bits_per_sample, uint8_t channel_count,
+                              uint32_t* pcmL, uint32_t* pcmR);
+
+void Deinterleave(benchmark::State& state, tDEINTERLEAVE deinterleave) {
+  const uint8_t bits_per_sample = state.range(0);
+  const uint8_t channel_count = state.range(1);
+  const uint32_t bytes_per_group =
+      A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP * channel_count * bits_per_sample / 8;
+  const uint32_t groups = kReadBytes / bytes_per_group;
+  std::vector<uint32_t> pcm(kReadBytes / sizeof(uint32_t));
+  std::vector<uint32_t> left(groups * A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP);
+  std::vector<uint32_t> right(groups * A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP);
+
+  for (size_t i = 0; i < pcm.size(); i++) pcm[i] = i * 2654435761u;
+
+  for (auto _ : state) {
+    deinterleave((const uint8_t*)pcm.data(), groups, bits_per_sample,
+                 channel_count, left.data(), right.data());
+    benchmark::DoNotOptimize(left.data());
+    benchmark::DoNotOptimize(right.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * groups * bytes_per_group);
+}
+
+void BM_Deinterleave(benchmark::State& state) {
+  Deinterleave(state, a2dp_vendor_aptx_tws_deinterleave);
+}
+
+void BM_DeinterleaveScalar(benchmark::State& state) {
+  Deinterleave(state, a2dp_vendor_aptx_tws_deinterleave_scalar);
+}
+
+void Formats(benchmark::internal::Benchmark* b) {
+  for (int bits_per_sample : {16, 24, 32}) {
+    for (int channel_count : {1, 2}) b->Args({bits_per_sample, channel_count});
+  }
+}
+
+BENCHMARK(BM_Deinterleave)->Apply(Formats);
+BENCHMARK(BM_DeinterleaveScalar)->Apply(Formats);
+
+}  // namespace
+
+BENCHMARK_MAIN();
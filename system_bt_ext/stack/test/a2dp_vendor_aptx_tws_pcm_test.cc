@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      a2dp_vendor_aptx_tws_pcm_test.cc
+ *
+ *  Description:   Host tests of the aptX-TWS PCM deinterleave. The SIMD
+ *                 paths of the build are checked against the scalar one on
+ *                 random audio, for every supported format and read size.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "a2dp_vendor_aptx_tws_pcm.h"
+
+namespace {
+
+const uint8_t kBitsPerSample[] = {16, 24, 32};
+const uint8_t kChannelCounts[] = {1, 2};
+// a PCM read is at most 1024 bytes, 128 groups of 16-bit mono
+const uint32_t kMaxGroups = 128;
+
+// Random PCM for |groups| groups, word aligned
+std::vector<uint32_t> RandomPcm(std::mt19937* p_rng, uint32_t groups,
+                                uint8_t bits_per_sample,
+                                uint8_t channel_count) {
+  size_t bytes = groups * A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP * channel_count *
+                 (bits_per_sample / 8);
+  std::vector<uint32_t> pcm((bytes + 3) / 4);
+  for (uint32_t& word : pcm) word = (*p_rng)();
+  return pcm;
+}
+
+TEST(A2dpVendorAptxTwsPcmTest, simd_matches_scalar) {
+  std::mt19937 rng(0x5eed);
+
+  for (uint8_t bits_per_sample : kBitsPerSample) {
+    for (uint8_t channel_count : kChannelCounts) {
+      for (uint32_t groups = 1; groups <= kMaxGroups; groups++) {
+        SCOPED_TRACE(testing::Message()
+                     << (int)bits_per_sample << " bit, "
+                     << (int)channel_count << " channels, " << groups
+                     << " groups");
+        std::vector<uint32_t> pcm =
+            RandomPcm(&rng, groups, bits_per_sample, channel_count);
+        size_t samples = groups * A2DP_APTX_TWS_PCM_SAMPLES_PER_GROUP;
+        // one extra sample catches writes past the end
+        std::vector<uint32_t> left(samples + 1, 0xdead);
+        std::vector<uint32_t> right(samples + 1, 0xdead);
+        std::vector<uint32_t> left_ref(samples + 1, 0xdead);
+        std::vector<uint32_t> right_ref(samples + 1, 0xdead);
+
+        ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave(
+            (const uint8_t*)pcm.data(), groups, bits_per_sample,
+            channel_count, left.data(), right.data()));
+        ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave_scalar(
+            (const uint8_t*)pcm.data(), groups, bits_per_sample,
+            channel_count, left_ref.data(), right_ref.data()));
+        ASSERT_EQ(left_ref, left);
+        ASSERT_EQ(right_ref, right);
+      }
+    }
+  }
+}
+
+TEST(A2dpVendorAptxTwsPcmTest, stereo_16_bit_is_split) {
+  const uint16_t pcm[8] = {1, 2, 3, 4, 5, 6, 7, 0xffff};
+  uint32_t left[4];
+  uint32_t right[4];
+
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave((const uint8_t*)pcm, 1, 16,
+                                                2, left, right));
+  EXPECT_EQ(1u, left[0]);
+  EXPECT_EQ(7u, left[3]);
+  EXPECT_EQ(2u, right[0]);
+  EXPECT_EQ(0xffffu, right[3]);
+}
+
+TEST(A2dpVendorAptxTwsPcmTest, wide_samples_keep_the_top_16_bits) {
+  // little endian 24-bit 0x123456 and 32-bit 0x89abcdef
+  const uint8_t pcm24[12] = {0x56, 0x34, 0x12, 0x56, 0x34, 0x12,
+                             0x56, 0x34, 0x12, 0x56, 0x34, 0x12};
+  const uint32_t pcm32[4] = {0x89abcdef, 0x89abcdef, 0x89abcdef, 0x89abcdef};
+  uint32_t left[4];
+  uint32_t right[4];
+
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave(pcm24, 1, 24, 1, left, right));
+  EXPECT_EQ(0x1234u, left[0]);
+  EXPECT_EQ(0x1234u, right[3]);
+
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave((const uint8_t*)pcm32, 1, 32,
+                                                1, left, right));
+  EXPECT_EQ(0x89abu, left[0]);
+  EXPECT_EQ(0x89abu, right[3]);
+}
+
+TEST(A2dpVendorAptxTwsPcmTest, mono_is_copied_to_both_channels) {
+  const uint16_t pcm[4] = {10, 20, 30, 40};
+  uint32_t left[4];
+  uint32_t right[4];
+
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_deinterleave((const uint8_t*)pcm, 1, 16,
+                                                1, left, right));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(10u * (i + 1), left[i]);
+    EXPECT_EQ(left[i], right[i]);
+  }
+}
+
+TEST(A2dpVendorAptxTwsPcmTest, unsupported_format_is_rejected) {
+  const uint32_t pcm[8] = {0};
+  uint32_t left[4];
+  uint32_t right[4];
+
+  EXPECT_FALSE(a2dp_vendor_aptx_tws_deinterleave((const uint8_t*)pcm, 1, 8, 2,
+                                                 left, right));
+  EXPECT_FALSE(a2dp_vendor_aptx_tws_deinterleave((const uint8_t*)pcm, 1, 16,
+                                                 6, left, right));
+}
+
+}  // namespace
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      a2dp_vendor_aptx_tws_sync_test.cc
+ *
+ *  Description:   Host tests of the aptX-TWS left/right synchronization. A
+ *                 simulated link delivers every packet to both earbuds with
+ *                 its own latency, skew and jitter, and the corrections are
+ *                 applied each packet the way the encoder does.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+
+#include <random>
+
+#include "a2dp_vendor_aptx_tws_sync.h"
+
+namespace {
+
+const uint32_t kSampleRate = 44100;
+const uint64_t kPacketIntervalUs = 15000;
+const uint32_t kSamplesPerPacket = 660;
+const int64_t kBaseLatencyUs = 20000;
+// one frame is 4 samples
+const int64_t kFrameUs = 4 * 1000000 / kSampleRate;
+const int64_t kMaxOffsetUs = 8 * kFrameUs;
+
+class A2dpVendorAptxTwsSyncTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    a2dp_vendor_aptx_tws_sync_reset(kSampleRate);
+    now_us_ = 1000000;
+    start_us_ = now_us_;
+    timestamp_ = 0;
+    skew_us_ = 0;
+    drift_us_per_s_ = 0;
+    jitter_us_ = 0;
+    applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_LEFT] = 0;
+    applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT] = 0;
+  }
+
+  // Latency of the right earbud minus the left one, jitter aside
+  int64_t SkewUs() const {
+    return skew_us_ +
+           drift_us_per_s_ * (int64_t)(now_us_ - start_us_) / 1000000;
+  }
+
+  int64_t Jitter() {
+    if (jitter_us_ == 0) return 0;
+    return std::uniform_int_distribution<int64_t>(-jitter_us_,
+                                                  jitter_us_)(rng_);
+  }
+
+  // Sends one packet over the link and has both earbuds report it. With
+  // |apply_hints| the pending corrections are picked up first, as the
+  // encoder does every tick.
+  void Step(bool apply_hints = true) {
+    if (apply_hints) {
+      for (uint8_t earbud = 0; earbud < A2DP_APTX_TWS_SYNC_NUM_EARBUDS;
+           earbud++)
+        applied_frames_[earbud] += a2dp_vendor_aptx_tws_sync_get_hint(earbud);
+    }
+
+    a2dp_vendor_aptx_tws_sync_packet_sent(timestamp_, now_us_);
+    a2dp_vendor_aptx_tws_sync_report_delivery(
+        A2DP_APTX_TWS_SYNC_EARBUD_LEFT, timestamp_,
+        now_us_ + kBaseLatencyUs + Jitter());
+    a2dp_vendor_aptx_tws_sync_report_delivery(
+        A2DP_APTX_TWS_SYNC_EARBUD_RIGHT, timestamp_,
+        now_us_ + kBaseLatencyUs + SkewUs() + Jitter());
+
+    timestamp_ += kSamplesPerPacket;
+    now_us_ += kPacketIntervalUs;
+  }
+
+  // Left minus right rendering offset the listener hears: dropped frames
+  // make an earbud render earlier
+  int64_t TrueOffsetUs() const {
+    return -SkewUs() -
+           applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_LEFT] * kFrameUs +
+           applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT] * kFrameUs;
+  }
+
+  // Runs the link for |duration_us|, checking the offset stays within
+  // 8 frames once |settle_us| have passed
+  void RunAndCheck(uint64_t duration_us, uint64_t settle_us) {
+    uint64_t end_us = now_us_ + duration_us;
+    uint64_t settled_us = now_us_ + settle_us;
+
+    while (now_us_ < end_us) {
+      Step();
+      if (now_us_ < settled_us) continue;
+
+      tA2DP_APTX_TWS_SYNC_STATS stats;
+      a2dp_vendor_aptx_tws_sync_get_stats(&stats);
+      ASSERT_LE(llabs(stats.offset_us), kMaxOffsetUs)
+          << "at " << (now_us_ - start_us_) / 1000 << " ms";
+      ASSERT_LE(llabs(TrueOffsetUs()), kMaxOffsetUs)
+          << "at " << (now_us_ - start_us_) / 1000 << " ms";
+    }
+  }
+
+  uint64_t now_us_;
+  uint64_t start_us_;
+  uint32_t timestamp_;
+  int64_t skew_us_;
+  int64_t drift_us_per_s_;
+  int64_t jitter_us_;
+  int32_t applied_frames_[A2DP_APTX_TWS_SYNC_NUM_EARBUDS];
+  std::mt19937 rng_{0x5eed};
+};
+
+TEST_F(A2dpVendorAptxTwsSyncTest, static_skew_converges) {
+  // the right earbud hears everything 3 ms late, 33 frames
+  skew_us_ = 3000;
+  RunAndCheck(30000000, 10000000);
+
+  tA2DP_APTX_TWS_SYNC_STATS stats;
+  a2dp_vendor_aptx_tws_sync_get_stats(&stats);
+  EXPECT_GE(stats.max_offset_us, 3000u);
+  EXPECT_EQ(2000u, stats.num_reports[A2DP_APTX_TWS_SYNC_EARBUD_LEFT]);
+  EXPECT_EQ(2000u, stats.num_reports[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT]);
+  // the late right earbud dropped frames to catch up
+  EXPECT_GT(applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT], 0);
+  EXPECT_EQ(0, applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_LEFT]);
+}
+
+TEST_F(A2dpVendorAptxTwsSyncTest, drifting_skew_with_jitter_is_tracked) {
+  // the left earbud starts 2 ms late and falls further behind by 100 us
+  // every second, on a link with 300 us of jitter
+  skew_us_ = -2000;
+  drift_us_per_s_ = -100;
+  jitter_us_ = 300;
+  RunAndCheck(60000000, 10000000);
+
+  EXPECT_GT(applied_frames_[A2DP_APTX_TWS_SYNC_EARBUD_LEFT], 0);
+}
+
+TEST_F(A2dpVendorAptxTwsSyncTest, early_earbud_inserts_once_late_one_is_full) {
+  skew_us_ = 3000;
+  // nobody picks up the corrections for 2 s
+  for (size_t i = 0; i < 2000000 / kPacketIntervalUs; i++) Step(false);
+
+  EXPECT_EQ(8, a2dp_vendor_aptx_tws_sync_get_hint(
+                   A2DP_APTX_TWS_SYNC_EARBUD_RIGHT));
+  EXPECT_EQ(-8, a2dp_vendor_aptx_tws_sync_get_hint(
+                    A2DP_APTX_TWS_SYNC_EARBUD_LEFT));
+  // both hints were handed out
+  EXPECT_EQ(0, a2dp_vendor_aptx_tws_sync_get_hint(
+                   A2DP_APTX_TWS_SYNC_EARBUD_RIGHT));
+
+  tA2DP_APTX_TWS_SYNC_STATS stats;
+  a2dp_vendor_aptx_tws_sync_get_stats(&stats);
+  EXPECT_EQ(16u, stats.num_corrections);
+}
+
+TEST_F(A2dpVendorAptxTwsSyncTest, offset_in_the_deadband_is_left_alone) {
+  skew_us_ = 3 * kFrameUs;
+  jitter_us_ = 0;
+  RunAndCheck(5000000, 0);
+
+  tA2DP_APTX_TWS_SYNC_STATS stats;
+  a2dp_vendor_aptx_tws_sync_get_stats(&stats);
+  EXPECT_EQ(0u, stats.num_corrections);
+}
+
+TEST_F(A2dpVendorAptxTwsSyncTest, reports_of_untracked_packets_are_ignored) {
+  // older than the 64 packets remembered
+  for (size_t i = 0; i < 65; i++)
+    a2dp_vendor_aptx_tws_sync_packet_sent(i * kSamplesPerPacket,
+                                          now_us_ + i * kPacketIntervalUs);
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_LEFT,
+                                            0, now_us_ + 2000000);
+  // never sent
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_LEFT,
+                                            1, now_us_ + 2000000);
+  // no such earbud
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_NUM_EARBUDS,
+                                            kSamplesPerPacket,
+                                            now_us_ + 2000000);
+  // delivered before it was sent
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_RIGHT,
+                                            64 * kSamplesPerPacket, now_us_);
+
+  tA2DP_APTX_TWS_SYNC_STATS stats;
+  a2dp_vendor_aptx_tws_sync_get_stats(&stats);
+  EXPECT_EQ(0u, stats.num_reports[A2DP_APTX_TWS_SYNC_EARBUD_LEFT]);
+  EXPECT_EQ(0u, stats.num_reports[A2DP_APTX_TWS_SYNC_EARBUD_RIGHT]);
+}
+
+}  // namespace
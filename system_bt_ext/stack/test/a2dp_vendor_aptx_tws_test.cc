@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      a2dp_vendor_aptx_tws_test.cc
+ *
+ *  Description:   Host tests of the aptX-TWS codec and its software encode
+ *                 pipeline. The encoder library is replaced by a fake that
+ *                 is handed out by the dlopen()/dlsym() fakes below, and
+ *                 the parts of the core A2DP codec API the codec uses are
+ *                 stubbed in this file.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "a2dp_codec_api.h"
+#include "a2dp_vendor_aptx_tws.h"
+#include "a2dp_vendor_aptx_tws_constants.h"
+#include "a2dp_vendor_aptx_tws_encoder.h"
+#include "a2dp_vendor_aptx_tws_sync.h"
+#include "bt_common.h"
+#include "osi/include/allocator.h"
+#include "osi/include/time.h"
+
+namespace {
+
+const uint16_t kPeerMtu = 672;
+const uint64_t kTickUs = 15000;
+
+uint64_t now_us = 0;
+
+/*******************************************************************************
+ *  Fake encoder library
+ ******************************************************************************/
+
+// The fake code words carry the first left and the last right sample of
+// the group, so the tests can check what the encoder was fed.
+int fake_encoder_init(void* state, short endian) { return 0; }
+
+int fake_encoder_encode_stereo(void* state, void* pcmL, void* pcmR,
+                               void* buffer) {
+  const uint32_t* p_left = (const uint32_t*)pcmL;
+  const uint32_t* p_right = (const uint32_t*)pcmR;
+  uint16_t* p_encoded = (uint16_t*)buffer;
+
+  p_encoded[0] = (uint16_t)p_left[0];
+  p_encoded[1] = (uint16_t)p_right[3];
+  return 0;
+}
+
+int fake_encoder_sizeof_params(void) { return 64; }
+
+int fake_library_handle;
+bool encoder_library_present = true;
+int num_open_libraries = 0;
+
+/*******************************************************************************
+ *  Audio source and transmit queue
+ ******************************************************************************/
+
+// 16-bit PCM whose samples count up, so gaps and repeats are visible
+uint16_t next_sample = 0;
+// bytes the source has left, reads past that come back short
+size_t pcm_available = SIZE_MAX;
+
+struct Packet {
+  uint32_t timestamp;
+  size_t frames;
+  uint32_t bytes_read;
+  std::vector<uint8_t> payload;
+};
+std::vector<Packet> packets;
+bool transmit_queue_full = false;
+
+uint32_t read_pcm(uint8_t* p_buf, uint32_t len) {
+  if (len > pcm_available) len = pcm_available;
+  len -= len % sizeof(uint16_t);
+  uint16_t* p_sample = (uint16_t*)p_buf;
+  for (uint32_t i = 0; i < len / sizeof(uint16_t); i++)
+    p_sample[i] = next_sample++;
+  pcm_available -= len;
+  return len;
+}
+
+bool enqueue_packet(BT_HDR* p_buf, size_t frames_n, uint32_t bytes_read) {
+  Packet packet;
+  const uint8_t* p_payload = (const uint8_t*)(p_buf + 1) + p_buf->offset;
+
+  packet.timestamp = *((uint32_t*)(p_buf + 1));
+  packet.frames = frames_n;
+  packet.bytes_read = bytes_read;
+  packet.payload.assign(p_payload, p_payload + p_buf->len);
+  osi_free(p_buf);
+  if (transmit_queue_full) return false;
+  packets.push_back(packet);
+  return true;
+}
+
+// code word |word| of group |group| in |packet|
+uint16_t CodeWord(const Packet& packet, size_t group, size_t word) {
+  size_t offset = group * 4 + word * 2;
+  return (uint16_t)((packet.payload[offset] << 8) |
+                    packet.payload[offset + 1]);
+}
+
+size_t Groups(const Packet& packet) { return packet.payload.size() / 4; }
+
+}  // namespace
+
+/*******************************************************************************
+ *  Fakes of the dynamic loader, the clock and the allocator
+ ******************************************************************************/
+
+extern "C" {
+
+void* dlopen(const char* filename, int flag) {
+  if (!encoder_library_present ||
+      strcmp(filename, "libaptXTWS_encoder.so") != 0)
+    return NULL;
+  num_open_libraries++;
+  return &fake_library_handle;
+}
+
+void* dlsym(void* handle, const char* symbol) {
+  if (handle != &fake_library_handle) return NULL;
+  if (strcmp(symbol, "aptxtwsbtenc_init") == 0)
+    return (void*)fake_encoder_init;
+  if (strcmp(symbol, "aptxtwsbtenc_encodestereo") == 0)
+    return (void*)fake_encoder_encode_stereo;
+  if (strcmp(symbol, "SizeofAptxtwsbtenc") == 0)
+    return (void*)fake_encoder_sizeof_params;
+  return NULL;
+}
+
+int dlclose(void* handle) {
+  if (handle == &fake_library_handle) num_open_libraries--;
+  return 0;
+}
+
+char* dlerror(void) { return (char*)"fake dlerror"; }
+
+}  // extern "C"
+
+uint64_t time_get_os_boottime_us(void) { return now_us; }
+
+void* osi_malloc(size_t size) { return malloc(size); }
+
+void* osi_calloc(size_t size) { return calloc(1, size); }
+
+void osi_free(void* ptr) { free(ptr); }
+
+/*******************************************************************************
+ *  Stubs of the core A2DP codec API
+ ******************************************************************************/
+
+bool A2DP_IsCodecEnabled(btav_a2dp_codec_index_t codec_index) { return true; }
+
+bool A2DP_IsCodecEnabledInSoftware(btav_a2dp_codec_index_t codec_index) {
+  return true;
+}
+
+bool A2DP_IsCodecEnabledInOffload(btav_a2dp_codec_index_t codec_index) {
+  return false;
+}
+
+uint8_t A2DP_BitsSet(uint64_t num) {
+  if (num == 0) return A2DP_SET_ZERO_BIT;
+  if ((num & (num - 1)) == 0) return A2DP_SET_ONE_BIT;
+  return A2DP_SET_MULTL_BIT;
+}
+
+A2dpCodecConfig::A2dpCodecConfig(btav_a2dp_codec_index_t codec_index,
+                                 const std::string& name,
+                                 btav_a2dp_codec_priority_t codec_priority)
+    : codec_index_(codec_index),
+      name_(name),
+      default_codec_priority_(codec_priority),
+      codec_priority_(codec_priority) {
+  memset(&codec_config_, 0, sizeof(codec_config_));
+  memset(&codec_capability_, 0, sizeof(codec_capability_));
+  memset(&codec_local_capability_, 0, sizeof(codec_local_capability_));
+  memset(&codec_selectable_capability_, 0,
+         sizeof(codec_selectable_capability_));
+  memset(&codec_user_config_, 0, sizeof(codec_user_config_));
+  memset(&codec_audio_config_, 0, sizeof(codec_audio_config_));
+  memset(ota_codec_config_, 0, sizeof(ota_codec_config_));
+  memset(ota_codec_peer_capability_, 0, sizeof(ota_codec_peer_capability_));
+  memset(ota_codec_peer_config_, 0, sizeof(ota_codec_peer_config_));
+}
+
+A2dpCodecConfig::~A2dpCodecConfig() {}
+
+bool A2dpCodecConfig::isValid() const { return true; }
+
+bool A2dpCodecConfig::copyOutOtaCodecConfig(uint8_t* p_codec_info) {
+  std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
+  if (!A2DP_IsVendorSourceCodecValidAptxTWS(ota_codec_config_)) return false;
+  memcpy(p_codec_info, ota_codec_config_, sizeof(ota_codec_config_));
+  return true;
+}
+
+uint8_t A2dpCodecConfig::getAudioBitsPerSample() {
+  std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
+  switch (codec_config_.bits_per_sample) {
+    case BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16:
+      return 16;
+    case BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24:
+      return 24;
+    case BTAV_A2DP_CODEC_BITS_PER_SAMPLE_32:
+      return 32;
+    default:
+      return 0;
+  }
+}
+
+void A2dpCodecConfig::debug_codec_dump(int fd) {}
+
+namespace {
+
+// aptX-TWS Sink capabilities of the peer, mono at |sample_rate|
+void BuildPeerCaps(uint8_t sample_rate, uint8_t* p_codec_info) {
+  memset(p_codec_info, 0, AVDT_CODEC_SIZE);
+  p_codec_info[0] = A2DP_APTX_TWS_CODEC_LEN;
+  p_codec_info[1] = AVDT_MEDIA_TYPE_AUDIO << 4;
+  p_codec_info[2] = A2DP_MEDIA_CT_NON_A2DP;
+  p_codec_info[3] = (uint8_t)(A2DP_APTX_TWS_VENDOR_ID & 0xff);
+  p_codec_info[4] = (uint8_t)((A2DP_APTX_TWS_VENDOR_ID >> 8) & 0xff);
+  p_codec_info[5] = (uint8_t)((A2DP_APTX_TWS_VENDOR_ID >> 16) & 0xff);
+  p_codec_info[6] = (uint8_t)((A2DP_APTX_TWS_VENDOR_ID >> 24) & 0xff);
+  p_codec_info[7] = (uint8_t)(A2DP_APTX_TWS_CODEC_ID_BLUETOOTH & 0xff);
+  p_codec_info[8] = (uint8_t)((A2DP_APTX_TWS_CODEC_ID_BLUETOOTH >> 8) & 0xff);
+  p_codec_info[9] = sample_rate | A2DP_APTX_TWS_CHANNELS_MONO;
+}
+
+class A2dpVendorAptxTwsEncoderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    now_us = 1000000;
+    next_sample = 0;
+    pcm_available = SIZE_MAX;
+    packets.clear();
+    transmit_queue_full = false;
+    encoder_library_present = true;
+  }
+
+  void TearDown() override {
+    a2dp_vendor_aptx_tws_encoder_cleanup();
+    A2DP_VendorUnloadEncoderAptxTWS();
+    EXPECT_EQ(0, num_open_libraries);
+  }
+
+  // configures the codec for a peer at |sample_rate| and starts the encoder
+  void StartEncoder(A2dpCodecConfigAptxTWS* p_codec, uint8_t sample_rate,
+                    uint16_t peer_mtu = kPeerMtu) {
+    uint8_t peer_caps[AVDT_CODEC_SIZE];
+    uint8_t result[AVDT_CODEC_SIZE];
+    tA2DP_ENCODER_INIT_PEER_PARAMS peer_params = {true, true, peer_mtu};
+
+    ASSERT_TRUE(p_codec->init());
+    BuildPeerCaps(sample_rate, peer_caps);
+    ASSERT_TRUE(p_codec->setCodecConfig(peer_caps, true, result));
+    a2dp_vendor_aptx_tws_encoder_init(&peer_params, p_codec, read_pcm,
+                                      enqueue_packet);
+  }
+
+  // runs |ticks| encoder ticks |interval_us| apart
+  void Tick(size_t ticks, uint64_t interval_us = kTickUs) {
+    for (size_t i = 0; i < ticks; i++) {
+      a2dp_vendor_aptx_tws_send_frames(now_us);
+      now_us += interval_us;
+    }
+  }
+
+  size_t TotalGroups() const {
+    size_t groups = 0;
+    for (const Packet& packet : packets) groups += Groups(packet);
+    return groups;
+  }
+};
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, ticks_at_44100_carry_the_remainder) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_44100);
+
+  // 661.5 samples per tick, 165.375 groups
+  Tick(8);
+  EXPECT_EQ(8u * 165 + 3, TotalGroups());
+  Tick(792);
+  EXPECT_EQ(800u * 44100 * 15 / 1000 / 4, TotalGroups());
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, packets_carry_continuous_audio) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000);
+  Tick(20);
+  ASSERT_FALSE(packets.empty());
+
+  uint32_t timestamp = packets[0].timestamp;
+  uint16_t sample = 0;
+  for (const Packet& packet : packets) {
+    // the media clock counts samples, each packet starts where the
+    // previous one ended
+    EXPECT_EQ(timestamp, packet.timestamp);
+    EXPECT_EQ(1u, packet.frames);
+    for (size_t group = 0; group < Groups(packet); group++) {
+      // dual mono, left and right samples alternate
+      ASSERT_EQ(sample, CodeWord(packet, group, 0));
+      ASSERT_EQ((uint16_t)(sample + 7), CodeWord(packet, group, 1));
+      sample += 8;
+    }
+    timestamp += Groups(packet) * 4;
+  }
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, packets_fit_the_peer_mtu) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000, 102);
+
+  // 180 groups per tick in packets of 25 groups, the rest is not held
+  // back to the next tick
+  Tick(1);
+  ASSERT_EQ(8u, packets.size());
+  for (size_t i = 0; i < 7; i++) EXPECT_EQ(100u, packets[i].payload.size());
+  EXPECT_EQ(20u, packets[7].payload.size());
+  EXPECT_EQ(180u, TotalGroups());
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, pcm_reads_stay_within_the_budget) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000);
+  Tick(1);
+
+  // 180 groups of 16 bytes in reads of at most 1024 bytes, 64 groups
+  a2dp_aptx_tws_encoder_stats_t stats;
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_get_encoder_stats(&stats));
+  EXPECT_EQ(3u, stats.media_read_total_expected_reads_count);
+  EXPECT_EQ(3u, stats.media_read_total_actual_reads_count);
+  EXPECT_EQ(180u * 16, stats.media_read_total_actual_read_bytes);
+  EXPECT_EQ(0u, stats.media_read_total_underflows);
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, short_read_is_padded_with_silence) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000);
+
+  // the source runs dry in the middle of the first read
+  pcm_available = 10 * 16 + 8;
+  Tick(1);
+  EXPECT_EQ(64u, TotalGroups());
+  const Packet& packet = packets[0];
+  EXPECT_EQ(80u, CodeWord(packet, 10, 0));
+  EXPECT_EQ(0u, CodeWord(packet, 10, 1));
+  EXPECT_EQ(0u, CodeWord(packet, 11, 0));
+
+  a2dp_aptx_tws_encoder_stats_t stats;
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_get_encoder_stats(&stats));
+  EXPECT_EQ(2u, stats.media_read_total_underflows);
+  EXPECT_EQ(1u, stats.media_read_total_actual_reads_count);
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, late_tick_catches_up_three_intervals) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000);
+  Tick(1, 10 * kTickUs);
+  Tick(1);
+  EXPECT_EQ(180u + 3 * 180, TotalGroups());
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, dropped_packet_ends_the_tick) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000, 102);
+  transmit_queue_full = true;
+  Tick(1);
+
+  a2dp_aptx_tws_encoder_stats_t stats;
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_get_encoder_stats(&stats));
+  EXPECT_EQ(1u, stats.media_read_total_dropped_packets);
+  EXPECT_EQ(0u, stats.media_read_total_sent_packets);
+
+  // the next tick starts over with fresh audio
+  transmit_queue_full = false;
+  Tick(1);
+  EXPECT_EQ(180u, TotalGroups());
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, sync_hints_insert_and_drop_groups) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  StartEncoder(&codec, A2DP_APTX_TWS_SAMPLERATE_48000);
+  Tick(1);
+  ASSERT_FALSE(packets.empty());
+
+  // the left earbud is 4 ms behind, with no delay to give up the right
+  // channel is held back one group instead
+  uint64_t sent_us = now_us - kTickUs;
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_LEFT,
+                                            packets[0].timestamp,
+                                            sent_us + 5000);
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_RIGHT,
+                                            packets[0].timestamp,
+                                            sent_us + 1000);
+  size_t first = packets.size();
+  Tick(1);
+  ASSERT_LT(first, packets.size());
+  for (size_t i = first; i < packets.size(); i++) {
+    for (size_t group = 0; group < Groups(packets[i]); group++)
+      ASSERT_EQ((uint16_t)(CodeWord(packets[i], group, 0) - 1),
+                CodeWord(packets[i], group, 1));
+  }
+
+  // the right earbud falls behind, it drops the group it was held back
+  Tick(7);
+  sent_us = now_us - kTickUs;
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_RIGHT,
+                                            packets.back().timestamp,
+                                            sent_us + 40000);
+  a2dp_vendor_aptx_tws_sync_report_delivery(A2DP_APTX_TWS_SYNC_EARBUD_LEFT,
+                                            packets.back().timestamp,
+                                            sent_us + 1000);
+  first = packets.size();
+  Tick(1);
+  ASSERT_LT(first, packets.size());
+  for (size_t i = first; i < packets.size(); i++) {
+    for (size_t group = 0; group < Groups(packets[i]); group++)
+      ASSERT_EQ((uint16_t)(CodeWord(packets[i], group, 0) + 7),
+                CodeWord(packets[i], group, 1));
+  }
+
+  a2dp_aptx_tws_encoder_stats_t stats;
+  ASSERT_TRUE(a2dp_vendor_aptx_tws_get_encoder_stats(&stats));
+  EXPECT_EQ(1u, stats.sync_inserted_frames);
+  EXPECT_EQ(1u, stats.sync_dropped_frames);
+}
+
+TEST_F(A2dpVendorAptxTwsEncoderTest, missing_library_fails_codec_init) {
+  A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  encoder_library_present = false;
+  EXPECT_FALSE(codec.init());
+}
+
+// The negotiation cache outlives a test, so the tests only look at how the
+// counters move
+class A2dpVendorAptxTwsNegotiationCacheTest
+    : public A2dpVendorAptxTwsEncoderTest {
+ protected:
+  struct Counters {
+    size_t hits;
+    size_t misses;
+  };
+
+  Counters Read() {
+    Counters counters;
+    A2DP_VendorGetNegotiationCacheStatsAptxTWS(&counters.hits,
+                                               &counters.misses);
+    return counters;
+  }
+
+  // negotiates on a freshly initialized codec, as a new connection does,
+  // with |octet| as the sample rate and channel mode octet of the peer
+  bool Negotiate(uint8_t octet, bool is_capability,
+                 uint8_t* p_result = NULL) {
+    A2dpCodecConfigAptxTWS codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+    uint8_t peer_info[AVDT_CODEC_SIZE];
+    uint8_t result[AVDT_CODEC_SIZE];
+
+    EXPECT_TRUE(codec.init());
+    BuildPeerCaps(0, peer_info);
+    peer_info[9] = octet;
+    memset(result, 0, sizeof(result));
+    bool negotiated = codec.setCodecConfig(peer_info, is_capability, result);
+    if (p_result != NULL) memcpy(p_result, result, sizeof(result));
+    return negotiated;
+  }
+
+  // both sample rates offered, mono
+  const uint8_t kBothRates = A2DP_APTX_TWS_SAMPLERATE_44100 |
+                             A2DP_APTX_TWS_SAMPLERATE_48000 |
+                             A2DP_APTX_TWS_CHANNELS_MONO;
+};
+
+TEST_F(A2dpVendorAptxTwsNegotiationCacheTest, same_inputs_hit_the_cache) {
+  uint8_t first[AVDT_CODEC_SIZE];
+  uint8_t second[AVDT_CODEC_SIZE];
+
+  ASSERT_TRUE(Negotiate(kBothRates, true, first));
+  Counters before = Read();
+  ASSERT_TRUE(Negotiate(kBothRates, true, second));
+  Counters after = Read();
+
+  EXPECT_EQ(before.hits + 1, after.hits);
+  EXPECT_EQ(before.misses, after.misses);
+  // the cached outcome is the negotiated one
+  EXPECT_EQ(0, memcmp(first, second, sizeof(first)));
+}
+
+TEST_F(A2dpVendorAptxTwsNegotiationCacheTest, failed_negotiation_is_cached) {
+  // no channel mode offered
+  const uint8_t octet = A2DP_APTX_TWS_SAMPLERATE_48000;
+
+  EXPECT_FALSE(Negotiate(octet, true));
+  Counters before = Read();
+  EXPECT_FALSE(Negotiate(octet, true));
+  Counters after = Read();
+
+  EXPECT_EQ(before.hits + 1, after.hits);
+  EXPECT_EQ(before.misses, after.misses);
+}
+
+TEST_F(A2dpVendorAptxTwsNegotiationCacheTest, least_recently_used_is_evicted) {
+  const uint8_t k44100 =
+      A2DP_APTX_TWS_SAMPLERATE_44100 | A2DP_APTX_TWS_CHANNELS_MONO;
+  const uint8_t k48000 =
+      A2DP_APTX_TWS_SAMPLERATE_48000 | A2DP_APTX_TWS_CHANNELS_MONO;
+  const struct {
+    uint8_t octet;
+    bool is_capability;
+  } keys[] = {{k44100, true},
+              {k48000, true},
+              {kBothRates, true},
+              {k44100, false},
+              {k48000, false}};
+
+  // fill the 4 entries, then each of them is found
+  for (size_t i = 0; i < 4; i++)
+    Negotiate(keys[i].octet, keys[i].is_capability);
+  Counters before = Read();
+  for (size_t i = 0; i < 4; i++)
+    Negotiate(keys[i].octet, keys[i].is_capability);
+  Counters after = Read();
+  EXPECT_EQ(before.hits + 4, after.hits);
+  EXPECT_EQ(before.misses, after.misses);
+
+  // a fifth key pushes out the first one, which then pushes out the second
+  before = Read();
+  Negotiate(keys[4].octet, keys[4].is_capability);
+  Negotiate(keys[0].octet, keys[0].is_capability);
+  after = Read();
+  EXPECT_EQ(before.hits, after.hits);
+  EXPECT_EQ(before.misses + 2, after.misses);
+
+  before = Read();
+  Negotiate(keys[2].octet, keys[2].is_capability);
+  Negotiate(keys[3].octet, keys[3].is_capability);
+  after = Read();
+  EXPECT_EQ(before.hits + 2, after.hits);
+  EXPECT_EQ(before.misses, after.misses);
+
+  before = Read();
+  Negotiate(keys[1].octet, keys[1].is_capability);
+  after = Read();
+  EXPECT_EQ(before.misses + 1, after.misses);
+}
+
+}  // namespace
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      btm_vendor_cmd_test.cc
+ *
+ *  Description:   Host tests of the vendor command dispatcher. BTM, the
+ *                 alarms and the clock are faked, completions and timeouts
+ *                 are delivered by hand.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <set>
+#include <vector>
+
+#include "btm_api.h"
+#include "btm_vendor_cmd.h"
+#include "hcidefs.h"
+#include "osi/include/alarm.h"
+#include "osi/include/time.h"
+
+namespace {
+
+const uint16_t kOpcodeA = 0x0023;
+const uint16_t kOpcodeB = 0x0024;
+const uint16_t kRawOpcode = 0x1406;
+// a late completion is never expected after this long
+const uint64_t kStaleUs = 60ULL * 1000 * 1000;
+
+uint64_t now_us = 0;
+std::set<alarm_t*> live_alarms;
+
+struct SentCmd {
+  uint16_t opcode;
+  tBTM_VSC_CMPL_CB* p_cb;
+  tBTM_RAW_CMPL_CB* p_raw_cb;
+};
+std::vector<SentCmd> sent;
+
+struct Result {
+  uint16_t cmd_id;
+  uint8_t status;
+  uintptr_t context;
+};
+std::vector<Result> results;
+
+struct BatchResult {
+  uint16_t batch_id;
+  uint8_t num_failed;
+  uint8_t num_cmds;
+};
+std::vector<BatchResult> batch_results;
+
+void dispatch_cback(uint16_t cmd_id, uint8_t status, tBTM_VSC_CMPL* p_cmpl,
+                    void* context) {
+  results.push_back({cmd_id, status, (uintptr_t)context});
+}
+
+void batch_cback(uint16_t batch_id, uint8_t num_failed, uint8_t num_cmds,
+                 const uint8_t* p_status, void* context) {
+  batch_results.push_back({batch_id, num_failed, num_cmds});
+}
+
+}  // namespace
+
+struct alarm_t {
+  alarm_callback_t cb;
+  void* data;
+  bool armed;
+};
+
+alarm_t* alarm_new(const char* name) {
+  alarm_t* alarm = new alarm_t();
+  live_alarms.insert(alarm);
+  return alarm;
+}
+
+void alarm_free(alarm_t* alarm) {
+  if (alarm == NULL) return;
+  live_alarms.erase(alarm);
+  delete alarm;
+}
+
+void alarm_cancel(alarm_t* alarm) {
+  if (alarm != NULL) alarm->armed = false;
+}
+
+void alarm_set_on_mloop(alarm_t* alarm, uint64_t interval_ms,
+                        alarm_callback_t cb, void* data) {
+  alarm->cb = cb;
+  alarm->data = data;
+  alarm->armed = true;
+}
+
+uint64_t time_get_os_boottime_us(void) { return now_us; }
+
+void BTM_VendorSpecificCommand(uint16_t opcode, uint8_t param_len,
+                               uint8_t* p_param_buf, tBTM_VSC_CMPL_CB* p_cb) {
+  sent.push_back({opcode, p_cb, NULL});
+}
+
+tBTM_STATUS BTM_Hci_Raw_Command(uint16_t opcode, uint8_t param_len,
+                                uint8_t* p_param_buf,
+                                tBTM_RAW_CMPL_CB* p_cb) {
+  sent.push_back({opcode, NULL, p_cb});
+  return BTM_SUCCESS;
+}
+
+namespace {
+
+class BtmVendorCmdTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    now_us = 0;
+    sent.clear();
+    results.clear();
+    batch_results.clear();
+  }
+
+  void TearDown() override {
+    BTM_VscCleanup();
+    EXPECT_TRUE(live_alarms.empty());
+  }
+
+  uint16_t Submit(uint16_t opcode, uintptr_t context,
+                  uint32_t timeout_ms = 100) {
+    uint8_t sub_opcode = 1;
+    return BTM_VscSubmit(opcode, 1, &sub_opcode, timeout_ms, dispatch_cback,
+                         (void*)context);
+  }
+
+  // the controller answers the i-th command sent. BTM reports the full
+  // vendor opcode.
+  void Complete(size_t i, uint8_t status = HCI_SUCCESS) {
+    ASSERT_LT(i, sent.size());
+    uint8_t rsp[2] = {status, 1};
+    tBTM_VSC_CMPL cmpl;
+    cmpl.opcode = sent[i].opcode;
+    cmpl.param_len = sizeof(rsp);
+    cmpl.p_param_buf = rsp;
+    sent[i].p_cb(&cmpl);
+  }
+
+  // fires the armed timeout of the command with cmd_id.
+  void Timeout(uint16_t cmd_id) {
+    for (alarm_t* alarm : live_alarms) {
+      if (!alarm->armed || (uint16_t)(uintptr_t)alarm->data != cmd_id)
+        continue;
+      alarm->armed = false;
+      alarm->cb(alarm->data);
+      return;
+    }
+    ADD_FAILURE() << "no timeout armed for command " << cmd_id;
+  }
+
+  // fills every slot with a command of opcode, context is the slot order.
+  void FillSlots(uint16_t opcode, std::vector<uint16_t>* p_ids) {
+    for (int i = 0; i < BTM_VSC_MAX_PENDING; i++) {
+      uint16_t cmd_id = Submit(opcode, i);
+      ASSERT_NE(BTM_VSC_INVALID_ID, cmd_id);
+      p_ids->push_back(cmd_id);
+    }
+    ASSERT_EQ(BTM_VSC_INVALID_ID, Submit(opcode, 0));
+  }
+};
+
+TEST_F(BtmVendorCmdTest, completions_of_one_opcode_route_by_slot) {
+  uint16_t first = Submit(kOpcodeA, 1);
+  uint16_t second = Submit(kOpcodeA, 2);
+  // the second command fails first
+  Complete(1, HCI_ERR_UNSPECIFIED);
+  Complete(0);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(second, results[0].cmd_id);
+  EXPECT_EQ(HCI_ERR_UNSPECIFIED, results[0].status);
+  EXPECT_EQ(first, results[1].cmd_id);
+  EXPECT_EQ(HCI_SUCCESS, results[1].status);
+}
+
+TEST_F(BtmVendorCmdTest, timed_out_slot_is_kept_while_others_are_free) {
+  uint16_t cmd_id = Submit(kOpcodeA, 1);
+  Timeout(cmd_id);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(BTM_VSC_STATUS_TIMEOUT, results[0].status);
+
+  // a free slot is used, the late completion still finds its slot
+  Submit(kOpcodeB, 2);
+  ASSERT_EQ(2u, sent.size());
+  EXPECT_NE(sent[0].p_cb, sent[1].p_cb);
+  Complete(0);
+  EXPECT_EQ(1u, results.size());
+  Complete(1);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(2u, results[1].context);
+}
+
+TEST_F(BtmVendorCmdTest, late_completion_of_recycled_slot_is_dropped) {
+  std::vector<uint16_t> ids;
+  FillSlots(kOpcodeA, &ids);
+  Timeout(ids[3]);
+  ASSERT_EQ(1u, results.size());
+
+  // no slot is free, the timed out one goes to another opcode
+  uint16_t cmd_id = Submit(kOpcodeB, 99);
+  ASSERT_NE(BTM_VSC_INVALID_ID, cmd_id);
+  ASSERT_EQ(sent[3].p_cb, sent.back().p_cb);
+  Complete(3);
+  EXPECT_EQ(1u, results.size());
+  Complete(sent.size() - 1);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(cmd_id, results[1].cmd_id);
+  EXPECT_EQ(99u, results[1].context);
+}
+
+TEST_F(BtmVendorCmdTest, missing_late_completion_does_not_eat_the_next) {
+  std::vector<uint16_t> ids;
+  FillSlots(kOpcodeA, &ids);
+  Timeout(ids[5]);
+
+  // the late completion of ids[5] never comes, the command that took its
+  // slot has no timeout of its own and must still get its completion
+  uint16_t cmd_id = Submit(kOpcodeB, 42, BTM_VSC_NO_TIMEOUT);
+  ASSERT_NE(BTM_VSC_INVALID_ID, cmd_id);
+  Complete(sent.size() - 1);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(cmd_id, results[1].cmd_id);
+  EXPECT_EQ(HCI_SUCCESS, results[1].status);
+}
+
+TEST_F(BtmVendorCmdTest, slot_awaiting_late_completion_skips_same_opcode) {
+  std::vector<uint16_t> ids;
+  FillSlots(kOpcodeA, &ids);
+  Timeout(ids[7]);
+  // the late completion could not be told apart from the new one's
+  EXPECT_EQ(BTM_VSC_INVALID_ID, Submit(kOpcodeA, 1));
+
+  // until it is not expected any more
+  now_us += kStaleUs;
+  uint16_t cmd_id = Submit(kOpcodeA, 2);
+  ASSERT_NE(BTM_VSC_INVALID_ID, cmd_id);
+  ASSERT_EQ(sent[7].p_cb, sent.back().p_cb);
+  Complete(sent.size() - 1);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(cmd_id, results[1].cmd_id);
+}
+
+TEST_F(BtmVendorCmdTest, stale_completion_is_not_taken_for_other_opcode) {
+  std::vector<uint16_t> ids;
+  FillSlots(kOpcodeA, &ids);
+  Timeout(ids[0]);
+  uint16_t b = Submit(kOpcodeB, 10);
+  Complete(sent.size() - 1);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(b, results[1].cmd_id);
+
+  // the slot is free again but still waits for the late kOpcodeA completion
+  uint16_t c = Submit(kOpcodeB, 11);
+  ASSERT_EQ(sent[0].p_cb, sent.back().p_cb);
+  Complete(0);
+  EXPECT_EQ(2u, results.size());
+  Complete(sent.size() - 1);
+  ASSERT_EQ(3u, results.size());
+  EXPECT_EQ(c, results[2].cmd_id);
+}
+
+TEST_F(BtmVendorCmdTest, raw_batch_completes_once) {
+  uint8_t handle[2] = {1, 0};
+  tBTM_VSC_BATCH_CMD cmds[2] = {
+      {kRawOpcode, sizeof(handle), handle, true, dispatch_cback, (void*)7},
+      {kOpcodeA, sizeof(handle), handle, false, dispatch_cback, (void*)8}};
+  uint16_t batch_id = BTM_VscSubmitBatch(cmds, 2, 100, batch_cback, NULL);
+  ASSERT_NE(BTM_VSC_INVALID_ID, batch_id);
+  ASSERT_EQ(2u, sent.size());
+  ASSERT_NE(nullptr, sent[0].p_raw_cb);
+
+  // num_hci_cmd_pkts, opcode, status, return parameters
+  uint8_t event[] = {1, 0x06, 0x14, HCI_SUCCESS, 0x01, 0x00, 0xAA};
+  tBTM_RAW_CMPL raw;
+  raw.event_code = HCI_COMMAND_COMPLETE_EVT;
+  raw.param_len = sizeof(event);
+  raw.p_param_buf = event;
+  sent[0].p_raw_cb(&raw);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(7u, results[0].context);
+  EXPECT_EQ(HCI_SUCCESS, results[0].status);
+  EXPECT_TRUE(batch_results.empty());
+
+  Complete(1, HCI_ERR_UNSPECIFIED);
+  ASSERT_EQ(1u, batch_results.size());
+  EXPECT_EQ(batch_id, batch_results[0].batch_id);
+  EXPECT_EQ(1, batch_results[0].num_failed);
+  EXPECT_EQ(2, batch_results[0].num_cmds);
+}
+
+TEST_F(BtmVendorCmdTest, batch_without_room_sends_nothing) {
+  std::vector<uint16_t> ids;
+  for (int i = 0; i < BTM_VSC_MAX_PENDING - 1; i++)
+    ids.push_back(Submit(kOpcodeA, i));
+  uint8_t param = 0;
+  tBTM_VSC_BATCH_CMD cmds[2] = {
+      {kOpcodeB, 1, &param, false, dispatch_cback, NULL},
+      {kOpcodeB, 1, &param, false, dispatch_cback, NULL}};
+  size_t num_sent = sent.size();
+  EXPECT_EQ(BTM_VSC_INVALID_ID,
+            BTM_VscSubmitBatch(cmds, 2, 100, batch_cback, NULL));
+  EXPECT_EQ(num_sent, sent.size());
+  // the slot taken by the failed batch was given back
+  EXPECT_NE(BTM_VSC_INVALID_ID, Submit(kOpcodeB, 0));
+}
+
+TEST_F(BtmVendorCmdTest, latency_is_recorded_per_opcode) {
+  Submit(kOpcodeA, 1);
+  now_us += 3000;
+  Complete(0);
+  Timeout(Submit(kOpcodeB, 2));
+
+  tBTM_VSC_LATENCY_STATS stats;
+  bool seen_a = false;
+  bool seen_b = false;
+  for (uint8_t i = 0; BTM_VscGetLatencyStats(i, &stats); i++) {
+    if (stats.opcode == (HCI_GRP_VENDOR_SPECIFIC | kOpcodeA)) {
+      seen_a = true;
+      EXPECT_LE(3u, stats.max_latency_ms);
+    }
+    if (stats.opcode == (HCI_GRP_VENDOR_SPECIFIC | kOpcodeB)) {
+      seen_b = true;
+      EXPECT_LE(1u, stats.num_timeouts);
+    }
+  }
+  EXPECT_TRUE(seen_a);
+  EXPECT_TRUE(seen_b);
+}
+
+}  // namespace
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*******************************************************************************
+ *
+ *  Filename:      hci_vendor_cmd_test.cc
+ *
+ *  Description:   Host tests of the HCI command layouts: parameter lengths,
+ *                 little endian encoding and the length checked decoding
+ *                 of command complete events. The layouts mirror the ones
+ *                 btif_vendor sends.
+ *
+ ******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <array>
+
+#include "hci_vendor_cmd.h"
+
+namespace {
+
+using hci_vendor_cmd::HciCmd;
+using hci_vendor_cmd::HciVendorCmd;
+
+typedef std::array<uint8_t, 10> AfhMap;
+typedef std::array<uint8_t, 5> LeMap;
+
+using ClockSyncConfigCmd =
+    HciVendorCmd<uint8_t, uint8_t, uint8_t, uint16_t, uint8_t, uint8_t, int16_t>;
+using LeHighPriorityModeCmd = HciVendorCmd<uint8_t, uint16_t, uint8_t>;
+using ReadAfhChannelMapCmd =
+    HciCmd<uint16_t>::Returning<uint16_t, uint8_t, AfhMap>;
+using LeReadChannelMapCmd = HciCmd<uint16_t>::Returning<uint16_t, LeMap>;
+using SetAfhHostChannelCmd = HciCmd<AfhMap>;
+using WideCmd = HciCmd<uint32_t>::Returning<uint32_t, int16_t>;
+
+TEST(HciVendorCmdTest, lengths_add_up_the_fields) {
+  EXPECT_EQ(9u, ClockSyncConfigCmd::kParamLen);
+  EXPECT_EQ(4u, LeHighPriorityModeCmd::kParamLen);
+  EXPECT_EQ(10u, SetAfhHostChannelCmd::kParamLen);
+  EXPECT_EQ(2u, ReadAfhChannelMapCmd::kParamLen);
+  EXPECT_EQ(sizeof(ClockSyncConfigCmd::Buffer), ClockSyncConfigCmd::kParamLen);
+
+  // status first, vendor commands add the sub opcode
+  EXPECT_EQ(1u + 2 + 1 + 10, ReadAfhChannelMapCmd::Cmpl::kParamLen);
+  EXPECT_EQ(1u + 2 + 5, LeReadChannelMapCmd::Cmpl::kParamLen);
+  EXPECT_EQ(1u, SetAfhHostChannelCmd::Cmpl::kParamLen);
+  EXPECT_EQ(2u, LeHighPriorityModeCmd::Cmpl::kParamLen);
+}
+
+TEST(HciVendorCmdTest, parameters_are_encoded_little_endian) {
+  ClockSyncConfigCmd::Buffer buf =
+      ClockSyncConfigCmd::Encode(0x01, 0x02, 0x03, 0x1234, 0x05, 0x06, -2);
+  const uint8_t expected[] = {0x01, 0x02, 0x03, 0x34, 0x12,
+                              0x05, 0x06, 0xfe, 0xff};
+  ASSERT_EQ(sizeof(expected), buf.size());
+  EXPECT_EQ(0, memcmp(expected, buf.data(), sizeof(expected)));
+
+  WideCmd::Buffer wide = WideCmd::Encode(0xaabbccdd);
+  const uint8_t expected_wide[] = {0xdd, 0xcc, 0xbb, 0xaa};
+  EXPECT_EQ(0, memcmp(expected_wide, wide.data(), sizeof(expected_wide)));
+}
+
+TEST(HciVendorCmdTest, byte_fields_are_copied_in_order) {
+  AfhMap map;
+  for (size_t i = 0; i < map.size(); i++) map[i] = (uint8_t)(0xf0 + i);
+
+  SetAfhHostChannelCmd::Buffer buf = SetAfhHostChannelCmd::Encode(map);
+  EXPECT_EQ(0, memcmp(map.data(), buf.data(), map.size()));
+}
+
+TEST(HciVendorCmdTest, command_complete_is_decoded) {
+  const uint8_t event[] = {0x00, 0x03, 0x01, 0x01, 0x10, 0x11, 0x12, 0x13,
+                           0x14, 0x15, 0x16, 0x17, 0x18, 0x19};
+  uint8_t status = 0xff;
+  uint16_t handle = 0;
+  uint8_t mode = 0;
+  AfhMap map;
+
+  ASSERT_TRUE(ReadAfhChannelMapCmd::Cmpl::Decode(event, sizeof(event),
+                                                 &status, &handle, &mode,
+                                                 &map));
+  EXPECT_EQ(0x00, status);
+  EXPECT_EQ(0x0103, handle);
+  EXPECT_EQ(0x01, mode);
+  for (size_t i = 0; i < map.size(); i++) EXPECT_EQ(0x10 + i, map[i]);
+}
+
+TEST(HciVendorCmdTest, signed_and_wide_returns_are_decoded) {
+  const uint8_t event[] = {0x00, 0x78, 0x56, 0x34, 0x12, 0x00, 0x80};
+  uint8_t status = 0xff;
+  uint32_t value = 0;
+  int16_t offset = 0;
+
+  ASSERT_TRUE(
+      WideCmd::Cmpl::Decode(event, sizeof(event), &status, &value, &offset));
+  EXPECT_EQ(0x12345678u, value);
+  EXPECT_EQ(-32768, offset);
+}
+
+TEST(HciVendorCmdTest, vendor_complete_starts_with_status_and_sub_opcode) {
+  const uint8_t event[] = {0x0c, 0x17};
+  uint8_t status = 0;
+  uint8_t sub_opcode = 0;
+
+  ASSERT_TRUE(LeHighPriorityModeCmd::Cmpl::Decode(event, sizeof(event),
+                                                  &status, &sub_opcode));
+  EXPECT_EQ(0x0c, status);
+  EXPECT_EQ(0x17, sub_opcode);
+}
+
+TEST(HciVendorCmdTest, short_complete_is_rejected) {
+  const uint8_t event[] = {0x00, 0x03, 0x01, 0x10, 0x11, 0x12, 0x13, 0x14};
+  uint8_t status = 0xaa;
+  uint16_t handle = 0xbbbb;
+  LeMap map;
+
+  // one byte of the channel map missing
+  EXPECT_FALSE(LeReadChannelMapCmd::Cmpl::Decode(event, sizeof(event) - 1,
+                                                 &status, &handle, &map));
+  EXPECT_FALSE(LeReadChannelMapCmd::Cmpl::Decode(NULL, sizeof(event),
+                                                 &status, &handle, &map));
+  // nothing is written on failure
+  EXPECT_EQ(0xaa, status);
+  EXPECT_EQ(0xbbbb, handle);
+
+  EXPECT_TRUE(LeReadChannelMapCmd::Cmpl::Decode(event, sizeof(event),
+                                                &status, &handle, &map));
+  EXPECT_EQ(0x0103, handle);
+}
+
+}  // namespace
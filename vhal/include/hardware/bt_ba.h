@@ -47,12 +47,42 @@ typedef enum {
 
 #define BT_PROFILE_BAT_ID "ba_transmitter"
 
+/* Broadcast streams. Stream 0 is the primary stream fed by the audio HAL and
+ * controlled through set_state(), others are additional streams (one per
+ * reserved LT_ADDR) controlled through the set_stream_* apis.
+ */
+#define BA_MAX_STREAMS     6
+#define BA_PRIMARY_STREAM  0
+
+/* requested state of an additional stream */
+#define BA_STREAM_REQ_STOP    0
+#define BA_STREAM_REQ_PAUSE   1
+#define BA_STREAM_REQ_STREAM  2
+
+/* codec configuration of an additional stream */
+typedef struct {
+    uint32_t sample_rate;  /* 32000, 44100 or 48000 */
+    uint8_t channel_mode;  /* 1: mono, 2: stereo */
+    uint16_t frame_size;   /* samples per frame: 64, 128, 256 or 512 */
+    uint32_t bit_rate;
+} ba_stream_config_t;
+
 /** Callback for updating apps for A2dp multicast state.
  */
 typedef void (* ba_state_update_callback)(ba_state_t state);
 typedef void (* ba_enc_key_update_callback) (uint8_t size, uint8_t *p_enc_key);
 typedef void (* ba_div_update_callback) (uint8_t size, uint8_t *p_div);
 typedef void (* ba_stream_id_update_callback) (uint8_t stream_id);
+typedef void (* ba_stream_state_update_callback) (uint8_t stream,
+                                                   ba_state_t state);
+typedef void (* ba_stream_enc_key_update_callback) (uint8_t stream,
+                                       uint8_t size, uint8_t *p_enc_key);
+typedef void (* ba_stream_div_update_callback) (uint8_t stream, uint8_t size,
+                                                 uint8_t *p_div);
+/* codec config of a stream changed, encoder has to be set up again. Same
+ * layout as the codec config the encoder reads at start. */
+typedef void (* ba_stream_codec_update_callback) (uint8_t stream,
+                                    uint8_t size, uint8_t *p_codec_config);
 
 /** BA callback structure.  */
 typedef struct {
@@ -62,6 +92,11 @@ typedef struct {
     ba_enc_key_update_callback enc_update_key_cb;
     ba_div_update_callback div_update_cb;
     ba_stream_id_update_callback  stream_id_update_cb;
+    /* additional streams */
+    ba_stream_state_update_callback stream_state_cb;
+    ba_stream_enc_key_update_callback stream_enc_update_key_cb;
+    ba_stream_div_update_callback stream_div_update_cb;
+    ba_stream_codec_update_callback stream_codec_update_cb;
 } ba_transmitter_callbacks_t;
 
 /** Represents the standard BA interface.
@@ -87,6 +122,20 @@ typedef struct {
     /** Closes the interface. */
     void  (*cleanup)( void );
 
+    /** set codec config of an additional stream, only while it is idle **/
+    bt_status_t (*set_stream_config)(uint8_t stream,
+                                     const ba_stream_config_t* config);
+
+    /** set state of an additional stream, one of BA_STREAM_REQ_* **/
+    bt_status_t (*set_stream_state)(uint8_t stream, uint8_t state);
+
+    /** refresh enc key of an additional stream **/
+    bt_status_t (*refresh_stream_enc_key)(uint8_t stream);
+
+    /** set vol level of an additional stream **/
+    bt_status_t (*set_stream_vol)(uint8_t stream, uint8_t vol,
+                                  uint8_t max_vol);
+
 } ba_transmitter_interface_t;
 
 __END_DECLS
@@ -168,6 +168,28 @@ typedef void (*get_afh_map_callback)(std::vector<uint8_t> afh_map_data, uint16_t
                           uint8_t afh_mode, uint8_t status);
 typedef void (*set_afh_map_callback)(uint8_t status, uint8_t transport);
 
+/** Link quality metrics tracked from Bluetooth Quality Reports */
+typedef enum {
+    BT_LINK_QUALITY_RSSI = 0,
+    BT_LINK_QUALITY_SNR,
+    BT_LINK_QUALITY_RETRANSMISSION,
+    BT_LINK_QUALITY_PACKET_LOSS,
+    BT_LINK_QUALITY_UNUSED_CHANNELS,
+    BT_LINK_QUALITY_METRIC_MAX
+} bt_link_quality_metric_t;
+
+/** Statistics over the recent reports of one metric of one link */
+typedef struct {
+    uint8_t num_samples;
+    int32_t min;
+    int32_t max;
+    int32_t avg;
+    int32_t p50;
+    int32_t p90;
+    bool breached;
+    uint32_t breach_count;
+} bt_link_quality_stats_t;
+
 /** BT-Vendor callback structure. */
 typedef struct {
     /** set to sizeof(BtVendorCallbacks) */
@@ -280,6 +302,13 @@ typedef struct {
     bool (*set_afh_map)(afh_map *afhMap, int transport);
     //** get the AFH map */
     bool (*get_afh_map)(const RawAddress* addr, int transport);
+    /** Sends the 2.4 GHz channel Wi-Fi is connected on, 0 MHz if none */
+    void (*set_wifi_channel)(int center_freq_mhz, int width_mhz);
+    //** dumps vendor stack state, for dumpsys */
+    void (*dump)(int fd);
+    //** gets the link quality statistics of a remote device */
+    bool (*get_link_quality_stats)(const RawAddress* addr,
+        bt_link_quality_metric_t metric, bt_link_quality_stats_t* stats);
 
 } btvendor_interface_t;
 